@@ -0,0 +1,760 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "clipboard-buffer.h"
+
+#define MIN_CHUNK_SIZE 64
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+/* Fastest zlib level, most of the gain on markup and raw bitmaps
+ * is already there */
+#define COMPRESSION_LEVEL 1
+#define COMPRESSION_STEP  (64 * 1024)
+
+/* Buffers smaller than this stay on the heap, a file each for
+ * them would cost more than it saves */
+#define SPILL_MIN_SIZE (64 * 1024)
+
+typedef struct {
+        guchar *data;
+        gsize   length;
+        gsize   capacity;
+} Chunk;
+
+struct _ClipboardBuffer {
+        int     ref_count;
+
+        GArray *chunks;         /* of Chunk */
+        gsize   length;
+
+        /* What the chunks, or the spill file, hold: length bytes,
+         * or fewer once compressed */
+        gsize   stored_length;
+
+        guint   hash;
+        guint   hash_valid : 1;
+        guint   compressed : 1;
+        guint   incompressible : 1;
+
+        /* Chunk that the last peek landed in, to make sequential
+         * reads cheap */
+        guint   cursor_chunk;
+        gsize   cursor_offset;
+
+        /* Set once spilled, the chunks are gone then */
+        int     fd;
+        guchar *map;
+
+        /* Decompressed contents, while they are being read */
+        guchar *expanded;
+};
+
+ClipboardBuffer *
+clipboard_buffer_new (void)
+{
+        ClipboardBuffer *buffer;
+
+        buffer = g_new0 (ClipboardBuffer, 1);
+        buffer->ref_count = 1;
+        buffer->chunks = g_array_new (FALSE, FALSE, sizeof (Chunk));
+        buffer->fd = -1;
+
+        return buffer;
+}
+
+ClipboardBuffer *
+clipboard_buffer_ref (ClipboardBuffer *buffer)
+{
+        buffer->ref_count++;
+        return buffer;
+}
+
+void
+clipboard_buffer_unref (ClipboardBuffer *buffer)
+{
+        guint i;
+
+        if (buffer == NULL)
+                return;
+
+        if (--buffer->ref_count > 0)
+                return;
+
+        for (i = 0; i < buffer->chunks->len; i++)
+                g_free (g_array_index (buffer->chunks, Chunk, i).data);
+        g_array_unref (buffer->chunks);
+
+        clipboard_buffer_unmap (buffer);
+        if (buffer->fd >= 0)
+                close (buffer->fd);
+
+        g_free (buffer);
+}
+
+void
+clipboard_buffer_append (ClipboardBuffer *buffer,
+                         const guchar    *data,
+                         gsize            length)
+{
+        g_return_if_fail (buffer->fd < 0 && !buffer->compressed);
+
+        buffer->length += length;
+        buffer->stored_length += length;
+        buffer->hash_valid = FALSE;
+
+        while (length > 0) {
+                Chunk *chunk = NULL;
+                gsize n;
+
+                if (buffer->chunks->len > 0)
+                        chunk = &g_array_index (buffer->chunks, Chunk, buffer->chunks->len - 1);
+
+                if (chunk == NULL || chunk->length == chunk->capacity) {
+                        Chunk new_chunk;
+
+                        /* Each chunk is at least as large as everything
+                         * before it, so there are O(log n) of them. The
+                         * first one fits the first append, which often is
+                         * all there is. */
+                        new_chunk.capacity = MIN_CHUNK_SIZE;
+                        while ((new_chunk.capacity < buffer->length - length ||
+                                (chunk == NULL && new_chunk.capacity < length)) &&
+                               new_chunk.capacity < MAX_CHUNK_SIZE)
+                                new_chunk.capacity *= 2;
+                        new_chunk.data = g_malloc (new_chunk.capacity);
+                        new_chunk.length = 0;
+
+                        g_array_append_val (buffer->chunks, new_chunk);
+                        chunk = &g_array_index (buffer->chunks, Chunk, buffer->chunks->len - 1);
+                }
+
+                n = MIN (length, chunk->capacity - chunk->length);
+                memcpy (chunk->data + chunk->length, data, n);
+                chunk->length += n;
+                data += n;
+                length -= n;
+        }
+}
+
+gsize
+clipboard_buffer_get_length (ClipboardBuffer *buffer)
+{
+        return buffer->length;
+}
+
+static gboolean
+map_buffer (ClipboardBuffer *buffer)
+{
+        void *map;
+
+        if (buffer->map != NULL)
+                return TRUE;
+
+        map = mmap (NULL, buffer->stored_length, PROT_READ, MAP_SHARED, buffer->fd, 0);
+        if (map == MAP_FAILED) {
+                g_warning ("Failed to map spilled clipboard contents: %s", g_strerror (errno));
+                return FALSE;
+        }
+
+        buffer->map = map;
+        return TRUE;
+}
+
+static gboolean
+expand_buffer (ClipboardBuffer *buffer)
+{
+        GConverter *decompressor;
+        const guchar *in;
+        gsize in_length, out_length = 0;
+        GConverterResult result;
+        GError *error = NULL;
+
+        if (buffer->expanded != NULL)
+                return TRUE;
+
+        /* Compressed contents are in a single chunk, or spilled */
+        if (buffer->fd >= 0) {
+                if (!map_buffer (buffer))
+                        return FALSE;
+                in = buffer->map;
+        } else {
+                in = g_array_index (buffer->chunks, Chunk, 0).data;
+        }
+        in_length = buffer->stored_length;
+
+        decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+        buffer->expanded = g_malloc (buffer->length);
+
+        do {
+                gsize bytes_read, bytes_written;
+
+                result = g_converter_convert (decompressor,
+                                              in, in_length,
+                                              buffer->expanded + out_length,
+                                              buffer->length - out_length,
+                                              G_CONVERTER_INPUT_AT_END,
+                                              &bytes_read, &bytes_written, &error);
+                if (result == G_CONVERTER_ERROR)
+                        break;
+
+                in += bytes_read;
+                in_length -= bytes_read;
+                out_length += bytes_written;
+        } while (result != G_CONVERTER_FINISHED);
+
+        g_object_unref (decompressor);
+
+        if (result == G_CONVERTER_ERROR || out_length != buffer->length) {
+                g_warning ("Failed to decompress clipboard contents: %s",
+                           error ? error->message : "unexpected length");
+                g_clear_error (&error);
+                g_clear_pointer (&buffer->expanded, g_free);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+const guchar *
+clipboard_buffer_peek (ClipboardBuffer *buffer,
+                       gsize            offset,
+                       gsize           *length)
+{
+        guint i;
+        gsize start;
+
+        if (offset >= buffer->length) {
+                *length = 0;
+                return NULL;
+        }
+
+        if (buffer->compressed) {
+                if (!expand_buffer (buffer)) {
+                        *length = 0;
+                        return NULL;
+                }
+
+                *length = buffer->length - offset;
+                return buffer->expanded + offset;
+        }
+
+        if (buffer->fd >= 0) {
+                if (!map_buffer (buffer)) {
+                        *length = 0;
+                        return NULL;
+                }
+
+                *length = buffer->length - offset;
+                return buffer->map + offset;
+        }
+
+        if (offset >= buffer->cursor_offset) {
+                i = buffer->cursor_chunk;
+                start = buffer->cursor_offset;
+        } else {
+                i = 0;
+                start = 0;
+        }
+
+        for (; i < buffer->chunks->len; i++) {
+                Chunk *chunk = &g_array_index (buffer->chunks, Chunk, i);
+
+                if (offset < start + chunk->length) {
+                        buffer->cursor_chunk = i;
+                        buffer->cursor_offset = start;
+
+                        *length = start + chunk->length - offset;
+                        return chunk->data + (offset - start);
+                }
+
+                start += chunk->length;
+        }
+
+        g_assert_not_reached ();
+}
+
+gsize
+clipboard_buffer_read (ClipboardBuffer *buffer,
+                       gsize            offset,
+                       guchar          *dest,
+                       gsize            length)
+{
+        gsize copied = 0;
+
+        while (copied < length) {
+                const guchar *data;
+                gsize n;
+
+                data = clipboard_buffer_peek (buffer, offset + copied, &n);
+                if (data == NULL)
+                        break;
+
+                n = MIN (n, length - copied);
+                memcpy (dest + copied, data, n);
+                copied += n;
+        }
+
+        return copied;
+}
+
+const guchar *
+clipboard_buffer_flatten (ClipboardBuffer *buffer)
+{
+        Chunk chunk;
+        guint i;
+
+        if (buffer->compressed)
+                return expand_buffer (buffer) ? buffer->expanded : NULL;
+
+        if (buffer->fd >= 0)
+                return map_buffer (buffer) ? buffer->map : NULL;
+
+        if (buffer->chunks->len == 0)
+                return NULL;
+
+        if (buffer->chunks->len == 1)
+                return g_array_index (buffer->chunks, Chunk, 0).data;
+
+        chunk.data = g_malloc (buffer->length);
+        chunk.length = 0;
+        chunk.capacity = buffer->length;
+
+        for (i = 0; i < buffer->chunks->len; i++) {
+                Chunk *c = &g_array_index (buffer->chunks, Chunk, i);
+
+                memcpy (chunk.data + chunk.length, c->data, c->length);
+                chunk.length += c->length;
+                g_free (c->data);
+        }
+
+        g_array_set_size (buffer->chunks, 0);
+        g_array_append_val (buffer->chunks, chunk);
+        buffer->cursor_chunk = 0;
+        buffer->cursor_offset = 0;
+
+        return chunk.data;
+}
+
+static int
+create_spill_file (GError **error)
+{
+        char *path;
+        int fd;
+
+#if HAVE_MEMFD_CREATE
+        fd = memfd_create ("gsd-clipboard", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd >= 0)
+                return fd;
+#endif
+
+        path = g_build_filename (g_get_user_runtime_dir (), "gsd-clipboard-XXXXXX", NULL);
+        fd = g_mkstemp_full (path, O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                int errsv = errno;
+
+                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                             "Could not create %s: %s", path, g_strerror (errsv));
+        } else {
+                g_unlink (path);
+        }
+        g_free (path);
+
+        return fd;
+}
+
+gboolean
+clipboard_buffer_spill (ClipboardBuffer  *buffer,
+                        GError          **error)
+{
+        guint i;
+        int fd;
+
+        if (buffer->fd >= 0 || buffer->stored_length == 0)
+                return TRUE;
+
+        fd = create_spill_file (error);
+        if (fd < 0)
+                return FALSE;
+
+        for (i = 0; i < buffer->chunks->len; i++) {
+                Chunk *chunk = &g_array_index (buffer->chunks, Chunk, i);
+                gsize written = 0;
+
+                while (written < chunk->length) {
+                        gssize n;
+
+                        n = write (fd, chunk->data + written, chunk->length - written);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n < 0) {
+                                int errsv = errno;
+
+                                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                                             "Could not spill clipboard contents: %s",
+                                             g_strerror (errsv));
+                                close (fd);
+                                return FALSE;
+                        }
+                        written += n;
+                }
+        }
+
+#if HAVE_MEMFD_CREATE
+        /* Nothing can change the contents behind our back from now on */
+        fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+        for (i = 0; i < buffer->chunks->len; i++)
+                g_free (g_array_index (buffer->chunks, Chunk, i).data);
+        g_array_set_size (buffer->chunks, 0);
+        buffer->cursor_chunk = 0;
+        buffer->cursor_offset = 0;
+
+        /* Read back from the file from now on, if at all */
+        g_clear_pointer (&buffer->expanded, g_free);
+
+        buffer->fd = fd;
+
+        return TRUE;
+}
+
+gsize
+clipboard_buffer_spill_to_budget (GPtrArray *buffers,
+                                  gsize      usage,
+                                  gsize      budget)
+{
+        while (usage > budget) {
+                ClipboardBuffer *largest = NULL;
+                gsize largest_size = SPILL_MIN_SIZE - 1;
+                GError *error = NULL;
+                gsize size;
+                guint i;
+
+                for (i = 0; i < buffers->len; i++) {
+                        ClipboardBuffer *buffer = g_ptr_array_index (buffers, i);
+
+                        if (buffer->fd >= 0)
+                                continue;
+
+                        size = clipboard_buffer_get_memory_size (buffer);
+                        if (size > largest_size) {
+                                largest = buffer;
+                                largest_size = size;
+                        }
+                }
+
+                if (largest == NULL)
+                        break;
+
+                if (!clipboard_buffer_spill (largest, &error)) {
+                        g_warning ("Could not move clipboard contents out of memory: %s", error->message);
+                        g_error_free (error);
+                        break;
+                }
+
+                /* Nothing left that spilling would free */
+                size = clipboard_buffer_get_memory_size (largest);
+                if (size >= largest_size)
+                        break;
+
+                g_debug ("Spilled %" G_GSIZE_FORMAT " bytes of clipboard contents", largest_size - size);
+                usage -= MIN (usage, largest_size - size);
+        }
+
+        return usage;
+}
+
+gboolean
+clipboard_buffer_is_spilled (ClipboardBuffer *buffer)
+{
+        return buffer->fd >= 0;
+}
+
+void
+clipboard_buffer_unmap (ClipboardBuffer *buffer)
+{
+        g_clear_pointer (&buffer->expanded, g_free);
+
+        if (buffer->map == NULL)
+                return;
+
+        munmap (buffer->map, buffer->stored_length);
+        buffer->map = NULL;
+}
+
+static gboolean
+is_loaded (ClipboardBuffer *buffer)
+{
+        return buffer->map != NULL || buffer->expanded != NULL;
+}
+
+gsize
+clipboard_buffer_get_memory_size (ClipboardBuffer *buffer)
+{
+        gsize size = 0;
+        guint i;
+
+        for (i = 0; i < buffer->chunks->len; i++)
+                size += g_array_index (buffer->chunks, Chunk, i).capacity;
+
+        if (buffer->expanded != NULL)
+                size += buffer->length;
+
+        return size;
+}
+
+/* Compresses @chunks into at most @limit bytes */
+static guchar *
+compress_chunks (GArray *chunks,
+                 gsize   limit,
+                 gsize  *compressed_length)
+{
+        GConverter *compressor;
+        GByteArray *out;
+        gboolean finished = FALSE;
+        guint i;
+
+        compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW,
+                                                         COMPRESSION_LEVEL));
+        out = g_byte_array_sized_new (MIN (limit, COMPRESSION_STEP));
+
+        /* One more round without input, to finish the stream */
+        for (i = 0; i <= chunks->len && !finished; i++) {
+                const guchar *in = NULL;
+                gsize in_length = 0;
+                GConverterFlags flags = G_CONVERTER_INPUT_AT_END;
+
+                if (i < chunks->len) {
+                        Chunk *chunk = &g_array_index (chunks, Chunk, i);
+
+                        in = chunk->data;
+                        in_length = chunk->length;
+                        flags = G_CONVERTER_NO_FLAGS;
+                }
+
+                while (!finished) {
+                        GConverterResult result;
+                        gsize bytes_read, bytes_written, start, space;
+
+                        start = out->len;
+                        space = MIN (COMPRESSION_STEP, limit - start);
+                        if (space == 0)
+                                goto fail;
+
+                        g_byte_array_set_size (out, start + space);
+                        result = g_converter_convert (compressor,
+                                                      in, in_length,
+                                                      out->data + start, space,
+                                                      flags,
+                                                      &bytes_read, &bytes_written, NULL);
+                        if (result == G_CONVERTER_ERROR)
+                                goto fail;
+
+                        g_byte_array_set_size (out, start + bytes_written);
+                        in += bytes_read;
+                        in_length -= bytes_read;
+
+                        if (result == G_CONVERTER_FINISHED)
+                                finished = TRUE;
+                        else if (in_length == 0 && flags == G_CONVERTER_NO_FLAGS)
+                                break;
+                }
+        }
+
+        g_object_unref (compressor);
+
+        *compressed_length = out->len;
+        return g_realloc (g_byte_array_free (out, FALSE), MAX (*compressed_length, 1));
+
+fail:
+        g_object_unref (compressor);
+        g_byte_array_free (out, TRUE);
+
+        return NULL;
+}
+
+/* Not worth the trouble of decompressing when read unless it
+ * saves at least a tenth */
+static gsize
+compression_limit (gsize length)
+{
+        return length - length / 10;
+}
+
+/* Tries the start of the buffer first, so that already compressed
+ * formats are given up on quickly */
+static gboolean
+probe_compressibility (ClipboardBuffer *buffer)
+{
+        GArray *sample;
+        Chunk chunk;
+        guchar *compressed;
+        gsize compressed_length;
+        gboolean compressible;
+
+        if (buffer->length <= COMPRESSION_STEP)
+                return TRUE;
+
+        chunk.data = g_malloc (COMPRESSION_STEP);
+        chunk.length = clipboard_buffer_read (buffer, 0, chunk.data, COMPRESSION_STEP);
+        chunk.capacity = COMPRESSION_STEP;
+
+        sample = g_array_new (FALSE, FALSE, sizeof (Chunk));
+        g_array_append_val (sample, chunk);
+
+        compressed = compress_chunks (sample, compression_limit (chunk.length), &compressed_length);
+        compressible = compressed != NULL;
+
+        g_free (compressed);
+        g_free (chunk.data);
+        g_array_unref (sample);
+
+        return compressible;
+}
+
+gboolean
+clipboard_buffer_compress (ClipboardBuffer *buffer)
+{
+        Chunk chunk;
+        guint i;
+
+        if (buffer->compressed)
+                return TRUE;
+
+        if (buffer->fd >= 0 || buffer->incompressible || buffer->length == 0)
+                return FALSE;
+
+        chunk.data = NULL;
+        if (probe_compressibility (buffer))
+                chunk.data = compress_chunks (buffer->chunks,
+                                              compression_limit (buffer->length),
+                                              &chunk.length);
+        if (chunk.data == NULL) {
+                buffer->incompressible = TRUE;
+                return FALSE;
+        }
+        chunk.capacity = chunk.length;
+
+        for (i = 0; i < buffer->chunks->len; i++)
+                g_free (g_array_index (buffer->chunks, Chunk, i).data);
+        g_array_set_size (buffer->chunks, 0);
+        g_array_append_val (buffer->chunks, chunk);
+        buffer->cursor_chunk = 0;
+        buffer->cursor_offset = 0;
+
+        buffer->stored_length = chunk.length;
+        buffer->compressed = TRUE;
+
+        return TRUE;
+}
+
+gboolean
+clipboard_buffer_is_compressed (ClipboardBuffer *buffer)
+{
+        return buffer->compressed;
+}
+
+/* FNV-1a */
+guint
+clipboard_buffer_hash (ClipboardBuffer *buffer)
+{
+        gboolean was_loaded = is_loaded (buffer);
+        gsize offset = 0;
+        guint32 hash = 2166136261u;
+
+        if (buffer->hash_valid)
+                return buffer->hash;
+
+        while (offset < buffer->length) {
+                const guchar *data;
+                gsize length, i;
+
+                data = clipboard_buffer_peek (buffer, offset, &length);
+                if (data == NULL)
+                        break;
+
+                for (i = 0; i < length; i++) {
+                        hash ^= data[i];
+                        hash *= 16777619u;
+                }
+                offset += length;
+        }
+
+        if (!was_loaded)
+                clipboard_buffer_unmap (buffer);
+
+        buffer->hash = hash;
+        buffer->hash_valid = TRUE;
+
+        return hash;
+}
+
+gboolean
+clipboard_buffer_equal (ClipboardBuffer *a,
+                        ClipboardBuffer *b)
+{
+        gboolean a_was_loaded, b_was_loaded;
+        gboolean equal = TRUE;
+        gsize offset = 0;
+
+        if (a == b)
+                return TRUE;
+
+        if (a->length != b->length ||
+            clipboard_buffer_hash (a) != clipboard_buffer_hash (b))
+                return FALSE;
+
+        a_was_loaded = is_loaded (a);
+        b_was_loaded = is_loaded (b);
+
+        while (offset < a->length) {
+                const guchar *data_a, *data_b;
+                gsize length_a, length_b, n;
+
+                data_a = clipboard_buffer_peek (a, offset, &length_a);
+                data_b = clipboard_buffer_peek (b, offset, &length_b);
+                if (data_a == NULL || data_b == NULL) {
+                        equal = FALSE;
+                        break;
+                }
+
+                n = MIN (length_a, length_b);
+                if (memcmp (data_a, data_b, n) != 0) {
+                        equal = FALSE;
+                        break;
+                }
+                offset += n;
+        }
+
+        if (!a_was_loaded)
+                clipboard_buffer_unmap (a);
+        if (!b_was_loaded)
+                clipboard_buffer_unmap (b);
+
+        return equal;
+}
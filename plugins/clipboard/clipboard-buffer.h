@@ -0,0 +1,92 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CLIPBOARD_BUFFER_H__
+#define __CLIPBOARD_BUFFER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Append-only byte buffer for saved clipboard contents, kept as a list
+ * of chunks of geometrically growing size, so that receiving a large
+ * INCR transfer copies every byte once. Chunk sizes are powers of two
+ * and chunks are filled completely before moving on to the next one,
+ * so 16- and 32-bit items never straddle two chunks.
+ */
+typedef struct _ClipboardBuffer ClipboardBuffer;
+
+ClipboardBuffer     *clipboard_buffer_new        (void);
+ClipboardBuffer     *clipboard_buffer_ref        (ClipboardBuffer     *buffer);
+void                 clipboard_buffer_unref      (ClipboardBuffer     *buffer);
+
+void                 clipboard_buffer_append     (ClipboardBuffer     *buffer,
+                                                  const guchar        *data,
+                                                  gsize                length);
+gsize                clipboard_buffer_get_length (ClipboardBuffer     *buffer);
+
+/* Returns the contiguous data at @offset, and in @length how much of it
+ * there is, which can be less than what is left in the buffer. */
+const guchar        *clipboard_buffer_peek       (ClipboardBuffer     *buffer,
+                                                  gsize                offset,
+                                                  gsize               *length);
+
+/* Copies up to @length bytes at @offset to @dest, returns how many */
+gsize                clipboard_buffer_read       (ClipboardBuffer     *buffer,
+                                                  gsize                offset,
+                                                  guchar              *dest,
+                                                  gsize                length);
+
+/* Merges the chunks, if there is more than one, and returns all the data */
+const guchar        *clipboard_buffer_flatten    (ClipboardBuffer     *buffer);
+
+/*
+ * A complete buffer can be compressed, which is given up on when it
+ * doesn't save enough, and spilled out of the heap into a sealed memfd,
+ * or an unlinked file in XDG_RUNTIME_DIR where memfds aren't available.
+ * Peeking at such a buffer decompresses it, or maps the file in, until
+ * the next clipboard_buffer_unmap().
+ */
+gboolean             clipboard_buffer_compress   (ClipboardBuffer     *buffer);
+gboolean             clipboard_buffer_is_compressed (ClipboardBuffer  *buffer);
+gboolean             clipboard_buffer_spill      (ClipboardBuffer     *buffer,
+                                                  GError             **error);
+gboolean             clipboard_buffer_is_spilled (ClipboardBuffer     *buffer);
+void                 clipboard_buffer_unmap      (ClipboardBuffer     *buffer);
+
+/* Spills the largest of @buffers, which are complete and distinct,
+ * until @usage, the heap memory held by them and anything else, is
+ * within @budget or nothing is left worth spilling. Returns the heap
+ * memory still held. */
+gsize                clipboard_buffer_spill_to_budget (GPtrArray *buffers,
+                                                       gsize      usage,
+                                                       gsize      budget);
+
+/* Hash and comparison of the contents of complete buffers, so that
+ * targets with the same contents can share a buffer */
+guint                clipboard_buffer_hash       (ClipboardBuffer     *buffer);
+gboolean             clipboard_buffer_equal      (ClipboardBuffer     *a,
+                                                  ClipboardBuffer     *b);
+
+/* Heap memory held by the buffer, which is 0 once it is spilled
+ * and not being read */
+gsize                clipboard_buffer_get_memory_size (ClipboardBuffer *buffer);
+
+G_END_DECLS
+
+#endif /* __CLIPBOARD_BUFFER_H__ */
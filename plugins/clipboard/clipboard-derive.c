@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <X11/Xutil.h>
+
+#include "clipboard-derive.h"
+
+#define TEXT_SOURCE  "UTF8_STRING"
+#define IMAGE_SOURCE "image/png"
+
+static const struct {
+        const char        *target;
+        XICCEncodingStyle  style;
+} text_targets[] = {
+        { "STRING",        XStringStyle },
+        { "TEXT",          XStdICCTextStyle },
+        { "COMPOUND_TEXT", XCompoundTextStyle },
+};
+
+static GdkPixbufFormat *
+find_writable_format (const char *mime_type)
+{
+        GdkPixbufFormat *found = NULL;
+        GSList *formats, *l;
+
+        formats = gdk_pixbuf_get_formats ();
+        for (l = formats; l != NULL && found == NULL; l = l->next) {
+                GdkPixbufFormat *format = l->data;
+                char **mime_types;
+
+                if (!gdk_pixbuf_format_is_writable (format))
+                        continue;
+
+                mime_types = gdk_pixbuf_format_get_mime_types (format);
+                if (g_strv_contains ((const char * const *) mime_types, mime_type))
+                        found = format;
+                g_strfreev (mime_types);
+        }
+        g_slist_free (formats);
+
+        return found;
+}
+
+const char *
+clipboard_derive_get_source (const char *target)
+{
+        guint i;
+
+        if (g_str_equal (target, "text/plain") ||
+            g_str_equal (target, "text/plain;charset=utf-8"))
+                return TEXT_SOURCE;
+
+        for (i = 0; i < G_N_ELEMENTS (text_targets); i++) {
+                if (g_str_equal (target, text_targets[i].target))
+                        return TEXT_SOURCE;
+        }
+
+        if (g_str_has_prefix (target, "image/") &&
+            !g_str_equal (target, IMAGE_SOURCE) &&
+            find_writable_format (target) != NULL)
+                return IMAGE_SOURCE;
+
+        return NULL;
+}
+
+static ClipboardBuffer *
+buffer_new_take (gchar *data,
+                 gsize  length)
+{
+        ClipboardBuffer *buffer;
+
+        buffer = clipboard_buffer_new ();
+        clipboard_buffer_append (buffer, (const guchar *) data, length);
+        g_free (data);
+
+        return buffer;
+}
+
+static ClipboardBuffer *
+derive_text_property (Display           *display,
+                      const guchar      *data,
+                      gsize              length,
+                      XICCEncodingStyle  style,
+                      Atom              *type)
+{
+        ClipboardBuffer *buffer;
+        XTextProperty property;
+        char *text;
+        int ret;
+
+        text = g_strndup ((const char *) data, length);
+        ret = Xutf8TextListToTextProperty (display, &text, 1, style, &property);
+        g_free (text);
+
+        /* A positive value is the number of characters that could not
+         * be converted, and were replaced */
+        if (ret < 0)
+                return NULL;
+
+        buffer = clipboard_buffer_new ();
+        clipboard_buffer_append (buffer, property.value, property.nitems);
+        *type = property.encoding;
+        XFree (property.value);
+
+        return buffer;
+}
+
+static ClipboardBuffer *
+derive_image (const char   *target,
+              const guchar *data,
+              gsize         length)
+{
+        GdkPixbufFormat *format;
+        GdkPixbufLoader *loader;
+        GdkPixbuf *pixbuf;
+        GError *error = NULL;
+        gchar *name, *image = NULL;
+        gsize image_length;
+
+        format = find_writable_format (target);
+        if (format == NULL)
+                return NULL;
+
+        loader = gdk_pixbuf_loader_new_with_mime_type (IMAGE_SOURCE, &error);
+        if (loader == NULL)
+                goto out;
+
+        if (!gdk_pixbuf_loader_write (loader, data, length, &error) ||
+            !gdk_pixbuf_loader_close (loader, &error))
+                goto out;
+
+        pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+        if (pixbuf == NULL)
+                goto out;
+
+        name = gdk_pixbuf_format_get_name (format);
+        gdk_pixbuf_save_to_buffer (pixbuf, &image, &image_length, name, &error, NULL);
+        g_free (name);
+
+out:
+        if (error != NULL) {
+                g_warning ("Could not convert clipboard image to %s: %s", target, error->message);
+                g_error_free (error);
+        }
+        g_clear_object (&loader);
+
+        return image != NULL ? buffer_new_take (image, image_length) : NULL;
+}
+
+ClipboardBuffer *
+clipboard_derive_target (Display         *display,
+                         const char      *target,
+                         ClipboardBuffer *source,
+                         Atom            *type)
+{
+        ClipboardBuffer *buffer = NULL;
+        const guchar *data;
+        gsize length;
+        guint i;
+
+        /* The same bytes */
+        if (g_str_equal (target, "text/plain;charset=utf-8")) {
+                *type = XInternAtom (display, target, False);
+                return clipboard_buffer_ref (source);
+        }
+
+        length = clipboard_buffer_get_length (source);
+        data = clipboard_buffer_flatten (source);
+        if (data == NULL)
+                data = (const guchar *) "";
+
+        if (g_str_equal (target, "text/plain")) {
+                gchar *text;
+                gsize text_length;
+
+                text = g_convert_with_fallback ((const gchar *) data, length,
+                                                "ASCII", "UTF-8", NULL,
+                                                NULL, &text_length, NULL);
+                if (text != NULL) {
+                        buffer = buffer_new_take (text, text_length);
+                        *type = XInternAtom (display, target, False);
+                }
+                goto out;
+        }
+
+        for (i = 0; i < G_N_ELEMENTS (text_targets); i++) {
+                if (g_str_equal (target, text_targets[i].target)) {
+                        buffer = derive_text_property (display, data, length,
+                                                       text_targets[i].style, type);
+                        goto out;
+                }
+        }
+
+        if (g_str_has_prefix (target, "image/")) {
+                buffer = derive_image (target, data, length);
+                if (buffer != NULL)
+                        *type = XInternAtom (display, target, False);
+        }
+
+out:
+        clipboard_buffer_unmap (source);
+
+        return buffer;
+}
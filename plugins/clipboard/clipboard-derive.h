@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CLIPBOARD_DERIVE_H__
+#define __CLIPBOARD_DERIVE_H__
+
+#include <glib.h>
+#include <X11/Xlib.h>
+
+#include "clipboard-buffer.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Text targets can be generated from UTF8_STRING, and images in any
+ * format gdk-pixbuf can write from image/png. Returns the name of the
+ * target @target can be generated from, or NULL.
+ */
+const char      *clipboard_derive_get_source (const char      *target);
+
+/* Generates the contents of @target from those of its source target,
+ * which are in 8-bit items, and returns the type of the result in @type */
+ClipboardBuffer *clipboard_derive_target     (Display         *display,
+                                              const char      *target,
+                                              ClipboardBuffer *source,
+                                              Atom            *type);
+
+G_END_DECLS
+
+#endif /* __CLIPBOARD_DERIVE_H__ */
@@ -34,6 +34,7 @@
 
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <gio/gio.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
@@ -42,12 +43,40 @@
 
 #include "xutils.h"
 #include "list.h"
+#include "clipboard-buffer.h"
+#include "clipboard-derive.h"
 
 #include "gnome-settings-profile.h"
 #include "gsd-clipboard-manager.h"
 
 #define GSD_CLIPBOARD_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_CLIPBOARD_MANAGER, GsdClipboardManagerPrivate))
 
+#define GSD_DBUS_NAME "org.gnome.SettingsDaemon"
+#define GSD_DBUS_PATH "/org/gnome/SettingsDaemon"
+
+#define GSD_CLIPBOARD_DBUS_NAME GSD_DBUS_NAME ".Clipboard"
+#define GSD_CLIPBOARD_DBUS_PATH GSD_DBUS_PATH "/Clipboard"
+
+#define CLIPBOARD_SCHEMA "org.gnome.settings-daemon.plugins.clipboard"
+#define MEMORY_BUDGET_KEY "memory-budget"
+#define CANONICAL_TARGETS_KEY "canonical-targets"
+#define COMPRESS_CONTENTS_KEY "compress-contents"
+
+/* Smaller targets are pasted too often, and save too little,
+ * to be worth compressing */
+#define COMPRESS_MIN_SIZE (64 * 1024)
+
+static const gchar introspection_xml[] =
+"<node>"
+"  <interface name='org.gnome.SettingsDaemon.Clipboard'>"
+"    <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+"    <property name='MemoryUsage' type='t' access='read'/>"
+"    <property name='SpilledSize' type='t' access='read'/>"
+"    <property name='MemoryBudget' type='t' access='read'/>"
+"    <property name='Targets' type='u' access='read'/>"
+"  </interface>"
+"</node>";
+
 struct GsdClipboardManagerPrivate
 {
         guint    start_idle_id;
@@ -55,23 +84,41 @@ struct GsdClipboardManagerPrivate
         Window   window;
         Time     timestamp;
 
-        List    *contents;
-        List    *conversions;
+        List       *contents;
+        GHashTable *contents_index;     /* target atom → TargetData in contents */
+        guint       pending_incr;       /* contents still received incrementally */
+        GHashTable *conversions;        /* of IncrConversion, by requestor and property */
+        GHashTable *requestors;         /* requestor window → number of conversions */
+        GByteArray *incr_chunk;         /* gathers INCR chunks that span buffer chunks */
 
         Window   requestor;
         Atom     property;
         Time     time;
+
+        GSettings       *settings;
+        gsize            memory_budget;
+        gboolean         compress_contents;
+
+        GCancellable    *bus_cancellable;
+        GDBusNodeInfo   *introspection_data;
+        GDBusConnection *connection;
+        guint            name_id;
 };
 
-typedef struct
+typedef struct _TargetData TargetData;
+
+struct _TargetData
 {
-        unsigned char *data;
-        int            length;
+        ClipboardBuffer *buffer;
         Atom           target;
         Atom           type;
         int            format;
         int            refcount;
-} TargetData;
+
+        /* For targets that are generated on demand, the target they
+         * are generated from. Their buffer is NULL until then. */
+        TargetData    *source;
+};
 
 typedef struct
 {
@@ -86,12 +133,6 @@ static void     gsd_clipboard_manager_class_init  (GsdClipboardManagerClass *kla
 static void     gsd_clipboard_manager_init        (GsdClipboardManager      *clipboard_manager);
 static void     gsd_clipboard_manager_finalize    (GObject                  *object);
 
-static void     clipboard_manager_watch_cb        (GsdClipboardManager *manager,
-                                                   Window               window,
-                                                   Bool                 is_start,
-                                                   long                 mask,
-                                                   void                *cb_data);
-
 G_DEFINE_TYPE (GsdClipboardManager, gsd_clipboard_manager, G_TYPE_OBJECT)
 
 static gpointer manager_object = NULL;
@@ -112,7 +153,9 @@ target_data_unref (TargetData *data)
 {
         data->refcount--;
         if (data->refcount == 0) {
-                free (data->data);
+                clipboard_buffer_unref (data->buffer);
+                if (data->source)
+                        target_data_unref (data->source);
                 free (data);
         }
 }
@@ -126,6 +169,62 @@ conversion_free (IncrConversion *rdata)
         free (rdata);
 }
 
+/* Requestors are not known to GDK, their events reach us through the
+ * default filter. We only select the events we need from each of them,
+ * without querying the window for what was selected before. */
+static void
+select_requestor_input (GsdClipboardManager *manager,
+                        Window               requestor)
+{
+        long mask = NoEventMask;
+
+        if (requestor == manager->priv->requestor)
+                mask |= StructureNotifyMask;
+        /* A requestor which goes away in the middle of a transfer
+         * never deletes its property again */
+        if (g_hash_table_contains (manager->priv->requestors, GUINT_TO_POINTER (requestor)))
+                mask |= PropertyChangeMask | StructureNotifyMask;
+
+        XSelectInput (manager->priv->display, requestor, mask);
+}
+
+static void
+watch_requestor (GsdClipboardManager *manager,
+                 Window               requestor)
+{
+        guint n;
+
+        n = GPOINTER_TO_UINT (g_hash_table_lookup (manager->priv->requestors,
+                                                   GUINT_TO_POINTER (requestor)));
+        g_hash_table_insert (manager->priv->requestors,
+                             GUINT_TO_POINTER (requestor), GUINT_TO_POINTER (n + 1));
+
+        if (n == 0)
+                select_requestor_input (manager, requestor);
+}
+
+static void
+unwatch_requestor (GsdClipboardManager *manager,
+                   Window               requestor)
+{
+        guint n;
+
+        n = GPOINTER_TO_UINT (g_hash_table_lookup (manager->priv->requestors,
+                                                   GUINT_TO_POINTER (requestor)));
+        if (n > 1) {
+                g_hash_table_insert (manager->priv->requestors,
+                                     GUINT_TO_POINTER (requestor), GUINT_TO_POINTER (n - 1));
+                return;
+        }
+
+        g_hash_table_remove (manager->priv->requestors, GUINT_TO_POINTER (requestor));
+
+        /* The requestor may be gone already */
+        gdk_error_trap_push ();
+        select_requestor_input (manager, requestor);
+        gdk_error_trap_pop_ignored ();
+}
+
 static void
 send_selection_notify (GsdClipboardManager *manager,
                        Bool                 success)
@@ -176,7 +275,6 @@ finish_selection_request (GsdClipboardManager *manager,
         XSendEvent (xev->xselectionrequest.display,
                     xev->xselectionrequest.requestor,
                     False, NoEventMask, (XEvent *) &notify);
-        XSync (manager->priv->display, False);
 
         gdk_error_trap_pop_ignored ();
 }
@@ -194,14 +292,227 @@ clipboard_bytes_per_item (int format)
         return 0;
 }
 
+static guint
+conversion_hash (gconstpointer key)
+{
+        const IncrConversion *rdata = key;
+
+        return (guint) rdata->requestor ^ ((guint) rdata->property << 16);
+}
+
+static gboolean
+conversion_equal (gconstpointer a,
+                  gconstpointer b)
+{
+        const IncrConversion *rdata_a = a;
+        const IncrConversion *rdata_b = b;
+
+        return (rdata_a->requestor == rdata_b->requestor &&
+                rdata_a->property == rdata_b->property);
+}
+
+static void
+add_content (GsdClipboardManager *manager,
+             TargetData          *tdata)
+{
+        manager->priv->contents = list_prepend (manager->priv->contents, tdata);
+        g_hash_table_insert (manager->priv->contents_index,
+                             GUINT_TO_POINTER (tdata->target), tdata);
+}
+
+static void
+remove_content (GsdClipboardManager *manager,
+                TargetData          *tdata)
+{
+        g_hash_table_remove (manager->priv->contents_index,
+                             GUINT_TO_POINTER (tdata->target));
+        manager->priv->contents = list_remove (manager->priv->contents, tdata);
+        target_data_unref (tdata);
+}
+
+static TargetData *
+lookup_content (GsdClipboardManager *manager,
+                Atom                 target)
+{
+        return g_hash_table_lookup (manager->priv->contents_index,
+                                    GUINT_TO_POINTER (target));
+}
+
 static void
 free_contents (GsdClipboardManager *manager)
 {
+        g_hash_table_remove_all (manager->priv->contents_index);
+        manager->priv->pending_incr = 0;
+
         list_foreach (manager->priv->contents, (Callback)target_data_unref, NULL);
         list_free (manager->priv->contents);
         manager->priv->contents = NULL;
 }
 
+/* Counts buffers shared between targets once */
+static gsize
+get_memory_usage (GsdClipboardManager *manager,
+                  gsize               *spilled_size)
+{
+        GHashTable *seen;
+        gsize usage = 0, spilled = 0;
+        List *list;
+
+        seen = g_hash_table_new (NULL, NULL);
+
+        for (list = manager->priv->contents; list; list = list->next) {
+                TargetData *tdata = (TargetData *) list->data;
+
+                if (tdata->buffer == NULL ||
+                    !g_hash_table_add (seen, tdata->buffer))
+                        continue;
+
+                usage += clipboard_buffer_get_memory_size (tdata->buffer);
+                if (clipboard_buffer_is_spilled (tdata->buffer))
+                        spilled += clipboard_buffer_get_length (tdata->buffer);
+        }
+
+        g_hash_table_destroy (seen);
+
+        if (spilled_size)
+                *spilled_size = spilled;
+
+        return usage;
+}
+
+static void
+compress_contents (GsdClipboardManager *manager)
+{
+        List *list;
+
+        for (list = manager->priv->contents; list; list = list->next) {
+                TargetData *tdata = (TargetData *) list->data;
+
+                if (tdata->type == XA_INCR || tdata->buffer == NULL ||
+                    clipboard_buffer_is_spilled (tdata->buffer) ||
+                    clipboard_buffer_get_length (tdata->buffer) < COMPRESS_MIN_SIZE)
+                        continue;
+
+                /* Already compressed formats are given up on quickly */
+                clipboard_buffer_compress (tdata->buffer);
+        }
+}
+
+/* Compresses the large targets, then moves the largest ones out of the
+ * heap until the saved clipboard fits in the memory budget again */
+static void
+enforce_memory_budget (GsdClipboardManager *manager)
+{
+        GHashTable *seen;
+        GPtrArray *buffers;
+        List *list;
+
+        if (manager->priv->compress_contents)
+                compress_contents (manager);
+
+        seen = g_hash_table_new (NULL, NULL);
+        buffers = g_ptr_array_new ();
+
+        for (list = manager->priv->contents; list; list = list->next) {
+                TargetData *tdata = (TargetData *) list->data;
+
+                /* Still being received, or not generated yet */
+                if (tdata->type == XA_INCR || tdata->buffer == NULL)
+                        continue;
+
+                if (g_hash_table_add (seen, tdata->buffer))
+                        g_ptr_array_add (buffers, tdata->buffer);
+        }
+
+        clipboard_buffer_spill_to_budget (buffers,
+                                          get_memory_usage (manager, NULL),
+                                          manager->priv->memory_budget);
+
+        g_ptr_array_unref (buffers);
+        g_hash_table_destroy (seen);
+}
+
+static void
+settings_changed_cb (GSettings           *settings,
+                     const char          *key,
+                     GsdClipboardManager *manager)
+{
+        if (g_strcmp0 (key, MEMORY_BUDGET_KEY) == 0)
+                manager->priv->memory_budget = (gsize) g_settings_get_int (settings, key) * 1024 * 1024;
+        else if (g_strcmp0 (key, COMPRESS_CONTENTS_KEY) == 0)
+                manager->priv->compress_contents = g_settings_get_boolean (settings, key);
+        else
+                return;
+
+        enforce_memory_budget (manager);
+}
+
+static TargetData *
+target_data_new (Atom target)
+{
+        TargetData *tdata;
+
+        tdata = (TargetData *) malloc (sizeof (TargetData));
+        tdata->buffer = NULL;
+        tdata->target = target;
+        tdata->type = None;
+        tdata->format = 0;
+        tdata->refcount = 1;
+        tdata->source = NULL;
+
+        return tdata;
+}
+
+static Bool
+is_saved_target (Atom target)
+{
+        return (target != XA_TARGETS &&
+                target != XA_MULTIPLE &&
+                target != XA_DELETE &&
+                target != XA_INSERT_PROPERTY &&
+                target != XA_INSERT_SELECTION &&
+                target != XA_PIXMAP);
+}
+
+/* Fills @sources with the target each of @targets can be generated
+ * from, if the owner offers it too, or None */
+static void
+find_derivation_sources (GsdClipboardManager *manager,
+                         Atom                *targets,
+                         int                  nitems,
+                         Atom                *sources)
+{
+        char **names;
+        int    i, j;
+
+        names = (char **) calloc (nitems, sizeof (char *));
+        XGetAtomNames (manager->priv->display, targets, nitems, names);
+
+        for (i = 0; i < nitems; i++) {
+                const char *source;
+
+                if (names[i] == NULL)
+                        continue;
+
+                source = clipboard_derive_get_source (names[i]);
+                if (source == NULL)
+                        continue;
+
+                for (j = 0; j < nitems; j++) {
+                        if (names[j] != NULL && strcmp (names[j], source) == 0) {
+                                sources[i] = targets[j];
+                                break;
+                        }
+                }
+        }
+
+        for (i = 0; i < nitems; i++) {
+                if (names[i] != NULL)
+                        XFree (names[i]);
+        }
+        free (names);
+}
+
 static void
 save_targets (GsdClipboardManager *manager,
               Atom                *save_targets,
@@ -209,32 +520,46 @@ save_targets (GsdClipboardManager *manager,
 {
         int         nout, i;
         Atom       *multiple;
+        Atom       *sources;
         TargetData *tdata;
 
         multiple = (Atom *) malloc (2 * nitems * sizeof (Atom));
+        sources = (Atom *) calloc (nitems, sizeof (Atom));
+
+        if (g_settings_get_boolean (manager->priv->settings, CANONICAL_TARGETS_KEY))
+                find_derivation_sources (manager, save_targets, nitems, sources);
 
+        /* Targets that can be generated from others aren't fetched */
         nout = 0;
         for (i = 0; i < nitems; i++) {
-                if (save_targets[i] != XA_TARGETS &&
-                    save_targets[i] != XA_MULTIPLE &&
-                    save_targets[i] != XA_DELETE &&
-                    save_targets[i] != XA_INSERT_PROPERTY &&
-                    save_targets[i] != XA_INSERT_SELECTION &&
-                    save_targets[i] != XA_PIXMAP) {
-                        tdata = (TargetData *) malloc (sizeof (TargetData));
-                        tdata->data = NULL;
-                        tdata->length = 0;
-                        tdata->target = save_targets[i];
-                        tdata->type = None;
-                        tdata->format = 0;
-                        tdata->refcount = 1;
-                        manager->priv->contents = list_prepend (manager->priv->contents, tdata);
+                if (is_saved_target (save_targets[i]) && sources[i] == None &&
+                    lookup_content (manager, save_targets[i]) == NULL) {
+                        tdata = target_data_new (save_targets[i]);
+                        tdata->buffer = clipboard_buffer_new ();
+                        add_content (manager, tdata);
 
                         multiple[nout++] = save_targets[i];
                         multiple[nout++] = save_targets[i];
                 }
         }
 
+        for (i = 0; i < nitems; i++) {
+                TargetData *source;
+
+                if (!is_saved_target (save_targets[i]) || sources[i] == None ||
+                    lookup_content (manager, save_targets[i]) != NULL)
+                        continue;
+
+                source = lookup_content (manager, sources[i]);
+                if (source == NULL)
+                        continue;
+
+                tdata = target_data_new (save_targets[i]);
+                tdata->source = target_data_ref (source);
+                add_content (manager, tdata);
+        }
+
+        free (sources);
         XFree (save_targets);
 
         XChangeProperty (manager->priv->display, manager->priv->window,
@@ -247,26 +572,30 @@ save_targets (GsdClipboardManager *manager,
                            manager->priv->window, manager->priv->time);
 }
 
-static int
-find_content_target (TargetData *tdata,
-                     Atom        target)
+/* Makes targets with the same contents, which often are all the
+ * text targets, share a single buffer */
+static void
+share_target_buffer (GsdClipboardManager *manager,
+                     TargetData          *tdata)
 {
-        return tdata->target == target;
-}
+        List *list;
 
-static int
-find_content_type (TargetData *tdata,
-                   Atom        type)
-{
-        return tdata->type == type;
-}
+        for (list = manager->priv->contents; list; list = list->next) {
+                TargetData *other = (TargetData *) list->data;
 
-static int
-find_conversion_requestor (IncrConversion *rdata,
-                           XEvent         *xev)
-{
-        return (rdata->requestor == xev->xproperty.window &&
-                rdata->property == xev->xproperty.atom);
+                if (other == tdata ||
+                    other->buffer == NULL ||
+                    other->buffer == tdata->buffer ||
+                    other->type == None ||
+                    other->type == XA_INCR)
+                        continue;
+
+                if (clipboard_buffer_equal (other->buffer, tdata->buffer)) {
+                        clipboard_buffer_unref (tdata->buffer);
+                        tdata->buffer = clipboard_buffer_ref (other->buffer);
+                        return;
+                }
+        }
 }
 
 static void
@@ -279,6 +608,10 @@ get_property (TargetData          *tdata,
         unsigned long  remaining;
         unsigned char *data;
 
+        /* Not fetched */
+        if (tdata->source)
+                return;
+
         XGetWindowProperty (manager->priv->display,
                             manager->priv->window,
                             tdata->target,
@@ -293,17 +626,18 @@ get_property (TargetData          *tdata,
                             &data);
 
         if (type == None) {
-                manager->priv->contents = list_remove (manager->priv->contents, tdata);
-                free (tdata);
+                remove_content (manager, tdata);
         } else if (type == XA_INCR) {
                 tdata->type = type;
-                tdata->length = 0;
+                manager->priv->pending_incr++;
                 XFree (data);
         } else {
                 tdata->type = type;
-                tdata->data = data;
-                tdata->length = length * clipboard_bytes_per_item (format);
+                clipboard_buffer_append (tdata->buffer, data, length * clipboard_bytes_per_item (format));
                 tdata->format = format;
+                XFree (data);
+
+                share_target_buffer (manager, tdata);
         }
 }
 
@@ -311,7 +645,6 @@ static Bool
 receive_incrementally (GsdClipboardManager *manager,
                        XEvent              *xev)
 {
-        List          *list;
         TargetData    *tdata;
         Atom           type;
         int            format;
@@ -321,15 +654,8 @@ receive_incrementally (GsdClipboardManager *manager,
         if (xev->xproperty.window != manager->priv->window)
                 return False;
 
-        list = list_find (manager->priv->contents,
-                          (ListFindFunc) find_content_target, (void *) xev->xproperty.atom);
-
-        if (!list)
-                return False;
-
-        tdata = (TargetData *) list->data;
-
-        if (tdata->type != XA_INCR)
+        tdata = lookup_content (manager, xev->xproperty.atom);
+        if (tdata == NULL || tdata->type != XA_INCR)
                 return False;
 
         XGetWindowProperty (xev->xproperty.display,
@@ -343,73 +669,131 @@ receive_incrementally (GsdClipboardManager *manager,
                 tdata->type = type;
                 tdata->format = format;
 
-                if (!list_find (manager->priv->contents,
-                                (ListFindFunc) find_content_type, (void *)XA_INCR)) {
+                share_target_buffer (manager, tdata);
+
+                if (--manager->priv->pending_incr == 0) {
                         /* all incremental transfers done */
                         send_selection_notify (manager, True);
                         manager->priv->requestor = None;
+                        enforce_memory_budget (manager);
                 }
 
                 XFree (data);
         } else {
-                if (!tdata->data) {
-                        tdata->data = data;
-                        tdata->length = length;
-                } else {
-                        tdata->data = realloc (tdata->data, tdata->length + length + 1);
-                        memcpy (tdata->data + tdata->length, data, length + 1);
-                        tdata->length += length;
-                        XFree (data);
-                }
+                clipboard_buffer_append (tdata->buffer, data, length);
+                XFree (data);
         }
 
         return True;
 }
 
+/* Drops the decompressed or mapped in contents of @buffer, unless an
+ * INCR transfer is still reading them */
+static void
+release_buffer (GsdClipboardManager *manager,
+                ClipboardBuffer     *buffer)
+{
+        GHashTableIter iter;
+        IncrConversion *rdata;
+
+        g_hash_table_iter_init (&iter, manager->priv->conversions);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &rdata, NULL)) {
+                if (rdata->data->buffer == buffer)
+                        return;
+        }
+
+        clipboard_buffer_unmap (buffer);
+}
+
+/* Drops the INCR transfers to a requestor whose window was destroyed */
+static void
+drop_requestor (GsdClipboardManager *manager,
+                Window               requestor)
+{
+        GHashTableIter   iter;
+        IncrConversion  *rdata;
+        GPtrArray       *buffers;
+        guint            i;
+
+        if (!g_hash_table_remove (manager->priv->requestors, GUINT_TO_POINTER (requestor)))
+                return;
+
+        buffers = g_ptr_array_new_with_free_func ((GDestroyNotify) clipboard_buffer_unref);
+
+        g_hash_table_iter_init (&iter, manager->priv->conversions);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &rdata, NULL)) {
+                if (rdata->requestor != requestor)
+                        continue;
+
+                g_ptr_array_add (buffers, clipboard_buffer_ref (rdata->data->buffer));
+                g_hash_table_iter_remove (&iter);
+        }
+
+        for (i = 0; i < buffers->len; i++)
+                release_buffer (manager, g_ptr_array_index (buffers, i));
+        g_ptr_array_unref (buffers);
+}
+
 static Bool
 send_incrementally (GsdClipboardManager *manager,
                     XEvent              *xev)
 {
-        List           *list;
+        IncrConversion  key;
         IncrConversion *rdata;
-        unsigned long   length;
+        gsize           length, remaining, wanted;
         unsigned long   items;
-        unsigned char  *data;
+        const guchar   *data;
         gsize           bytes_per_item;
 
-        list = list_find (manager->priv->conversions,
-                          (ListFindFunc) find_conversion_requestor, xev);
-        if (list == NULL)
+        key.requestor = xev->xproperty.window;
+        key.property = xev->xproperty.atom;
+        rdata = g_hash_table_lookup (manager->priv->conversions, &key);
+        if (rdata == NULL)
                 return False;
 
-        rdata = (IncrConversion *) list->data;
-
         bytes_per_item = clipboard_bytes_per_item (rdata->data->format);
         if (bytes_per_item == 0)
                 return False;
 
-        data = rdata->data->data + rdata->offset;
-        length = rdata->data->length - rdata->offset;
-        if (length > SELECTION_MAX_SIZE)
-                length = SELECTION_MAX_SIZE;
+        /* Serve straight from the chunk the offset is in when it
+         * holds a full INCR chunk, and gather smaller ones, so that
+         * no round trip is wasted on a short chunk */
+        remaining = clipboard_buffer_get_length (rdata->data->buffer) - rdata->offset;
+        wanted = MIN (remaining, INCR_CHUNK_SIZE);
+
+        data = clipboard_buffer_peek (rdata->data->buffer, rdata->offset, &length);
+        if (data == NULL) {
+                data = (const guchar *) "";
+                length = 0;
+        } else if (length < wanted) {
+                g_byte_array_set_size (manager->priv->incr_chunk, wanted);
+                length = clipboard_buffer_read (rdata->data->buffer, rdata->offset,
+                                                manager->priv->incr_chunk->data, wanted);
+                data = manager->priv->incr_chunk->data;
+        }
+        if (length > wanted)
+                length = wanted;
+        length -= length % bytes_per_item;
 
         rdata->offset += length;
 
+        /* Each requestor proceeds at its own pace, the property
+         * was deleted so there is nothing to append to */
         items = length / bytes_per_item;
         XChangeProperty (manager->priv->display, rdata->requestor,
                          rdata->property, rdata->data->type,
-                         rdata->data->format, PropModeAppend,
-                         data, items);
+                         rdata->data->format, PropModeReplace,
+                         (const unsigned char *) data, items);
 
         if (length == 0) {
-                clipboard_manager_watch_cb (manager,
-                                            rdata->requestor,
-                                            False,
-                                            PropertyChangeMask,
-                                            NULL);
-
-                manager->priv->conversions = list_remove (manager->priv->conversions, rdata);
-                conversion_free (rdata);
+                Window requestor = rdata->requestor;
+                ClipboardBuffer *buffer = clipboard_buffer_ref (rdata->data->buffer);
+
+                g_hash_table_remove (manager->priv->conversions, rdata);
+                unwatch_requestor (manager, requestor);
+
+                release_buffer (manager, buffer);
+                clipboard_buffer_unref (buffer);
         }
 
         return True;
@@ -434,18 +818,14 @@ convert_clipboard_manager (GsdClipboardManager *manager,
                 } else {
                         gdk_error_trap_push ();
 
-                        clipboard_manager_watch_cb (manager,
-                                                    xev->xselectionrequest.requestor,
-                                                    True,
-                                                    StructureNotifyMask,
-                                                    NULL);
-                        XSelectInput (manager->priv->display,
-                                      xev->xselectionrequest.requestor,
-                                      StructureNotifyMask);
+                        manager->priv->requestor = xev->xselectionrequest.requestor;
+                        select_requestor_input (manager, manager->priv->requestor);
                         XSync (manager->priv->display, False);
 
-                        if (gdk_error_trap_pop () != Success)
+                        if (gdk_error_trap_pop () != Success) {
+                                manager->priv->requestor = None;
                                 return;
+                        }
 
                         gdk_error_trap_push ();
 
@@ -461,11 +841,11 @@ convert_clipboard_manager (GsdClipboardManager *manager,
                                         if (targets)
                                                 XFree (targets);
 
+                                        manager->priv->requestor = None;
                                         return;
                                 }
                         }
 
-                        manager->priv->requestor = xev->xselectionrequest.requestor;
                         manager->priv->property = xev->xselectionrequest.property;
                         manager->priv->time = xev->xselectionrequest.time;
 
@@ -503,6 +883,32 @@ convert_clipboard_manager (GsdClipboardManager *manager,
                 finish_selection_request (manager, xev, False);
 }
 
+/* Generates a target that wasn't fetched from the one it derives from */
+static Bool
+derive_target (GsdClipboardManager *manager,
+               TargetData          *tdata)
+{
+        TargetData *source = tdata->source;
+        char       *name;
+
+        if (source->type == None || source->type == XA_INCR || source->format != 8)
+                return False;
+
+        name = XGetAtomName (manager->priv->display, tdata->target);
+        tdata->buffer = clipboard_derive_target (manager->priv->display, name,
+                                                 source->buffer, &tdata->type);
+        XFree (name);
+
+        if (tdata->buffer == NULL)
+                return False;
+
+        tdata->format = 8;
+        share_target_buffer (manager, tdata);
+        enforce_memory_budget (manager);
+
+        return True;
+}
+
 static void
 convert_clipboard_target (IncrConversion      *rdata,
                           GsdClipboardManager *manager)
@@ -511,8 +917,8 @@ convert_clipboard_target (IncrConversion      *rdata,
         Atom             *targets;
         int               n_targets;
         List             *list;
+        gsize             length;
         unsigned long     items;
-        XWindowAttributes atts;
 
         if (rdata->target == XA_TARGETS) {
                 n_targets = list_length (manager->priv->contents) + 2;
@@ -537,14 +943,17 @@ convert_clipboard_target (IncrConversion      *rdata,
                 gsize bytes_per_item;
 
                 /* Convert from stored CLIPBOARD data */
-                list = list_find (manager->priv->contents,
-                                  (ListFindFunc) find_content_target, (void *) rdata->target);
+                tdata = lookup_content (manager, rdata->target);
 
                 /* We got a target that we don't support */
-                if (!list)
+                if (tdata == NULL)
+                        return;
+
+                if (tdata->buffer == NULL && !derive_target (manager, tdata)) {
+                        rdata->property = None;
                         return;
+                }
 
-                tdata = (TargetData *)list->data;
                 if (tdata->type == XA_INCR) {
                         /* we haven't completely received this target yet  */
                         rdata->property = None;
@@ -556,36 +965,38 @@ convert_clipboard_target (IncrConversion      *rdata,
                         return;
 
                 rdata->data = target_data_ref (tdata);
-                items = tdata->length / bytes_per_item;
-                if (tdata->length <= SELECTION_MAX_SIZE)
+                length = clipboard_buffer_get_length (tdata->buffer);
+                items = length / bytes_per_item;
+                if (length <= SELECTION_MAX_SIZE) {
+                        const guchar *data;
+
+                        /* Spilled contents get mapped back in */
+                        data = clipboard_buffer_flatten (tdata->buffer);
+                        if (data == NULL) {
+                                data = (const guchar *) "";
+                                items = 0;
+                        }
+
                         XChangeProperty (manager->priv->display, rdata->requestor,
                                          rdata->property,
                                          tdata->type, tdata->format, PropModeReplace,
-                                         tdata->data, items);
-                else {
+                                         data, items);
+                        release_buffer (manager, tdata->buffer);
+                } else {
                         /* start incremental transfer */
                         rdata->offset = 0;
 
+                        /* Errors from a requestor that went away are
+                         * ignored without a round trip */
                         gdk_error_trap_push ();
 
-                        XGetWindowAttributes (manager->priv->display, rdata->requestor, &atts);
-
-                        clipboard_manager_watch_cb (manager,
-                                                    rdata->requestor,
-                                                    True,
-                                                    PropertyChangeMask,
-                                                    NULL);
-
-                        XSelectInput (manager->priv->display, rdata->requestor,
-                                      atts.your_event_mask | PropertyChangeMask);
+                        watch_requestor (manager, rdata->requestor);
 
                         XChangeProperty (manager->priv->display, rdata->requestor,
                                          rdata->property,
                                          XA_INCR, 32, PropModeReplace,
                                          (unsigned char *) &items, 1);
 
-                        XSync (manager->priv->display, False);
-
                         gdk_error_trap_pop_ignored ();
                 }
         }
@@ -595,9 +1006,26 @@ static void
 collect_incremental (IncrConversion      *rdata,
                      GsdClipboardManager *manager)
 {
-        if (rdata->offset >= 0)
-                manager->priv->conversions = list_prepend (manager->priv->conversions, rdata);
-        else {
+        if (rdata->offset >= 0) {
+                IncrConversion *old;
+
+                /* A requestor reusing the property of a transfer it
+                 * didn't finish replaces it */
+                old = g_hash_table_lookup (manager->priv->conversions, rdata);
+                if (old != NULL)
+                        g_hash_table_steal (manager->priv->conversions, old);
+
+                g_hash_table_add (manager->priv->conversions, rdata);
+
+                if (old != NULL) {
+                        ClipboardBuffer *buffer = clipboard_buffer_ref (old->data->buffer);
+
+                        conversion_free (old);
+                        unwatch_requestor (manager, rdata->requestor);
+                        release_buffer (manager, buffer);
+                        clipboard_buffer_unref (buffer);
+                }
+        } else {
                 if (rdata->data) {
                         target_data_unref (rdata->data);
                         rdata->data = NULL;
@@ -687,6 +1115,22 @@ convert_clipboard (GsdClipboardManager *manager,
                 free (multiple);
 }
 
+/* Drops the targets that were to be generated from a target the
+ * owner failed to convert */
+static void
+remove_orphaned_targets (GsdClipboardManager *manager)
+{
+        List *list, *next;
+
+        for (list = manager->priv->contents; list; list = next) {
+                TargetData *tdata = (TargetData *) list->data;
+
+                next = list->next;
+                if (tdata->source && lookup_content (manager, tdata->source->target) != tdata->source)
+                        remove_content (manager, tdata);
+        }
+}
+
 static Bool
 clipboard_manager_process_event (GsdClipboardManager *manager,
                                  XEvent              *xev)
@@ -701,14 +1145,11 @@ clipboard_manager_process_event (GsdClipboardManager *manager,
 
         switch (xev->xany.type) {
         case DestroyNotify:
+                drop_requestor (manager, xev->xdestroywindow.window);
+
                 if (xev->xdestroywindow.window == manager->priv->requestor) {
                         free_contents (manager);
 
-                        clipboard_manager_watch_cb (manager,
-                                                    manager->priv->requestor,
-                                                    False,
-                                                    0,
-                                                    NULL);
                         manager->priv->requestor = None;
                 }
                 break;
@@ -738,11 +1179,6 @@ clipboard_manager_process_event (GsdClipboardManager *manager,
                 if (xev->xselectionclear.selection == XA_CLIPBOARD) {
                         /* We lost the clipboard selection */
                         free_contents (manager);
-                        clipboard_manager_watch_cb (manager,
-                                                    manager->priv->requestor,
-                                                    False,
-                                                    0,
-                                                    NULL);
                         manager->priv->requestor = None;
 
                         return True;
@@ -771,6 +1207,8 @@ clipboard_manager_process_event (GsdClipboardManager *manager,
                                 list_foreach (tmp, (Callback) get_property, manager);
                                 list_free (tmp);
 
+                                remove_orphaned_targets (manager);
+
                                 manager->priv->time = xev->xselection.time;
                                 XSetSelectionOwner (manager->priv->display, XA_CLIPBOARD,
                                                     manager->priv->window, manager->priv->time);
@@ -782,27 +1220,17 @@ clipboard_manager_process_event (GsdClipboardManager *manager,
                                                          XA_ATOM, 32, PropModeReplace,
                                                          (unsigned char *)&XA_NULL, 1);
 
-                                if (!list_find (manager->priv->contents,
-                                                (ListFindFunc)find_content_type, (void *)XA_INCR)) {
+                                if (manager->priv->pending_incr == 0) {
                                         /* all transfers done */
                                         send_selection_notify (manager, True);
-                                        clipboard_manager_watch_cb (manager,
-                                                                    manager->priv->requestor,
-                                                                    False,
-                                                                    0,
-                                                                    NULL);
                                         manager->priv->requestor = None;
+                                        enforce_memory_budget (manager);
                                 }
                         }
                         else if (xev->xselection.property == None) {
                                 send_selection_notify (manager, False);
 
                                 free_contents (manager);
-                                clipboard_manager_watch_cb (manager,
-                                                            manager->priv->requestor,
-                                                            False,
-                                                            0,
-                                                            NULL);
                                 manager->priv->requestor = None;
                         }
 
@@ -842,38 +1270,70 @@ clipboard_manager_event_filter (GdkXEvent           *xevent,
         }
 }
 
-static void
-clipboard_manager_watch_cb (GsdClipboardManager *manager,
-                            Window               window,
-                            Bool                 is_start,
-                            long                 mask,
-                            void                *cb_data)
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     GsdClipboardManager *manager)
 {
-        GdkWindow  *gdkwin;
-        GdkDisplay *display;
+        gsize memory_usage, spilled_size;
 
-        display = gdk_display_get_default ();
-        gdkwin = gdk_x11_window_lookup_for_display (display, window);
+        memory_usage = get_memory_usage (manager, &spilled_size);
 
-        if (is_start) {
-                if (gdkwin == NULL) {
-                        gdkwin = gdk_x11_window_foreign_new_for_display (display, window);
-                } else {
-                        g_object_ref (gdkwin);
-                }
+        if (g_strcmp0 (property_name, "MemoryUsage") == 0)
+                return g_variant_new_uint64 (memory_usage);
+        if (g_strcmp0 (property_name, "SpilledSize") == 0)
+                return g_variant_new_uint64 (spilled_size);
+        if (g_strcmp0 (property_name, "MemoryBudget") == 0)
+                return g_variant_new_uint64 (manager->priv->memory_budget);
+        if (g_strcmp0 (property_name, "Targets") == 0)
+                return g_variant_new_uint32 (list_length (manager->priv->contents));
 
-                gdk_window_add_filter (gdkwin,
-                                       (GdkFilterFunc)clipboard_manager_event_filter,
-                                       manager);
-        } else {
-                if (gdkwin == NULL) {
-                        return;
-                }
-                gdk_window_remove_filter (gdkwin,
-                                          (GdkFilterFunc)clipboard_manager_event_filter,
-                                          manager);
-                g_object_unref (gdkwin);
+        return NULL;
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+        NULL,
+        (GDBusInterfaceGetPropertyFunc) handle_get_property,
+        NULL
+};
+
+static void
+on_bus_gotten (GObject             *source_object,
+               GAsyncResult        *res,
+               GsdClipboardManager *manager)
+{
+        GDBusConnection *connection;
+        GError *error = NULL;
+
+        connection = g_bus_get_finish (res, &error);
+        if (connection == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Could not get session bus: %s", error->message);
+                g_error_free (error);
+                return;
         }
+        manager->priv->connection = connection;
+
+        g_dbus_connection_register_object (connection,
+                                           GSD_CLIPBOARD_DBUS_PATH,
+                                           manager->priv->introspection_data->interfaces[0],
+                                           &interface_vtable,
+                                           manager,
+                                           NULL,
+                                           NULL);
+
+        manager->priv->name_id = g_bus_own_name_on_connection (connection,
+                                                               GSD_CLIPBOARD_DBUS_NAME,
+                                                               G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL,
+                                                               NULL);
 }
 
 static gboolean
@@ -893,7 +1353,6 @@ start_clipboard_idle_cb (GsdClipboardManager *manager)
         }
 
         manager->priv->contents = NULL;
-        manager->priv->conversions = NULL;
         manager->priv->requestor = None;
 
         manager->priv->window = XCreateSimpleWindow (manager->priv->display,
@@ -903,11 +1362,9 @@ start_clipboard_idle_cb (GsdClipboardManager *manager)
                                                                  DefaultScreen (manager->priv->display)),
                                                      WhitePixel (manager->priv->display,
                                                                  DefaultScreen (manager->priv->display)));
-        clipboard_manager_watch_cb (manager,
-                                    manager->priv->window,
-                                    True,
-                                    PropertyChangeMask,
-                                    NULL);
+        gdk_window_add_filter (NULL,
+                               (GdkFilterFunc) clipboard_manager_event_filter,
+                               manager);
         XSelectInput (manager->priv->display,
                       manager->priv->window,
                       PropertyChangeMask);
@@ -938,11 +1395,9 @@ start_clipboard_idle_cb (GsdClipboardManager *manager)
                             StructureNotifyMask,
                             (XEvent *)&xev);
         } else {
-                clipboard_manager_watch_cb (manager,
-                                            manager->priv->window,
-                                            False,
-                                            0,
-                                            NULL);
+                gdk_window_remove_filter (NULL,
+                                          (GdkFilterFunc) clipboard_manager_event_filter,
+                                          manager);
                 /* FIXME: manager->priv->terminate (manager->priv->cb_data); */
         }
 
@@ -959,9 +1414,26 @@ gsd_clipboard_manager_start (GsdClipboardManager *manager,
 {
         gnome_settings_profile_start (NULL);
 
+        manager->priv->settings = g_settings_new (CLIPBOARD_SCHEMA);
+        manager->priv->memory_budget = (gsize) g_settings_get_int (manager->priv->settings,
+                                                                   MEMORY_BUDGET_KEY) * 1024 * 1024;
+        manager->priv->compress_contents = g_settings_get_boolean (manager->priv->settings,
+                                                                   COMPRESS_CONTENTS_KEY);
+        g_signal_connect (manager->priv->settings, "changed",
+                          G_CALLBACK (settings_changed_cb), manager);
+
         manager->priv->start_idle_id = g_idle_add ((GSourceFunc) start_clipboard_idle_cb, manager);
         g_source_set_name_by_id (manager->priv->start_idle_id, "[gnome-settings-daemon] start_clipboard_idle_cb");
 
+        manager->priv->introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+        g_assert (manager->priv->introspection_data != NULL);
+
+        manager->priv->bus_cancellable = g_cancellable_new ();
+        g_bus_get (G_BUS_TYPE_SESSION,
+                   manager->priv->bus_cancellable,
+                   (GAsyncReadyCallback) on_bus_gotten,
+                   manager);
+
         gnome_settings_profile_end (NULL);
 
         return TRUE;
@@ -973,22 +1445,31 @@ gsd_clipboard_manager_stop (GsdClipboardManager *manager)
         g_debug ("Stopping clipboard manager");
 
         if (manager->priv->window != None) {
-                clipboard_manager_watch_cb (manager,
-                                            manager->priv->window,
-                                            FALSE,
-                                            0,
-                                            NULL);
+                gdk_window_remove_filter (NULL,
+                                          (GdkFilterFunc) clipboard_manager_event_filter,
+                                          manager);
                 XDestroyWindow (manager->priv->display, manager->priv->window);
                 manager->priv->window = None;
         }
 
-        if (manager->priv->conversions != NULL) {
-                list_foreach (manager->priv->conversions, (Callback) conversion_free, NULL);
-                list_free (manager->priv->conversions);
-                manager->priv->conversions = NULL;
-        }
+        g_hash_table_remove_all (manager->priv->conversions);
+        g_hash_table_remove_all (manager->priv->requestors);
 
         free_contents (manager);
+
+        if (manager->priv->bus_cancellable != NULL) {
+                g_cancellable_cancel (manager->priv->bus_cancellable);
+                g_clear_object (&manager->priv->bus_cancellable);
+        }
+
+        if (manager->priv->name_id != 0) {
+                g_bus_unown_name (manager->priv->name_id);
+                manager->priv->name_id = 0;
+        }
+
+        g_clear_pointer (&manager->priv->introspection_data, g_dbus_node_info_unref);
+        g_clear_object (&manager->priv->connection);
+        g_clear_object (&manager->priv->settings);
 }
 
 static void
@@ -1008,6 +1489,13 @@ gsd_clipboard_manager_init (GsdClipboardManager *manager)
 
         manager->priv->display = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
 
+        manager->priv->contents_index = g_hash_table_new (NULL, NULL);
+        manager->priv->conversions = g_hash_table_new_full (conversion_hash,
+                                                            conversion_equal,
+                                                            (GDestroyNotify) conversion_free,
+                                                            NULL);
+        manager->priv->requestors = g_hash_table_new (NULL, NULL);
+        manager->priv->incr_chunk = g_byte_array_new ();
 }
 
 static void
@@ -1027,6 +1515,11 @@ gsd_clipboard_manager_finalize (GObject *object)
         if (clipboard_manager->priv->start_idle_id !=0)
                 g_source_remove (clipboard_manager->priv->start_idle_id);
 
+        g_hash_table_destroy (clipboard_manager->priv->contents_index);
+        g_hash_table_destroy (clipboard_manager->priv->conversions);
+        g_hash_table_destroy (clipboard_manager->priv->requestors);
+        g_byte_array_unref (clipboard_manager->priv->incr_chunk);
+
         G_OBJECT_CLASS (gsd_clipboard_manager_parent_class)->finalize (object);
 }
 
@@ -0,0 +1,250 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for clipboard_buffer_compress(): builds payloads like the
+ * ones commonly saved from the clipboard, and reports for each how long
+ * compressing takes, how much memory it saves, and how long reading the
+ * contents back takes, which is the added latency when pasting.
+ * Also checks that a compressed buffer being read still gets spilled
+ * with no memory budget at all.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "clipboard-buffer.h"
+
+#define DEFAULT_SIZE    4       /* MiB */
+#define APPEND_SIZE     (256 * 1024)
+
+static const char * const words[] = {
+        "clipboard", "settings", "daemon", "the", "of", "and", "window",
+        "selection", "transfer", "property", "a", "to", "is", "contents"
+};
+
+static GByteArray *
+make_html (gsize size)
+{
+        GByteArray *array = g_byte_array_sized_new (size);
+        guint row = 0;
+
+        while (array->len < size) {
+                char *line;
+
+                line = g_strdup_printf ("<tr class=\"row-%u\"><td style=\"font-weight: bold\">%u</td>"
+                                        "<td><a href=\"https://example.org/item/%u\">Item %u</a></td></tr>\n",
+                                        row % 2, row, row * 7, row);
+                g_byte_array_append (array, (guint8 *) line, strlen (line));
+                g_free (line);
+                row++;
+        }
+        g_byte_array_set_size (array, size);
+
+        return array;
+}
+
+static GByteArray *
+make_text (GRand *rand,
+           gsize  size)
+{
+        GByteArray *array = g_byte_array_sized_new (size);
+
+        while (array->len < size) {
+                const char *word = words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))];
+                const char *separator = g_rand_int_range (rand, 0, 12) ? " " : ".\n";
+
+                g_byte_array_append (array, (guint8 *) word, strlen (word));
+                g_byte_array_append (array, (guint8 *) separator, strlen (separator));
+        }
+        g_byte_array_set_size (array, size);
+
+        return array;
+}
+
+/* A screenshot-like 24-bit bitmap: flat areas with some gradients */
+static GByteArray *
+make_bmp (gsize size)
+{
+        GByteArray *array = g_byte_array_sized_new (size);
+        guint width = 1024;
+        guint i;
+
+        g_byte_array_set_size (array, size);
+        memset (array->data, 0, 54);
+        array->data[0] = 'B';
+        array->data[1] = 'M';
+
+        for (i = 54; i + 3 <= size; i += 3) {
+                guint pixel = (i - 54) / 3;
+                guint x = pixel % width, y = pixel / width;
+
+                if ((x / 128 + y / 128) % 3 == 0) {
+                        array->data[i] = x & 0xff;
+                        array->data[i + 1] = y & 0xff;
+                        array->data[i + 2] = 0x80;
+                } else {
+                        array->data[i] = 0xf0;
+                        array->data[i + 1] = 0xf0;
+                        array->data[i + 2] = 0xf0;
+                }
+        }
+
+        return array;
+}
+
+/* Stands in for PNG or JPEG images, which don't compress further */
+static GByteArray *
+make_random (GRand *rand,
+             gsize  size)
+{
+        GByteArray *array = g_byte_array_sized_new (size);
+        guint i;
+
+        g_byte_array_set_size (array, size);
+        for (i = 0; i + 4 <= size; i += 4) {
+                guint32 r = g_rand_int (rand);
+                memcpy (array->data + i, &r, 4);
+        }
+
+        return array;
+}
+
+static void
+run (const char *name,
+     GByteArray *payload)
+{
+        ClipboardBuffer *buffer;
+        gsize before, after, offset;
+        gint64 start, compress_time, read_time;
+        const guchar *data;
+        gboolean compressed;
+
+        buffer = clipboard_buffer_new ();
+        for (offset = 0; offset < payload->len; offset += APPEND_SIZE)
+                clipboard_buffer_append (buffer, payload->data + offset,
+                                         MIN (APPEND_SIZE, payload->len - offset));
+        before = clipboard_buffer_get_memory_size (buffer);
+
+        start = g_get_monotonic_time ();
+        compressed = clipboard_buffer_compress (buffer);
+        compress_time = g_get_monotonic_time () - start;
+        after = clipboard_buffer_get_memory_size (buffer);
+
+        start = g_get_monotonic_time ();
+        data = clipboard_buffer_flatten (buffer);
+        read_time = g_get_monotonic_time () - start;
+
+        if (data == NULL || memcmp (data, payload->data, payload->len) != 0) {
+                g_printerr ("%s: contents differ after compression\n", name);
+                exit (1);
+        }
+        clipboard_buffer_unmap (buffer);
+
+        g_print ("%-10s %8.2f MiB → %8.2f MiB (%5.1f%%)  compress %8.2f ms  read %8.2f ms%s\n",
+                 name, before / (1024.0 * 1024.0), after / (1024.0 * 1024.0),
+                 100.0 * after / before, compress_time / 1000.0, read_time / 1000.0,
+                 compressed ? "" : "  (kept as is)");
+
+        clipboard_buffer_unref (buffer);
+}
+
+static void
+check_spill_expanded (GByteArray *payload)
+{
+        ClipboardBuffer *buffer;
+        GPtrArray *buffers;
+        const guchar *data;
+        gsize usage;
+
+        buffer = clipboard_buffer_new ();
+        clipboard_buffer_append (buffer, payload->data, payload->len);
+        if (!clipboard_buffer_compress (buffer)) {
+                g_printerr ("spill: contents did not compress\n");
+                exit (1);
+        }
+
+        /* Being read, so decompressed */
+        data = clipboard_buffer_flatten (buffer);
+        g_assert (data != NULL);
+
+        buffers = g_ptr_array_new ();
+        g_ptr_array_add (buffers, buffer);
+
+        usage = clipboard_buffer_spill_to_budget (buffers,
+                                                  clipboard_buffer_get_memory_size (buffer),
+                                                  0);
+        if (usage != 0 || !clipboard_buffer_is_spilled (buffer) ||
+            clipboard_buffer_get_memory_size (buffer) != 0) {
+                g_printerr ("spill: %" G_GSIZE_FORMAT " bytes left on the heap\n", usage);
+                exit (1);
+        }
+
+        /* Read again, which there is nothing more to spill for */
+        data = clipboard_buffer_flatten (buffer);
+        if (data == NULL || memcmp (data, payload->data, payload->len) != 0) {
+                g_printerr ("spill: contents differ after spilling\n");
+                exit (1);
+        }
+        clipboard_buffer_spill_to_budget (buffers,
+                                          clipboard_buffer_get_memory_size (buffer),
+                                          0);
+        clipboard_buffer_unmap (buffer);
+
+        g_ptr_array_unref (buffers);
+        clipboard_buffer_unref (buffer);
+}
+
+int
+main (int argc, char **argv)
+{
+        GByteArray *payload;
+        GRand *rand;
+        gsize size;
+
+        size = (gsize) (argc > 1 ? atoi (argv[1]) : DEFAULT_SIZE) * 1024 * 1024;
+        if (size == 0) {
+                g_printerr ("Usage: %s [MiB per payload]\n", argv[0]);
+                return 1;
+        }
+
+        rand = g_rand_new_with_seed (42);
+
+        payload = make_html (size);
+        check_spill_expanded (payload);
+        run ("text/html", payload);
+        g_byte_array_unref (payload);
+
+        payload = make_text (rand, size);
+        run ("text/plain", payload);
+        g_byte_array_unref (payload);
+
+        payload = make_bmp (size);
+        run ("image/bmp", payload);
+        g_byte_array_unref (payload);
+
+        payload = make_random (rand, size);
+        run ("image/png", payload);
+        g_byte_array_unref (payload);
+
+        g_rand_free (rand);
+
+        return 0;
+}
@@ -0,0 +1,443 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for INCR transfers through a running gsd-clipboard, for
+ * example on Xvfb. Offers a number of large targets on CLIPBOARD, has
+ * the clipboard manager save them, which it does with one concurrent
+ * INCR transfer per target, then reads them back from the clipboard
+ * manager with one requestor and with several concurrent requestors.
+ *
+ * Usage: test-clipboard-incr [targets] [MiB per target] [requestors]
+ *
+ * For instance, from the build directory:
+ *
+ *   xvfb-run -a sh -c 'plugins/clipboard/gsd-clipboard & sleep 1;
+ *                      plugins/clipboard/test-clipboard-incr 8 4 8'
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#define DEFAULT_N_TARGETS       8
+#define DEFAULT_TARGET_SIZE     4
+#define DEFAULT_N_REQUESTORS    8
+
+typedef struct {
+        Window  requestor;
+        Atom    property;
+        guint   target;
+        gsize   offset;
+} Transfer;
+
+typedef struct {
+        Window  window;
+        guint   target;
+        gsize   received;
+        guint32 checksum;
+        gboolean incr;
+        gboolean done;
+} Requestor;
+
+static Display *display;
+static Window   owner;
+
+static Atom XA_CLIPBOARD;
+static Atom XA_CLIPBOARD_MANAGER;
+static Atom XA_SAVE_TARGETS;
+static Atom XA_TARGETS;
+static Atom XA_MULTIPLE;
+static Atom XA_ATOM_PAIR;
+static Atom XA_INCR;
+static Atom XA_BENCH_PROPERTY;
+
+static guint   n_targets;
+static gsize   target_size;
+static Atom   *targets;
+static guchar *contents;
+static gsize   chunk_size;
+
+static GPtrArray *transfers;
+
+static guint32
+checksum_update (guint32       checksum,
+                 const guchar *data,
+                 gsize         length)
+{
+        gsize i;
+
+        for (i = 0; i < length; i++)
+                checksum = (checksum ^ data[i]) * 16777619u;
+
+        return checksum;
+}
+
+static void
+send_notify (XSelectionRequestEvent *request,
+             Atom                    property)
+{
+        XSelectionEvent notify;
+
+        notify.type = SelectionNotify;
+        notify.serial = 0;
+        notify.send_event = True;
+        notify.display = display;
+        notify.requestor = request->requestor;
+        notify.selection = request->selection;
+        notify.target = request->target;
+        notify.property = property;
+        notify.time = request->time;
+
+        XSendEvent (display, request->requestor, False, NoEventMask, (XEvent *) &notify);
+}
+
+static guint
+find_target (Atom target)
+{
+        guint i;
+
+        for (i = 0; i < n_targets; i++) {
+                if (targets[i] == target)
+                        return i;
+        }
+
+        return G_MAXUINT;
+}
+
+static gboolean
+start_transfer (Window requestor,
+                Atom   target,
+                Atom   property)
+{
+        Transfer *transfer;
+        long size = target_size;
+        guint i;
+
+        i = find_target (target);
+        if (i == G_MAXUINT)
+                return FALSE;
+
+        transfer = g_new0 (Transfer, 1);
+        transfer->requestor = requestor;
+        transfer->property = property;
+        transfer->target = i;
+        g_ptr_array_add (transfers, transfer);
+
+        XSelectInput (display, requestor, PropertyChangeMask);
+        XChangeProperty (display, requestor, property, XA_INCR, 32,
+                         PropModeReplace, (unsigned char *) &size, 1);
+
+        return TRUE;
+}
+
+static void
+handle_selection_request (XSelectionRequestEvent *request)
+{
+        if (request->target == XA_TARGETS) {
+                XChangeProperty (display, request->requestor, request->property,
+                                 XA_ATOM, 32, PropModeReplace,
+                                 (unsigned char *) targets, n_targets);
+                send_notify (request, request->property);
+        } else if (request->target == XA_MULTIPLE) {
+                Atom type, *pairs = NULL;
+                int format;
+                unsigned long n_items, remaining, i;
+
+                XGetWindowProperty (display, request->requestor, request->property,
+                                    0, 0x1FFFFFFF, False, XA_ATOM_PAIR,
+                                    &type, &format, &n_items, &remaining,
+                                    (unsigned char **) &pairs);
+
+                for (i = 0; i + 1 < n_items; i += 2) {
+                        if (!start_transfer (request->requestor, pairs[i], pairs[i + 1]))
+                                pairs[i + 1] = None;
+                }
+                XChangeProperty (display, request->requestor, request->property,
+                                 XA_ATOM_PAIR, 32, PropModeReplace,
+                                 (unsigned char *) pairs, n_items);
+                if (pairs)
+                        XFree (pairs);
+
+                send_notify (request, request->property);
+        } else if (start_transfer (request->requestor, request->target, request->property)) {
+                send_notify (request, request->property);
+        } else {
+                send_notify (request, None);
+        }
+}
+
+/* The requestor deleted the property, send it the next chunk */
+static void
+continue_transfer (XPropertyEvent *event)
+{
+        Transfer *transfer = NULL;
+        gsize length;
+        guint i;
+
+        for (i = 0; i < transfers->len; i++) {
+                Transfer *t = g_ptr_array_index (transfers, i);
+
+                if (t->requestor == event->window && t->property == event->atom) {
+                        transfer = t;
+                        break;
+                }
+        }
+
+        if (transfer == NULL)
+                return;
+
+        length = MIN (chunk_size, target_size - transfer->offset);
+        XChangeProperty (display, transfer->requestor, transfer->property,
+                         targets[transfer->target], 8, PropModeReplace,
+                         contents + transfer->target * target_size + transfer->offset,
+                         length);
+        transfer->offset += length;
+
+        if (length == 0)
+                g_ptr_array_remove_index_fast (transfers, i);
+}
+
+static void
+read_reply (Requestor *requestor)
+{
+        Atom type;
+        int format;
+        unsigned long n_items, remaining;
+        unsigned char *data = NULL;
+
+        XGetWindowProperty (display, requestor->window, XA_BENCH_PROPERTY,
+                            0, 0x1FFFFFFF, True, AnyPropertyType,
+                            &type, &format, &n_items, &remaining, &data);
+
+        if (type == XA_INCR) {
+                requestor->incr = TRUE;
+        } else {
+                requestor->checksum = checksum_update (requestor->checksum, data, n_items);
+                requestor->received += n_items;
+                if (!requestor->incr || n_items == 0)
+                        requestor->done = TRUE;
+        }
+
+        if (data)
+                XFree (data);
+}
+
+static void
+save_targets (void)
+{
+        Window saver;
+        gint64 start;
+        gboolean done = FALSE;
+
+        owner = XCreateSimpleWindow (display, DefaultRootWindow (display),
+                                     0, 0, 1, 1, 0, 0, 0);
+        saver = XCreateSimpleWindow (display, DefaultRootWindow (display),
+                                     0, 0, 1, 1, 0, 0, 0);
+        XSetSelectionOwner (display, XA_CLIPBOARD, owner, CurrentTime);
+
+        start = g_get_monotonic_time ();
+        XConvertSelection (display, XA_CLIPBOARD_MANAGER, XA_SAVE_TARGETS,
+                           None, saver, CurrentTime);
+
+        while (!done) {
+                XEvent event;
+
+                XNextEvent (display, &event);
+
+                switch (event.type) {
+                case SelectionRequest:
+                        handle_selection_request (&event.xselectionrequest);
+                        break;
+                case PropertyNotify:
+                        if (event.xproperty.state == PropertyDelete)
+                                continue_transfer (&event.xproperty);
+                        break;
+                case SelectionNotify:
+                        if (event.xselection.requestor == saver) {
+                                if (event.xselection.property == None) {
+                                        g_printerr ("The clipboard manager failed to save the targets\n");
+                                        exit (1);
+                                }
+                                done = TRUE;
+                        }
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        g_print ("Save %u × %" G_GSIZE_FORMAT " MiB:        %8.2f ms\n",
+                 n_targets, target_size / (1024 * 1024),
+                 (g_get_monotonic_time () - start) / 1000.0);
+
+        XDestroyWindow (display, saver);
+}
+
+/* Returns the aggregate throughput, in MiB/s */
+static double
+read_targets (guint n_requestors)
+{
+        Requestor *requestors;
+        guint i, n_done = 0;
+        gint64 start, elapsed;
+        double throughput;
+
+        requestors = g_new0 (Requestor, n_requestors);
+        for (i = 0; i < n_requestors; i++) {
+                requestors[i].window = XCreateSimpleWindow (display, DefaultRootWindow (display),
+                                                            0, 0, 1, 1, 0, 0, 0);
+                requestors[i].target = i % n_targets;
+                requestors[i].checksum = 2166136261u;
+                XSelectInput (display, requestors[i].window, PropertyChangeMask);
+        }
+        XSync (display, False);
+
+        start = g_get_monotonic_time ();
+        for (i = 0; i < n_requestors; i++)
+                XConvertSelection (display, XA_CLIPBOARD, targets[requestors[i].target],
+                                   XA_BENCH_PROPERTY, requestors[i].window, CurrentTime);
+
+        while (n_done < n_requestors) {
+                Requestor *requestor = NULL;
+                XEvent event;
+
+                XNextEvent (display, &event);
+
+                for (i = 0; i < n_requestors; i++) {
+                        if (requestors[i].window == event.xany.window)
+                                requestor = &requestors[i];
+                }
+                if (requestor == NULL || requestor->done)
+                        continue;
+
+                if (event.type == SelectionNotify) {
+                        if (event.xselection.property == None) {
+                                g_printerr ("The clipboard manager refused the conversion\n");
+                                exit (1);
+                        }
+                        read_reply (requestor);
+                } else if (event.type == PropertyNotify &&
+                           event.xproperty.state == PropertyNewValue &&
+                           event.xproperty.atom == XA_BENCH_PROPERTY &&
+                           requestor->incr) {
+                        read_reply (requestor);
+                }
+
+                if (requestor->done)
+                        n_done++;
+        }
+        elapsed = g_get_monotonic_time () - start;
+
+        for (i = 0; i < n_requestors; i++) {
+                guint t = requestors[i].target;
+
+                if (requestors[i].received != target_size ||
+                    requestors[i].checksum != checksum_update (2166136261u,
+                                                               contents + t * target_size,
+                                                               target_size)) {
+                        g_printerr ("Requestor %u received wrong contents\n", i);
+                        exit (1);
+                }
+                XDestroyWindow (display, requestors[i].window);
+        }
+
+        throughput = ((double) n_requestors * target_size / (1024 * 1024)) / (elapsed / 1000000.0);
+        g_print ("Read with %2u requestor(s): %8.2f ms, %8.2f MiB/s\n",
+                 n_requestors, elapsed / 1000.0, throughput);
+
+        g_free (requestors);
+
+        return throughput;
+}
+
+int
+main (int argc, char **argv)
+{
+        long max_request_size;
+        guint n_requestors;
+        double single, concurrent;
+        gsize i;
+
+        n_targets = argc > 1 ? atoi (argv[1]) : DEFAULT_N_TARGETS;
+        target_size = (gsize) (argc > 2 ? atoi (argv[2]) : DEFAULT_TARGET_SIZE) * 1024 * 1024;
+        n_requestors = argc > 3 ? atoi (argv[3]) : DEFAULT_N_REQUESTORS;
+        if (n_targets == 0 || target_size == 0 || n_requestors == 0) {
+                g_printerr ("Usage: %s [targets] [MiB per target] [requestors]\n", argv[0]);
+                return 1;
+        }
+
+        display = XOpenDisplay (NULL);
+        if (display == NULL) {
+                g_printerr ("Could not open display\n");
+                return 77;
+        }
+
+        XA_CLIPBOARD = XInternAtom (display, "CLIPBOARD", False);
+        XA_CLIPBOARD_MANAGER = XInternAtom (display, "CLIPBOARD_MANAGER", False);
+        XA_SAVE_TARGETS = XInternAtom (display, "SAVE_TARGETS", False);
+        XA_TARGETS = XInternAtom (display, "TARGETS", False);
+        XA_MULTIPLE = XInternAtom (display, "MULTIPLE", False);
+        XA_ATOM_PAIR = XInternAtom (display, "ATOM_PAIR", False);
+        XA_INCR = XInternAtom (display, "INCR", False);
+        XA_BENCH_PROPERTY = XInternAtom (display, "GSD_CLIPBOARD_BENCH", False);
+
+        if (XGetSelectionOwner (display, XA_CLIPBOARD_MANAGER) == None) {
+                g_printerr ("No clipboard manager is running\n");
+                return 77;
+        }
+
+        max_request_size = XExtendedMaxRequestSize (display);
+        if (max_request_size == 0)
+                max_request_size = XMaxRequestSize (display);
+        chunk_size = MIN ((gsize) max_request_size - 100, 262144);
+
+        targets = g_new (Atom, n_targets);
+        for (i = 0; i < n_targets; i++) {
+                char *name = g_strdup_printf ("application/x-gsd-clipboard-bench-%" G_GSIZE_FORMAT, i);
+                targets[i] = XInternAtom (display, name, False);
+                g_free (name);
+        }
+
+        contents = g_malloc (n_targets * target_size);
+        for (i = 0; i < n_targets * target_size; i++)
+                contents[i] = (i * 31 + i / target_size) & 0xff;
+
+        transfers = g_ptr_array_new_with_free_func (g_free);
+
+        save_targets ();
+        single = read_targets (1);
+        concurrent = read_targets (n_requestors);
+
+        /* What concurrent requestors gain from not waiting for each
+         * other's round trips */
+        g_print ("Scaling with %2u requestor(s): %8.2fx\n",
+                 n_requestors, concurrent / single);
+
+        g_ptr_array_unref (transfers);
+        g_free (contents);
+        g_free (targets);
+        XDestroyWindow (display, owner);
+        XCloseDisplay (display);
+
+        return 0;
+}
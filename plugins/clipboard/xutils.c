@@ -40,6 +40,7 @@ Atom XA_TARGETS;
 Atom XA_TIMESTAMP;
 
 unsigned long SELECTION_MAX_SIZE = 0;
+unsigned long INCR_CHUNK_SIZE = 0;
 
 
 void
@@ -71,6 +72,13 @@ init_atoms (Display *display)
   SELECTION_MAX_SIZE = max_request_size - 100;
   if (SELECTION_MAX_SIZE > 262144)
     SELECTION_MAX_SIZE =  262144;
+
+  /* The maximum request length is in 4-byte units. Chunks of INCR
+   * transfers use as much of it as they can, within a bound so that
+   * one requestor doesn't hold up the others for long. */
+  INCR_CHUNK_SIZE = max_request_size * 4 - 100;
+  if (INCR_CHUNK_SIZE > INCR_CHUNK_MAX_SIZE)
+    INCR_CHUNK_SIZE = INCR_CHUNK_MAX_SIZE;
 }
 
 typedef struct 
@@ -42,6 +42,9 @@ extern Atom XA_TIMESTAMP;
 
 extern unsigned long SELECTION_MAX_SIZE;
 
+#define INCR_CHUNK_MAX_SIZE (1024 * 1024)
+extern unsigned long INCR_CHUNK_SIZE;
+
 void init_atoms      (Display *display);
 
 Time get_server_time (Display *display,
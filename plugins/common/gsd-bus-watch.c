@@ -0,0 +1,775 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "gsd-bus-watch.h"
+
+/*
+ * All the watchers on a bus are kept in a trie keyed by the elements of
+ * the watched names, so that a NameOwnerChanged signal is dispatched by
+ * walking the elements of its name once, whatever the number of
+ * watchers. The watched names are grouped by their first two elements,
+ * such as org.freedesktop, and each group gets a bus subscription
+ * filtered on the longest namespace common to its names. That makes a
+ * handful of subscriptions at most, and keeps the unique name churn of
+ * clients connecting and disconnecting, as well as the names nobody
+ * watches, out of the daemon.
+ */
+
+typedef struct _BusWatchNode BusWatchNode;
+
+struct _BusWatchNode
+{
+        GHashTable *children;           /* element → BusWatchNode */
+        GSList     *watchers;           /* watching exactly this name */
+        GSList     *namespace_watchers; /* watching this name and below */
+};
+
+typedef struct
+{
+        GBusType         bus_type;
+        GDBusConnection *connection;
+        GCancellable    *cancellable;
+        gboolean         connecting;
+
+        BusWatchNode    *root;
+
+        GHashTable      *subscriptions;  /* namespace → subscription ID */
+
+        gboolean         listing;
+} BusWatchBus;
+
+typedef struct
+{
+        guint                     id;
+        BusWatchBus              *bus;
+        gchar                    *name;
+        gboolean                  is_namespace;
+        GBusNameAppearedCallback  appeared_handler;
+        GBusNameVanishedCallback  vanished_handler;
+        gpointer                  user_data;
+        GDestroyNotify            user_data_destroy;
+
+        /* Whether the initial state has been reported, and whether
+         * the ListNames call in flight will report it */
+        gboolean                  resolved;
+        gboolean                  listing;
+        GHashTable               *names;
+} BusWatcher;
+
+/* Buses are never freed, so that they can be safely used after calling
+ * out to a handler which might have removed the last watcher */
+static BusWatchBus *bus_watch_buses[G_BUS_TYPE_SESSION + 1];
+static GHashTable *bus_watch_watchers;
+static guint bus_watch_next_id = 1;
+
+static BusWatchNode *
+bus_watch_node_new (void)
+{
+        BusWatchNode *node;
+
+        node = g_slice_new0 (BusWatchNode);
+        node->children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        return node;
+}
+
+static void
+bus_watch_node_free (BusWatchNode *node)
+{
+        g_hash_table_destroy (node->children);
+        g_slist_free (node->watchers);
+        g_slist_free (node->namespace_watchers);
+        g_slice_free (BusWatchNode, node);
+}
+
+static void
+bus_watch_node_insert (BusWatchNode *root,
+                       BusWatcher   *watcher)
+{
+        BusWatchNode *node = root;
+        gchar **elements;
+        guint i;
+
+        elements = g_strsplit (watcher->name, ".", -1);
+        for (i = 0; elements[i] != NULL; i++) {
+                BusWatchNode *child;
+
+                child = g_hash_table_lookup (node->children, elements[i]);
+                if (child == NULL) {
+                        child = bus_watch_node_new ();
+                        g_hash_table_insert (node->children, g_strdup (elements[i]), child);
+                }
+                node = child;
+        }
+        g_strfreev (elements);
+
+        if (watcher->is_namespace)
+                node->namespace_watchers = g_slist_prepend (node->namespace_watchers, watcher);
+        else
+                node->watchers = g_slist_prepend (node->watchers, watcher);
+}
+
+/* Returns TRUE if @node became empty and can be pruned */
+static gboolean
+bus_watch_node_remove (BusWatchNode  *node,
+                       gchar        **elements,
+                       BusWatcher    *watcher)
+{
+        if (*elements == NULL) {
+                node->watchers = g_slist_remove (node->watchers, watcher);
+                node->namespace_watchers = g_slist_remove (node->namespace_watchers, watcher);
+        } else {
+                BusWatchNode *child;
+
+                child = g_hash_table_lookup (node->children, *elements);
+                if (child != NULL && bus_watch_node_remove (child, elements + 1, watcher)) {
+                        bus_watch_node_free (child);
+                        g_hash_table_remove (node->children, *elements);
+                }
+        }
+
+        return node->watchers == NULL &&
+               node->namespace_watchers == NULL &&
+               g_hash_table_size (node->children) == 0;
+}
+
+static void
+collect_ids (GSList *watchers,
+             GArray *ids)
+{
+        GSList *l;
+
+        for (l = watchers; l != NULL; l = l->next) {
+                BusWatcher *watcher = l->data;
+                g_array_append_val (ids, watcher->id);
+        }
+}
+
+/* Watchers are returned as IDs, as the handlers called for one of them
+ * might remove the others */
+static GArray *
+bus_watch_node_lookup (BusWatchNode *root,
+                       const gchar  *name)
+{
+        BusWatchNode *node = root;
+        GArray *ids;
+        gchar *copy, *element;
+
+        ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+        copy = g_strdup (name);
+        element = copy;
+        for (;;) {
+                gchar *dot;
+
+                dot = strchr (element, '.');
+                if (dot != NULL)
+                        *dot = '\0';
+
+                node = g_hash_table_lookup (node->children, element);
+                if (node == NULL)
+                        break;
+
+                collect_ids (node->namespace_watchers, ids);
+
+                if (dot == NULL) {
+                        collect_ids (node->watchers, ids);
+                        break;
+                }
+                element = dot + 1;
+        }
+        g_free (copy);
+
+        return ids;
+}
+
+static void
+bus_watcher_name_appeared (BusWatcher  *watcher,
+                           const gchar *name,
+                           const gchar *owner)
+{
+        /* Both the initial ListNames and the NameOwnerChanged signals
+         * may report the same name, only notify the first time */
+        if (g_hash_table_contains (watcher->names, name))
+                return;
+
+        g_hash_table_add (watcher->names, g_strdup (name));
+
+        if (watcher->appeared_handler)
+                watcher->appeared_handler (watcher->bus->connection, name, owner, watcher->user_data);
+}
+
+static void
+bus_watcher_name_vanished (BusWatcher  *watcher,
+                           const gchar *name)
+{
+        if (g_hash_table_remove (watcher->names, name) && watcher->vanished_handler)
+                watcher->vanished_handler (watcher->bus->connection, name, watcher->user_data);
+}
+
+static BusWatcher *
+lookup_watcher (guint id)
+{
+        if (bus_watch_watchers == NULL)
+                return NULL;
+        return g_hash_table_lookup (bus_watch_watchers, GUINT_TO_POINTER (id));
+}
+
+static GList *
+bus_watch_bus_get_watchers (BusWatchBus *bus)
+{
+        GHashTableIter iter;
+        BusWatcher *watcher;
+        GList *list = NULL;
+
+        if (bus_watch_watchers == NULL)
+                return NULL;
+
+        g_hash_table_iter_init (&iter, bus_watch_watchers);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &watcher)) {
+                if (watcher->bus == bus)
+                        list = g_list_prepend (list, watcher);
+        }
+
+        return list;
+}
+
+static void
+name_owner_changed (GDBusConnection *connection,
+                    const gchar     *sender_name,
+                    const gchar     *object_path,
+                    const gchar     *interface_name,
+                    const gchar     *signal_name,
+                    GVariant        *parameters,
+                    gpointer         user_data)
+{
+        BusWatchBus *bus = user_data;
+        const gchar *name;
+        const gchar *old_owner;
+        const gchar *new_owner;
+        GArray *ids;
+        guint i;
+
+        g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+        ids = bus_watch_node_lookup (bus->root, name);
+        for (i = 0; i < ids->len; i++) {
+                BusWatcher *watcher;
+
+                /* Not yet resolved watchers get their state from the
+                 * ListNames reply, which comes after this signal */
+                watcher = lookup_watcher (g_array_index (ids, guint, i));
+                if (watcher == NULL || !watcher->resolved)
+                        continue;
+
+                if (old_owner[0] != '\0')
+                        bus_watcher_name_vanished (watcher, name);
+
+                watcher = lookup_watcher (g_array_index (ids, guint, i));
+                if (watcher != NULL && new_owner[0] != '\0')
+                        bus_watcher_name_appeared (watcher, name, new_owner);
+        }
+        g_array_unref (ids);
+}
+
+/* Shortens @name_space to the longest common prefix of it and @name
+ * which ends on an element boundary in both */
+static void
+shorten_to_common_namespace (gchar       *name_space,
+                             const gchar *name)
+{
+        guint i, len = 0;
+
+        for (i = 0; name_space[i] != '\0' && name_space[i] == name[i]; i++) {
+                gchar a = name_space[i + 1];
+                gchar b = name[i + 1];
+
+                if ((a == '.' || a == '\0') && (b == '.' || b == '\0'))
+                        len = i + 1;
+        }
+        name_space[len] = '\0';
+}
+
+/* Returns the namespaces to subscribe to, one per group of names
+ * sharing their first two elements */
+static GHashTable *
+bus_watch_bus_get_namespaces (BusWatchBus *bus)
+{
+        GHashTable *groups, *namespaces;
+        GHashTableIter iter;
+        GList *watchers, *l;
+        gchar *group, *name_space;
+
+        groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        watchers = bus_watch_bus_get_watchers (bus);
+        for (l = watchers; l != NULL; l = l->next) {
+                BusWatcher *watcher = l->data;
+                const gchar *dot;
+
+                dot = strchr (watcher->name, '.');
+                if (dot != NULL)
+                        dot = strchr (dot + 1, '.');
+                group = dot ? g_strndup (watcher->name, dot - watcher->name) : g_strdup (watcher->name);
+
+                name_space = g_hash_table_lookup (groups, group);
+                if (name_space == NULL) {
+                        g_hash_table_insert (groups, group, g_strdup (watcher->name));
+                } else {
+                        shorten_to_common_namespace (name_space, watcher->name);
+                        g_free (group);
+                }
+        }
+        g_list_free (watchers);
+
+        namespaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        g_hash_table_iter_init (&iter, groups);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &group, (gpointer *) &name_space)) {
+                g_hash_table_iter_steal (&iter);
+                g_hash_table_add (namespaces, name_space);
+                g_free (group);
+        }
+        g_hash_table_destroy (groups);
+
+        return namespaces;
+}
+
+static void
+bus_watch_bus_update_subscription (BusWatchBus *bus)
+{
+        GHashTable *namespaces;
+        GHashTableIter iter;
+        const gchar *name_space;
+        gpointer id;
+
+        if (bus->connection == NULL)
+                return;
+
+        namespaces = bus_watch_bus_get_namespaces (bus);
+
+        /* Subscribe before unsubscribing, so that no signal gets lost
+         * while the match rules change */
+        g_hash_table_iter_init (&iter, namespaces);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &name_space, NULL)) {
+                guint subscription_id;
+
+                if (g_hash_table_contains (bus->subscriptions, name_space))
+                        continue;
+
+                subscription_id =
+                        g_dbus_connection_signal_subscribe (bus->connection,
+                                                            "org.freedesktop.DBus",
+                                                            "org.freedesktop.DBus",
+                                                            "NameOwnerChanged",
+                                                            "/org/freedesktop/DBus",
+                                                            name_space,
+                                                            G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE,
+                                                            name_owner_changed,
+                                                            bus,
+                                                            NULL);
+                g_hash_table_insert (bus->subscriptions, g_strdup (name_space),
+                                     GUINT_TO_POINTER (subscription_id));
+        }
+
+        g_hash_table_iter_init (&iter, bus->subscriptions);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &name_space, &id)) {
+                if (g_hash_table_contains (namespaces, name_space))
+                        continue;
+
+                g_dbus_connection_signal_unsubscribe (bus->connection, GPOINTER_TO_UINT (id));
+                g_hash_table_iter_remove (&iter);
+        }
+
+        g_hash_table_destroy (namespaces);
+}
+
+static void bus_watch_bus_list_names (BusWatchBus *bus);
+
+static void
+names_listed (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+        BusWatchBus *bus = user_data;
+        GError *error = NULL;
+        GVariant *reply;
+        GList *watchers, *l;
+        GArray *resolved;
+        gboolean again = FALSE;
+        guint i;
+
+        reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (object), result, &error);
+
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_error_free (error);
+                return;
+        }
+
+        bus->listing = FALSE;
+
+        if (reply == NULL) {
+                g_warning ("gsd_bus_watch: error calling org.freedesktop.DBus.ListNames: %s", error->message);
+                g_error_free (error);
+        }
+
+        /* Only the watchers that were waiting when the call was made
+         * can be resolved from this reply */
+        resolved = g_array_new (FALSE, FALSE, sizeof (guint));
+        watchers = bus_watch_bus_get_watchers (bus);
+        for (l = watchers; l != NULL; l = l->next) {
+                BusWatcher *watcher = l->data;
+
+                if (watcher->resolved)
+                        continue;
+                if (!watcher->listing) {
+                        again = TRUE;
+                        continue;
+                }
+
+                watcher->listing = FALSE;
+                watcher->resolved = TRUE;
+                g_array_append_val (resolved, watcher->id);
+        }
+        g_list_free (watchers);
+
+        if (reply != NULL) {
+                GVariantIter *iter;
+                const gchar *name;
+
+                g_variant_get (reply, "(as)", &iter);
+                while (g_variant_iter_next (iter, "&s", &name)) {
+                        GArray *ids;
+
+                        if (name[0] == ':')
+                                continue;
+
+                        ids = bus_watch_node_lookup (bus->root, name);
+                        for (i = 0; i < ids->len; i++) {
+                                guint id = g_array_index (ids, guint, i);
+                                BusWatcher *watcher;
+                                guint j;
+
+                                for (j = 0; j < resolved->len; j++) {
+                                        if (g_array_index (resolved, guint, j) == id)
+                                                break;
+                                }
+                                if (j == resolved->len)
+                                        continue;
+
+                                watcher = lookup_watcher (id);
+                                if (watcher != NULL)
+                                        bus_watcher_name_appeared (watcher, name, NULL);
+                        }
+                        g_array_unref (ids);
+                }
+                g_variant_iter_free (iter);
+                g_variant_unref (reply);
+        }
+
+        /* Like g_bus_watch_name(), report absent names as vanished */
+        for (i = 0; i < resolved->len; i++) {
+                BusWatcher *watcher;
+
+                watcher = lookup_watcher (g_array_index (resolved, guint, i));
+                if (watcher != NULL &&
+                    !watcher->is_namespace &&
+                    g_hash_table_size (watcher->names) == 0 &&
+                    watcher->vanished_handler)
+                        watcher->vanished_handler (bus->connection, watcher->name, watcher->user_data);
+        }
+        g_array_unref (resolved);
+
+        if (again)
+                bus_watch_bus_list_names (bus);
+}
+
+static void
+bus_watch_bus_list_names (BusWatchBus *bus)
+{
+        GList *watchers, *l;
+
+        if (bus->connection == NULL || bus->listing)
+                return;
+
+        watchers = bus_watch_bus_get_watchers (bus);
+        for (l = watchers; l != NULL; l = l->next) {
+                BusWatcher *watcher = l->data;
+
+                if (!watcher->resolved)
+                        watcher->listing = TRUE;
+        }
+        g_list_free (watchers);
+
+        /* One call covers all the watchers added in the meantime */
+        bus->listing = TRUE;
+        g_dbus_connection_call (bus->connection, "org.freedesktop.DBus", "/",
+                                "org.freedesktop.DBus", "ListNames", NULL, G_VARIANT_TYPE ("(as)"),
+                                G_DBUS_CALL_FLAGS_NONE, -1, bus->cancellable,
+                                names_listed, bus);
+}
+
+static void
+bus_watch_bus_lost (BusWatchBus *bus)
+{
+        GList *watchers, *l;
+        GArray *ids;
+        guint i;
+
+        ids = g_array_new (FALSE, FALSE, sizeof (guint));
+        watchers = bus_watch_bus_get_watchers (bus);
+        for (l = watchers; l != NULL; l = l->next) {
+                BusWatcher *watcher = l->data;
+
+                watcher->resolved = FALSE;
+                watcher->listing = FALSE;
+                g_array_append_val (ids, watcher->id);
+        }
+        g_list_free (watchers);
+
+        if (bus->connection != NULL) {
+                g_signal_handlers_disconnect_by_data (bus->connection, bus);
+                g_clear_object (&bus->connection);
+        }
+        g_hash_table_remove_all (bus->subscriptions);
+
+        g_cancellable_cancel (bus->cancellable);
+        g_clear_object (&bus->cancellable);
+        bus->listing = FALSE;
+
+        /* Like g_bus_watch_name(), the handlers get a NULL connection */
+        for (i = 0; i < ids->len; i++) {
+                BusWatcher *watcher;
+                GHashTableIter iter;
+                const gchar *name;
+                GList *names;
+
+                watcher = lookup_watcher (g_array_index (ids, guint, i));
+                if (watcher == NULL)
+                        continue;
+
+                names = NULL;
+                g_hash_table_iter_init (&iter, watcher->names);
+                while (g_hash_table_iter_next (&iter, (gpointer *) &name, NULL))
+                        names = g_list_prepend (names, g_strdup (name));
+
+                if (names == NULL && !watcher->is_namespace)
+                        names = g_list_prepend (names, g_strdup (watcher->name));
+                g_hash_table_remove_all (watcher->names);
+
+                for (l = names; l != NULL; l = l->next) {
+                        watcher = lookup_watcher (g_array_index (ids, guint, i));
+                        if (watcher != NULL && watcher->vanished_handler)
+                                watcher->vanished_handler (NULL, l->data, watcher->user_data);
+                }
+                g_list_free_full (names, g_free);
+        }
+        g_array_unref (ids);
+}
+
+static void
+connection_closed (GDBusConnection *connection,
+                   gboolean         remote_peer_vanished,
+                   GError          *error,
+                   gpointer         user_data)
+{
+        bus_watch_bus_lost (user_data);
+}
+
+static void
+got_bus (GObject      *object,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+        BusWatchBus *bus = user_data;
+        GDBusConnection *connection;
+        GError *error = NULL;
+
+        connection = g_bus_get_finish (result, &error);
+
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_error_free (error);
+                return;
+        }
+
+        bus->connecting = FALSE;
+
+        if (connection == NULL) {
+                g_warning ("gsd_bus_watch: could not connect to the bus: %s", error->message);
+                g_error_free (error);
+                bus_watch_bus_lost (bus);
+                return;
+        }
+
+        bus->connection = connection;
+        g_signal_connect (bus->connection, "closed", G_CALLBACK (connection_closed), bus);
+
+        bus_watch_bus_update_subscription (bus);
+        bus_watch_bus_list_names (bus);
+}
+
+static void
+bus_watch_bus_connect (BusWatchBus *bus)
+{
+        if (bus->connection != NULL || bus->connecting)
+                return;
+
+        if (bus->cancellable == NULL)
+                bus->cancellable = g_cancellable_new ();
+
+        bus->connecting = TRUE;
+        g_bus_get (bus->bus_type, bus->cancellable, got_bus, bus);
+}
+
+static BusWatchBus *
+bus_watch_bus_get (GBusType bus_type)
+{
+        BusWatchBus *bus;
+
+        bus = bus_watch_buses[bus_type];
+        if (bus == NULL) {
+                bus = g_new0 (BusWatchBus, 1);
+                bus->bus_type = bus_type;
+                bus->root = bus_watch_node_new ();
+                bus->subscriptions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+                bus_watch_buses[bus_type] = bus;
+        }
+
+        return bus;
+}
+
+static guint
+bus_watch_add (GBusType                  bus_type,
+               const gchar              *name,
+               gboolean                  is_namespace,
+               GBusNameAppearedCallback  appeared_handler,
+               GBusNameVanishedCallback  vanished_handler,
+               gpointer                  user_data,
+               GDestroyNotify            user_data_destroy)
+{
+        BusWatcher *watcher;
+        BusWatchBus *bus;
+
+        /* Resolve the well-known bus types to the actual bus */
+        if (bus_type == G_BUS_TYPE_STARTER) {
+                const gchar *starter = g_getenv ("DBUS_STARTER_BUS_TYPE");
+
+                if (g_strcmp0 (starter, "system") == 0)
+                        bus_type = G_BUS_TYPE_SYSTEM;
+                else
+                        bus_type = G_BUS_TYPE_SESSION;
+        }
+        g_return_val_if_fail (bus_type == G_BUS_TYPE_SYSTEM || bus_type == G_BUS_TYPE_SESSION, 0);
+
+        bus = bus_watch_bus_get (bus_type);
+
+        watcher = g_new0 (BusWatcher, 1);
+        watcher->id = bus_watch_next_id++;
+        watcher->bus = bus;
+        watcher->name = g_strdup (name);
+        watcher->is_namespace = is_namespace;
+        watcher->appeared_handler = appeared_handler;
+        watcher->vanished_handler = vanished_handler;
+        watcher->user_data = user_data;
+        watcher->user_data_destroy = user_data_destroy;
+        watcher->names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        if (bus_watch_watchers == NULL)
+                bus_watch_watchers = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_hash_table_insert (bus_watch_watchers, GUINT_TO_POINTER (watcher->id), watcher);
+
+        bus_watch_node_insert (bus->root, watcher);
+
+        if (bus->connection != NULL) {
+                bus_watch_bus_update_subscription (bus);
+                bus_watch_bus_list_names (bus);
+        } else {
+                bus_watch_bus_connect (bus);
+        }
+
+        return watcher->id;
+}
+
+guint
+gsd_bus_watch_name (GBusType                  bus_type,
+                    const gchar              *name,
+                    GBusNameAppearedCallback  appeared_handler,
+                    GBusNameVanishedCallback  vanished_handler,
+                    gpointer                  user_data,
+                    GDestroyNotify            user_data_destroy)
+{
+        g_return_val_if_fail (name != NULL && g_dbus_is_name (name) && !g_dbus_is_unique_name (name), 0);
+
+        return bus_watch_add (bus_type, name, FALSE,
+                              appeared_handler, vanished_handler,
+                              user_data, user_data_destroy);
+}
+
+guint
+gsd_bus_watch_namespace (GBusType                  bus_type,
+                         const gchar              *name_space,
+                         GBusNameAppearedCallback  appeared_handler,
+                         GBusNameVanishedCallback  vanished_handler,
+                         gpointer                  user_data,
+                         GDestroyNotify            user_data_destroy)
+{
+        /* same rules for interfaces and well-known names */
+        g_return_val_if_fail (name_space != NULL && g_dbus_is_interface_name (name_space), 0);
+        g_return_val_if_fail (appeared_handler || vanished_handler, 0);
+
+        return bus_watch_add (bus_type, name_space, TRUE,
+                              appeared_handler, vanished_handler,
+                              user_data, user_data_destroy);
+}
+
+void
+gsd_bus_unwatch (guint id)
+{
+        BusWatcher *watcher;
+        BusWatchBus *bus;
+        gchar **elements;
+
+        watcher = lookup_watcher (id);
+        if (watcher == NULL) {
+                g_warning ("Invalid id %u passed to gsd_bus_unwatch()", id);
+                return;
+        }
+
+        bus = watcher->bus;
+
+        g_hash_table_remove (bus_watch_watchers, GUINT_TO_POINTER (id));
+        if (g_hash_table_size (bus_watch_watchers) == 0)
+                g_clear_pointer (&bus_watch_watchers, g_hash_table_destroy);
+
+        elements = g_strsplit (watcher->name, ".", -1);
+        bus_watch_node_remove (bus->root, elements, watcher);
+        g_strfreev (elements);
+
+        /* Narrow the subscriptions, or drop them with the last watchers */
+        bus_watch_bus_update_subscription (bus);
+
+        if (watcher->user_data_destroy)
+                watcher->user_data_destroy (watcher->user_data);
+
+        g_hash_table_unref (watcher->names);
+        g_free (watcher->name);
+        g_free (watcher);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GSD_BUS_WATCH_H__
+#define __GSD_BUS_WATCH_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Drop-in replacements for g_bus_watch_name() and bus_watch_namespace()
+ * which share a single NameOwnerChanged subscription and a single
+ * ListNames call per bus between all the watchers of the process.
+ *
+ * Unlike with g_bus_watch_name(), @name_owner is NULL when the appeared
+ * handler is called for a name that was already owned when the watch
+ * started.
+ */
+guint gsd_bus_watch_name      (GBusType                  bus_type,
+                               const gchar              *name,
+                               GBusNameAppearedCallback  appeared_handler,
+                               GBusNameVanishedCallback  vanished_handler,
+                               gpointer                  user_data,
+                               GDestroyNotify            user_data_destroy);
+
+guint gsd_bus_watch_namespace (GBusType                  bus_type,
+                               const gchar              *name_space,
+                               GBusNameAppearedCallback  appeared_handler,
+                               GBusNameVanishedCallback  vanished_handler,
+                               gpointer                  user_data,
+                               GDestroyNotify            user_data_destroy);
+
+void  gsd_bus_unwatch         (guint                     id);
+
+G_END_DECLS
+
+#endif /* __GSD_BUS_WATCH_H__ */
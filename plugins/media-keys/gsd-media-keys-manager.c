@@ -56,6 +56,7 @@
 #include "shell-key-grabber.h"
 #include "gsd-screenshot-utils.h"
 #include "gsd-input-helper.h"
+#include "gsd-bus-watch.h"
 #include "gsd-enums.h"
 #include "gsd-shell-helper.h"
 
@@ -87,6 +88,10 @@
 #define SHELL_GRABBER_RETRY_INTERVAL 1
 #define OSD_ALL_OUTPUTS -1
 
+/* Custom keybinding latency histogram buckets, from the key press to
+ * the launch, in powers of two of milliseconds */
+#define LAUNCH_HISTOGRAM_BUCKETS 12
+
 /* How long to suppress power-button presses after resume,
  * 3 seconds is the minimum necessary to make resume reliable */
 #define GSD_REENABLE_POWER_BUTTON_DELAY                 3000 /* ms */
@@ -106,6 +111,9 @@ static const gchar introspection_xml[] =
 "      <arg name='application' type='s'/>"
 "      <arg name='key' type='s'/>"
 "    </signal>"
+"    <property name='CustomKeybindingLatencies' type='a{sau}' access='read'>"
+"      <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+"    </property>"
 "  </interface>"
 "</node>";
 
@@ -134,9 +142,19 @@ typedef struct {
         char   *application;
         char   *dbus_name;
         guint32 time;
-        guint   watch_id;
+        guint64 serial;
+        guint   heap_index;
+        GList   name_link;
 } MediaPlayer;
 
+/* The players registered from one bus name */
+typedef struct {
+        GsdMediaKeysManager *manager;
+        char                *name;
+        GQueue               players;
+        GCancellable        *cancellable;
+} MediaPlayerName;
+
 typedef struct {
         gint ref_count;
 
@@ -146,6 +164,8 @@ typedef struct {
         const char *hard_coded;
         char *custom_path;
         char *custom_command;
+        GAppInfo *custom_app_info;
+        guint launch_histogram[LAUNCH_HISTOGRAM_BUCKETS];
         guint accel_id;
         gboolean ungrab_requested;
 } MediaKey;
@@ -178,6 +198,11 @@ struct GsdMediaKeysManagerPrivate
         GSettings       *settings;
         GHashTable      *custom_settings;
 
+        /* Launching */
+        GVariant        *keyring_environment;
+        GHashTable      *desktop_app_infos;
+        GAppInfoMonitor *app_info_monitor;
+
         GPtrArray       *keys;
 
         /* HighContrast theme settings */
@@ -193,6 +218,7 @@ struct GsdMediaKeysManagerPrivate
         UpDevice        *composite_device;
         char            *chassis_type;
         gboolean         power_button_disabled;
+        guint            power_capabilities; /* mask of supported GsdPowerActionType */
         guint            reenable_power_button_timer_id;
 
         /* Shell stuff */
@@ -227,7 +253,12 @@ struct GsdMediaKeysManagerPrivate
         gint             inhibit_suspend_fd;
         gboolean         inhibit_suspend_taken;
 
-        GList           *media_players;
+        /* Legacy media player registrations */
+        GHashTable      *media_players_by_app;  /* application → MediaPlayer */
+        GHashTable      *media_players_by_name; /* dbus_name → MediaPlayerName */
+        guint            media_players_owner_id;
+        GPtrArray       *media_players_heap;    /* newest registration first */
+        guint64          media_players_serial;
 
         GDBusNodeInfo   *introspection_data;
         GDBusConnection *connection;
@@ -266,6 +297,7 @@ media_key_unref (MediaKey *key)
                 return;
         g_free (key->custom_path);
         g_free (key->custom_command);
+        g_clear_object (&key->custom_app_info);
         g_free (key);
 }
 
@@ -283,21 +315,79 @@ media_key_new (void)
         return media_key_ref (key);
 }
 
+static void
+apply_launch_context_env (GAppLaunchContext *launch_context,
+                          GVariant          *environment)
+{
+	GVariantIter iter;
+	const char *key;
+	const char *value;
+
+	g_variant_iter_init (&iter, environment);
+	while (g_variant_iter_next (&iter, "{&s&s}", &key, &value))
+		g_app_launch_context_setenv (launch_context, key, value);
+}
+
+static void
+keyring_environment_ready_cb (GObject             *source_object,
+                              GAsyncResult        *res,
+                              GsdMediaKeysManager *manager)
+{
+	GError *error = NULL;
+	GVariant *variant;
+
+	variant = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+	if (variant == NULL) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug ("Failed to call GetEnvironment on keyring daemon: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	g_clear_pointer (&manager->priv->keyring_environment, g_variant_unref);
+	manager->priv->keyring_environment = g_variant_get_child_value (variant, 0);
+	g_variant_unref (variant);
+}
+
+/* The keyring environment doesn't change during the session, so it is
+ * fetched once when the bus is available rather than on every launch */
+static void
+fetch_keyring_environment (GsdMediaKeysManager *manager)
+{
+	g_dbus_connection_call (manager->priv->connection,
+				GNOME_KEYRING_DBUS_NAME,
+				GNOME_KEYRING_DBUS_PATH,
+				GNOME_KEYRING_DBUS_INTERFACE,
+				"GetEnvironment",
+				NULL,
+				G_VARIANT_TYPE ("(a{ss})"),
+				G_DBUS_CALL_FLAGS_NONE,
+				-1,
+				manager->priv->bus_cancellable,
+				(GAsyncReadyCallback) keyring_environment_ready_cb,
+				manager);
+}
+
 static void
 set_launch_context_env (GsdMediaKeysManager *manager,
 			GAppLaunchContext   *launch_context)
 {
 	GError *error = NULL;
-	GVariant *variant, *item;
-	GVariantIter *iter;
+	GVariant *variant;
+
+	if (manager->priv->keyring_environment != NULL) {
+		apply_launch_context_env (launch_context, manager->priv->keyring_environment);
+		return;
+	}
 
+	/* The keyring wasn't available yet when we started */
 	variant = g_dbus_connection_call_sync (manager->priv->connection,
 					       GNOME_KEYRING_DBUS_NAME,
 					       GNOME_KEYRING_DBUS_PATH,
 					       GNOME_KEYRING_DBUS_INTERFACE,
 					       "GetEnvironment",
 					       NULL,
-					       NULL,
+					       G_VARIANT_TYPE ("(a{ss})"),
 					       G_DBUS_CALL_FLAGS_NONE,
 					       -1,
 					       NULL,
@@ -308,26 +398,10 @@ set_launch_context_env (GsdMediaKeysManager *manager,
 		return;
 	}
 
-	g_variant_get (variant, "(a{ss})", &iter);
-
-	while ((item = g_variant_iter_next_value (iter))) {
-		char *key;
-		char *value;
-
-		g_variant_get (item,
-			       "{ss}",
-			       &key,
-			       &value);
-
-		g_app_launch_context_setenv (launch_context, key, value);
-
-		g_variant_unref (item);
-		g_free (key);
-		g_free (value);
-	}
-
-	g_variant_iter_free (iter);
+	manager->priv->keyring_environment = g_variant_get_child_value (variant, 0);
 	g_variant_unref (variant);
+
+	apply_launch_context_env (launch_context, manager->priv->keyring_environment);
 }
 
 static char *
@@ -670,6 +744,45 @@ gsettings_changed_cb (GSettings           *settings,
         }
 }
 
+static GAppInfo *
+app_info_for_command (const char *cmd)
+{
+	g_autofree gchar *escaped = NULL;
+	gchar *p;
+
+	if (*cmd == '\0')
+		return NULL;
+
+	/* Escape all % characters as g_app_info_create_from_commandline will
+	 * try to interpret them otherwise. */
+	escaped = g_malloc (strlen (cmd) * 2 + 1);
+	p = escaped;
+	while (*cmd) {
+		*p = *cmd;
+		p++;
+		if (*cmd == '%') {
+			*p = '%';
+			p++;
+		}
+		cmd++;
+	}
+	*p = '\0';
+
+	return g_app_info_create_from_commandline (escaped, NULL, G_APP_INFO_CREATE_NONE, NULL);
+}
+
+static void
+media_key_set_custom_command (MediaKey *key,
+                              char     *command)
+{
+        g_free (key->custom_command);
+        key->custom_command = command;
+
+        /* Parse the command once, rather than on every key press */
+        g_clear_object (&key->custom_app_info);
+        key->custom_app_info = app_info_for_command (command);
+}
+
 static MediaKey *
 media_key_new_for_path (GsdMediaKeysManager *manager,
 			char                *path)
@@ -705,7 +818,7 @@ media_key_new_for_path (GsdMediaKeysManager *manager,
         key->key_type = CUSTOM_KEY;
         key->modes = GSD_ACTION_MODE_LAUNCHER;
         key->custom_path = g_strdup (path);
-        key->custom_command = command;
+        media_key_set_custom_command (key, command);
 
         return key;
 }
@@ -755,8 +868,7 @@ update_custom_binding_command (GsdMediaKeysManager *manager,
                 if (key->custom_path == NULL)
                         continue;
                 if (strcmp (key->custom_path, path) == 0) {
-                        g_free (key->custom_command);
-                        key->custom_command = g_settings_get_string (settings, "command");
+                        media_key_set_custom_command (key, g_settings_get_string (settings, "command"));
                         break;
                 }
         }
@@ -875,55 +987,30 @@ init_kbd (GsdMediaKeysManager *manager)
         gnome_settings_profile_end (NULL);
 }
 
-static void
+static gboolean
 launch_app (GsdMediaKeysManager *manager,
 	    GAppInfo            *app_info,
 	    gint64               timestamp)
 {
 	GError *error = NULL;
         GdkAppLaunchContext *launch_context;
+        gboolean ret;
 
         /* setup the launch context so the startup notification is correct */
         launch_context = gdk_display_get_app_launch_context (gdk_display_get_default ());
         gdk_app_launch_context_set_timestamp (launch_context, timestamp);
         set_launch_context_env (manager, G_APP_LAUNCH_CONTEXT (launch_context));
 
-	if (!g_app_info_launch (app_info, NULL, G_APP_LAUNCH_CONTEXT (launch_context), &error)) {
+	ret = g_app_info_launch (app_info, NULL, G_APP_LAUNCH_CONTEXT (launch_context), &error);
+	if (!ret) {
 		g_warning ("Could not launch '%s': %s",
 			   g_app_info_get_commandline (app_info),
 			   error->message);
 		g_error_free (error);
 	}
         g_object_unref (launch_context);
-}
-
-static void
-execute (GsdMediaKeysManager *manager,
-         char                *cmd,
-         gint64               timestamp)
-{
-	GAppInfo *app_info;
-	g_autofree gchar *escaped = NULL;
-	gchar *p;
 
-	/* Escape all % characters as g_app_info_create_from_commandline will
-	 * try to interpret them otherwise. */
-	escaped = g_malloc (strlen (cmd) * 2 + 1);
-	p = escaped;
-	while (*cmd) {
-		*p = *cmd;
-		p++;
-		if (*cmd == '%') {
-			*p = '%';
-			p++;
-		}
-		cmd++;
-	}
-	*p = '\0';
-
-	app_info = g_app_info_create_from_commandline (escaped, NULL, G_APP_INFO_CREATE_NONE, NULL);
-	launch_app (manager, app_info, timestamp);
-	g_object_unref (app_info);
+        return ret;
 }
 
 static void
@@ -1094,6 +1181,40 @@ do_search_action (GsdMediaKeysManager *manager,
                                      NULL, NULL, NULL);
 }
 
+static void
+app_info_changed (GAppInfoMonitor     *monitor,
+                  GsdMediaKeysManager *manager)
+{
+        g_hash_table_remove_all (manager->priv->desktop_app_infos);
+}
+
+/* Desktop files are looked up once, and cached until the installed
+ * applications change */
+static GDesktopAppInfo *
+lookup_desktop_app_info (GsdMediaKeysManager *manager,
+                         const char          *desktop)
+{
+        GDesktopAppInfo *app_info;
+
+        if (manager->priv->desktop_app_infos == NULL) {
+                manager->priv->desktop_app_infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                          g_free, (GDestroyNotify) g_object_unref);
+                manager->priv->app_info_monitor = g_app_info_monitor_get ();
+                g_signal_connect (manager->priv->app_info_monitor, "changed",
+                                  G_CALLBACK (app_info_changed), manager);
+        }
+
+        app_info = g_hash_table_lookup (manager->priv->desktop_app_infos, desktop);
+        if (app_info != NULL)
+                return app_info;
+
+        app_info = g_desktop_app_info_new (desktop);
+        if (app_info != NULL)
+                g_hash_table_insert (manager->priv->desktop_app_infos, g_strdup (desktop), app_info);
+
+        return app_info;
+}
+
 static void
 do_execute_desktop_or_desktop (GsdMediaKeysManager *manager,
 			       const char          *desktop,
@@ -1102,13 +1223,12 @@ do_execute_desktop_or_desktop (GsdMediaKeysManager *manager,
 {
         GDesktopAppInfo *app_info;
 
-        app_info = g_desktop_app_info_new (desktop);
+        app_info = lookup_desktop_app_info (manager, desktop);
         if (app_info == NULL && alt_desktop != NULL)
-                app_info = g_desktop_app_info_new (alt_desktop);
+                app_info = lookup_desktop_app_info (manager, alt_desktop);
 
         if (app_info != NULL) {
                 launch_app (manager, G_APP_INFO (app_info), timestamp);
-                g_object_unref (app_info);
                 return;
         }
 
@@ -1553,55 +1673,293 @@ on_control_stream_removed (GvcMixerControl     *control,
 static void
 free_media_player (MediaPlayer *player)
 {
-        if (player->watch_id > 0) {
-                g_bus_unwatch_name (player->watch_id);
-                player->watch_id = 0;
-        }
         g_free (player->application);
         g_free (player->dbus_name);
         g_free (player);
 }
 
-static gint
-find_by_application (gconstpointer a,
-                     gconstpointer b)
+/* The players are kept in a binary heap so that the one receiving the
+ * key presses is always at index 0. Registrations with the same time
+ * are ordered by serial, so the latest registration wins, like it did
+ * when the players were kept in a sorted list. */
+static gboolean
+media_player_is_newer (MediaPlayer *a,
+                       MediaPlayer *b)
 {
-        return strcmp (((MediaPlayer *)a)->application, b);
+        if (a->time != b->time)
+                return a->time > b->time;
+        return a->serial > b->serial;
 }
 
-static gint
-find_by_name (gconstpointer a,
-              gconstpointer b)
+static void
+media_players_heap_set (GPtrArray   *heap,
+                        guint        index,
+                        MediaPlayer *player)
 {
-        return strcmp (((MediaPlayer *)a)->dbus_name, b);
+        heap->pdata[index] = player;
+        player->heap_index = index;
 }
 
-static gint
-find_by_time (gconstpointer a,
-              gconstpointer b)
+static void
+media_players_heap_sift_up (GPtrArray *heap,
+                            guint      index)
 {
-        return ((MediaPlayer *)a)->time < ((MediaPlayer *)b)->time;
+        MediaPlayer *player = heap->pdata[index];
+
+        while (index > 0) {
+                guint parent = (index - 1) / 2;
+
+                if (!media_player_is_newer (player, heap->pdata[parent]))
+                        break;
+                media_players_heap_set (heap, index, heap->pdata[parent]);
+                index = parent;
+        }
+        media_players_heap_set (heap, index, player);
 }
 
 static void
-name_vanished_handler (GDBusConnection     *connection,
-                       const gchar         *name,
-                       GsdMediaKeysManager *manager)
+media_players_heap_sift_down (GPtrArray *heap,
+                              guint      index)
+{
+        MediaPlayer *player = heap->pdata[index];
+
+        for (;;) {
+                guint child = 2 * index + 1;
+
+                if (child >= heap->len)
+                        break;
+                if (child + 1 < heap->len &&
+                    media_player_is_newer (heap->pdata[child + 1], heap->pdata[child]))
+                        child++;
+                if (!media_player_is_newer (heap->pdata[child], player))
+                        break;
+                media_players_heap_set (heap, index, heap->pdata[child]);
+                index = child;
+        }
+        media_players_heap_set (heap, index, player);
+}
+
+static void
+media_players_heap_remove (GPtrArray   *heap,
+                           MediaPlayer *player)
 {
-        GList *iter;
+        guint index = player->heap_index;
+        MediaPlayer *last;
+
+        last = g_ptr_array_remove_index_fast (heap, heap->len - 1);
+        if (last == player)
+                return;
+
+        media_players_heap_set (heap, index, last);
+        if (index > 0 && media_player_is_newer (last, heap->pdata[(index - 1) / 2]))
+                media_players_heap_sift_up (heap, index);
+        else
+                media_players_heap_sift_down (heap, index);
+}
 
-        iter = g_list_find_custom (manager->priv->media_players,
-                                   name,
-                                   find_by_name);
+static void
+media_player_name_owner_changed (GDBusConnection *connection,
+                    const gchar     *sender_name,
+                    const gchar     *object_path,
+                    const gchar     *interface_name,
+                    const gchar     *signal_name,
+                    GVariant        *parameters,
+                    gpointer         user_data);
 
-        if (iter != NULL) {
+/* The links of the queue are embedded in the players, so it is not
+ * freed here */
+static void
+free_media_player_name (MediaPlayerName *player_name)
+{
+        g_cancellable_cancel (player_name->cancellable);
+        g_object_unref (player_name->cancellable);
+        g_free (player_name->name);
+        g_free (player_name);
+}
+
+static void
+unwatch_media_player_names (GsdMediaKeysManager *manager)
+{
+        GsdMediaKeysManagerPrivate *priv = manager->priv;
+
+        if (priv->media_players_owner_id == 0)
+                return;
+
+        g_dbus_connection_signal_unsubscribe (priv->connection, priv->media_players_owner_id);
+        priv->media_players_owner_id = 0;
+}
+
+static void
+remove_media_player (GsdMediaKeysManager *manager,
+                     MediaPlayer         *player)
+{
+        GsdMediaKeysManagerPrivate *priv = manager->priv;
+        MediaPlayerName *player_name;
+
+        media_players_heap_remove (priv->media_players_heap, player);
+
+        /* Stop watching the name once nobody is registered from it,
+         * and the bus once no name is left */
+        player_name = g_hash_table_lookup (priv->media_players_by_name, player->dbus_name);
+        g_queue_unlink (&player_name->players, &player->name_link);
+        if (g_queue_is_empty (&player_name->players))
+                g_hash_table_remove (priv->media_players_by_name, player->dbus_name);
+        if (g_hash_table_size (priv->media_players_by_name) == 0)
+                unwatch_media_player_names (manager);
+
+        g_hash_table_remove (priv->media_players_by_app, player->application);
+}
+
+static void
+remove_vanished_media_players (GsdMediaKeysManager *manager,
+                               const char          *name)
+{
+        MediaPlayerName *player_name;
+
+        /* Removing the last player for a name drops it */
+        while ((player_name = g_hash_table_lookup (manager->priv->media_players_by_name, name)) != NULL) {
                 MediaPlayer *player;
 
-                player = iter->data;
+                player = g_queue_peek_head (&player_name->players);
                 g_debug ("Deregistering vanished %s (dbus_name: %s)", player->application, player->dbus_name);
-                free_media_player (player);
-                manager->priv->media_players = g_list_delete_link (manager->priv->media_players, iter);
+                remove_media_player (manager, player);
+        }
+}
+
+static void
+media_player_name_owner_cb (GObject      *source_object,
+                            GAsyncResult *res,
+                            gpointer      user_data)
+{
+        MediaPlayerName *player_name = user_data;
+        GVariant *variant;
+        GError *error = NULL;
+        char *name;
+
+        variant = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+        if (variant != NULL) {
+                g_variant_unref (variant);
+                return;
+        }
+
+        /* Cancelled when the name was dropped */
+        if (!g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER)) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Failed to get the owner of %s: %s", player_name->name, error->message);
+                g_error_free (error);
+                return;
         }
+        g_error_free (error);
+
+        /* Gone before the subscription was in place */
+        name = g_strdup (player_name->name);
+        remove_vanished_media_players (player_name->manager, name);
+        g_free (name);
+}
+
+static MediaPlayerName *
+watch_media_player_name (GsdMediaKeysManager *manager,
+                         const char          *name)
+{
+        GsdMediaKeysManagerPrivate *priv = manager->priv;
+        MediaPlayerName *player_name;
+
+        player_name = g_new0 (MediaPlayerName, 1);
+        player_name->manager = manager;
+        player_name->name = g_strdup (name);
+        player_name->cancellable = g_cancellable_new ();
+
+        /* One subscription for all the names, dispatched on the name
+         * in the handler, and only while there are any */
+        if (priv->media_players_owner_id == 0)
+                priv->media_players_owner_id =
+                        g_dbus_connection_signal_subscribe (priv->connection,
+                                                            "org.freedesktop.DBus",
+                                                            "org.freedesktop.DBus",
+                                                            "NameOwnerChanged",
+                                                            "/org/freedesktop/DBus",
+                                                            NULL,
+                                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                                            media_player_name_owner_changed,
+                                                            manager,
+                                                            NULL);
+
+        /* The name could have gone away before we subscribed */
+        g_dbus_connection_call (priv->connection,
+                                "org.freedesktop.DBus",
+                                "/org/freedesktop/DBus",
+                                "org.freedesktop.DBus",
+                                "GetNameOwner",
+                                g_variant_new ("(s)", name),
+                                G_VARIANT_TYPE ("(s)"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                player_name->cancellable,
+                                media_player_name_owner_cb,
+                                player_name);
+
+        g_hash_table_insert (priv->media_players_by_name, player_name->name, player_name);
+
+        return player_name;
+}
+
+static void
+add_media_player (GsdMediaKeysManager *manager,
+                  MediaPlayer         *player)
+{
+        GsdMediaKeysManagerPrivate *priv = manager->priv;
+        MediaPlayerName *player_name;
+
+        player->serial = priv->media_players_serial++;
+        player->name_link.data = player;
+
+        g_hash_table_insert (priv->media_players_by_app, player->application, player);
+
+        player_name = g_hash_table_lookup (priv->media_players_by_name, player->dbus_name);
+        if (player_name == NULL)
+                player_name = watch_media_player_name (manager, player->dbus_name);
+        g_queue_push_tail_link (&player_name->players, &player->name_link);
+
+        g_ptr_array_add (priv->media_players_heap, player);
+        media_players_heap_sift_up (priv->media_players_heap,
+                                    priv->media_players_heap->len - 1);
+}
+
+static void
+clear_media_players (GsdMediaKeysManager *manager)
+{
+        GsdMediaKeysManagerPrivate *priv = manager->priv;
+
+        if (priv->media_players_heap != NULL)
+                g_ptr_array_set_size (priv->media_players_heap, 0);
+        if (priv->media_players_by_name != NULL)
+                g_hash_table_remove_all (priv->media_players_by_name);
+        unwatch_media_player_names (manager);
+        if (priv->media_players_by_app != NULL)
+                g_hash_table_remove_all (priv->media_players_by_app);
+}
+
+static void
+media_player_name_owner_changed (GDBusConnection *connection,
+                    const gchar     *sender_name,
+                    const gchar     *object_path,
+                    const gchar     *interface_name,
+                    const gchar     *signal_name,
+                    GVariant        *parameters,
+                    gpointer         user_data)
+{
+        GsdMediaKeysManager *manager = user_data;
+        const gchar *name;
+        const gchar *old_owner;
+        const gchar *new_owner;
+
+        g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+        if (new_owner[0] != '\0' ||
+            !g_hash_table_contains (manager->priv->media_players_by_name, name))
+                return;
+
+        remove_vanished_media_players (manager, name);
 }
 
 /*
@@ -1617,9 +1975,7 @@ gsd_media_keys_manager_grab_media_player_keys (GsdMediaKeysManager *manager,
                                                const char          *dbus_name,
                                                guint32              time)
 {
-        GList       *iter;
         MediaPlayer *media_player;
-        guint        watch_id;
 
         if (time == GDK_CURRENT_TIME) {
                 GTimeVal tv;
@@ -1628,38 +1984,23 @@ gsd_media_keys_manager_grab_media_player_keys (GsdMediaKeysManager *manager,
                 time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
         }
 
-        iter = g_list_find_custom (manager->priv->media_players,
-                                   application,
-                                   find_by_application);
+        media_player = g_hash_table_lookup (manager->priv->media_players_by_app,
+                                            application);
 
-        if (iter != NULL) {
-                if (((MediaPlayer *)iter->data)->time < time) {
-                        MediaPlayer *player = iter->data;
-                        free_media_player (player);
-                        manager->priv->media_players = g_list_delete_link (manager->priv->media_players, iter);
-                } else {
+        if (media_player != NULL) {
+                if (media_player->time < time)
+                        remove_media_player (manager, media_player);
+                else
                         return;
-                }
         }
 
-        watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION,
-                                     dbus_name,
-                                     G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                     NULL,
-                                     (GBusNameVanishedCallback) name_vanished_handler,
-                                     manager,
-                                     NULL);
-
         g_debug ("Registering %s at %u", application, time);
         media_player = g_new0 (MediaPlayer, 1);
         media_player->application = g_strdup (application);
         media_player->dbus_name = g_strdup (dbus_name);
         media_player->time = time;
-        media_player->watch_id = watch_id;
 
-        manager->priv->media_players = g_list_insert_sorted (manager->priv->media_players,
-                                                             media_player,
-                                                             find_by_time);
+        add_media_player (manager, media_player);
 }
 
 static void
@@ -1667,29 +2008,26 @@ gsd_media_keys_manager_release_media_player_keys (GsdMediaKeysManager *manager,
                                                   const char          *application,
                                                   const char          *name)
 {
-        GList *iter = NULL;
+        MediaPlayer *player = NULL;
 
         g_return_if_fail (application != NULL || name != NULL);
 
         if (application != NULL) {
-                iter = g_list_find_custom (manager->priv->media_players,
-                                           application,
-                                           find_by_application);
+                player = g_hash_table_lookup (manager->priv->media_players_by_app,
+                                              application);
         }
 
-        if (iter == NULL && name != NULL) {
-                iter = g_list_find_custom (manager->priv->media_players,
-                                           name,
-                                           find_by_name);
-        }
+        if (player == NULL && name != NULL) {
+                MediaPlayerName *player_name;
 
-        if (iter != NULL) {
-                MediaPlayer *player;
+                player_name = g_hash_table_lookup (manager->priv->media_players_by_name, name);
+                if (player_name != NULL)
+                        player = g_queue_peek_head (&player_name->players);
+        }
 
-                player = iter->data;
+        if (player != NULL) {
                 g_debug ("Deregistering %s (dbus_name: %s)", application, player->dbus_name);
-                free_media_player (player);
-                manager->priv->media_players = g_list_delete_link (manager->priv->media_players, iter);
+                remove_media_player (manager, player);
         }
 }
 
@@ -1712,7 +2050,7 @@ gsd_media_player_key_pressed (GsdMediaKeysManager *manager,
                         return TRUE;
         }
 
-        have_listeners = (manager->priv->media_players != NULL);
+        have_listeners = (manager->priv->media_players_heap->len > 0);
 
         if (!have_listeners) {
                 /* Popup a dialog with an (/) icon */
@@ -1720,7 +2058,7 @@ gsd_media_player_key_pressed (GsdMediaKeysManager *manager,
 		return TRUE;
         }
 
-        player = manager->priv->media_players->data;
+        player = g_ptr_array_index (manager->priv->media_players_heap, 0);
         application = player->application;
 
         if (g_dbus_connection_emit_signal (manager->priv->connection,
@@ -1767,10 +2105,54 @@ handle_method_call (GDBusConnection       *connection,
         }
 }
 
+/* Custom keybinding path → latency histogram */
+static GVariant *
+get_custom_keybinding_latencies (GsdMediaKeysManager *manager)
+{
+        GVariantBuilder builder;
+        guint i;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sau}"));
+        for (i = 0; i < manager->priv->keys->len; i++) {
+                MediaKey *key = g_ptr_array_index (manager->priv->keys, i);
+                GVariantBuilder buckets;
+                guint j;
+
+                if (key->key_type != CUSTOM_KEY || key->custom_path == NULL)
+                        continue;
+
+                g_variant_builder_init (&buckets, G_VARIANT_TYPE ("au"));
+                for (j = 0; j < LAUNCH_HISTOGRAM_BUCKETS; j++)
+                        g_variant_builder_add (&buckets, "u", key->launch_histogram[j]);
+                g_variant_builder_add (&builder, "{sau}", key->custom_path, &buckets);
+        }
+
+        return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+                     const gchar     *sender,
+                     const gchar     *object_path,
+                     const gchar     *interface_name,
+                     const gchar     *property_name,
+                     GError         **error,
+                     gpointer         user_data)
+{
+        GsdMediaKeysManager *manager = (GsdMediaKeysManager *) user_data;
+
+        if (g_strcmp0 (property_name, "CustomKeybindingLatencies") == 0)
+                return get_custom_keybinding_latencies (manager);
+
+        g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                     "No such property: %s", property_name);
+        return NULL;
+}
+
 static const GDBusInterfaceVTable interface_vtable =
 {
         handle_method_call,
-        NULL, /* Get Property */
+        handle_get_property,
         NULL, /* Set Property */
 };
 
@@ -2023,51 +2405,87 @@ do_config_power_action (GsdMediaKeysManager *manager,
         }
 }
 
-static gboolean
-supports_power_action (GsdMediaKeysManager *manager,
-                       GsdPowerActionType   action_type)
+typedef struct {
+        GsdMediaKeysManager *manager;
+        GsdPowerActionType   action_type;
+} PowerCapabilityData;
+
+static const struct {
+        GsdPowerActionType  action_type;
+        const char         *method_name;
+} power_capabilities[] = {
+        { GSD_POWER_ACTION_SUSPEND,   "CanSuspend" },
+        { GSD_POWER_ACTION_SHUTDOWN,  "CanPowerOff" },
+        { GSD_POWER_ACTION_HIBERNATE, "CanHibernate" },
+};
+
+static void
+power_capability_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
 {
-        const char *method_name = NULL;
+        PowerCapabilityData *data = user_data;
         g_autoptr(GVariant) variant = NULL;
+        GError *error = NULL;
         const char *reply;
-        gboolean result = FALSE;
 
-        switch (action_type) {
-        case GSD_POWER_ACTION_SUSPEND:
-                method_name = "CanSuspend";
-                break;
-        case GSD_POWER_ACTION_SHUTDOWN:
-                method_name = "CanPowerOff";
-                break;
-        case GSD_POWER_ACTION_HIBERNATE:
-                method_name = "CanHibernate";
-                break;
-        case GSD_POWER_ACTION_INTERACTIVE:
-        case GSD_POWER_ACTION_BLANK:
-        case GSD_POWER_ACTION_LOGOUT:
-        case GSD_POWER_ACTION_NOTHING:
-                break;
+        variant = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (variant == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_debug ("Failed to query power action %d: %s", data->action_type, error->message);
+                        data->manager->priv->power_capabilities &= ~(1 << data->action_type);
+                }
+                g_error_free (error);
+                g_free (data);
+                return;
         }
 
-        if (method_name == NULL)
-                return FALSE;
+        g_variant_get (variant, "(&s)", &reply);
+        if (g_strcmp0 (reply, "yes") == 0)
+                data->manager->priv->power_capabilities |= (1 << data->action_type);
+        else
+                data->manager->priv->power_capabilities &= ~(1 << data->action_type);
 
-        variant = g_dbus_proxy_call_sync (manager->priv->logind_proxy,
-                                          method_name,
-                                          NULL,
-                                          G_DBUS_CALL_FLAGS_NONE,
-                                          -1,
-                                          manager->priv->bus_cancellable,
-                                          NULL);
+        g_free (data);
+}
 
-        if (variant == NULL)
-                return FALSE;
+/* The capabilities are queried in the background, so that the power
+ * and suspend keys can be answered from memory without blocking on
+ * logind. They are refreshed whenever logind might have changed its
+ * answer, and after each use. */
+static void
+refresh_power_capabilities (GsdMediaKeysManager *manager)
+{
+        guint i;
 
-        g_variant_get (variant, "(&s)", &reply);
-        if (g_strcmp0 (reply, "yes") == 0)
-                result = TRUE;
+        /* Not started, or already stopped */
+        if (manager->priv->logind_proxy == NULL ||
+            manager->priv->bus_cancellable == NULL)
+                return;
+
+        for (i = 0; i < G_N_ELEMENTS (power_capabilities); i++) {
+                PowerCapabilityData *data;
+
+                data = g_new0 (PowerCapabilityData, 1);
+                data->manager = manager;
+                data->action_type = power_capabilities[i].action_type;
+
+                g_dbus_proxy_call (manager->priv->logind_proxy,
+                                   power_capabilities[i].method_name,
+                                   NULL,
+                                   G_DBUS_CALL_FLAGS_NONE,
+                                   -1,
+                                   manager->priv->bus_cancellable,
+                                   power_capability_cb,
+                                   data);
+        }
+}
 
-        return result;
+static gboolean
+supports_power_action (GsdMediaKeysManager *manager,
+                       GsdPowerActionType   action_type)
+{
+        return (manager->priv->power_capabilities & (1 << action_type)) != 0;
 }
 
 static void
@@ -2112,6 +2530,8 @@ do_config_power_button_action (GsdMediaKeysManager *manager,
                 action = GSD_POWER_ACTION_INTERACTIVE;
 
         do_config_power_action (manager, action, in_lock_screen);
+
+        refresh_power_capabilities (manager);
 }
 
 static void
@@ -2407,15 +2827,56 @@ do_screencast_action (GsdMediaKeysManager *manager)
                 screencast_stop (manager);
 }
 
+static char *
+format_launch_histogram (MediaKey *key)
+{
+        GString *str;
+        guint i;
+
+        str = g_string_new (NULL);
+        for (i = 0; i < LAUNCH_HISTOGRAM_BUCKETS; i++) {
+                if (key->launch_histogram[i] == 0)
+                        continue;
+                if (str->len > 0)
+                        g_string_append_c (str, ' ');
+                if (i == LAUNCH_HISTOGRAM_BUCKETS - 1)
+                        g_string_append_printf (str, ">=%u:%u", 1 << (i - 1), key->launch_histogram[i]);
+                else
+                        g_string_append_printf (str, "<%u:%u", 1 << i, key->launch_histogram[i]);
+        }
+
+        return g_string_free (str, FALSE);
+}
+
 static void
 do_custom_action (GsdMediaKeysManager *manager,
                   guint                deviceid,
                   MediaKey            *key,
-                  gint64               timestamp)
+                  gint64               timestamp,
+                  gint64               received)
 {
+        g_autofree char *histogram = NULL;
+        gint64 elapsed;
+        guint bucket;
+
         g_debug ("Launching custom action for key (on device id %d)", deviceid);
 
-	execute (manager, key->custom_command, timestamp);
+        if (key->custom_app_info == NULL)
+                return;
+
+        if (!launch_app (manager, key->custom_app_info, timestamp))
+                return;
+        elapsed = g_get_monotonic_time () - received;
+
+        for (bucket = 0; bucket < LAUNCH_HISTOGRAM_BUCKETS - 1; bucket++) {
+                if (elapsed < (1000 << bucket))
+                        break;
+        }
+        key->launch_histogram[bucket]++;
+
+        histogram = format_launch_histogram (key);
+        g_debug ("Launched '%s' for %s %" G_GINT64_FORMAT " µs after the key press, histogram (ms): %s",
+                 key->custom_command, key->custom_path, elapsed, histogram);
 }
 
 static gboolean
@@ -2599,6 +3060,9 @@ on_accelerator_activated (ShellKeyGrabber     *grabber,
         guint deviceid;
         guint timestamp;
         guint mode;
+        gint64 received;
+
+        received = g_get_monotonic_time ();
 
         g_variant_dict_init (&dict, parameters);
 
@@ -2621,7 +3085,7 @@ on_accelerator_activated (ShellKeyGrabber     *grabber,
                         continue;
 
                 if (key->key_type == CUSTOM_KEY)
-                        do_custom_action (manager, deviceid, key, timestamp);
+                        do_custom_action (manager, deviceid, key, timestamp, received);
                 else
                         do_action (manager, deviceid, mode, key->key_type, timestamp);
                 return;
@@ -2822,13 +3286,12 @@ initialize_volume_handler (GsdMediaKeysManager *manager)
         gvc_mixer_control_open (manager->priv->volume);
 
         manager->priv->audio_selection_watch_id =
-                g_bus_watch_name (G_BUS_TYPE_SESSION,
-                                  AUDIO_SELECTION_DBUS_NAME,
-                                  G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                  audio_selection_appeared,
-                                  audio_selection_vanished,
-                                  manager,
-                                  NULL);
+                gsd_bus_watch_name (G_BUS_TYPE_SESSION,
+                                    AUDIO_SELECTION_DBUS_NAME,
+                                    audio_selection_appeared,
+                                    audio_selection_vanished,
+                                    manager,
+                                    NULL);
 
         gnome_settings_profile_end ("gvc_mixer_control_new");
 }
@@ -2991,23 +3454,21 @@ start_media_keys_idle_cb (GsdMediaKeysManager *manager)
                                   G_CALLBACK (shell_presence_changed), manager);
         shell_presence_changed (manager);
 
-        manager->priv->rfkill_watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION,
-                                                           "org.gnome.SettingsDaemon.Rfkill",
-                                                           G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                                           rfkill_appeared_cb,
-                                                           NULL,
-                                                           manager, NULL);
+        manager->priv->rfkill_watch_id = gsd_bus_watch_name (G_BUS_TYPE_SESSION,
+                                                             "org.gnome.SettingsDaemon.Rfkill",
+                                                             rfkill_appeared_cb,
+                                                             NULL,
+                                                             manager, NULL);
 
         g_debug ("Starting mpris controller");
         manager->priv->mpris_controller = mpris_controller_new ();
 
         /* Rotation */
-        manager->priv->iio_sensor_watch_id = g_bus_watch_name (G_BUS_TYPE_SYSTEM,
-                                                               "net.hadess.SensorProxy",
-                                                               G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                                               iio_sensor_appeared_cb,
-                                                               iio_sensor_disappeared_cb,
-                                                               manager, NULL);
+        manager->priv->iio_sensor_watch_id = gsd_bus_watch_name (G_BUS_TYPE_SYSTEM,
+                                                                 "net.hadess.SensorProxy",
+                                                                 iio_sensor_appeared_cb,
+                                                                 iio_sensor_disappeared_cb,
+                                                                 manager, NULL);
 
         gnome_settings_profile_end (NULL);
 
@@ -3034,6 +3495,8 @@ gsd_media_keys_manager_start (GsdMediaKeysManager *manager,
 
         register_manager (manager_object);
 
+        refresh_power_capabilities (manager);
+
         gnome_settings_profile_end (NULL);
 
         return TRUE;
@@ -3069,12 +3532,12 @@ gsd_media_keys_manager_stop (GsdMediaKeysManager *manager)
         }
 
         if (manager->priv->rfkill_watch_id > 0) {
-                g_bus_unwatch_name (manager->priv->rfkill_watch_id);
+                gsd_bus_unwatch (manager->priv->rfkill_watch_id);
                 manager->priv->rfkill_watch_id = 0;
         }
 
         if (manager->priv->iio_sensor_watch_id > 0) {
-                g_bus_unwatch_name (manager->priv->iio_sensor_watch_id);
+                gsd_bus_unwatch (manager->priv->iio_sensor_watch_id);
                 manager->priv->iio_sensor_watch_id = 0;
         }
 
@@ -3109,6 +3572,15 @@ gsd_media_keys_manager_stop (GsdMediaKeysManager *manager)
         g_clear_object (&priv->iio_sensor_proxy);
         g_clear_pointer (&priv->chassis_type, g_free);
 
+        clear_media_players (manager);
+
+        g_clear_pointer (&priv->keyring_environment, g_variant_unref);
+        if (priv->app_info_monitor != NULL) {
+                g_signal_handlers_disconnect_by_func (priv->app_info_monitor, app_info_changed, manager);
+                g_clear_object (&priv->app_info_monitor);
+        }
+        g_clear_pointer (&priv->desktop_app_infos, g_hash_table_destroy);
+
         g_clear_pointer (&priv->introspection_data, g_dbus_node_info_unref);
         g_clear_object (&priv->connection);
 
@@ -3147,15 +3619,10 @@ gsd_media_keys_manager_stop (GsdMediaKeysManager *manager)
         g_clear_object (&priv->source);
         g_clear_object (&priv->volume);
 
-        if (priv->media_players != NULL) {
-                g_list_free_full (priv->media_players, (GDestroyNotify) free_media_player);
-                priv->media_players = NULL;
-        }
-
         g_clear_object (&priv->shell_proxy);
 
         if (priv->audio_selection_watch_id)
-                g_bus_unwatch_name (priv->audio_selection_watch_id);
+                gsd_bus_unwatch (priv->audio_selection_watch_id);
         priv->audio_selection_watch_id = 0;
         clear_audio_selection (manager);
 }
@@ -3287,9 +3754,19 @@ logind_proxy_signal_cb (GDBusProxy  *proxy,
                 inhibit_suspend (manager);
                 /* Re-enable power-button handling (after a small delay) */
                 setup_reenable_power_button_timer (manager);
+                refresh_power_capabilities (manager);
         }
 }
 
+static void
+logind_proxy_properties_changed_cb (GDBusProxy *proxy,
+                                    GVariant   *changed_properties,
+                                    GStrv       invalidated_properties,
+                                    gpointer    user_data)
+{
+        refresh_power_capabilities (GSD_MEDIA_KEYS_MANAGER (user_data));
+}
+
 static void
 gsd_media_keys_manager_class_init (GsdMediaKeysManagerClass *klass)
 {
@@ -3339,6 +3816,12 @@ gsd_media_keys_manager_init (GsdMediaKeysManager *manager)
         error = NULL;
         manager->priv = GSD_MEDIA_KEYS_MANAGER_GET_PRIVATE (manager);
 
+        manager->priv->media_players_by_app = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                     NULL, (GDestroyNotify) free_media_player);
+        manager->priv->media_players_by_name = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                      NULL, (GDestroyNotify) free_media_player_name);
+        manager->priv->media_players_heap = g_ptr_array_new ();
+
         bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
         if (bus == NULL) {
                 g_warning ("Failed to connect to system bus: %s",
@@ -3386,6 +3869,9 @@ gsd_media_keys_manager_init (GsdMediaKeysManager *manager)
         g_signal_connect (manager->priv->logind_proxy, "g-signal",
                           G_CALLBACK (logind_proxy_signal_cb),
                           manager);
+        g_signal_connect (manager->priv->logind_proxy, "g-properties-changed",
+                          G_CALLBACK (logind_proxy_properties_changed_cb),
+                          manager);
         inhibit_suspend (manager);
 }
 
@@ -3409,6 +3895,10 @@ gsd_media_keys_manager_finalize (GObject *object)
         g_clear_object (&media_keys_manager->priv->logind_proxy);
         g_clear_object (&media_keys_manager->priv->screen_saver_proxy);
 
+        g_clear_pointer (&media_keys_manager->priv->media_players_heap, g_ptr_array_unref);
+        g_clear_pointer (&media_keys_manager->priv->media_players_by_name, g_hash_table_destroy);
+        g_clear_pointer (&media_keys_manager->priv->media_players_by_app, g_hash_table_destroy);
+
         G_OBJECT_CLASS (gsd_media_keys_manager_parent_class)->finalize (object);
 }
 
@@ -3506,6 +3996,8 @@ on_bus_gotten (GObject             *source_object,
         }
         manager->priv->connection = connection;
 
+        fetch_keyring_environment (manager);
+
         g_dbus_connection_register_object (connection,
                                            GSD_MEDIA_KEYS_DBUS_PATH,
                                            manager->priv->introspection_data->interfaces[0],
@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Registers and releases a large number of legacy media players against
+ * a running gsd-media-keys, the way browser tabs do, and reports how long
+ * the daemon took. Half of the players are dropped by closing their bus
+ * connection instead of calling ReleaseMediaPlayerKeys, to exercise the
+ * NameOwnerChanged path as well.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <gio/gio.h>
+
+#define GSD_MEDIA_KEYS_DBUS_NAME                "org.gnome.SettingsDaemon.MediaKeys"
+#define GSD_MEDIA_KEYS_DBUS_PATH                "/org/gnome/SettingsDaemon/MediaKeys"
+#define GSD_MEDIA_KEYS_DBUS_INTERFACE           "org.gnome.SettingsDaemon.MediaKeys"
+
+#define DEFAULT_N_PLAYERS                       10000
+#define N_CONNECTIONS                           100
+
+static guint n_pending;
+
+static void
+call_done (GObject      *source,
+           GAsyncResult *res,
+           gpointer      user_data)
+{
+        GError *error = NULL;
+        GVariant *ret;
+
+        ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &error);
+        if (ret == NULL) {
+                g_printerr ("Call failed: %s\n", error->message);
+                exit (1);
+        }
+        g_variant_unref (ret);
+
+        n_pending--;
+}
+
+static void
+call (GDBusConnection *connection,
+      const char      *method,
+      GVariant        *parameters)
+{
+        n_pending++;
+        g_dbus_connection_call (connection,
+                                GSD_MEDIA_KEYS_DBUS_NAME,
+                                GSD_MEDIA_KEYS_DBUS_PATH,
+                                GSD_MEDIA_KEYS_DBUS_INTERFACE,
+                                method,
+                                parameters,
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                -1,
+                                NULL,
+                                call_done,
+                                NULL);
+}
+
+static void
+wait_for_calls (void)
+{
+        while (n_pending > 0)
+                g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+report (const char *what,
+        guint       n,
+        gint64      start)
+{
+        gint64 elapsed = g_get_monotonic_time () - start;
+
+        g_print ("%-32s %6u calls in %8.2f ms (%6.2f µs/call)\n",
+                 what, n, elapsed / 1000.0, (double) elapsed / n);
+}
+
+int main (int argc, char **argv)
+{
+        GDBusConnection *connections[N_CONNECTIONS];
+        GDBusConnection *bus;
+        GError *error = NULL;
+        char *address;
+        guint n_players;
+        gint64 start;
+        guint i;
+
+        n_players = argc > 1 ? atoi (argv[1]) : DEFAULT_N_PLAYERS;
+        if (n_players < N_CONNECTIONS * 2) {
+                g_printerr ("Need at least %u players\n", N_CONNECTIONS * 2);
+                return 1;
+        }
+
+        address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, &error);
+        if (address == NULL) {
+                g_printerr ("No session bus: %s\n", error->message);
+                return 1;
+        }
+
+        /* Separate connections, so that each has its own unique name */
+        for (i = 0; i < N_CONNECTIONS; i++) {
+                connections[i] = g_dbus_connection_new_for_address_sync (address,
+                                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                                         NULL, NULL, &error);
+                if (connections[i] == NULL) {
+                        g_printerr ("Could not connect to the session bus: %s\n", error->message);
+                        return 1;
+                }
+        }
+        g_free (address);
+
+        start = g_get_monotonic_time ();
+        for (i = 0; i < n_players; i++) {
+                char *application = g_strdup_printf ("stress-test-%u", i);
+
+                /* Mix current and low priority registrations */
+                call (connections[i % N_CONNECTIONS], "GrabMediaPlayerKeys",
+                      g_variant_new ("(su)", application, (i % 3 == 0) ? 1 : 0));
+                g_free (application);
+        }
+        wait_for_calls ();
+        report ("GrabMediaPlayerKeys", n_players, start);
+
+        start = g_get_monotonic_time ();
+        for (i = 0; i < n_players / 2; i++) {
+                char *application = g_strdup_printf ("stress-test-%u", i);
+
+                /* Re-registering with a newer time replaces the player */
+                call (connections[i % N_CONNECTIONS], "GrabMediaPlayerKeys",
+                      g_variant_new ("(su)", application, 0));
+                g_free (application);
+        }
+        wait_for_calls ();
+        report ("GrabMediaPlayerKeys (replace)", n_players / 2, start);
+
+        start = g_get_monotonic_time ();
+        for (i = 0; i < n_players / 2; i++) {
+                char *application = g_strdup_printf ("stress-test-%u", i);
+
+                call (connections[i % N_CONNECTIONS], "ReleaseMediaPlayerKeys",
+                      g_variant_new ("(s)", application));
+                g_free (application);
+        }
+        wait_for_calls ();
+        report ("ReleaseMediaPlayerKeys", n_players / 2, start);
+
+        /* The remaining players go away with their connections */
+        start = g_get_monotonic_time ();
+        for (i = 0; i < N_CONNECTIONS; i++) {
+                g_dbus_connection_close_sync (connections[i], NULL, NULL);
+                g_object_unref (connections[i]);
+        }
+
+        /* Round trip to the daemon so that the vanished names have
+         * been processed before stopping the clock */
+        bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+        call (bus, "ReleaseMediaPlayerKeys",
+              g_variant_new ("(s)", "stress-test-none"));
+        wait_for_calls ();
+        report ("Connection closed", N_CONNECTIONS, start);
+        g_object_unref (bus);
+
+        return 0;
+}
@@ -17,7 +17,7 @@
  */
 
 #include "mpris-controller.h"
-#include "bus-watch-namespace.h"
+#include "gsd-bus-watch.h"
 #include <gio/gio.h>
 
 G_DEFINE_TYPE (MprisController, mpris_controller, G_TYPE_OBJECT)
@@ -33,31 +33,107 @@ enum {
 struct _MprisControllerPrivate
 {
   GCancellable *cancellable;
-  GDBusProxy *mpris_client_proxy;
   guint namespace_watcher_id;
-  GSList *other_players;
-  gboolean connecting;
+
+  /* name → MprisPlayer, owns the players */
+  GHashTable *players;
+  /* MprisPlayer, most recently playing first */
+  GQueue ranked;
+  guint n_ready;
 };
 
+typedef struct
+{
+  MprisController *controller;
+  gchar *name;
+  GDBusProxy *proxy;
+  GCancellable *cancellable;
+  gboolean playing;
+  GList link;
+} MprisPlayer;
+
+static void
+mpris_player_free (MprisPlayer *player)
+{
+  g_cancellable_cancel (player->cancellable);
+  g_clear_object (&player->cancellable);
+
+  if (player->proxy)
+    {
+      g_signal_handlers_disconnect_by_data (player->proxy, player);
+      g_clear_object (&player->proxy);
+    }
+
+  g_free (player->name);
+  g_slice_free (MprisPlayer, player);
+}
+
+static gboolean
+playback_status_is_playing (GDBusProxy *proxy)
+{
+  GVariant *status;
+  gboolean playing = FALSE;
+
+  status = g_dbus_proxy_get_cached_property (proxy, "PlaybackStatus");
+  if (status == NULL)
+    return FALSE;
+
+  if (g_variant_is_of_type (status, G_VARIANT_TYPE_STRING))
+    playing = g_strcmp0 (g_variant_get_string (status, NULL), "Playing") == 0;
+  g_variant_unref (status);
+
+  return playing;
+}
+
+static void
+mpris_player_promote (MprisPlayer *player)
+{
+  MprisControllerPrivate *priv = player->controller->priv;
+
+  if (priv->ranked.head == &player->link)
+    return;
+
+  g_queue_unlink (&priv->ranked, &player->link);
+  g_queue_push_head_link (&priv->ranked, &player->link);
+}
+
+static MprisPlayer *
+mpris_controller_get_active_player (MprisController *self)
+{
+  GList *l;
+
+  /* The ranking only changes on player churn and PlaybackStatus
+   * changes, so a key press just picks the first warm proxy. */
+  for (l = self->priv->ranked.head; l != NULL; l = l->next)
+    {
+      MprisPlayer *player = l->data;
+
+      if (player->proxy != NULL)
+        return player;
+    }
+
+  return NULL;
+}
 
 static void
 mpris_controller_dispose (GObject *object)
 {
   MprisControllerPrivate *priv = MPRIS_CONTROLLER (object)->priv;
 
+  g_cancellable_cancel (priv->cancellable);
   g_clear_object (&priv->cancellable);
-  g_clear_object (&priv->mpris_client_proxy);
 
   if (priv->namespace_watcher_id)
     {
-      bus_unwatch_namespace (priv->namespace_watcher_id);
+      gsd_bus_unwatch (priv->namespace_watcher_id);
       priv->namespace_watcher_id = 0;
     }
 
-  if (priv->other_players)
+  if (priv->players)
     {
-      g_slist_free_full (priv->other_players, g_free);
-      priv->other_players = NULL;
+      g_queue_init (&priv->ranked);
+      priv->n_ready = 0;
+      g_clear_pointer (&priv->players, g_hash_table_destroy);
     }
 
   G_OBJECT_CLASS (mpris_controller_parent_class)->dispose (object);
@@ -85,28 +161,52 @@ gboolean
 mpris_controller_key (MprisController *self, const gchar *key)
 {
   MprisControllerPrivate *priv = MPRIS_CONTROLLER (self)->priv;
+  MprisPlayer *player;
 
-  if (!priv->mpris_client_proxy)
+  player = mpris_controller_get_active_player (self);
+  if (!player)
     return FALSE;
 
   if (g_strcmp0 (key, "Play") == 0)
     key = "PlayPause";
 
   g_debug ("calling %s over dbus to mpris client %s",
-           key, g_dbus_proxy_get_name (priv->mpris_client_proxy));
-  g_dbus_proxy_call (priv->mpris_client_proxy,
+           key, player->name);
+  g_dbus_proxy_call (player->proxy,
                      key, NULL, 0, -1, priv->cancellable,
                      mpris_proxy_call_done,
                      NULL);
   return TRUE;
 }
 
+static void
+mpris_player_properties_changed (GDBusProxy *proxy,
+                                 GVariant   *changed_properties,
+                                 GStrv       invalidated_properties,
+                                 gpointer    user_data)
+{
+  MprisPlayer *player = user_data;
+  gboolean playing;
+
+  playing = playback_status_is_playing (proxy);
+  if (playing == player->playing)
+    return;
+
+  player->playing = playing;
+  if (playing)
+    {
+      g_debug ("mpris client %s started playing", player->name);
+      mpris_player_promote (player);
+    }
+}
+
 static void
 mpris_proxy_ready_cb (GObject      *object,
                       GAsyncResult *res,
                       gpointer      user_data)
 {
   MprisControllerPrivate *priv;
+  MprisPlayer *player;
   GError *error = NULL;
   GDBusProxy *proxy;
 
@@ -120,29 +220,19 @@ mpris_proxy_ready_cb (GObject      *object,
       return;
     }
 
-  priv = MPRIS_CONTROLLER (user_data)->priv;
-  priv->mpris_client_proxy = proxy;
-  priv->connecting = FALSE;
+  player = user_data;
+  priv = player->controller->priv;
 
-  g_object_notify (user_data, "has-active-player");
-}
+  player->proxy = proxy;
+  player->playing = playback_status_is_playing (proxy);
+  g_signal_connect (proxy, "g-properties-changed",
+                    G_CALLBACK (mpris_player_properties_changed), player);
 
-static void
-start_mpris_proxy (MprisController *self, const gchar *name)
-{
-  MprisControllerPrivate *priv = MPRIS_CONTROLLER (self)->priv;
+  if (player->playing)
+    mpris_player_promote (player);
 
-  g_debug ("Creating proxy for for %s", name);
-  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
-                            0,
-                            NULL,
-                            name,
-                            "/org/mpris/MediaPlayer2",
-                            "org.mpris.MediaPlayer2.Player",
-                            priv->cancellable,
-                            mpris_proxy_ready_cb,
-                            self);
-  priv->connecting = TRUE;
+  if (priv->n_ready++ == 0)
+    g_object_notify (G_OBJECT (player->controller), "has-active-player");
 }
 
 static void
@@ -153,11 +243,30 @@ mpris_player_appeared (GDBusConnection *connection,
 {
   MprisController *self = user_data;
   MprisControllerPrivate *priv = MPRIS_CONTROLLER (self)->priv;
+  MprisPlayer *player;
+
+  if (g_hash_table_contains (priv->players, name))
+    return;
 
-  if (priv->mpris_client_proxy == NULL && !priv->connecting)
-    start_mpris_proxy (self, name);
-  else
-    self->priv->other_players = g_slist_prepend (self->priv->other_players, g_strdup (name));
+  player = g_slice_new0 (MprisPlayer);
+  player->controller = self;
+  player->name = g_strdup (name);
+  player->cancellable = g_cancellable_new ();
+  player->link.data = player;
+
+  g_hash_table_insert (priv->players, player->name, player);
+  g_queue_push_tail_link (&priv->ranked, &player->link);
+
+  g_debug ("Creating proxy for for %s", name);
+  g_dbus_proxy_new (connection,
+                    G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                    NULL,
+                    name,
+                    "/org/mpris/MediaPlayer2",
+                    "org.mpris.MediaPlayer2.Player",
+                    player->cancellable,
+                    mpris_proxy_ready_cb,
+                    player);
 }
 
 static void
@@ -167,29 +276,20 @@ mpris_player_vanished (GDBusConnection *connection,
 {
   MprisController *self = user_data;
   MprisControllerPrivate *priv = MPRIS_CONTROLLER (self)->priv;
+  MprisPlayer *player;
+  gboolean was_ready;
 
-  if (priv->mpris_client_proxy &&
-      g_strcmp0 (name, g_dbus_proxy_get_name (priv->mpris_client_proxy)) == 0)
-    {
-      g_clear_object (&priv->mpris_client_proxy);
-      g_object_notify (user_data, "has-active-player");
-
-      /* take the next one if there's one */
-      if (self->priv->other_players && !priv->connecting)
-        {
-          GSList *first;
-          gchar *name;
+  player = g_hash_table_lookup (priv->players, name);
+  if (!player)
+    return;
 
-          first = self->priv->other_players;
-          name = first->data;
+  was_ready = (player->proxy != NULL);
 
-          start_mpris_proxy (self, name);
+  g_queue_unlink (&priv->ranked, &player->link);
+  g_hash_table_remove (priv->players, name);
 
-          self->priv->other_players = self->priv->other_players->next;
-          g_free (name);
-          g_slist_free_1 (first);
-        }
-    }
+  if (was_ready && --priv->n_ready == 0)
+    g_object_notify (G_OBJECT (self), "has-active-player");
 }
 
 static void
@@ -197,12 +297,12 @@ mpris_controller_constructed (GObject *object)
 {
   MprisControllerPrivate *priv = MPRIS_CONTROLLER (object)->priv;
 
-  priv->namespace_watcher_id = bus_watch_namespace (G_BUS_TYPE_SESSION,
-                                                    "org.mpris.MediaPlayer2",
-                                                    mpris_player_appeared,
-                                                    mpris_player_vanished,
-                                                    MPRIS_CONTROLLER (object),
-                                                    NULL);
+  priv->namespace_watcher_id = gsd_bus_watch_namespace (G_BUS_TYPE_SESSION,
+                                                        "org.mpris.MediaPlayer2",
+                                                        mpris_player_appeared,
+                                                        mpris_player_vanished,
+                                                        MPRIS_CONTROLLER (object),
+                                                        NULL);
 }
 
 static void
@@ -248,6 +348,10 @@ static void
 mpris_controller_init (MprisController *self)
 {
   self->priv = CONTROLLER_PRIVATE (self);
+  self->priv->cancellable = g_cancellable_new ();
+  self->priv->players = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               NULL, (GDestroyNotify) mpris_player_free);
+  g_queue_init (&self->priv->ranked);
 }
 
 gboolean
@@ -255,7 +359,7 @@ mpris_controller_get_has_active_player (MprisController *controller)
 {
   g_return_val_if_fail (MPRIS_IS_CONTROLLER (controller), FALSE);
 
-  return (controller->priv->mpris_client_proxy != NULL);
+  return (controller->priv->n_ready > 0);
 }
 
 MprisController *
@@ -37,6 +37,7 @@
 #include <libgnome-desktop/gnome-idle-monitor.h>
 
 #include <gsd-input-helper.h>
+#include <gsd-bus-watch.h>
 
 #include "gsd-power-constants.h"
 #include "gsm-inhibitor-flag.h"
@@ -2064,7 +2065,7 @@ gsd_power_manager_finalize (GObject *object)
                 g_bus_unown_name (manager->priv->name_id);
 
         if (manager->priv->iio_proxy_watch_id != 0)
-                g_bus_unwatch_name (manager->priv->iio_proxy_watch_id);
+                gsd_bus_unwatch (manager->priv->iio_proxy_watch_id);
         manager->priv->iio_proxy_watch_id = 0;
 
         G_OBJECT_CLASS (gsd_power_manager_parent_class)->finalize (object);
@@ -2863,12 +2864,11 @@ gsd_power_manager_start (GsdPowerManager *manager,
 
         /* setup ambient light support */
         manager->priv->iio_proxy_watch_id =
-                g_bus_watch_name (G_BUS_TYPE_SYSTEM,
-                                  "net.hadess.SensorProxy",
-                                  G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                  iio_proxy_appeared_cb,
-                                  iio_proxy_vanished_cb,
-                                  manager, NULL);
+                gsd_bus_watch_name (G_BUS_TYPE_SYSTEM,
+                                    "net.hadess.SensorProxy",
+                                    iio_proxy_appeared_cb,
+                                    iio_proxy_vanished_cb,
+                                    manager, NULL);
         manager->priv->ambient_norm_required = TRUE;
         manager->priv->ambient_accumulator = -1.f;
         manager->priv->ambient_norm_value = -1.f;
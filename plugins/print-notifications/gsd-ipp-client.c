@@ -0,0 +1,257 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include "gsd-ipp-client.h"
+
+#include <glib/gstdio.h>
+
+/*
+ * libcups keeps the server, the user and the password callback per
+ * thread, so the server is looked up once on the thread creating the
+ * client, and the requests are built by the callers on their own
+ * thread. The connection is only ever used by the single worker thread.
+ * It is kept alive between requests, so that a burst of notifications
+ * does not cost one TCP, or TLS, handshake per request. libcups
+ * reconnects on its own when the server closed an idle connection, and
+ * the connection is dropped after any other failure, so that the next
+ * request starts from a fresh one. PPD files are fetched the same way,
+ * since that is a blocking HTTP request to the same server.
+ *
+ * Every queued request holds a reference on the client, so that freeing
+ * it doesn't wait for a slow server: the worker thread sends what is
+ * left in the queue, and the last request closes the connection.
+ */
+
+struct _GsdIppClient
+{
+        gint                ref_count;
+        GThreadPool        *pool;
+
+        gchar              *server;
+        int                 port;
+        http_encryption_t   encryption;
+        http_t             *http;
+};
+
+typedef struct
+{
+        ipp_t        *request;
+        gchar        *resource;
+        /* Instead of a request, the printer whose PPD file to get */
+        gchar        *ppd_printer;
+} IppRequest;
+
+static void
+ipp_request_free (IppRequest *data)
+{
+        if (data->request != NULL)
+                ippDelete (data->request);
+        g_free (data->resource);
+        g_free (data->ppd_printer);
+        g_free (data);
+}
+
+/* For a PPD file which nobody got from the task */
+static void
+ppd_file_free (gchar *ppd_file_name)
+{
+        g_unlink (ppd_file_name);
+        g_free (ppd_file_name);
+}
+
+static void
+ipp_client_unref (GsdIppClient *client)
+{
+        if (!g_atomic_int_dec_and_test (&client->ref_count))
+                return;
+
+        g_clear_pointer (&client->http, httpClose);
+        g_free (client->server);
+        g_free (client);
+}
+
+static void
+ipp_client_push (GsdIppClient *client,
+                 GTask        *task)
+{
+        g_atomic_int_inc (&client->ref_count);
+        g_thread_pool_push (client->pool, task, NULL);
+}
+
+static const char *
+password_cb (const char *prompt,
+             http_t     *http,
+             const char *method,
+             const char *resource,
+             void       *user_data)
+{
+        /* Never prompt for a password on the terminal */
+        return NULL;
+}
+
+static void
+ipp_client_worker (gpointer data,
+                   gpointer user_data)
+{
+        GTask        *task = data;
+        GsdIppClient *client = user_data;
+        IppRequest   *request = g_task_get_task_data (task);
+        ipp_t        *response;
+
+        if (g_task_return_error_if_cancelled (task))
+                goto out;
+
+        cupsSetPasswordCB2 (password_cb, NULL);
+
+        if (client->http == NULL)
+                client->http = httpConnectEncrypt (client->server,
+                                                   client->port,
+                                                   client->encryption);
+
+        if (client->http == NULL) {
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                                         "Connection to CUPS server '%s' failed",
+                                         client->server);
+                goto out;
+        }
+
+        if (request->ppd_printer != NULL) {
+                const char *ppd_file_name;
+
+                ppd_file_name = cupsGetPPD2 (client->http, request->ppd_printer);
+                if (ppd_file_name == NULL) {
+                        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "%s", cupsLastErrorString ());
+                        /* Most printers simply have no PPD file */
+                        if (cupsLastError () != IPP_STATUS_ERROR_NOT_FOUND)
+                                g_clear_pointer (&client->http, httpClose);
+                } else {
+                        g_task_return_pointer (task, g_strdup (ppd_file_name),
+                                               (GDestroyNotify) ppd_file_free);
+                }
+                goto out;
+        }
+
+        /* cupsDoRequest() frees the request */
+        response = cupsDoRequest (client->http,
+                                  g_steal_pointer (&request->request),
+                                  request->resource);
+        if (response == NULL) {
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                         "%s", cupsLastErrorString ());
+                g_clear_pointer (&client->http, httpClose);
+        } else {
+                g_task_return_pointer (task, response, (GDestroyNotify) ippDelete);
+        }
+
+ out:
+        g_object_unref (task);
+        ipp_client_unref (client);
+}
+
+GsdIppClient *
+gsd_ipp_client_new (void)
+{
+        GsdIppClient *client;
+
+        client = g_new0 (GsdIppClient, 1);
+        client->ref_count = 1;
+        client->server = g_strdup (cupsServer ());
+        client->port = ippPort ();
+        client->encryption = cupsEncryption ();
+        client->pool = g_thread_pool_new (ipp_client_worker, client, 1, FALSE, NULL);
+
+        return client;
+}
+
+void
+gsd_ipp_client_free (GsdIppClient *client)
+{
+        /* Requests which were queued without a cancellable, such as
+         * cancelling a subscription, still get sent, but without
+         * waiting for them here */
+        g_thread_pool_free (client->pool, FALSE, FALSE);
+        client->pool = NULL;
+
+        ipp_client_unref (client);
+}
+
+/* Takes ownership of @request, like cupsDoRequest() */
+void
+gsd_ipp_client_send_async (GsdIppClient        *client,
+                           ipp_t               *request,
+                           const char          *resource,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+        IppRequest *data;
+        GTask      *task;
+
+        task = g_task_new (NULL, cancellable, callback, user_data);
+        g_task_set_source_tag (task, gsd_ipp_client_send_async);
+
+        data = g_new0 (IppRequest, 1);
+        data->request = request;
+        data->resource = g_strdup (resource);
+        g_task_set_task_data (task, data, (GDestroyNotify) ipp_request_free);
+
+        ipp_client_push (client, task);
+}
+
+ipp_t *
+gsd_ipp_client_send_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+        g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+        g_return_val_if_fail (g_async_result_is_tagged (result, gsd_ipp_client_send_async), NULL);
+
+        return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/* The PPD file is a temporary copy, which the caller unlinks */
+void
+gsd_ipp_client_get_ppd_async (GsdIppClient        *client,
+                              const char          *printer_name,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data)
+{
+        IppRequest *data;
+        GTask      *task;
+
+        task = g_task_new (NULL, cancellable, callback, user_data);
+        g_task_set_source_tag (task, gsd_ipp_client_get_ppd_async);
+
+        data = g_new0 (IppRequest, 1);
+        data->ppd_printer = g_strdup (printer_name);
+        g_task_set_task_data (task, data, (GDestroyNotify) ipp_request_free);
+
+        ipp_client_push (client, task);
+}
+
+gchar *
+gsd_ipp_client_get_ppd_finish (GAsyncResult  *result,
+                               GError       **error)
+{
+        g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+        g_return_val_if_fail (g_async_result_is_tagged (result, gsd_ipp_client_get_ppd_async), NULL);
+
+        return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GSD_IPP_CLIENT_H__
+#define __GSD_IPP_CLIENT_H__
+
+#include <gio/gio.h>
+#include <cups/cups.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Sends IPP requests to the CUPS server from a worker thread, so that a
+ * slow or unreachable server does not block the main loop. Requests are
+ * sent in the order they were queued, on one persistent connection to
+ * the server, and their responses are returned to the main context of
+ * the caller.
+ */
+typedef struct _GsdIppClient GsdIppClient;
+
+GsdIppClient *gsd_ipp_client_new         (void);
+void          gsd_ipp_client_free        (GsdIppClient         *client);
+
+void          gsd_ipp_client_send_async  (GsdIppClient         *client,
+                                          ipp_t                *request,
+                                          const char           *resource,
+                                          GCancellable         *cancellable,
+                                          GAsyncReadyCallback   callback,
+                                          gpointer              user_data);
+ipp_t        *gsd_ipp_client_send_finish (GAsyncResult         *result,
+                                          GError              **error);
+
+void          gsd_ipp_client_get_ppd_async  (GsdIppClient         *client,
+                                             const char           *printer_name,
+                                             GCancellable         *cancellable,
+                                             GAsyncReadyCallback   callback,
+                                             gpointer              user_data);
+gchar        *gsd_ipp_client_get_ppd_finish (GAsyncResult         *result,
+                                             GError              **error);
+
+G_END_DECLS
+
+#endif /* __GSD_IPP_CLIENT_H__ */
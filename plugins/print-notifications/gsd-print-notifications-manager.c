@@ -38,6 +38,7 @@
 #include <libnotify/notify.h>
 
 #include "gnome-settings-profile.h"
+#include "gsd-ipp-client.h"
 #include "gsd-print-notifications-manager.h"
 
 #define GSD_PRINT_NOTIFICATIONS_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_PRINT_NOTIFICATIONS_MANAGER, GsdPrintNotificationsManagerPrivate))
@@ -51,7 +52,10 @@
 #define CONNECTING_TIMEOUT               60
 #define REASON_TIMEOUT                   15000
 #define CUPS_CONNECTION_TEST_INTERVAL    300
+#define CUPS_CONNECTION_TEST_MAX_INTERVAL 3600
 #define CHECK_INTERVAL                   60 /* secs */
+#define CHECK_MAX_INTERVAL               900 /* secs */
+#define NOTIFIER_COALESCE_TIMEOUT        250 /* ms */
 #define AUTHENTICATION_CHECK_TIMEOUT     3
 
 #if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR > 5)
@@ -66,6 +70,14 @@
 #define ippGetCount(attr) attr->num_values
 #define ippGetBoolean(attr, index) attr->values[index].boolean
 
+static ipp_attribute_t *
+ippFirstAttribute (ipp_t *ipp)
+{
+  if (!ipp)
+    return (NULL);
+  return (ipp->current = ipp->attrs);
+}
+
 static ipp_attribute_t *
 ippNextAttribute (ipp_t *ipp)
 {
@@ -79,26 +91,37 @@ struct GsdPrintNotificationsManagerPrivate
 {
         GDBusConnection              *cups_bus_connection;
         gint                          subscription_id;
-        cups_dest_t                  *dests;
-        gint                          num_dests;
+        GHashTable                   *printers;
+        gboolean                      cups_connected;
         gboolean                      scp_handler_spawned;
         GPid                          scp_handler_pid;
         GList                        *timeouts;
         GHashTable                   *printing_printers;
         GList                        *active_notifications;
         guint                         cups_connection_timeout_id;
+        guint                         cups_connection_test_interval;
         guint                         check_source_id;
+        guint                         check_interval;
+        guint                         server_check_interval;
+        gboolean                      poll_notifications;
+        guint                         notifier_timeout_id;
         guint                         cups_dbus_subscription_id;
         guint                         renew_source_id;
         gint                          last_notify_sequence_number;
         guint                         start_idle_id;
         GList                        *held_jobs;
+        GsdIppClient                 *ipp_client;
+        GCancellable                 *cancellable;
+        gboolean                      fetching_notifications;
+        gboolean                      fetch_again;
+        GQueue                       *notifications;
 };
 
 static void     gsd_print_notifications_manager_class_init  (GsdPrintNotificationsManagerClass *klass);
 static void     gsd_print_notifications_manager_init        (GsdPrintNotificationsManager      *print_notifications_manager);
 static void     gsd_print_notifications_manager_finalize    (GObject                           *object);
 static gboolean cups_connection_test                        (gpointer                           user_data);
+static void     schedule_notifications_check                (GsdPrintNotificationsManager      *manager);
 static gboolean process_new_notifications                   (gpointer                           user_data);
 
 G_DEFINE_TYPE (GsdPrintNotificationsManager, gsd_print_notifications_manager, G_TYPE_OBJECT)
@@ -115,60 +138,6 @@ password_cb (const char *prompt,
   return NULL;
 }
 
-static char *
-get_dest_attr (const char *dest_name,
-               const char *attr,
-               cups_dest_t *dests,
-               int          num_dests)
-{
-        cups_dest_t *dest;
-        const char  *value;
-        char        *ret;
-
-        if (dest_name == NULL)
-                return NULL;
-
-        ret = NULL;
-
-        dest = cupsGetDest (dest_name, NULL, num_dests, dests);
-        if (dest == NULL) {
-                g_debug ("Unable to find a printer named '%s'", dest_name);
-                goto out;
-        }
-
-        value = cupsGetOption (attr, dest->num_options, dest->options);
-        if (value == NULL) {
-                g_debug ("Unable to get %s for '%s'", attr, dest_name);
-                goto out;
-        }
-        ret = g_strdup (value);
- out:
-        return ret;
-}
-
-static gboolean
-is_local_dest (const char  *name,
-               cups_dest_t *dests,
-               int          num_dests)
-{
-        char        *type_str;
-        cups_ptype_t type;
-        gboolean     is_remote;
-
-        is_remote = TRUE;
-
-        type_str = get_dest_attr (name, "printer-type", dests, num_dests);
-        if (type_str == NULL) {
-                goto out;
-        }
-
-        type = atoi (type_str);
-        is_remote = type & (CUPS_PRINTER_REMOTE | CUPS_PRINTER_IMPLICIT);
-        g_free (type_str);
- out:
-        return !is_remote;
-}
-
 static gboolean
 server_is_local (const gchar *server_name)
 {
@@ -214,6 +183,46 @@ struct
         guint  timeout_id;
 } typedef HeldJob;
 
+struct
+{
+        gchar    *name;
+        gboolean  type_known;
+        gboolean  is_local;
+        gchar    *state_reasons;
+} typedef PrinterInfo;
+
+struct
+{
+        gchar *printer_name;
+        GsdPrintNotificationsManager *manager;
+} typedef PrinterLookup;
+
+struct
+{
+        gchar    *notify_subscribed_event;
+        gchar    *notify_text;
+        gchar    *notify_printer_uri;
+        gchar    *printer_name;
+        gint      printer_state;
+        gchar    *printer_state_reasons;
+        gboolean  printer_is_accepting_jobs;
+        guint     notify_job_id;
+        gint      job_state;
+        gchar    *job_state_reasons;
+        gchar    *job_name;
+        gint      job_impressions_completed;
+        gboolean  my_job;
+        gboolean  owner_pending;
+        gboolean  owner_requested;
+        GsdPrintNotificationsManager *manager;
+} typedef CupsNotification;
+
+struct
+{
+        GPtrArray *notifications;
+        GsdPrintNotificationsManager *manager;
+} typedef OwnerLookup;
+
 static void
 free_timeout_data (gpointer user_data)
 {
@@ -258,6 +267,35 @@ free_held_job (gpointer user_data)
         }
 }
 
+static void
+free_printer_info (gpointer user_data)
+{
+        PrinterInfo *printer = (PrinterInfo *) user_data;
+
+        if (printer != NULL) {
+                g_free (printer->name);
+                g_free (printer->state_reasons);
+                g_free (printer);
+        }
+}
+
+static void
+free_cups_notification (gpointer user_data)
+{
+        CupsNotification *notification = (CupsNotification *) user_data;
+
+        if (notification != NULL) {
+                g_free (notification->notify_subscribed_event);
+                g_free (notification->notify_text);
+                g_free (notification->notify_printer_uri);
+                g_free (notification->printer_name);
+                g_free (notification->printer_state_reasons);
+                g_free (notification->job_state_reasons);
+                g_free (notification->job_name);
+                g_free (notification);
+        }
+}
+
 static void
 notification_closed_cb (NotifyNotification *notification,
                         gpointer            user_data)
@@ -343,6 +381,17 @@ reason_is_blacklisted (const gchar *reason)
         return FALSE;
 }
 
+static gboolean
+notifier_timeout_cb (gpointer user_data)
+{
+        GsdPrintNotificationsManager *manager = user_data;
+
+        manager->priv->notifier_timeout_id = 0;
+        process_new_notifications (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
 static void
 on_cups_notification (GDBusConnection *connection,
                       const char      *sender_name,
@@ -352,6 +401,8 @@ on_cups_notification (GDBusConnection *connection,
                       GVariant        *parameters,
                       gpointer         user_data)
 {
+        GsdPrintNotificationsManager *manager = user_data;
+
         /* Ignore any signal starting with Server*. This has caused a message
          * storm through ServerAudit messages in the past, see
          *  https://gitlab.gnome.org/GNOME/gnome-settings-daemon/issues/62
@@ -359,7 +410,14 @@ on_cups_notification (GDBusConnection *connection,
         if (!signal_name || (strncmp (signal_name, "Server", 6) == 0))
                 return;
 
-        process_new_notifications (user_data);
+        /* Every subscription with a D-Bus recipient on the server, one per
+         * session, sends its own signal for the same event, so a burst of
+         * signals is answered with a single fetch. */
+        if (manager->priv->notifier_timeout_id == 0) {
+                manager->priv->notifier_timeout_id =
+                        g_timeout_add (NOTIFIER_COALESCE_TIMEOUT, notifier_timeout_cb, manager);
+                g_source_set_name_by_id (manager->priv->notifier_timeout_id, "[gnome-settings-daemon] notifier_timeout_cb");
+        }
 }
 
 static gchar *
@@ -472,19 +530,83 @@ unref_notification (NotifyNotification *notification,
         g_object_unref (notification);
 }
 
+static void
+check_job_for_authentication_cb (GObject      *source_object,
+                                 GAsyncResult *res,
+                                 gpointer      user_data)
+{
+        ipp_attribute_t *attr;
+        gboolean         needs_authentication = FALSE;
+        HeldJob         *job = user_data;
+        GError          *error = NULL;
+        gchar           *primary_text;
+        gchar           *secondary_text;
+        ipp_t           *response;
+        gint             i;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response != NULL) {
+                if (ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
+                        if ((attr = ippFindAttribute (response, "job-state-reasons", IPP_TAG_ZERO)) != NULL) {
+                                for (i = 0; i < ippGetCount (attr); i++) {
+                                        if (g_strcmp0 (ippGetString (attr, i, NULL), "cups-held-for-authentication") == 0) {
+                                                needs_authentication = TRUE;
+                                                break;
+                                        }
+                                }
+                        }
+
+                        if (!needs_authentication && (attr = ippFindAttribute (response, "job-hold-until", IPP_TAG_ZERO)) != NULL) {
+                                if (g_strcmp0 (ippGetString (attr, 0, NULL), "auth-info-required") == 0)
+                                        needs_authentication = TRUE;
+                        }
+                }
+
+                ippDelete (response);
+        } else {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Could not get attributes of job %u: %s", job->job_id, error->message);
+                g_error_free (error);
+        }
+
+        if (needs_authentication) {
+                NotifyNotification *notification;
+
+                /* Translators: The printer has a job to print but the printer needs authentication to continue with the print */
+                primary_text = g_strdup_printf (_("%s Requires Authentication"), job->printer_name);
+                /* Translators: A printer needs credentials to continue printing a job */
+                secondary_text = g_strdup_printf (_("Credentials required in order to print"));
+
+                notification = notify_notification_new (primary_text,
+                                                        secondary_text,
+                                                        "printer-symbolic");
+                notify_notification_set_app_name (notification, _("Printers"));
+                notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
+                notify_notification_add_action (notification,
+                                                "default",
+                                                /* This is a default action so the label won't be shown */
+                                                "Authenticate",
+                                                authenticate_cb,
+                                                g_strdup (job->printer_name), g_free);
+                g_signal_connect (notification, "closed", G_CALLBACK (unref_notification), NULL);
+
+                notify_notification_show (notification, NULL);
+
+                g_free (primary_text);
+                g_free (secondary_text);
+        }
+
+        free_held_job (job);
+}
+
 static gint
 check_job_for_authentication (gpointer userdata)
 {
         GsdPrintNotificationsManager *manager = userdata;
-        ipp_attribute_t              *attr;
         static gchar                 *requested_attributes[] = { "job-state-reasons", "job-hold-until", NULL };
-        gboolean                      needs_authentication = FALSE;
         HeldJob                      *job;
-        gchar                        *primary_text;
-        gchar                        *secondary_text;
         gchar                        *job_uri;
-        ipp_t                        *request, *response;
-        gint                          i;
+        ipp_t                        *request;
 
         if (manager->priv->held_jobs != NULL) {
                 job = (HeldJob *) manager->priv->held_jobs->data;
@@ -503,58 +625,409 @@ check_job_for_authentication (gpointer userdata)
                 ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
                                "requested-attributes", 2, NULL, (const char **) requested_attributes);
 
-                response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
-                if (response != NULL) {
-                        if (ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
-                                if ((attr = ippFindAttribute (response, "job-state-reasons", IPP_TAG_ZERO)) != NULL) {
-                                        for (i = 0; i < ippGetCount (attr); i++) {
-                                                if (g_strcmp0 (ippGetString (attr, i, NULL), "cups-held-for-authentication") == 0) {
-                                                        needs_authentication = TRUE;
-                                                        break;
-                                                }
-                                        }
-                                }
+                gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                           request,
+                                           "/",
+                                           manager->priv->cancellable,
+                                           check_job_for_authentication_cb,
+                                           job);
+        }
 
-                                if (!needs_authentication && (attr = ippFindAttribute (response, "job-hold-until", IPP_TAG_ZERO)) != NULL) {
-                                        if (g_strcmp0 (ippGetString (attr, 0, NULL), "auth-info-required") == 0)
-                                                needs_authentication = TRUE;
-                                }
+        return G_SOURCE_REMOVE;
+}
+
+static void
+show_transient_notification (const gchar *primary_text,
+                             const gchar *secondary_text)
+{
+        NotifyNotification *notification;
+
+        notification = notify_notification_new (primary_text,
+                                                secondary_text,
+                                                "printer-symbolic");
+        notify_notification_set_app_name (notification, _("Printers"));
+        notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
+        notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
+        notify_notification_show (notification, NULL);
+        g_object_unref (notification);
+}
+
+static gchar *
+get_joined_strings (ipp_attribute_t *attr)
+{
+        gchar **strings;
+        gchar  *joined;
+        gint    i;
+
+        strings = g_new0 (gchar *, ippGetCount (attr) + 1);
+        for (i = 0; i < ippGetCount (attr); i++)
+                strings[i] = g_strdup (ippGetString (attr, i, NULL));
+        joined = g_strjoinv (",", strings);
+        g_strfreev (strings);
+
+        return joined;
+}
+
+/* The printers are cached by queue name, with whether they are local
+ * worked out once when they are added. The cache is filled with one
+ * CUPS-Get-Printers request, then kept up to date from the printer-*
+ * events, so that a printer event costs at most a request for that one
+ * queue rather than the whole list of destinations.
+ */
+static void
+add_printers (GsdPrintNotificationsManager *manager,
+              ipp_t                        *response)
+{
+        ipp_attribute_t *attr;
+        PrinterInfo     *printer;
+        const char      *attr_name;
+
+        printer = g_new0 (PrinterInfo, 1);
+
+        /* Printer groups are separated by attributes without a name */
+        for (attr = ippFirstAttribute (response); ; attr = ippNextAttribute (response)) {
+                attr_name = attr != NULL ? ippGetName (attr) : NULL;
+
+                if (attr_name == NULL) {
+                        if (printer->name != NULL) {
+                                g_hash_table_replace (manager->priv->printers, printer->name, printer);
+                                printer = g_new0 (PrinterInfo, 1);
+                        } else {
+                                g_clear_pointer (&printer->state_reasons, g_free);
+                                printer->type_known = FALSE;
                         }
 
-                        ippDelete (response);
+                        if (attr == NULL)
+                                break;
+                } else if (g_strcmp0 (attr_name, "printer-name") == 0) {
+                        g_free (printer->name);
+                        printer->name = g_strdup (ippGetString (attr, 0, NULL));
+                } else if (g_strcmp0 (attr_name, "printer-type") == 0) {
+                        printer->type_known = TRUE;
+                        printer->is_local = !(ippGetInteger (attr, 0) & (CUPS_PRINTER_REMOTE | CUPS_PRINTER_IMPLICIT));
+                } else if (g_strcmp0 (attr_name, "printer-state-reasons") == 0) {
+                        g_free (printer->state_reasons);
+                        printer->state_reasons = get_joined_strings (attr);
                 }
+        }
+
+        free_printer_info (printer);
+}
 
-                if (needs_authentication) {
-                        NotifyNotification *notification;
-
-                        /* Translators: The printer has a job to print but the printer needs authentication to continue with the print */
-                        primary_text = g_strdup_printf (_("%s Requires Authentication"), job->printer_name);
-                        /* Translators: A printer needs credentials to continue printing a job */
-                        secondary_text = g_strdup_printf (_("Credentials required in order to print"));
-
-                        notification = notify_notification_new (primary_text,
-                                                                secondary_text,
-                                                                "printer-symbolic");
-                        notify_notification_set_app_name (notification, _("Printers"));
-                        notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
-                        notify_notification_add_action (notification,
-                                                        "default",
-                                                        /* This is a default action so the label won't be shown */
-                                                        "Authenticate",
-                                                        authenticate_cb,
-                                                        g_strdup (job->printer_name), g_free);
-                        g_signal_connect (notification, "closed", G_CALLBACK (unref_notification), NULL);
-
-                        notify_notification_show (notification, NULL);
-
-                        g_free (primary_text);
-                        g_free (secondary_text);
+static const char * const printer_attributes[] = {
+        "printer-name",
+        "printer-type",
+        "printer-state-reasons"
+};
+
+static void
+load_printers_cb (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+        GsdPrintNotificationsManager *manager = (GsdPrintNotificationsManager *) user_data;
+        GError                       *error = NULL;
+        ipp_t                        *response;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Could not get printers: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+
+        if (ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
+                g_hash_table_remove_all (manager->priv->printers);
+                add_printers (manager, response);
+                g_debug ("Got %u printers from CUPS server.", g_hash_table_size (manager->priv->printers));
+        }
+
+        ippDelete (response);
+}
+
+static void
+load_printers (GsdPrintNotificationsManager *manager)
+{
+        ipp_t *request;
+
+        request = ippNewRequest (CUPS_GET_PRINTERS);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+        ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                       "requested-attributes", G_N_ELEMENTS (printer_attributes),
+                       NULL, printer_attributes);
+
+        gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                   request,
+                                   "/",
+                                   manager->priv->cancellable,
+                                   load_printers_cb,
+                                   manager);
+}
+
+static void
+free_printer_lookup (PrinterLookup *lookup)
+{
+        g_free (lookup->printer_name);
+        g_free (lookup);
+}
+
+static void
+printer_added_cb (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+        PrinterLookup *lookup = user_data;
+        PrinterInfo   *printer;
+        GError        *error = NULL;
+        ipp_t         *response;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Could not get attributes of printer '%s': %s",
+                                 lookup->printer_name, error->message);
+                g_error_free (error);
+                free_printer_lookup (lookup);
+                return;
+        }
+
+        if (ippGetStatusCode (response) <= IPP_OK_CONFLICT)
+                add_printers (lookup->manager, response);
+        ippDelete (response);
+
+        printer = g_hash_table_lookup (lookup->manager->priv->printers, lookup->printer_name);
+        if (printer != NULL && printer->type_known && printer->is_local) {
+                /* Translators: New printer has been added */
+                show_transient_notification (_("Printer added"), lookup->printer_name);
+        }
+
+        free_printer_lookup (lookup);
+}
+
+static void
+printer_added (GsdPrintNotificationsManager *manager,
+               const char                   *printer_name,
+               const char                   *printer_uri)
+{
+        PrinterLookup *lookup;
+        PrinterInfo   *printer;
+        gchar         *uri = NULL;
+        ipp_t         *request;
+
+        if (printer_name == NULL)
+                return;
+
+        printer = g_hash_table_lookup (manager->priv->printers, printer_name);
+        if (printer != NULL && printer->type_known) {
+                if (printer->is_local) {
+                        /* Translators: New printer has been added */
+                        show_transient_notification (_("Printer added"), printer_name);
                 }
+                return;
+        }
 
-                free_held_job (job);
+        if (printer_uri == NULL) {
+                uri = g_strdup_printf ("ipp://localhost/printers/%s", printer_name);
+                printer_uri = uri;
         }
 
-        return G_SOURCE_REMOVE;
+        request = ippNewRequest (IPP_GET_PRINTER_ATTRIBUTES);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "printer-uri", NULL, printer_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+        ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                       "requested-attributes", G_N_ELEMENTS (printer_attributes),
+                       NULL, printer_attributes);
+
+        lookup = g_new0 (PrinterLookup, 1);
+        lookup->printer_name = g_strdup (printer_name);
+        lookup->manager = manager;
+
+        gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                   request,
+                                   "/",
+                                   manager->priv->cancellable,
+                                   printer_added_cb,
+                                   lookup);
+        g_free (uri);
+}
+
+static void
+update_printer_state_reasons (GsdPrintNotificationsManager *manager,
+                              const char                   *printer_name,
+                              const char                   *printer_state_reasons)
+{
+        PrinterInfo *printer;
+
+        printer = g_hash_table_lookup (manager->priv->printers, printer_name);
+        if (printer == NULL) {
+                printer = g_new0 (PrinterInfo, 1);
+                printer->name = g_strdup (printer_name);
+                g_hash_table_insert (manager->priv->printers, printer->name, printer);
+        }
+
+        g_free (printer->state_reasons);
+        printer->state_reasons = g_strdup (printer_state_reasons);
+}
+
+static gboolean
+is_handled_event (const char *notify_subscribed_event)
+{
+        return g_strcmp0 (notify_subscribed_event, "printer-added") == 0 ||
+               g_strcmp0 (notify_subscribed_event, "printer-deleted") == 0 ||
+               g_strcmp0 (notify_subscribed_event, "printer-state-changed") == 0 ||
+               g_strcmp0 (notify_subscribed_event, "job-completed") == 0 ||
+               g_strcmp0 (notify_subscribed_event, "job-state-changed") == 0 ||
+               g_strcmp0 (notify_subscribed_event, "job-created") == 0;
+}
+
+struct
+{
+        GsdPrintNotificationsManager *manager;
+        gchar                        *printer_name;
+        gchar                        *reason;
+} typedef UnknownReasonData;
+
+static void
+free_unknown_reason_data (UnknownReasonData *data)
+{
+        g_free (data->printer_name);
+        g_free (data->reason);
+        g_free (data);
+}
+
+/* Returns the descriptions of @reason found in the PPD file, if any */
+static gchar *
+localize_reason (const gchar *ppd_file_name,
+                 const gchar *reason)
+{
+        static const char * const schemes[] = {
+                "text", "http", "help", "file"
+        };
+        ppd_file_t  *ppd_file;
+        gchar      **tmpv;
+        gchar       *text = NULL;
+        char         buffer[8192];
+        gint         i, j;
+
+        ppd_file = ppdOpenFile (ppd_file_name);
+        if (ppd_file == NULL)
+                return NULL;
+
+        tmpv = g_new0 (gchar *, G_N_ELEMENTS (schemes) + 1);
+        i = 0;
+        for (j = 0; j < G_N_ELEMENTS (schemes); j++) {
+                if (ppdLocalizeIPPReason (ppd_file, reason, schemes[j], buffer, sizeof (buffer))) {
+                        tmpv[i++] = g_strdup (buffer);
+                }
+        }
+
+        if (i > 0)
+                text = g_strjoinv (", ", tmpv);
+        g_strfreev (tmpv);
+
+        ppdClose (ppd_file);
+
+        return text;
+}
+
+static void
+show_unknown_reason_notification (GsdPrintNotificationsManager *manager,
+                                  const gchar                  *printer_name,
+                                  const gchar                  *reason,
+                                  const gchar                  *text)
+{
+        NotifyNotification *notification;
+        ReasonData         *reason_data;
+        gchar              *first_row;
+        gchar              *second_row;
+
+        if (g_str_has_suffix (reason, "-report"))
+                /* Translators: This is a title of a report notification for a printer */
+                first_row = g_strdup (_("Printer report"));
+        else if (g_str_has_suffix (reason, "-warning"))
+                /* Translators: This is a title of a warning notification for a printer */
+                first_row = g_strdup (_("Printer warning"));
+        else
+                /* Translators: This is a title of an error notification for a printer */
+                first_row = g_strdup (_("Printer error"));
+
+        /* Translators: "Printer 'MyPrinterName': 'Description of the report/warning/error from a PPD file'." */
+        second_row = g_strdup_printf (_("Printer “%s”: “%s”."), printer_name, text != NULL ? text : reason);
+
+        notification = notify_notification_new (first_row,
+                                                second_row,
+                                                "printer-symbolic");
+        notify_notification_set_app_name (notification, _("Printers"));
+        notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
+        notify_notification_set_hint (notification,
+                                      "resident",
+                                      g_variant_new_boolean (TRUE));
+        notify_notification_set_timeout (notification, REASON_TIMEOUT);
+
+        reason_data = g_new0 (ReasonData, 1);
+        reason_data->printer_name = g_strdup (printer_name);
+        reason_data->reason = g_strdup (reason);
+        reason_data->notification = notification;
+        reason_data->manager = manager;
+
+        reason_data->notification_close_id =
+                g_signal_connect (notification,
+                                  "closed",
+                                  G_CALLBACK (notification_closed_cb),
+                                  reason_data);
+
+        manager->priv->active_notifications =
+                g_list_append (manager->priv->active_notifications, reason_data);
+
+        notify_notification_show (notification, NULL);
+
+        g_free (first_row);
+        g_free (second_row);
+}
+
+static void
+get_reason_ppd_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+        UnknownReasonData *data = user_data;
+        PrinterInfo       *printer;
+        GError            *error = NULL;
+        gchar             *ppd_file_name;
+        gchar             *text = NULL;
+        gchar            **state_reasons = NULL;
+
+        ppd_file_name = gsd_ipp_client_get_ppd_finish (res, &error);
+        if (ppd_file_name == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        free_unknown_reason_data (data);
+                        return;
+                }
+
+                g_debug ("No PPD file for printer %s: %s", data->printer_name, error->message);
+                g_error_free (error);
+        } else {
+                text = localize_reason (ppd_file_name, data->reason);
+                g_unlink (ppd_file_name);
+                g_free (ppd_file_name);
+        }
+
+        /* The reason may have gone away while the PPD file was fetched */
+        printer = g_hash_table_lookup (data->manager->priv->printers, data->printer_name);
+        if (printer != NULL && printer->state_reasons != NULL)
+                state_reasons = g_strsplit (printer->state_reasons, ",", -1);
+
+        if (state_reasons != NULL && g_strv_contains ((const gchar * const *) state_reasons, data->reason))
+                show_unknown_reason_notification (data->manager, data->printer_name, data->reason, text);
+
+        g_strfreev (state_reasons);
+        g_free (text);
+        free_unknown_reason_data (data);
 }
 
 static void
@@ -570,17 +1043,13 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
                            gint                          job_state,
                            const char                   *job_state_reasons,
                            const char                   *job_name,
-                           gint                          job_impressions_completed)
+                           gint                          job_impressions_completed,
+                           gboolean                      my_job)
 {
-        ipp_attribute_t *attr;
-        gboolean         my_job = FALSE;
         gboolean         known_reason;
         HeldJob         *held_job;
-        http_t          *http;
         gchar           *primary_text = NULL;
         gchar           *secondary_text = NULL;
-        gchar           *job_uri = NULL;
-        ipp_t           *request, *response;
         static const char * const reasons[] = {
                 "toner-low",
                 "toner-empty",
@@ -621,58 +1090,11 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
                 /* Translators: The printer has detected an error (same as in system-config-printer) */
                 N_("Printer error") };
 
-        if (g_strcmp0 (notify_subscribed_event, "printer-added") != 0 &&
-            g_strcmp0 (notify_subscribed_event, "printer-deleted") != 0 &&
-            g_strcmp0 (notify_subscribed_event, "printer-state-changed") != 0 &&
-            g_strcmp0 (notify_subscribed_event, "job-completed") != 0 &&
-            g_strcmp0 (notify_subscribed_event, "job-state-changed") != 0 &&
-            g_strcmp0 (notify_subscribed_event, "job-created") != 0)
-                return;
-
-        if (notify_job_id > 0) {
-                if ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                                cupsEncryption ())) == NULL) {
-                        g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
-                } else {
-                        job_uri = g_strdup_printf ("ipp://localhost/jobs/%d", notify_job_id);
-
-                        request = ippNewRequest (IPP_GET_JOB_ATTRIBUTES);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                      "job-uri", NULL, job_uri);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                     "requesting-user-name", NULL, cupsUser ());
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                                     "requested-attributes", NULL, "job-originating-user-name");
-                        response = cupsDoRequest (http, request, "/");
-
-                        if (response) {
-                                if (ippGetStatusCode (response) <= IPP_OK_CONFLICT &&
-                                    (attr = ippFindAttribute(response, "job-originating-user-name",
-                                                             IPP_TAG_NAME))) {
-                                        if (g_strcmp0 (ippGetString (attr, 0, NULL), cupsUser ()) == 0)
-                                                my_job = TRUE;
-                                }
-                                ippDelete(response);
-                        }
-                        g_free (job_uri);
-                        httpClose (http);
-                }
-        }
-
         if (g_strcmp0 (notify_subscribed_event, "printer-added") == 0) {
-                cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-
-                if (is_local_dest (printer_name,
-                                   manager->priv->dests,
-                                   manager->priv->num_dests)) {
-                        /* Translators: New printer has been added */
-                        primary_text = g_strdup (_("Printer added"));
-                        secondary_text = g_strdup (printer_name);
-                }
+                printer_added (manager, printer_name, notify_printer_uri);
         } else if (g_strcmp0 (notify_subscribed_event, "printer-deleted") == 0) {
-                cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
+                if (printer_name != NULL)
+                        g_hash_table_remove (manager->priv->printers, printer_name);
         } else if (g_strcmp0 (notify_subscribed_event, "job-completed") == 0 && my_job) {
                 g_hash_table_remove (manager->priv->printing_printers,
                                      printer_name);
@@ -775,8 +1197,7 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
                         secondary_text = g_strdup_printf (C_("print job", "“%s” on %s"), job_name, printer_name);
                 }
         } else if (g_strcmp0 (notify_subscribed_event, "printer-state-changed") == 0) {
-                cups_dest_t  *dest = NULL;
-                const gchar  *tmp_printer_state_reasons = NULL;
+                PrinterInfo  *printer;
                 GSList       *added_reasons = NULL;
                 GSList       *tmp_list = NULL;
                 GList        *tmp;
@@ -831,32 +1252,15 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
 
                 /* Check whether we are printing on this printer right now. */
                 if (g_hash_table_lookup_extended (manager->priv->printing_printers, printer_name, NULL, NULL)) {
-                        dest = cupsGetDest (printer_name,
-                                            NULL,
-                                            manager->priv->num_dests,
-                                            manager->priv->dests);
-                        if (dest)
-                                tmp_printer_state_reasons = cupsGetOption ("printer-state-reasons",
-                                                                           dest->num_options,
-                                                                           dest->options);
-
-                        if (tmp_printer_state_reasons)
-                                old_state_reasons = g_strsplit (tmp_printer_state_reasons, ",", -1);
-
-                        cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                        manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-
-                        dest = cupsGetDest (printer_name,
-                                            NULL,
-                                            manager->priv->num_dests,
-                                            manager->priv->dests);
-                        if (dest)
-                                tmp_printer_state_reasons = cupsGetOption ("printer-state-reasons",
-                                                                           dest->num_options,
-                                                                           dest->options);
-
-                        if (tmp_printer_state_reasons)
-                                new_state_reasons = g_strsplit (tmp_printer_state_reasons, ",", -1);
+                        printer = g_hash_table_lookup (manager->priv->printers, printer_name);
+                        if (printer != NULL && printer->state_reasons != NULL)
+                                old_state_reasons = g_strsplit (printer->state_reasons, ",", -1);
+
+                        /* The event carries the new reasons */
+                        if (printer_state_reasons != NULL)
+                                new_state_reasons = g_strsplit (printer_state_reasons, ",", -1);
+
+                        update_printer_state_reasons (manager, printer_name, printer_state_reasons);
 
                         if (new_state_reasons)
                                 qsort (new_state_reasons,
@@ -948,92 +1352,19 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
 
                                 if (!known_reason &&
                                     !reason_is_blacklisted (data)) {
-                                        NotifyNotification *notification;
-                                        ReasonData         *reason_data;
-                                        gchar              *first_row;
-                                        gchar              *second_row;
-                                        gchar              *text = NULL;
-                                        gchar              *ppd_file_name;
-                                        ppd_file_t         *ppd_file;
-                                        char                buffer[8192];
-
-                                        ppd_file_name = g_strdup (cupsGetPPD (printer_name));
-                                        if (ppd_file_name) {
-                                                ppd_file = ppdOpenFile (ppd_file_name);
-                                                if (ppd_file) {
-                                                        gchar **tmpv;
-                                                        static const char * const schemes[] = {
-                                                                "text", "http", "help", "file"
-                                                        };
-
-                                                        tmpv = g_new0 (gchar *, G_N_ELEMENTS (schemes) + 1);
-                                                        i = 0;
-                                                        for (j = 0; j < G_N_ELEMENTS (schemes); j++) {
-                                                                if (ppdLocalizeIPPReason (ppd_file, data, schemes[j], buffer, sizeof (buffer))) {
-                                                                        tmpv[i++] = g_strdup (buffer);
-                                                                }
-                                                        }
-
-                                                        if (i > 0)
-                                                                text = g_strjoinv (", ", tmpv);
-                                                        g_strfreev (tmpv);
-
-                                                        ppdClose (ppd_file);
-                                                }
-
-                                                g_unlink (ppd_file_name);
-                                                g_free (ppd_file_name);
-                                        }
-
-
-                                        if (g_str_has_suffix (data, "-report"))
-                                                /* Translators: This is a title of a report notification for a printer */
-                                                first_row = g_strdup (_("Printer report"));
-                                        else if (g_str_has_suffix (data, "-warning"))
-                                                /* Translators: This is a title of a warning notification for a printer */
-                                                first_row = g_strdup (_("Printer warning"));
-                                        else
-                                                /* Translators: This is a title of an error notification for a printer */
-                                                first_row = g_strdup (_("Printer error"));
-
-
-                                        if (text == NULL)
-                                                text = g_strdup (data);
+                                        UnknownReasonData *reason_data;
 
-                                        /* Translators: "Printer 'MyPrinterName': 'Description of the report/warning/error from a PPD file'." */
-                                        second_row = g_strdup_printf (_("Printer “%s”: “%s”."), printer_name, text);
-                                        g_free (text);
-
-
-                                        notification = notify_notification_new (first_row,
-                                                                                second_row,
-                                                                                "printer-symbolic");
-                                        notify_notification_set_app_name (notification, _("Printers"));
-                                        notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
-                                        notify_notification_set_hint (notification,
-                                                                      "resident",
-                                                                      g_variant_new_boolean (TRUE));
-                                        notify_notification_set_timeout (notification, REASON_TIMEOUT);
-
-                                        reason_data = g_new0 (ReasonData, 1);
+                                        /* Looked up in the PPD file, which is fetched over HTTP */
+                                        reason_data = g_new0 (UnknownReasonData, 1);
+                                        reason_data->manager = manager;
                                         reason_data->printer_name = g_strdup (printer_name);
                                         reason_data->reason = g_strdup (data);
-                                        reason_data->notification = notification;
-                                        reason_data->manager = manager;
-
-                                        reason_data->notification_close_id =
-                                                g_signal_connect (notification,
-                                                                  "closed",
-                                                                  G_CALLBACK (notification_closed_cb),
-                                                                  reason_data);
-
-                                        manager->priv->active_notifications =
-                                                g_list_append (manager->priv->active_notifications, reason_data);
-
-                                        notify_notification_show (notification, NULL);
 
-                                        g_free (first_row);
-                                        g_free (second_row);
+                                        gsd_ipp_client_get_ppd_async (manager->priv->ipp_client,
+                                                                      printer_name,
+                                                                      manager->priv->cancellable,
+                                                                      get_reason_ppd_cb,
+                                                                      reason_data);
                                 }
                         }
                         g_slist_free (added_reasons);
@@ -1048,65 +1379,312 @@ process_cups_notification (GsdPrintNotificationsManager *manager,
 
 
         if (primary_text) {
-                NotifyNotification *notification;
-                notification = notify_notification_new (primary_text,
-                                                        secondary_text,
-                                                        "printer-symbolic");
-                notify_notification_set_app_name (notification, _("Printers"));
-                notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
-                notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
-                notify_notification_show (notification, NULL);
-                g_object_unref (notification);
+                show_transient_notification (primary_text, secondary_text);
                 g_free (primary_text);
                 g_free (secondary_text);
         }
 }
 
-static gboolean
-process_new_notifications (gpointer user_data)
+/* Notifications are processed in the order CUPS sent them, each one
+ * waiting for the owner of its job to be known.
+ */
+static void
+dispatch_cups_notifications (GsdPrintNotificationsManager *manager)
 {
-        GsdPrintNotificationsManager  *manager = (GsdPrintNotificationsManager *) user_data;
-        ipp_attribute_t               *attr;
-        const gchar                   *notify_subscribed_event = NULL;
-        const gchar                   *printer_name = NULL;
-        const gchar                   *notify_text = NULL;
-        const gchar                   *notify_printer_uri = NULL;
-        const gchar                   *job_state_reasons = NULL;
-        const gchar                   *job_name = NULL;
-        const char                    *attr_name;
-        gboolean                       printer_is_accepting_jobs = FALSE;
-        gchar                         *printer_state_reasons = NULL;
-        gchar                        **reasons;
-        guint                          notify_job_id = 0;
-        ipp_t                         *request;
-        ipp_t                         *response;
-        gint                           printer_state = -1;
-        gint                           job_state = -1;
-        gint                           job_impressions_completed = -1;
-        gint                           notify_sequence_number = -1;
-        gint                           i;
+        CupsNotification *notification;
 
-        request = ippNewRequest (IPP_GET_NOTIFICATIONS);
+        while ((notification = g_queue_peek_head (manager->priv->notifications)) != NULL &&
+               !notification->owner_pending) {
+                g_queue_pop_head (manager->priv->notifications);
+
+                process_cups_notification (manager,
+                                           notification->notify_subscribed_event,
+                                           notification->notify_text,
+                                           notification->notify_printer_uri,
+                                           notification->printer_name,
+                                           notification->printer_state,
+                                           notification->printer_state_reasons,
+                                           notification->printer_is_accepting_jobs,
+                                           notification->notify_job_id,
+                                           notification->job_state,
+                                           notification->job_state_reasons,
+                                           notification->job_name,
+                                           notification->job_impressions_completed,
+                                           notification->my_job);
+
+                free_cups_notification (notification);
+        }
+}
+
+static void
+job_owner_cb (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+        CupsNotification *notification = user_data;
+        ipp_attribute_t  *attr;
+        GError           *error = NULL;
+        ipp_t            *response;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        /* The notification went away with the manager */
+                        g_error_free (error);
+                        return;
+                }
+
+                g_debug ("Could not get owner of job %u: %s", notification->notify_job_id, error->message);
+                g_error_free (error);
+        } else {
+                if (ippGetStatusCode (response) <= IPP_OK_CONFLICT &&
+                    (attr = ippFindAttribute (response, "job-originating-user-name",
+                                              IPP_TAG_NAME))) {
+                        if (g_strcmp0 (ippGetString (attr, 0, NULL), cupsUser ()) == 0)
+                                notification->my_job = TRUE;
+                }
+                ippDelete (response);
+        }
+
+        notification->owner_pending = FALSE;
+        dispatch_cups_notifications (notification->manager);
+}
+
+static void
+queue_cups_notification (GsdPrintNotificationsManager *manager,
+                         CupsNotification             *notification)
+{
+        if (notification->notify_subscribed_event == NULL ||
+            !is_handled_event (notification->notify_subscribed_event)) {
+                free_cups_notification (notification);
+                return;
+        }
 
+        /* The owner of the job is looked up for the whole batch */
+        notification->owner_pending = notification->notify_job_id > 0;
+
+        g_queue_push_tail (manager->priv->notifications, notification);
+}
+
+static void
+lookup_job_owner (GsdPrintNotificationsManager *manager,
+                  CupsNotification             *notification)
+{
+        gchar *job_uri;
+        ipp_t *request;
+
+        job_uri = g_strdup_printf ("ipp://localhost/jobs/%d", notification->notify_job_id);
+
+        request = ippNewRequest (IPP_GET_JOB_ATTRIBUTES);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "job-uri", NULL, job_uri);
         ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                      "requesting-user-name", NULL, cupsUser ());
+                     "requesting-user-name", NULL, cupsUser ());
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                     "requested-attributes", NULL, "job-originating-user-name");
+
+        gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                   request,
+                                   "/",
+                                   manager->priv->cancellable,
+                                   job_owner_cb,
+                                   notification);
+        g_free (job_uri);
+}
 
-        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                       "notify-subscription-ids", manager->priv->subscription_id);
+static void
+free_owner_lookup (OwnerLookup *lookup)
+{
+        g_ptr_array_free (lookup->notifications, TRUE);
+        g_free (lookup);
+}
 
-        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
-                      "/printers/");
+static void
+job_owners_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+        OwnerLookup      *lookup = user_data;
+        CupsNotification *notification;
+        ipp_attribute_t  *attr;
+        GHashTable       *my_jobs;
+        const char       *attr_name;
+        const char       *owner = NULL;
+        GError           *error = NULL;
+        ipp_t            *response;
+        gint              job_id = 0;
+        guint             i;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        /* The notifications went away with the manager */
+                        g_error_free (error);
+                        free_owner_lookup (lookup);
+                        return;
+                }
 
-        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI, "job-uri", NULL,
-                      "/jobs/");
+                g_debug ("Could not get owners of jobs: %s", error->message);
+                g_error_free (error);
+        } else if (ippGetStatusCode (response) > IPP_OK_CONFLICT) {
+                /* Servers which predate job-ids get asked job by job */
+                g_debug ("Get-Jobs with job-ids failed: %s, looking up jobs one by one",
+                         ippErrorString (ippGetStatusCode (response)));
 
-        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                       "notify-sequence-numbers",
-                       manager->priv->last_notify_sequence_number + 1);
+                for (i = 0; i < lookup->notifications->len; i++)
+                        lookup_job_owner (lookup->manager, g_ptr_array_index (lookup->notifications, i));
+
+                ippDelete (response);
+                free_owner_lookup (lookup);
+                return;
+        }
+
+        /* Job groups are separated by attributes without a name */
+        my_jobs = g_hash_table_new (NULL, NULL);
+        for (attr = ippFirstAttribute (response); ; attr = ippNextAttribute (response)) {
+                attr_name = attr != NULL ? ippGetName (attr) : NULL;
+
+                if (attr_name == NULL) {
+                        if (job_id > 0 && g_strcmp0 (owner, cupsUser ()) == 0)
+                                g_hash_table_add (my_jobs, GINT_TO_POINTER (job_id));
+                        job_id = 0;
+                        owner = NULL;
+
+                        if (attr == NULL)
+                                break;
+                } else if (g_strcmp0 (attr_name, "job-id") == 0) {
+                        job_id = ippGetInteger (attr, 0);
+                } else if (g_strcmp0 (attr_name, "job-originating-user-name") == 0) {
+                        owner = ippGetString (attr, 0, NULL);
+                }
+        }
+
+        for (i = 0; i < lookup->notifications->len; i++) {
+                notification = g_ptr_array_index (lookup->notifications, i);
+                notification->my_job = g_hash_table_contains (my_jobs,
+                                                              GINT_TO_POINTER (notification->notify_job_id));
+                notification->owner_pending = FALSE;
+        }
+
+        g_hash_table_destroy (my_jobs);
+        if (response != NULL)
+                ippDelete (response);
+
+        dispatch_cups_notifications (lookup->manager);
+        free_owner_lookup (lookup);
+}
+
+/* A burst of job events costs a single Get-Jobs request for all the jobs
+ * involved, rather than one Get-Job-Attributes request per event.
+ */
+static void
+lookup_job_owners (GsdPrintNotificationsManager *manager)
+{
+        static const char * const requested_attributes[] = { "job-id", "job-originating-user-name" };
+        CupsNotification *notification;
+        OwnerLookup      *lookup;
+        GHashTable       *job_ids;
+        GArray           *ids;
+        GList            *l;
+        ipp_t            *request;
+        gint              job_id;
+
+        lookup = g_new0 (OwnerLookup, 1);
+        lookup->manager = manager;
+        lookup->notifications = g_ptr_array_new ();
+
+        job_ids = g_hash_table_new (NULL, NULL);
+        ids = g_array_new (FALSE, FALSE, sizeof (int));
+
+        for (l = manager->priv->notifications->head; l != NULL; l = l->next) {
+                notification = l->data;
+
+                if (!notification->owner_pending || notification->owner_requested)
+                        continue;
+
+                notification->owner_requested = TRUE;
+                g_ptr_array_add (lookup->notifications, notification);
+
+                job_id = notification->notify_job_id;
+                if (!g_hash_table_contains (job_ids, GINT_TO_POINTER (job_id))) {
+                        g_hash_table_add (job_ids, GINT_TO_POINTER (job_id));
+                        g_array_append_val (ids, job_id);
+                }
+        }
+
+        if (lookup->notifications->len == 0) {
+                free_owner_lookup (lookup);
+        } else {
+                request = ippNewRequest (IPP_GET_JOBS);
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                              "printer-uri", NULL, "ipp://localhost/");
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                              "requesting-user-name", NULL, cupsUser ());
+                ippAddIntegers (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                                "job-ids", ids->len, (const int *) ids->data);
+                ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                               "requested-attributes", G_N_ELEMENTS (requested_attributes),
+                               NULL, requested_attributes);
+
+                gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                           request,
+                                           "/",
+                                           manager->priv->cancellable,
+                                           job_owners_cb,
+                                           lookup);
+        }
+
+        g_array_free (ids, TRUE);
+        g_hash_table_destroy (job_ids);
+}
+
+static CupsNotification *
+cups_notification_new (GsdPrintNotificationsManager *manager)
+{
+        CupsNotification *notification;
+
+        notification = g_new0 (CupsNotification, 1);
+        notification->printer_state = -1;
+        notification->job_state = -1;
+        notification->job_impressions_completed = -1;
+        notification->manager = manager;
+
+        return notification;
+}
+
+static void
+process_new_notifications_cb (GObject      *source_object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
+{
+        GsdPrintNotificationsManager  *manager = (GsdPrintNotificationsManager *) user_data;
+        CupsNotification              *notification;
+        ipp_attribute_t               *attr;
+        const char                    *attr_name;
+        GError                        *error = NULL;
+        ipp_t                         *response;
+        gint                           notify_sequence_number;
+        gint                           last_sequence_number;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        return;
+                }
+
+                g_debug ("Could not get notifications: %s", error->message);
+                g_error_free (error);
+        }
 
+        manager->priv->fetching_notifications = FALSE;
+        last_sequence_number = manager->priv->last_notify_sequence_number;
 
-        response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
+        /* How often the server would like to be polled */
+        if ((attr = ippFindAttribute (response, "notify-get-interval", IPP_TAG_INTEGER)) != NULL)
+                manager->priv->server_check_interval = ippGetInteger (attr, 0);
 
+        notification = cups_notification_new (manager);
 
         for (attr = ippFindAttribute (response, "notify-sequence-number", IPP_TAG_INTEGER);
              attr != NULL;
@@ -1119,94 +1697,144 @@ process_new_notifications (gpointer user_data)
                         if (notify_sequence_number > manager->priv->last_notify_sequence_number)
                                 manager->priv->last_notify_sequence_number = notify_sequence_number;
 
-                        if (notify_subscribed_event != NULL) {
-                                process_cups_notification (manager,
-                                                           notify_subscribed_event,
-                                                           notify_text,
-                                                           notify_printer_uri,
-                                                           printer_name,
-                                                           printer_state,
-                                                           printer_state_reasons,
-                                                           printer_is_accepting_jobs,
-                                                           notify_job_id,
-                                                           job_state,
-                                                           job_state_reasons,
-                                                           job_name,
-                                                           job_impressions_completed);
-
-                                g_clear_pointer (&printer_state_reasons, g_free);
-                                g_clear_pointer (&job_state_reasons, g_free);
-                        }
-
-                        notify_subscribed_event = NULL;
-                        notify_text = NULL;
-                        notify_printer_uri = NULL;
-                        printer_name = NULL;
-                        printer_state = -1;
-                        printer_state_reasons = NULL;
-                        printer_is_accepting_jobs = FALSE;
-                        notify_job_id = 0;
-                        job_state = -1;
-                        job_state_reasons = NULL;
-                        job_name = NULL;
-                        job_impressions_completed = -1;
+                        queue_cups_notification (manager, notification);
+                        notification = cups_notification_new (manager);
                 } else if (g_strcmp0 (attr_name, "notify-subscribed-event") == 0) {
-                        notify_subscribed_event = ippGetString (attr, 0, NULL);
+                        g_free (notification->notify_subscribed_event);
+                        notification->notify_subscribed_event = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "notify-text") == 0) {
-                        notify_text = ippGetString (attr, 0, NULL);
+                        g_free (notification->notify_text);
+                        notification->notify_text = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "notify-printer-uri") == 0) {
-                        notify_printer_uri = ippGetString (attr, 0, NULL);
+                        g_free (notification->notify_printer_uri);
+                        notification->notify_printer_uri = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "printer-name") == 0) {
-                        printer_name = ippGetString (attr, 0, NULL);
+                        g_free (notification->printer_name);
+                        notification->printer_name = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "printer-state") == 0) {
-                        printer_state = ippGetInteger (attr, 0);
+                        notification->printer_state = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "printer-state-reasons") == 0) {
-                        reasons = g_new0 (gchar *, ippGetCount (attr) + 1);
-                        for (i = 0; i < ippGetCount (attr); i++)
-                                reasons[i] = g_strdup (ippGetString (attr, i, NULL));
-                        printer_state_reasons = g_strjoinv (",", reasons);
-                        g_strfreev (reasons);
+                        g_free (notification->printer_state_reasons);
+                        notification->printer_state_reasons = get_joined_strings (attr);
                 } else if (g_strcmp0 (attr_name, "printer-is-accepting-jobs") == 0) {
-                        printer_is_accepting_jobs = ippGetBoolean (attr, 0);
+                        notification->printer_is_accepting_jobs = ippGetBoolean (attr, 0);
                 } else if (g_strcmp0 (attr_name, "notify-job-id") == 0) {
-                        notify_job_id = ippGetInteger (attr, 0);
+                        notification->notify_job_id = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "job-state") == 0) {
-                        job_state = ippGetInteger (attr, 0);
+                        notification->job_state = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "job-state-reasons") == 0) {
-                        reasons = g_new0 (gchar *, ippGetCount (attr) + 1);
-                        for (i = 0; i < ippGetCount (attr); i++)
-                                reasons[i] = g_strdup (ippGetString (attr, i, NULL));
-                        job_state_reasons = g_strjoinv (",", reasons);
-                        g_strfreev (reasons);
+                        g_free (notification->job_state_reasons);
+                        notification->job_state_reasons = get_joined_strings (attr);
                 } else if (g_strcmp0 (attr_name, "job-name") == 0) {
-                        job_name = ippGetString (attr, 0, NULL);
+                        g_free (notification->job_name);
+                        notification->job_name = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "job-impressions-completed") == 0) {
-                        job_impressions_completed = ippGetInteger (attr, 0);
+                        notification->job_impressions_completed = ippGetInteger (attr, 0);
                 }
         }
 
-        if (notify_subscribed_event != NULL) {
-                process_cups_notification (manager,
-                                           notify_subscribed_event,
-                                           notify_text,
-                                           notify_printer_uri,
-                                           printer_name,
-                                           printer_state,
-                                           printer_state_reasons,
-                                           printer_is_accepting_jobs,
-                                           notify_job_id,
-                                           job_state,
-                                           job_state_reasons,
-                                           job_name,
-                                           job_impressions_completed);
-
-                g_clear_pointer (&printer_state_reasons, g_free);
-                g_clear_pointer (&job_state_reasons, g_free);
-        }
+        queue_cups_notification (manager, notification);
 
         if (response != NULL)
                 ippDelete (response);
 
+        lookup_job_owners (manager);
+        dispatch_cups_notifications (manager);
+
+        /* Signals which arrived while fetching may be about events
+         * which were not part of the response */
+        if (manager->priv->fetch_again) {
+                manager->priv->fetch_again = FALSE;
+                process_new_notifications (manager);
+        }
+
+        if (manager->priv->poll_notifications && !manager->priv->fetching_notifications) {
+                /* Poll less and less often while nothing happens and none
+                 * of our jobs is printing, and quickly again once the
+                 * sequence moves */
+                if (manager->priv->last_notify_sequence_number != last_sequence_number ||
+                    g_hash_table_size (manager->priv->printing_printers) > 0 ||
+                    manager->priv->held_jobs != NULL)
+                        manager->priv->check_interval = CHECK_INTERVAL;
+                else
+                        manager->priv->check_interval = MIN (manager->priv->check_interval * 2,
+                                                             CHECK_MAX_INTERVAL);
+
+                schedule_notifications_check (manager);
+        }
+}
+
+static gboolean
+check_notifications_cb (gpointer user_data)
+{
+        GsdPrintNotificationsManager *manager = user_data;
+
+        manager->priv->check_source_id = 0;
+        process_new_notifications (manager);
+
+        /* Nothing was sent, try again later */
+        if (!manager->priv->fetching_notifications)
+                schedule_notifications_check (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Only used when the server cannot signal new events over D-Bus */
+static void
+schedule_notifications_check (GsdPrintNotificationsManager *manager)
+{
+        guint interval;
+
+        if (manager->priv->check_source_id > 0)
+                g_source_remove (manager->priv->check_source_id);
+
+        interval = MAX (manager->priv->check_interval, manager->priv->server_check_interval);
+        manager->priv->check_source_id = g_timeout_add_seconds (interval, check_notifications_cb, manager);
+        g_source_set_name_by_id (manager->priv->check_source_id, "[gnome-settings-daemon] check_notifications_cb");
+}
+
+static gboolean
+process_new_notifications (gpointer user_data)
+{
+        GsdPrintNotificationsManager  *manager = (GsdPrintNotificationsManager *) user_data;
+        ipp_t                         *request;
+
+        if (manager->priv->subscription_id < 0)
+                return TRUE;
+
+        /* Only one fetch at a time, so that the same sequence number
+         * is not asked for twice */
+        if (manager->priv->fetching_notifications) {
+                manager->priv->fetch_again = TRUE;
+                return TRUE;
+        }
+
+        request = ippNewRequest (IPP_GET_NOTIFICATIONS);
+
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+
+        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                       "notify-subscription-ids", manager->priv->subscription_id);
+
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
+                      "/printers/");
+
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI, "job-uri", NULL,
+                      "/jobs/");
+
+        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                       "notify-sequence-numbers",
+                       manager->priv->last_notify_sequence_number + 1);
+
+        manager->priv->fetching_notifications = TRUE;
+        gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                   request,
+                                   "/",
+                                   manager->priv->cancellable,
+                                   process_new_notifications_cb,
+                                   manager);
+
         return TRUE;
 }
 
@@ -1243,34 +1871,84 @@ scp_handler (GsdPrintNotificationsManager *manager,
 }
 
 static void
-cancel_subscription (gint id)
+cancel_subscription (GsdPrintNotificationsManager *manager)
 {
-        http_t *http;
         ipp_t  *request;
 
-        if (id >= 0 &&
-            ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                        cupsEncryption ())) != NULL)) {
+        if (manager->priv->subscription_id >= 0) {
                 request = ippNewRequest (IPP_CANCEL_SUBSCRIPTION);
                 ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
                              "printer-uri", NULL, "/");
                 ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
                              "requesting-user-name", NULL, cupsUser ());
                 ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                              "notify-subscription-id", id);
-                ippDelete (cupsDoRequest (http, request, "/"));
-                httpClose (http);
+                              "notify-subscription-id", manager->priv->subscription_id);
+
+                /* Not cancellable, this is sent on the way out */
+                gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                           request,
+                                           "/",
+                                           NULL,
+                                           NULL,
+                                           NULL);
+
+                manager->priv->subscription_id = -1;
+        }
+}
+
+static void
+renew_subscription_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+        GError *error = NULL;
+        ipp_t  *response;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Could not renew subscription: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+
+        ippDelete (response);
+}
+
+static void
+create_subscription_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+        GsdPrintNotificationsManager *manager = (GsdPrintNotificationsManager *) user_data;
+        ipp_attribute_t              *attr = NULL;
+        GError                       *error = NULL;
+        ipp_t                        *response;
+
+        response = gsd_ipp_client_send_finish (res, &error);
+        if (response == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Could not create subscription: %s", error->message);
+                g_error_free (error);
+                return;
         }
+
+        if (ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
+                if ((attr = ippFindAttribute (response, "notify-subscription-id",
+                                              IPP_TAG_INTEGER)) == NULL)
+                        g_debug ("No notify-subscription-id in response!\n");
+                else
+                        manager->priv->subscription_id = ippGetInteger (attr, 0);
+        }
+
+        ippDelete (response);
 }
 
 static gboolean
 renew_subscription (gpointer data)
 {
         GsdPrintNotificationsManager *manager = (GsdPrintNotificationsManager *) data;
-        ipp_attribute_t              *attr = NULL;
-        http_t                       *http;
         ipp_t                        *request;
-        ipp_t                        *response;
         gint                          num_events = 7;
         static const char * const events[] = {
                 "job-created",
@@ -1281,53 +1959,47 @@ renew_subscription (gpointer data)
                 "printer-deleted",
                 "printer-state-changed"};
 
-        if ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                        cupsEncryption ())) == NULL) {
-                g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
+        if (manager->priv->subscription_id >= 0) {
+                request = ippNewRequest (IPP_RENEW_SUBSCRIPTION);
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                             "printer-uri", NULL, "/");
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                             "requesting-user-name", NULL, cupsUser ());
+                ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                              "notify-subscription-id", manager->priv->subscription_id);
+                ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
+                              "notify-lease-duration", SUBSCRIPTION_DURATION);
+                gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                           request,
+                                           "/",
+                                           manager->priv->cancellable,
+                                           renew_subscription_cb,
+                                           manager);
         } else {
-                if (manager->priv->subscription_id >= 0) {
-                        request = ippNewRequest (IPP_RENEW_SUBSCRIPTION);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                     "printer-uri", NULL, "/");
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                     "requesting-user-name", NULL, cupsUser ());
-                        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                                      "notify-subscription-id", manager->priv->subscription_id);
-                        ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
-                                      "notify-lease-duration", SUBSCRIPTION_DURATION);
-                        ippDelete (cupsDoRequest (http, request, "/"));
-                } else {
-                        request = ippNewRequest (IPP_CREATE_PRINTER_SUBSCRIPTION);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                      "printer-uri", NULL,
-                                      "/");
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                      "requesting-user-name", NULL, cupsUser ());
-                        ippAddStrings (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
-                                       "notify-events", num_events, NULL, events);
-                        ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
-                                      "notify-pull-method", NULL, "ippget");
-                        if (server_is_local (cupsServer ())) {
-                                ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_URI,
-                                              "notify-recipient-uri", NULL, "dbus://");
-                        }
-                        ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
-                                       "notify-lease-duration", SUBSCRIPTION_DURATION);
-                        response = cupsDoRequest (http, request, "/");
-
-                        if (response != NULL && ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
-                                if ((attr = ippFindAttribute (response, "notify-subscription-id",
-                                                              IPP_TAG_INTEGER)) == NULL)
-                                        g_debug ("No notify-subscription-id in response!\n");
-                                else
-                                        manager->priv->subscription_id = ippGetInteger (attr, 0);
-                        }
-
-                        if (response)
-                                ippDelete (response);
+                request = ippNewRequest (IPP_CREATE_PRINTER_SUBSCRIPTION);
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                              "printer-uri", NULL,
+                              "/");
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                              "requesting-user-name", NULL, cupsUser ());
+                ippAddStrings (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+                               "notify-events", num_events, NULL, events);
+                ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+                              "notify-pull-method", NULL, "ippget");
+                if (server_is_local (cupsServer ())) {
+                        ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_URI,
+                                      "notify-recipient-uri", NULL, "dbus://");
                 }
-                httpClose (http);
+                ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
+                               "notify-lease-duration", SUBSCRIPTION_DURATION);
+                gsd_ipp_client_send_async (manager->priv->ipp_client,
+                                           request,
+                                           "/",
+                                           manager->priv->cancellable,
+                                           create_subscription_cb,
+                                           manager);
         }
+
         return TRUE;
 }
 
@@ -1351,13 +2023,16 @@ renew_subscription_with_connection_test_cb (GObject      *source_object,
 
                 renew_subscription (user_data);
         } else {
-                g_debug ("Test connection to CUPS server \'%s:%d\' failed.", cupsServer (), ippPort ());
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_debug ("Test connection to CUPS server \'%s:%d\' failed.", cupsServer (), ippPort ());
+                g_error_free (error);
         }
 }
 
 static gboolean
 renew_subscription_with_connection_test (gpointer user_data)
 {
+        GsdPrintNotificationsManager *manager = (GsdPrintNotificationsManager *) user_data;
         GSocketClient *client;
         gchar         *address;
         int            port;
@@ -1374,7 +2049,7 @@ renew_subscription_with_connection_test (gpointer user_data)
                 g_socket_client_connect_to_host_async (client,
                                                        address,
                                                        port,
-                                                       NULL,
+                                                       manager->priv->cancellable,
                                                        renew_subscription_with_connection_test_cb,
                                                        user_data);
 
@@ -1435,18 +2110,26 @@ cups_connection_test_cb (GObject      *source_object,
                 g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
                 g_object_unref (connection);
 
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-                g_debug ("Got dests from remote CUPS server.");
+                manager->priv->cups_connected = TRUE;
+                load_printers (manager);
 
+                /* A remote server cannot reach us over D-Bus */
                 renew_subscription_timeout_enable (manager, TRUE, TRUE);
-                manager->priv->check_source_id = g_timeout_add_seconds (CHECK_INTERVAL, process_new_notifications, manager);
-                g_source_set_name_by_id (manager->priv->check_source_id, "[gnome-settings-daemon] process_new_notifications");
+                manager->priv->poll_notifications = TRUE;
+                schedule_notifications_check (manager);
+        } else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_error_free (error);
         } else {
                 g_debug ("Test connection to CUPS server \'%s:%d\' failed.", cupsServer (), ippPort ());
+                g_error_free (error);
+
+                /* Back off while the server stays unreachable */
                 if (manager->priv->cups_connection_timeout_id == 0) {
                         manager->priv->cups_connection_timeout_id =
-                                g_timeout_add_seconds (CUPS_CONNECTION_TEST_INTERVAL, cups_connection_test, manager);
+                                g_timeout_add_seconds (manager->priv->cups_connection_test_interval, cups_connection_test, manager);
                         g_source_set_name_by_id (manager->priv->cups_connection_timeout_id, "[gnome-settings-daemon] cups_connection_test");
+                        manager->priv->cups_connection_test_interval = MIN (manager->priv->cups_connection_test_interval * 2,
+                                                                            CUPS_CONNECTION_TEST_MAX_INTERVAL);
                 }
         }
 }
@@ -1459,7 +2142,9 @@ cups_connection_test (gpointer user_data)
         gchar                        *address;
         int                           port = ippPort ();
 
-        if (!manager->priv->dests) {
+        manager->priv->cups_connection_timeout_id = 0;
+
+        if (!manager->priv->cups_connected) {
                 address = g_strdup_printf ("%s:%d", cupsServer (), port);
 
                 client = g_socket_client_new ();
@@ -1469,7 +2154,7 @@ cups_connection_test (gpointer user_data)
                 g_socket_client_connect_to_host_async (client,
                                                        address,
                                                        port,
-                                                       NULL,
+                                                       manager->priv->cancellable,
                                                        cups_connection_test_cb,
                                                        manager);
 
@@ -1477,13 +2162,7 @@ cups_connection_test (gpointer user_data)
                 g_free (address);
         }
 
-        if (manager->priv->dests) {
-                manager->priv->cups_connection_timeout_id = 0;
-
-                return FALSE;
-        } else {
-                return TRUE;
-        }
+        return G_SOURCE_REMOVE;
 }
 
 static void
@@ -1530,8 +2209,7 @@ gsd_print_notifications_manager_start_idle (gpointer data)
         cupsSetPasswordCB2 (password_cb, NULL);
 
         if (server_is_local (cupsServer ())) {
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-                g_debug ("Got dests from local CUPS server.");
+                load_printers (manager);
 
                 renew_subscription_timeout_enable (manager, TRUE, FALSE);
 
@@ -1559,16 +2237,26 @@ gsd_print_notifications_manager_start (GsdPrintNotificationsManager *manager,
         gnome_settings_profile_start (NULL);
 
         manager->priv->subscription_id = -1;
-        manager->priv->dests = NULL;
-        manager->priv->num_dests = 0;
+        manager->priv->printers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_printer_info);
+        manager->priv->cups_connected = FALSE;
         manager->priv->scp_handler_spawned = FALSE;
         manager->priv->timeouts = NULL;
         manager->priv->printing_printers = NULL;
         manager->priv->active_notifications = NULL;
         manager->priv->cups_bus_connection = NULL;
         manager->priv->cups_connection_timeout_id = 0;
+        manager->priv->cups_connection_test_interval = CUPS_CONNECTION_TEST_INTERVAL;
+        manager->priv->check_interval = CHECK_INTERVAL;
+        manager->priv->server_check_interval = 0;
+        manager->priv->poll_notifications = FALSE;
+        manager->priv->notifier_timeout_id = 0;
         manager->priv->last_notify_sequence_number = -1;
         manager->priv->held_jobs = NULL;
+        manager->priv->fetching_notifications = FALSE;
+        manager->priv->fetch_again = FALSE;
+        manager->priv->notifications = g_queue_new ();
+        manager->priv->cancellable = g_cancellable_new ();
+        manager->priv->ipp_client = gsd_ipp_client_new ();
 
         manager->priv->start_idle_id = g_idle_add (gsd_print_notifications_manager_start_idle, manager);
         g_source_set_name_by_id (manager->priv->start_idle_id, "[gnome-settings-daemon] gsd_print_notifications_manager_start_idle");
@@ -1588,9 +2276,7 @@ gsd_print_notifications_manager_stop (GsdPrintNotificationsManager *manager)
 
         g_debug ("Stopping print-notifications manager");
 
-        cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-        manager->priv->num_dests = 0;
-        manager->priv->dests = NULL;
+        g_clear_pointer (&manager->priv->printers, g_hash_table_destroy);
 
         if (manager->priv->cups_dbus_subscription_id > 0 &&
             manager->priv->cups_bus_connection != NULL) {
@@ -1606,8 +2292,32 @@ gsd_print_notifications_manager_stop (GsdPrintNotificationsManager *manager)
                 manager->priv->check_source_id = 0;
         }
 
-        if (manager->priv->subscription_id >= 0)
-                cancel_subscription (manager->priv->subscription_id);
+        if (manager->priv->notifier_timeout_id > 0) {
+                g_source_remove (manager->priv->notifier_timeout_id);
+                manager->priv->notifier_timeout_id = 0;
+        }
+
+        if (manager->priv->cups_connection_timeout_id > 0) {
+                g_source_remove (manager->priv->cups_connection_timeout_id);
+                manager->priv->cups_connection_timeout_id = 0;
+        }
+
+        manager->priv->poll_notifications = FALSE;
+
+        /* Replies to the requests still in flight are dropped */
+        g_cancellable_cancel (manager->priv->cancellable);
+
+        if (manager->priv->ipp_client != NULL) {
+                cancel_subscription (manager);
+                g_clear_pointer (&manager->priv->ipp_client, gsd_ipp_client_free);
+        }
+
+        g_clear_object (&manager->priv->cancellable);
+
+        if (manager->priv->notifications != NULL) {
+                g_queue_free_full (manager->priv->notifications, free_cups_notification);
+                manager->priv->notifications = NULL;
+        }
 
         g_clear_pointer (&manager->priv->printing_printers, g_hash_table_destroy);
 
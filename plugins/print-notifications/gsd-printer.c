@@ -105,210 +105,384 @@ static const gchar pdi_introspection_xml[] =
   "  </interface>"
   "</node>";
 
-static GMainLoop *main_loop;
-static guint      npn_registration_id;
-static guint      pdi_registration_id;
-static guint      npn_owner_id;
-static guint      pdi_owner_id;
+static GMainLoop    *main_loop;
+static GCancellable *session_cancellable;
+static guint         npn_registration_id;
+static guint         pdi_registration_id;
+static guint         npn_owner_id;
+static guint         pdi_owner_id;
+
+typedef enum {
+        PROXY_SCP,
+        PROXY_PACKAGE_KIT_QUERY,
+        PROXY_PACKAGE_KIT_MODIFY,
+        PROXY_MECHANISM,
+        N_PROXIES
+} ProxyId;
+
+static const struct {
+        GBusType     bus_type;
+        const gchar *name;
+        const gchar *path;
+        const gchar *interface;
+} proxy_info[N_PROXIES] = {
+        { G_BUS_TYPE_SESSION, SCP_BUS, SCP_PATH, SCP_IFACE },
+        { G_BUS_TYPE_SESSION, PACKAGE_KIT_BUS, PACKAGE_KIT_PATH, PACKAGE_KIT_QUERY_IFACE },
+        { G_BUS_TYPE_SESSION, PACKAGE_KIT_BUS, PACKAGE_KIT_PATH, PACKAGE_KIT_MODIFY_IFACE },
+        { G_BUS_TYPE_SYSTEM, MECHANISM_BUS, "/", MECHANISM_BUS }
+};
+
+/* Created on first use and kept for the lifetime of the process, so
+ * that each step of setting up a printer costs a single method call */
+static GDBusProxy *proxies[N_PROXIES];
 
-static GHashTable *
-get_missing_executables (const gchar *ppd_file_name)
+typedef struct
 {
-        GHashTable *executables = NULL;
-        GDBusProxy *proxy;
-        GVariant   *output;
-        GVariant   *array;
-        GError     *error = NULL;
-        gint        i;
+        ProxyId   id;
+        gchar    *method;
+        GVariant *parameters;
+        gint      timeout;
+} ProxyCall;
 
-        if (!ppd_file_name)
-                return NULL;
+static void
+proxy_call_free (ProxyCall *call)
+{
+        g_free (call->method);
+        g_variant_unref (call->parameters);
+        g_free (call);
+}
 
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               SCP_BUS,
-                                               SCP_PATH,
-                                               SCP_IFACE,
-                                               NULL,
-                                               &error);
+static void
+proxy_call_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+        GTask    *task = user_data;
+        GVariant *output;
+        GError   *error = NULL;
 
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return NULL;
-        }
+        output = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (output)
+                g_task_return_pointer (task, output, (GDestroyNotify) g_variant_unref);
+        else
+                g_task_return_error (task, error);
 
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "MissingExecutables",
-                                         g_variant_new ("(s)",
-                                                        ppd_file_name),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
+        g_object_unref (task);
+}
 
-        if (output && g_variant_n_children (output) == 1) {
-                array = g_variant_get_child_value (output, 0);
-                if (array) {
-                        executables = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                             g_free, NULL);
-                        for (i = 0; i < g_variant_n_children (array); i++) {
-                                g_hash_table_insert (executables,
-                                                     g_strdup (g_variant_get_string (
-                                                       g_variant_get_child_value (array, i),
-                                                       NULL)),
-                                                     NULL);
-                        }
-                }
-        }
+static void
+proxy_call_start (GTask      *task,
+                  GDBusProxy *proxy)
+{
+        ProxyCall *call = g_task_get_task_data (task);
+
+        g_dbus_proxy_call (proxy,
+                           call->method,
+                           call->parameters,
+                           G_DBUS_CALL_FLAGS_NONE,
+                           call->timeout,
+                           g_task_get_cancellable (task),
+                           proxy_call_cb,
+                           task);
+}
 
-        if (output) {
-                g_variant_unref (output);
-        } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
+static void
+proxy_new_cb (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+        GTask      *task = user_data;
+        ProxyCall  *call = g_task_get_task_data (task);
+        GDBusProxy *proxy;
+        GError     *error = NULL;
+
+        proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+        if (!proxy) {
+                g_task_return_error (task, error);
+                g_object_unref (task);
+                return;
         }
 
-        g_object_unref (proxy);
+        /* A concurrent call may have created it in the meantime */
+        if (proxies[call->id] == NULL)
+                proxies[call->id] = proxy;
+        else
+                g_object_unref (proxy);
 
-        return executables;
+        proxy_call_start (task, proxies[call->id]);
 }
 
-static GHashTable *
-find_packages_for_executables (GHashTable *executables)
+static void
+proxy_call (ProxyId              id,
+            const gchar         *method,
+            GVariant            *parameters,
+            gint                 timeout,
+            GCancellable        *cancellable,
+            GAsyncReadyCallback  callback,
+            gpointer             user_data)
 {
-        GHashTableIter  exec_iter;
-        GHashTable     *packages = NULL;
-        GDBusProxy     *proxy;
-        GVariant       *output;
-        gpointer        key, value;
-        GError         *error = NULL;
+        ProxyCall *call;
+        GTask     *task;
 
-        if (!executables || g_hash_table_size (executables) <= 0)
-                return NULL;
+        task = g_task_new (NULL, cancellable, callback, user_data);
 
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               PACKAGE_KIT_BUS,
-                                               PACKAGE_KIT_PATH,
-                                               PACKAGE_KIT_QUERY_IFACE,
-                                               NULL,
-                                               &error);
+        call = g_new0 (ProxyCall, 1);
+        call->id = id;
+        call->method = g_strdup (method);
+        call->parameters = g_variant_ref_sink (parameters);
+        call->timeout = timeout;
+        g_task_set_task_data (task, call, (GDestroyNotify) proxy_call_free);
 
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return NULL;
+        if (proxies[id]) {
+                proxy_call_start (task, proxies[id]);
+        } else {
+                g_dbus_proxy_new_for_bus (proxy_info[id].bus_type,
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                          NULL,
+                                          proxy_info[id].name,
+                                          proxy_info[id].path,
+                                          proxy_info[id].interface,
+                                          cancellable,
+                                          proxy_new_cb,
+                                          task);
         }
+}
 
-        packages = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free, NULL);
+static GVariant *
+proxy_call_finish (GAsyncResult  *res,
+                   GError       **error)
+{
+        return g_task_propagate_pointer (G_TASK (res), error);
+}
 
-        g_hash_table_iter_init (&exec_iter, executables);
-        while (g_hash_table_iter_next (&exec_iter, &key, &value)) {
-                output = g_dbus_proxy_call_sync (proxy,
-                                                 "SearchFile",
-                                                 g_variant_new ("(ss)",
-                                                                (gchar *) key,
-                                                                ""),
-                                                 G_DBUS_CALL_FLAGS_NONE,
-                                                 DBUS_TIMEOUT,
-                                                 NULL,
-                                                 &error);
+static void
+warn_unless_cancelled (GError *error)
+{
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                g_warning ("%s", error->message);
+        g_error_free (error);
+}
 
-                if (output) {
-                        gboolean  installed;
-                        gchar    *package;
+/* libcups is blocking, so its calls are made from a worker thread which
+ * gets a copy of @data */
+static void
+run_in_thread (GTaskThreadFunc      func,
+               const gchar         *data,
+               GCancellable        *cancellable,
+               GAsyncReadyCallback  callback,
+               gpointer             user_data)
+{
+        GTask *task;
 
-                        g_variant_get (output,
-                                       "(bs)",
-                                       &installed,
-                                       &package);
-                        if (!installed)
-                                g_hash_table_insert (packages, g_strdup (package), NULL);
+        task = g_task_new (NULL, cancellable, callback, user_data);
+        g_task_set_task_data (task, g_strdup (data), g_free);
+        g_task_run_in_thread (task, func);
+        g_object_unref (task);
+}
 
-                        g_variant_unref (output);
-                } else {
-                        g_warning ("%s", error->message);
-                        g_error_free (error);
-                }
-        }
+typedef struct
+{
+        GHashTable *packages;
+        guint       n_pending;
+} MissingPackages;
+
+static void
+missing_packages_free (MissingPackages *data)
+{
+        g_hash_table_destroy (data->packages);
+        g_free (data);
+}
 
-        g_object_unref (proxy);
+static void
+install_packages_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+        GTask    *task = user_data;
+        GVariant *output;
+        GError   *error = NULL;
 
-        return packages;
+        output = proxy_call_finish (res, &error);
+        if (output)
+                g_variant_unref (output);
+        else
+                warn_unless_cancelled (error);
+
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
 }
 
 static void
-install_packages (GHashTable *packages)
+install_packages (GTask *task)
 {
+        MissingPackages *data = g_task_get_task_data (task);
         GVariantBuilder  array_builder;
         GHashTableIter   pkg_iter;
-        GDBusProxy      *proxy;
-        GVariant        *output;
         gpointer         key, value;
-        GError          *error = NULL;
 
-        if (!packages || g_hash_table_size (packages) <= 0)
-                return;
-
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               PACKAGE_KIT_BUS,
-                                               PACKAGE_KIT_PATH,
-                                               PACKAGE_KIT_MODIFY_IFACE,
-                                               NULL,
-                                               &error);
-
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
+        if (g_hash_table_size (data->packages) == 0) {
+                g_task_return_boolean (task, TRUE);
                 return;
         }
 
         g_variant_builder_init (&array_builder, G_VARIANT_TYPE ("as"));
 
-        g_hash_table_iter_init (&pkg_iter, packages);
+        g_hash_table_iter_init (&pkg_iter, data->packages);
         while (g_hash_table_iter_next (&pkg_iter, &key, &value)) {
                 g_variant_builder_add (&array_builder,
                                        "s",
                                        (gchar *) key);
         }
 
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "InstallPackageNames",
-                                         g_variant_new ("(uass)",
-                                                        0,
-                                                        &array_builder,
-                                                        "hide-finished"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_INSTALL_TIMEOUT,
-                                         NULL,
-                                         &error);
+        proxy_call (PROXY_PACKAGE_KIT_MODIFY,
+                    "InstallPackageNames",
+                    g_variant_new ("(uass)",
+                                   0,
+                                   &array_builder,
+                                   "hide-finished"),
+                    DBUS_INSTALL_TIMEOUT,
+                    g_task_get_cancellable (task),
+                    install_packages_cb,
+                    g_object_ref (task));
+}
 
+static void
+search_file_cb (GObject      *source_object,
+                GAsyncResult *res,
+                gpointer      user_data)
+{
+        GTask           *task = user_data;
+        MissingPackages *data = g_task_get_task_data (task);
+        GVariant        *output;
+        GError          *error = NULL;
+
+        output = proxy_call_finish (res, &error);
         if (output) {
+                gboolean  installed;
+                gchar    *package;
+
+                g_variant_get (output,
+                               "(bs)",
+                               &installed,
+                               &package);
+                if (!installed)
+                        g_hash_table_add (data->packages, package);
+                else
+                        g_free (package);
+
                 g_variant_unref (output);
         } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
+                warn_unless_cancelled (error);
+        }
+
+        if (--data->n_pending == 0) {
+                if (!g_task_return_error_if_cancelled (task))
+                        install_packages (task);
+        }
+
+        g_object_unref (task);
+}
+
+static void
+missing_executables_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+        GTask           *task = user_data;
+        MissingPackages *data = g_task_get_task_data (task);
+        GHashTable      *executables;
+        GVariant        *output;
+        GVariant        *array;
+        GError          *error = NULL;
+        gint             i;
+
+        output = proxy_call_finish (res, &error);
+        if (!output) {
+                warn_unless_cancelled (error);
+                g_task_return_boolean (task, TRUE);
+                g_object_unref (task);
+                return;
+        }
+
+        executables = g_hash_table_new (g_str_hash, g_str_equal);
+
+        /* The packages providing the executables are looked up
+         * concurrently */
+        if (g_variant_n_children (output) == 1) {
+                array = g_variant_get_child_value (output, 0);
+                for (i = 0; i < g_variant_n_children (array); i++) {
+                        const gchar *executable;
+
+                        g_variant_get_child (array, i, "&s", &executable);
+                        if (!g_hash_table_add (executables, (gpointer) executable))
+                                continue;
+
+                        data->n_pending++;
+                        proxy_call (PROXY_PACKAGE_KIT_QUERY,
+                                    "SearchFile",
+                                    g_variant_new ("(ss)",
+                                                   executable,
+                                                   ""),
+                                    DBUS_TIMEOUT,
+                                    g_task_get_cancellable (task),
+                                    search_file_cb,
+                                    g_object_ref (task));
+                }
+                g_variant_unref (array);
         }
 
-        g_object_unref (proxy);
+        g_hash_table_destroy (executables);
+        g_variant_unref (output);
+
+        if (data->n_pending == 0)
+                g_task_return_boolean (task, TRUE);
+
+        g_object_unref (task);
+}
+
+/*
+ * Installs the packages providing the executables which the PPD needs
+ * and which are missing.
+ */
+static void
+install_missing_packages_async (const gchar         *ppd_file_name,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+        MissingPackages *data;
+        GTask           *task;
+
+        task = g_task_new (NULL, cancellable, callback, user_data);
+
+        data = g_new0 (MissingPackages, 1);
+        data->packages = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+        g_task_set_task_data (task, data, (GDestroyNotify) missing_packages_free);
+
+        proxy_call (PROXY_SCP,
+                    "MissingExecutables",
+                    g_variant_new ("(s)",
+                                   ppd_file_name),
+                    DBUS_TIMEOUT,
+                    cancellable,
+                    missing_executables_cb,
+                    task);
+}
+
+static gboolean
+install_missing_packages_finish (GAsyncResult  *res,
+                                 GError       **error)
+{
+        return g_task_propagate_boolean (G_TASK (res), error);
 }
 
 static gchar *
-get_best_ppd (gchar *device_id,
-              gchar *device_make_and_model,
-              gchar *device_uri)
+get_best_ppd (GVariant *output)
 {
-        GDBusProxy  *proxy;
-        GVariant    *output;
         GVariant    *array;
         GVariant    *tuple;
-        GError      *error = NULL;
         gchar       *ppd_name = NULL;
         gint         i, j;
         static const char * const match_levels[] = {
@@ -318,57 +492,25 @@ get_best_ppd (gchar *device_id,
                    "generic",
                    "none"};
 
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               SCP_BUS,
-                                               SCP_PATH,
-                                               SCP_IFACE,
-                                               NULL,
-                                               &error);
-
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
+        if (g_variant_n_children (output) < 1)
                 return NULL;
-        }
 
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "GetBestDrivers",
-                                         g_variant_new ("(sss)",
-                                                 device_id ? device_id : "",
-                                                 device_make_and_model ? device_make_and_model : "",
-                                                 device_uri ? device_uri : ""),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
-
-        if (output && g_variant_n_children (output) >= 1) {
-                array = g_variant_get_child_value (output, 0);
-                if (array)
-                        for (j = 0; j < G_N_ELEMENTS (match_levels) && ppd_name == NULL; j++)
-                                for (i = 0; i < g_variant_n_children (array) && ppd_name == NULL; i++) {
-                                        tuple = g_variant_get_child_value (array, i);
-                                        if (tuple && g_variant_n_children (tuple) == 2) {
-                                                if (g_strcmp0 (g_variant_get_string (
-                                                                   g_variant_get_child_value (tuple, 1),
-                                                                   NULL), match_levels[j]) == 0)
-                                                        ppd_name = g_strdup (g_variant_get_string (
-                                                                                 g_variant_get_child_value (tuple, 0),
-                                                                                 NULL));
-                                        }
-                                }
-        }
-
-        if (output) {
-                g_variant_unref (output);
-        } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-        }
-
-        g_object_unref (proxy);
+        array = g_variant_get_child_value (output, 0);
+        for (j = 0; j < G_N_ELEMENTS (match_levels) && ppd_name == NULL; j++)
+                for (i = 0; i < g_variant_n_children (array) && ppd_name == NULL; i++) {
+                        const gchar *name;
+                        const gchar *match;
+
+                        tuple = g_variant_get_child_value (array, i);
+                        if (g_variant_n_children (tuple) == 2) {
+                                g_variant_get_child (tuple, 0, "&s", &name);
+                                g_variant_get_child (tuple, 1, "&s", &match);
+                                if (g_strcmp0 (match, match_levels[j]) == 0)
+                                        ppd_name = g_strdup (name);
+                        }
+                        g_variant_unref (tuple);
+                }
+        g_variant_unref (array);
 
         return ppd_name;
 }
@@ -446,172 +588,6 @@ create_name (gchar *device_id)
         return name;
 }
 
-static gboolean
-add_printer (gchar *printer_name,
-             gchar *device_uri,
-             gchar *ppd_name,
-             gchar *info,
-             gchar *location)
-{
-        cups_dest_t *dests;
-        GDBusProxy  *proxy;
-        gboolean     success = FALSE;
-        GVariant    *output;
-        GError      *error = NULL;
-        gint         num_dests;
-        gint         i;
-
-        if (!printer_name || !device_uri || !ppd_name)
-                return FALSE;
-
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               MECHANISM_BUS,
-                                               "/",
-                                               MECHANISM_BUS,
-                                               NULL,
-                                               &error);
-
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return FALSE;
-        }
-
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "PrinterAdd",
-                                         g_variant_new ("(sssss)",
-                                                        printer_name,
-                                                        device_uri,
-                                                        ppd_name,
-                                                        info ? info : "",
-                                                        location ? location : ""),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
-
-        if (output) {
-                g_variant_unref (output);
-        } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-        }
-
-        g_object_unref (proxy);
-
-        num_dests = cupsGetDests (&dests);
-        for (i = 0; i < num_dests; i++)
-                if (g_strcmp0 (dests[i].name, printer_name) == 0)
-                        success = TRUE;
-        cupsFreeDests (num_dests, dests);
-
-        return success;
-}
-
-static gboolean
-printer_set_enabled (const gchar *printer_name,
-                     gboolean     enabled)
-{
-        GDBusProxy *proxy;
-        gboolean    result = TRUE;
-        GVariant   *output;
-        GError     *error = NULL;
-
-        if (!printer_name)
-                return FALSE;
-
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               MECHANISM_BUS,
-                                               "/",
-                                               MECHANISM_BUS,
-                                               NULL,
-                                               &error);
-
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return FALSE;
-        }
-
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "PrinterSetEnabled",
-                                         g_variant_new ("(sb)",
-                                                        printer_name,
-                                                        enabled),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
-
-        if (output) {
-                g_variant_unref (output);
-        } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                result = FALSE;
-        }
-
-        g_object_unref (proxy);
-
-        return result;
-}
-
-static gboolean
-printer_set_accepting_jobs (const gchar *printer_name,
-                            gboolean     accepting_jobs,
-                            const gchar *reason)
-{
-        GDBusProxy *proxy;
-        gboolean    result = TRUE;
-        GVariant   *output;
-        GError     *error = NULL;
-
-        if (!printer_name)
-                return FALSE;
-
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               MECHANISM_BUS,
-                                               "/",
-                                               MECHANISM_BUS,
-                                               NULL,
-                                               &error);
-
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return FALSE;
-        }
-
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "PrinterSetAcceptJobs",
-                                         g_variant_new ("(sbs)",
-                                                        printer_name,
-                                                        accepting_jobs,
-                                                        reason ? reason : ""),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
-
-        if (output) {
-                g_variant_unref (output);
-        } else {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                result = FALSE;
-        }
-
-        g_object_unref (proxy);
-
-        return result;
-}
-
 static ipp_t *
 execute_maintenance_command (const char *printer_name,
                              const char *command,
@@ -752,115 +728,581 @@ get_page_size_from_locale (void)
 }
 
 static void
-set_default_paper_size (const gchar *printer_name,
-                        const gchar *ppd_file_name)
+create_name_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
 {
-        GDBusProxy      *proxy;
-        GVariant        *output;
-        GError          *error = NULL;
-        GVariantBuilder *builder;
+        g_task_return_pointer (task, create_name (task_data), g_free);
+}
 
-        proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                               G_DBUS_PROXY_FLAGS_NONE,
-                                               NULL,
-                                               MECHANISM_BUS,
-                                               "/",
-                                               MECHANISM_BUS,
-                                               NULL,
-                                               &error);
+static void
+printer_exists_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+        cups_dest_t *dests;
+        gboolean     exists = FALSE;
+        gint         num_dests;
+        gint         i;
 
-        if (!proxy) {
-                g_warning ("%s", error->message);
-                g_error_free (error);
-                return;
-        }
+        num_dests = cupsGetDests (&dests);
+        for (i = 0; i < num_dests; i++)
+                if (g_strcmp0 (dests[i].name, task_data) == 0)
+                        exists = TRUE;
+        cupsFreeDests (num_dests, dests);
 
-        /* Set default media size according to the locale
-         * FIXME: Handle more than A4 and Letter:
-         * https://bugzilla.gnome.org/show_bug.cgi?id=660769 */
-        builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
-        g_variant_builder_add (builder, "s", get_page_size_from_locale ());
-
-        output = g_dbus_proxy_call_sync (proxy,
-                                         "PrinterAddOption",
-                                         g_variant_new ("(ssas)",
-                                                        printer_name ? printer_name : "",
-                                                        "PageSize",
-                                                        builder),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         DBUS_TIMEOUT,
-                                         NULL,
-                                         &error);
+        g_task_return_boolean (task, exists);
+}
+
+/* For a PPD file which nobody got from the task, because it was
+ * cancelled in the meantime */
+static void
+ppd_file_free (gchar *ppd_file_name)
+{
+        g_unlink (ppd_file_name);
+        g_free (ppd_file_name);
+}
+
+static void
+get_ppd_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+        const gchar *ppd_file_name;
+
+        /* cupsGetPPD() returns a per-thread buffer */
+        ppd_file_name = cupsGetPPD (task_data);
+        if (ppd_file_name == NULL)
+                g_task_return_pointer (task, NULL, NULL);
+        else
+                g_task_return_pointer (task, g_strdup (ppd_file_name),
+                                       (GDestroyNotify) ppd_file_free);
+}
+
+static void
+configure_printer_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+        printer_autoconfigure (task_data);
+        get_ppd_thread (task, source_object, task_data, cancellable);
+}
+
+typedef struct
+{
+        gchar    *device_id;
+        gchar    *device_make_and_model;
+        gchar    *device_uri;
+        gchar    *ppd_name;
+        gchar    *printer_name;
+        gchar    *ppd_file_name;
+        guint     n_pending;
+        gint64    start_time;
+        gint64    stage_start_time;
+        GString  *timings;
+} SetupData;
+
+static void
+setup_data_free (SetupData *data)
+{
+        if (data->ppd_file_name)
+                g_unlink (data->ppd_file_name);
+
+        g_free (data->device_id);
+        g_free (data->device_make_and_model);
+        g_free (data->device_uri);
+        g_free (data->ppd_name);
+        g_free (data->printer_name);
+        g_free (data->ppd_file_name);
+        g_string_free (data->timings, TRUE);
+        g_free (data);
+}
+
+/* The steps of a stage run concurrently, and each of them is timed
+ * from the start of its stage */
+static void
+setup_stage_start (SetupData *data,
+                   guint      n_steps)
+{
+        data->stage_start_time = g_get_monotonic_time ();
+        data->n_pending = n_steps;
+}
+
+static gboolean
+setup_step_done (SetupData   *data,
+                 const gchar *step)
+{
+        g_string_append_printf (data->timings, " %s %.1f ms,", step,
+                                (g_get_monotonic_time () - data->stage_start_time) / 1000.0);
 
+        return --data->n_pending == 0;
+}
+
+static void
+setup_return (GTask    *task,
+              gboolean  success)
+{
+        SetupData *data = g_task_get_task_data (task);
+
+        if (data->timings->len > 0)
+                g_string_truncate (data->timings, data->timings->len - 1);
+
+        g_debug ("Setting up printer for %s %s after %.1f ms:%s",
+                 data->device_uri,
+                 success ? "succeeded" : "failed",
+                 (g_get_monotonic_time () - data->start_time) / 1000.0,
+                 data->timings->str);
+
+        g_task_return_boolean (task, success);
+}
+
+static void
+setup_drivers_step_done (GTask       *task,
+                         const gchar *step)
+{
+        SetupData *data = g_task_get_task_data (task);
+
+        if (setup_step_done (data, step))
+                setup_return (task, TRUE);
+}
+
+static void
+setup_missing_packages_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+        GTask *task = user_data;
+
+        install_missing_packages_finish (res, NULL);
+        setup_drivers_step_done (task, "drivers");
+        g_object_unref (task);
+}
+
+static void
+setup_paper_size_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+        GTask    *task = user_data;
+        GVariant *output;
+        GError   *error = NULL;
+
+        output = proxy_call_finish (res, &error);
         if (output) {
                 g_variant_unref (output);
         } else {
                 if (!(error->domain == G_DBUS_ERROR &&
                       (error->code == G_DBUS_ERROR_SERVICE_UNKNOWN ||
                        error->code == G_DBUS_ERROR_UNKNOWN_METHOD)))
-                        g_warning ("%s", error->message);
-                g_error_free (error);
+                        warn_unless_cancelled (error);
+                else
+                        g_error_free (error);
         }
 
-        g_object_unref (proxy);
+        setup_drivers_step_done (task, "paper size");
+        g_object_unref (task);
 }
 
-/*
- * Setup new printer and returns TRUE if successful.
- */
-static gboolean
-setup_printer (gchar *device_id,
-               gchar *device_make_and_model,
-               gchar *device_uri)
+static void
+setup_configure_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
 {
-        gboolean  success = FALSE;
-        gchar    *ppd_name;
-        gchar    *printer_name;
+        GTask           *task = user_data;
+        SetupData       *data = g_task_get_task_data (task);
+        GCancellable    *cancellable = g_task_get_cancellable (task);
+        GVariantBuilder  builder;
+
+        data->ppd_file_name = g_task_propagate_pointer (G_TASK (res), NULL);
+        setup_step_done (data, "configure");
+
+        if (g_task_return_error_if_cancelled (task))
+                goto out;
+
+        if (!data->ppd_file_name) {
+                setup_return (task, TRUE);
+                goto out;
+        }
+
+        setup_stage_start (data, 2);
 
-        ppd_name = get_best_ppd (device_id, device_make_and_model, device_uri);
-        printer_name = create_name (device_id);
+        /* Set default media size according to the locale
+         * FIXME: Handle more than A4 and Letter:
+         * https://bugzilla.gnome.org/show_bug.cgi?id=660769 */
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+        g_variant_builder_add (&builder, "s", get_page_size_from_locale ());
+
+        proxy_call (PROXY_MECHANISM,
+                    "PrinterAddOption",
+                    g_variant_new ("(ssas)",
+                                   data->printer_name,
+                                   "PageSize",
+                                   &builder),
+                    DBUS_TIMEOUT,
+                    cancellable,
+                    setup_paper_size_cb,
+                    g_object_ref (task));
+
+        install_missing_packages_async (data->ppd_file_name,
+                                        cancellable,
+                                        setup_missing_packages_cb,
+                                        g_object_ref (task));
+
+ out:
+        g_object_unref (task);
+}
 
-        if (!ppd_name || !printer_name || !device_uri) {
-                g_free (ppd_name);
-                g_free (printer_name);
-                return FALSE;
+static void
+setup_enable_cb (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+        GTask     *task = user_data;
+        SetupData *data = g_task_get_task_data (task);
+        GVariant  *output;
+        GError    *error = NULL;
+
+        output = proxy_call_finish (res, &error);
+        if (output)
+                g_variant_unref (output);
+        else
+                warn_unless_cancelled (error);
+
+        if (setup_step_done (data, "enable") &&
+            !g_task_return_error_if_cancelled (task)) {
+                setup_stage_start (data, 1);
+                run_in_thread (configure_printer_thread,
+                               data->printer_name,
+                               g_task_get_cancellable (task),
+                               setup_configure_cb,
+                               g_object_ref (task));
         }
 
-        success = add_printer (printer_name, device_uri,
-                               ppd_name, NULL, NULL);
+        g_object_unref (task);
+}
+
+static void
+setup_printer_exists_cb (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+        GTask        *task = user_data;
+        SetupData    *data = g_task_get_task_data (task);
+        GCancellable *cancellable = g_task_get_cancellable (task);
+        gboolean      exists;
+
+        exists = g_task_propagate_boolean (G_TASK (res), NULL);
+        setup_step_done (data, "add");
+
+        if (g_task_return_error_if_cancelled (task))
+                goto out;
+
+        if (!exists) {
+                setup_return (task, FALSE);
+                goto out;
+        }
 
         /* Set some options of the new printer */
-        if (success) {
-                const char *ppd_file_name;
+        setup_stage_start (data, 2);
+
+        proxy_call (PROXY_MECHANISM,
+                    "PrinterSetAcceptJobs",
+                    g_variant_new ("(sbs)",
+                                   data->printer_name,
+                                   TRUE,
+                                   ""),
+                    DBUS_TIMEOUT,
+                    cancellable,
+                    setup_enable_cb,
+                    g_object_ref (task));
+
+        proxy_call (PROXY_MECHANISM,
+                    "PrinterSetEnabled",
+                    g_variant_new ("(sb)",
+                                   data->printer_name,
+                                   TRUE),
+                    DBUS_TIMEOUT,
+                    cancellable,
+                    setup_enable_cb,
+                    g_object_ref (task));
+
+ out:
+        g_object_unref (task);
+}
+
+static void
+setup_printer_add_cb (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        GTask     *task = user_data;
+        SetupData *data = g_task_get_task_data (task);
+        GVariant  *output;
+        GError    *error = NULL;
+
+        output = proxy_call_finish (res, &error);
+        if (output)
+                g_variant_unref (output);
+        else
+                warn_unless_cancelled (error);
+
+        /* The mechanism does not always report failures, so check
+         * that the queue is there */
+        if (!g_task_return_error_if_cancelled (task))
+                run_in_thread (printer_exists_thread,
+                               data->printer_name,
+                               g_task_get_cancellable (task),
+                               setup_printer_exists_cb,
+                               g_object_ref (task));
+
+        g_object_unref (task);
+}
 
-                printer_set_accepting_jobs (printer_name, TRUE, NULL);
-                printer_set_enabled (printer_name, TRUE);
-                printer_autoconfigure (printer_name);
+static void
+setup_lookup_done (GTask       *task,
+                   const gchar *step)
+{
+        SetupData *data = g_task_get_task_data (task);
 
-                ppd_file_name = cupsGetPPD (printer_name);
+        if (!setup_step_done (data, step) ||
+            g_task_return_error_if_cancelled (task))
+                return;
 
-                if (ppd_file_name) {
-                        GHashTable *executables;
-                        GHashTable *packages;
+        if (!data->ppd_name || !data->printer_name) {
+                setup_return (task, FALSE);
+                return;
+        }
 
-                        set_default_paper_size (printer_name, ppd_file_name);
+        setup_stage_start (data, 1);
+
+        proxy_call (PROXY_MECHANISM,
+                    "PrinterAdd",
+                    g_variant_new ("(sssss)",
+                                   data->printer_name,
+                                   data->device_uri,
+                                   data->ppd_name,
+                                   "",
+                                   ""),
+                    DBUS_TIMEOUT,
+                    g_task_get_cancellable (task),
+                    setup_printer_add_cb,
+                    g_object_ref (task));
+}
 
-                        executables = get_missing_executables (ppd_file_name);
-                        packages = find_packages_for_executables (executables);
-                        install_packages (packages);
+static void
+setup_best_ppd_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+        GTask     *task = user_data;
+        SetupData *data = g_task_get_task_data (task);
+        GVariant  *output;
+        GError    *error = NULL;
+
+        output = proxy_call_finish (res, &error);
+        if (output) {
+                data->ppd_name = get_best_ppd (output);
+                g_variant_unref (output);
+        } else {
+                warn_unless_cancelled (error);
+        }
+
+        setup_lookup_done (task, "driver lookup");
+        g_object_unref (task);
+}
+
+static void
+setup_create_name_cb (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        GTask     *task = user_data;
+        SetupData *data = g_task_get_task_data (task);
+
+        data->printer_name = g_task_propagate_pointer (G_TASK (res), NULL);
+
+        setup_lookup_done (task, "name");
+        g_object_unref (task);
+}
+
+/*
+ * Sets up a new printer. Looking up the driver and choosing a name for
+ * the queue are independent, so they run concurrently; the remaining
+ * stages depend on each other. How long each stage took is logged
+ * as a debug message once the setup is done.
+ */
+static void
+setup_printer_async (const gchar         *device_id,
+                     const gchar         *device_make_and_model,
+                     const gchar         *device_uri,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
+{
+        SetupData *data;
+        GTask     *task;
+
+        task = g_task_new (NULL, cancellable, callback, user_data);
+
+        data = g_new0 (SetupData, 1);
+        data->device_id = g_strdup (device_id);
+        data->device_make_and_model = g_strdup (device_make_and_model);
+        data->device_uri = g_strdup (device_uri);
+        data->timings = g_string_new (NULL);
+        data->start_time = g_get_monotonic_time ();
+        g_task_set_task_data (task, data, (GDestroyNotify) setup_data_free);
+
+        if (!device_id || !device_uri) {
+                setup_return (task, FALSE);
+                g_object_unref (task);
+                return;
+        }
+
+        setup_stage_start (data, 2);
+
+        proxy_call (PROXY_SCP,
+                    "GetBestDrivers",
+                    g_variant_new ("(sss)",
+                                   device_id,
+                                   device_make_and_model ? device_make_and_model : "",
+                                   device_uri),
+                    DBUS_TIMEOUT,
+                    cancellable,
+                    setup_best_ppd_cb,
+                    g_object_ref (task));
+
+        run_in_thread (create_name_thread,
+                       device_id,
+                       cancellable,
+                       setup_create_name_cb,
+                       g_object_ref (task));
+
+        g_object_unref (task);
+}
+
+/*
+ * Returns TRUE if the printer was set up successfully.
+ */
+static gboolean
+setup_printer_finish (GAsyncResult  *res,
+                      GError       **error)
+{
+        return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+show_notification (const gchar *primary_text,
+                   const gchar *secondary_text)
+{
+        NotifyNotification *notification;
+
+        notification = notify_notification_new (primary_text,
+                                                secondary_text,
+                                                "printer-symbolic");
+        notify_notification_set_app_name (notification, _("Printers"));
+        notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
+        notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
+
+        notify_notification_show (notification, NULL);
+        g_object_unref (notification);
+}
+
+typedef struct
+{
+        GDBusMethodInvocation *invocation;
+        gchar                 *device;
+        gchar                 *ppd_file_name;
+} NewPrinterData;
+
+static void
+new_printer_return (NewPrinterData *data)
+{
+        g_dbus_method_invocation_return_value (data->invocation,
+                                               NULL);
+
+        if (data->ppd_file_name)
+                g_unlink (data->ppd_file_name);
+        g_free (data->ppd_file_name);
+        g_free (data->device);
+        g_free (data);
+}
+
+static void
+new_printer_setup_cb (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        NewPrinterData *data = user_data;
+        GError         *error = NULL;
+        gchar          *secondary_text;
+
+        if (!setup_printer_finish (res, &error)) {
+                if (error == NULL) {
+                        if (data->device)
+                                /* Translators: We have no driver installed for the device */
+                                secondary_text = g_strdup_printf (_("No printer driver for %s."), data->device);
+                        else
+                                /* Translators: We have no driver installed for this printer */
+                                secondary_text = g_strdup (_("No driver for this printer."));
 
-                        if (executables)
-                                g_hash_table_destroy (executables);
-                        if (packages)
-                                g_hash_table_destroy (packages);
-                        g_unlink (ppd_file_name);
+                        /* Translators: We have no driver installed for this printer */
+                        show_notification (_("Missing printer driver"), secondary_text);
+                        g_free (secondary_text);
+                } else {
+                        g_error_free (error);
                 }
         }
 
-        g_free (printer_name);
-        g_free (ppd_name);
+        new_printer_return (data);
+}
+
+static void
+new_printer_packages_cb (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+        install_missing_packages_finish (res, NULL);
+        new_printer_return (user_data);
+}
 
-        return success;
+static void
+new_printer_ppd_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+        NewPrinterData *data = user_data;
+
+        data->ppd_file_name = g_task_propagate_pointer (G_TASK (res), NULL);
+        if (data->ppd_file_name)
+                install_missing_packages_async (data->ppd_file_name,
+                                                session_cancellable,
+                                                new_printer_packages_cb,
+                                                data);
+        else
+                new_printer_return (data);
+}
+
+static void
+install_drivers_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+        GDBusMethodInvocation *invocation = user_data;
+        GVariant              *output;
+        GError                *error = NULL;
+
+        output = proxy_call_finish (res, &error);
+        if (output)
+                g_variant_unref (output);
+        else
+                warn_unless_cancelled (error);
+
+        g_dbus_method_invocation_return_value (invocation,
+                                               NULL);
 }
 
 static void
@@ -873,8 +1315,6 @@ handle_method_call (GDBusConnection       *connection,
                     GDBusMethodInvocation *invocation,
                     gpointer               user_data)
 {
-        gchar *primary_text = NULL;
-        gchar *secondary_text = NULL;
         gchar *name = NULL;
         gchar *mfg = NULL;
         gchar *mdl = NULL;
@@ -886,15 +1326,17 @@ handle_method_call (GDBusConnection       *connection,
         gint   status = 0;
 
         if (g_strcmp0 (method_name, "GetReady") == 0) {
-                /* Translators: We are configuring new printer */
-                primary_text = g_strdup (_("Configuring new printer"));
-                /* Translators: Just wait */
-                secondary_text = g_strdup (_("Please wait…"));
-
                 g_dbus_method_invocation_return_value (invocation,
                                                        NULL);
+
+                /* Translators: We are configuring new printer */
+                show_notification (_("Configuring new printer"),
+                                   /* Translators: Just wait */
+                                   _("Please wait…"));
         }
         else if (g_strcmp0 (method_name, "NewPrinter") == 0) {
+                NewPrinterData *data;
+
                 if (g_variant_n_children (parameters) == 6) {
                         g_variant_get (parameters, "(i&s&s&s&s&s)",
                                &status,
@@ -905,6 +1347,10 @@ handle_method_call (GDBusConnection       *connection,
                                &cmd);
                 }
 
+                /* The invocation is returned once the printer is set up */
+                data = g_new0 (NewPrinterData, 1);
+                data->invocation = invocation;
+
                 if (g_strrstr (name, "/")) {
                         /* name is a URI, no queue was generated, because no suitable
                          * driver was found
@@ -913,25 +1359,15 @@ handle_method_call (GDBusConnection       *connection,
                         device_id = g_strdup_printf ("MFG:%s;MDL:%s;DES:%s;CMD:%s;", mfg, mdl, des, cmd);
                         make_and_model = g_strdup_printf ("%s %s", mfg, mdl);
 
-                        if (!setup_printer (device_id, make_and_model, name)) {
+                        if (mfg && mdl)
+                                data->device = g_strdup_printf ("%s %s", mfg, mdl);
+                        else
+                                data->device = g_strdup (des);
 
-                                /* Translators: We have no driver installed for this printer */
-                                primary_text = g_strdup (_("Missing printer driver"));
-
-                                if ((mfg && mdl) || des) {
-                                        if (mfg && mdl)
-                                                device = g_strdup_printf ("%s %s", mfg, mdl);
-                                        else
-                                                device = g_strdup (des);
-
-                                        /* Translators: We have no driver installed for the device */
-                                        secondary_text = g_strdup_printf (_("No printer driver for %s."), device);
-                                        g_free (device);
-                                }
-                                else
-                                        /* Translators: We have no driver installed for this printer */
-                                        secondary_text = g_strdup (_("No driver for this printer."));
-                        }
+                        setup_printer_async (device_id, make_and_model, name,
+                                             session_cancellable,
+                                             new_printer_setup_cb,
+                                             data);
 
                         g_free (make_and_model);
                         g_free (device_id);
@@ -941,31 +1377,15 @@ handle_method_call (GDBusConnection       *connection,
                          * automatically.
                          */
 
-                        const char *ppd_file_name;
-
-                        ppd_file_name = cupsGetPPD (name);
-                        if (ppd_file_name) {
-                                GHashTable *executables;
-                                GHashTable *packages;
-
-                                executables = get_missing_executables (ppd_file_name);
-                                packages = find_packages_for_executables (executables);
-                                install_packages (packages);
-
-                                if (executables)
-                                        g_hash_table_destroy (executables);
-                                if (packages)
-                                        g_hash_table_destroy (packages);
-                                g_unlink (ppd_file_name);
-                        }
+                        run_in_thread (get_ppd_thread,
+                                       name,
+                                       session_cancellable,
+                                       new_printer_ppd_cb,
+                                       data);
                 }
-
-                g_dbus_method_invocation_return_value (invocation,
-                                                       NULL);
         }
         else if (g_strcmp0 (method_name, "InstallDrivers") == 0) {
-                GDBusProxy *proxy;
-                GError     *error = NULL;
+                GVariantBuilder builder;
 
                 if (g_variant_n_children (parameters) == 3) {
                         g_variant_get (parameters, "(&s&s&s)",
@@ -974,68 +1394,29 @@ handle_method_call (GDBusConnection       *connection,
                                &cmd);
                 }
 
-                if (mfg && mdl)
-                        device = g_strdup_printf ("MFG:%s;MDL:%s;", mfg, mdl);
-
-                proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                       G_DBUS_PROXY_FLAGS_NONE,
-                                                       NULL,
-                                                       PACKAGE_KIT_BUS,
-                                                       PACKAGE_KIT_PATH,
-                                                       PACKAGE_KIT_MODIFY_IFACE,
-                                                       NULL,
-                                                       &error);
-
-                if (!proxy) {
-                        g_warning ("%s", error->message);
-                        g_error_free (error);
+                if (!mfg || !mdl) {
+                        g_dbus_method_invocation_return_value (invocation,
+                                                               NULL);
+                        return;
                 }
 
-                if (proxy && device) {
-                        GVariantBuilder *builder;
-                        GVariant        *output;
-
-                        builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
-                        g_variant_builder_add (builder, "s", device);
-
-                        output = g_dbus_proxy_call_sync (proxy,
-                                                         "InstallPrinterDrivers",
-                                                         g_variant_new ("(uass)",
-                                                                        0,
-                                                                        builder,
-                                                                        "hide-finished"),
-                                                         G_DBUS_CALL_FLAGS_NONE,
-                                                         DBUS_INSTALL_TIMEOUT,
-                                                         NULL,
-                                                         &error);
-
-                        if (output) {
-                                g_variant_unref (output);
-                        } else {
-                                g_warning ("%s", error->message);
-                                g_error_free (error);
-                        }
+                device = g_strdup_printf ("MFG:%s;MDL:%s;", mfg, mdl);
 
-                        g_object_unref (proxy);
-                }
+                g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+                g_variant_builder_add (&builder, "s", device);
 
-                g_dbus_method_invocation_return_value (invocation,
-                                                       NULL);
-        }
+                proxy_call (PROXY_PACKAGE_KIT_MODIFY,
+                            "InstallPrinterDrivers",
+                            g_variant_new ("(uass)",
+                                           0,
+                                           &builder,
+                                           "hide-finished"),
+                            DBUS_INSTALL_TIMEOUT,
+                            session_cancellable,
+                            install_drivers_cb,
+                            invocation);
 
-        if (primary_text) {
-                NotifyNotification *notification;
-                notification = notify_notification_new (primary_text,
-                                                        secondary_text,
-                                                        "printer-symbolic");
-                notify_notification_set_app_name (notification, _("Printers"));
-                notify_notification_set_hint_string (notification, "desktop-entry", "gnome-printers-panel");
-                notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
-
-                notify_notification_show (notification, NULL);
-                g_object_unref (notification);
-                g_free (primary_text);
-                g_free (secondary_text);
+                g_free (device);
         }
 }
 
@@ -1227,6 +1608,7 @@ client_signal_handler (GDBusConnection  *connection,
                 }
 
                 if (g_strcmp0 (signal_name, "EndSession") == 0) {
+                        g_cancellable_cancel (session_cancellable);
                         g_main_loop_quit (main_loop);
                         g_debug ("Exiting gsd-printer");
                 }
@@ -1291,6 +1673,7 @@ main (int argc, char *argv[])
   guint            client_signal_subscription_id;
   guint            session_signal_subscription_id;
   gchar           *object_path;
+  gint             i;
 
   bindtextdomain (GETTEXT_PACKAGE, GNOME_SETTINGS_LOCALEDIR);
   bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
@@ -1374,9 +1757,16 @@ main (int argc, char *argv[])
                                          NULL,
                                          NULL);
 
+  session_cancellable = g_cancellable_new ();
+
   main_loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (main_loop);
 
+  g_cancellable_cancel (session_cancellable);
+  g_clear_object (&session_cancellable);
+  for (i = 0; i < N_PROXIES; i++)
+          g_clear_object (&proxies[i]);
+
   unregister_objects ();
   unown_names ();
 
@@ -0,0 +1,521 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for GsdIppClient against a slow IPP server. Starts
+ * ippeveprinter, or uses the printer given in GSD_TEST_IPP_PRINTER, for
+ * example ipp://localhost:631/printers/foo on a running cupsd, and puts
+ * a proxy in front of it which delays everything sent to the server.
+ * Then sends the same Get-Printer-Attributes requests with
+ * cupsDoRequest() from the main loop, and through the client, and
+ * reports how long the main loop was unable to run in both cases.
+ *
+ * Usage: test-ipp-client [requests] [latency in ms]
+ */
+
+#include "config.h"
+
+#include <signal.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <cups/cups.h>
+
+#include "gsd-ipp-client.h"
+
+#define DEFAULT_N_REQUESTS      20
+#define DEFAULT_LATENCY         100 /* ms */
+#define TICK_INTERVAL           5   /* ms */
+#define CHUNK_SIZE              65536
+
+typedef struct {
+        GSocketConnection *client;
+        GSocketConnection *upstream;
+} ProxyConnection;
+
+typedef struct {
+        ProxyConnection *connection;
+        GInputStream    *input;
+        GOutputStream   *output;
+        gint64           latency;
+        GAsyncQueue     *chunks;
+} DelayLine;
+
+typedef struct {
+        gint64  due;
+        GBytes *bytes; /* NULL at the end of the stream */
+} Chunk;
+
+static gchar   *upstream_host;
+static int      upstream_port;
+static gint64   latency;
+
+static GMainLoop *loop;
+static gint64     last_tick;
+static gint64     max_stall;
+
+static guint      n_requests;
+static guint      n_replies;
+static guint      n_errors;
+
+static gpointer
+delay_line_read (gpointer user_data)
+{
+        DelayLine *line = user_data;
+        gssize     n_read;
+        guchar    *buffer;
+
+        buffer = g_malloc (CHUNK_SIZE);
+
+        do {
+                Chunk *chunk;
+
+                n_read = g_input_stream_read (line->input, buffer, CHUNK_SIZE, NULL, NULL);
+
+                chunk = g_new0 (Chunk, 1);
+                chunk->due = g_get_monotonic_time () + line->latency;
+                if (n_read > 0)
+                        chunk->bytes = g_bytes_new (buffer, n_read);
+                g_async_queue_push (line->chunks, chunk);
+        } while (n_read > 0);
+
+        g_free (buffer);
+
+        return NULL;
+}
+
+/* Each chunk is forwarded @latency after it was read, so requests sent
+ * back to back each see the latency once, like on a slow network */
+static gpointer
+delay_line_write (gpointer user_data)
+{
+        DelayLine *line = user_data;
+        gboolean   done = FALSE;
+
+        while (!done) {
+                Chunk *chunk;
+                gint64 delay;
+
+                chunk = g_async_queue_pop (line->chunks);
+
+                delay = chunk->due - g_get_monotonic_time ();
+                if (delay > 0)
+                        g_usleep (delay);
+
+                if (chunk->bytes == NULL ||
+                    !g_output_stream_write_all (line->output,
+                                                g_bytes_get_data (chunk->bytes, NULL),
+                                                g_bytes_get_size (chunk->bytes),
+                                                NULL, NULL, NULL))
+                        done = TRUE;
+
+                g_clear_pointer (&chunk->bytes, g_bytes_unref);
+                g_free (chunk);
+        }
+
+        /* Wake up the readers of both directions */
+        g_socket_shutdown (g_socket_connection_get_socket (line->connection->client), TRUE, TRUE, NULL);
+        g_socket_shutdown (g_socket_connection_get_socket (line->connection->upstream), TRUE, TRUE, NULL);
+
+        return NULL;
+}
+
+static gboolean
+proxy_run (GThreadedSocketService *service,
+           GSocketConnection      *connection,
+           GObject                *source_object,
+           gpointer                user_data)
+{
+        ProxyConnection proxy;
+        DelayLine       lines[2];
+        GThread        *threads[4];
+        GSocketClient  *client;
+        GError         *error = NULL;
+        guint           i;
+
+        client = g_socket_client_new ();
+        proxy.client = connection;
+        proxy.upstream = g_socket_client_connect_to_host (client, upstream_host, upstream_port, NULL, &error);
+        g_object_unref (client);
+
+        if (proxy.upstream == NULL) {
+                g_printerr ("Could not connect to %s:%d: %s\n", upstream_host, upstream_port, error->message);
+                g_error_free (error);
+                return TRUE;
+        }
+
+        lines[0].input = g_io_stream_get_input_stream (G_IO_STREAM (proxy.client));
+        lines[0].output = g_io_stream_get_output_stream (G_IO_STREAM (proxy.upstream));
+        lines[0].latency = latency;
+        lines[1].input = g_io_stream_get_input_stream (G_IO_STREAM (proxy.upstream));
+        lines[1].output = g_io_stream_get_output_stream (G_IO_STREAM (proxy.client));
+        lines[1].latency = 0;
+
+        for (i = 0; i < G_N_ELEMENTS (lines); i++) {
+                lines[i].connection = &proxy;
+                lines[i].chunks = g_async_queue_new ();
+                threads[2 * i] = g_thread_new ("proxy-read", delay_line_read, &lines[i]);
+                threads[2 * i + 1] = g_thread_new ("proxy-write", delay_line_write, &lines[i]);
+        }
+
+        for (i = 0; i < G_N_ELEMENTS (threads); i++)
+                g_thread_join (threads[i]);
+
+        for (i = 0; i < G_N_ELEMENTS (lines); i++)
+                g_async_queue_unref (lines[i].chunks);
+
+        g_io_stream_close (G_IO_STREAM (proxy.upstream), NULL, NULL);
+        g_object_unref (proxy.upstream);
+
+        return TRUE;
+}
+
+static gpointer
+proxy_thread (gpointer user_data)
+{
+        GAsyncQueue    *port_queue = user_data;
+        GSocketService *service;
+        GSocketAddress *address;
+        GSocketAddress *effective_address = NULL;
+        GInetAddress   *loopback;
+        GMainContext   *context;
+        GMainLoop      *proxy_loop;
+        GError         *error = NULL;
+        guint16         port;
+
+        /* The proxy has to keep accepting connections while the main
+         * loop is blocked, so it gets its own main context */
+        context = g_main_context_new ();
+        g_main_context_push_thread_default (context);
+
+        service = g_threaded_socket_service_new (-1);
+        g_signal_connect (service, "run", G_CALLBACK (proxy_run), NULL);
+
+        loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+        address = g_inet_socket_address_new (loopback, 0);
+        if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+                                            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+                                            NULL, &effective_address, &error)) {
+                g_printerr ("Could not start the proxy: %s\n", error->message);
+                exit (1);
+        }
+        port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective_address));
+
+        g_object_unref (effective_address);
+        g_object_unref (address);
+        g_object_unref (loopback);
+
+        g_socket_service_start (service);
+        g_async_queue_push (port_queue, GUINT_TO_POINTER (port));
+
+        proxy_loop = g_main_loop_new (context, FALSE);
+        g_main_loop_run (proxy_loop);
+
+        return NULL;
+}
+
+static guint16
+start_proxy (void)
+{
+        GAsyncQueue *port_queue;
+        guint16      port;
+
+        port_queue = g_async_queue_new ();
+        g_thread_unref (g_thread_new ("proxy", proxy_thread, port_queue));
+        port = GPOINTER_TO_UINT (g_async_queue_pop (port_queue));
+        g_async_queue_unref (port_queue);
+
+        return port;
+}
+
+static guint16
+get_free_port (void)
+{
+        GSocketAddress *address;
+        GInetAddress   *loopback;
+        GSocket        *socket;
+        guint16         port;
+
+        socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL);
+        loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+        address = g_inet_socket_address_new (loopback, 0);
+        g_socket_bind (socket, address, FALSE, NULL);
+        g_object_unref (address);
+
+        address = g_socket_get_local_address (socket, NULL);
+        port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+
+        g_object_unref (address);
+        g_object_unref (loopback);
+        g_object_unref (socket);
+
+        return port;
+}
+
+static gboolean
+wait_for_port (const char *host,
+               int         port)
+{
+        GSocketClient     *client;
+        GSocketConnection *connection;
+        guint              i;
+
+        client = g_socket_client_new ();
+
+        for (i = 0; i < 50; i++) {
+                connection = g_socket_client_connect_to_host (client, host, port, NULL, NULL);
+                if (connection != NULL) {
+                        g_object_unref (connection);
+                        break;
+                }
+                g_usleep (100 * 1000);
+        }
+
+        g_object_unref (client);
+
+        return i < 50;
+}
+
+static GPid
+start_ippeveprinter (gchar **spool_dir)
+{
+        GError  *error = NULL;
+        gchar   *program;
+        gchar   *port;
+        GPid     pid;
+
+        program = g_find_program_in_path ("ippeveprinter");
+        if (program == NULL)
+                return 0;
+
+        *spool_dir = g_dir_make_tmp ("test-ipp-client-XXXXXX", NULL);
+        upstream_host = g_strdup ("127.0.0.1");
+        upstream_port = get_free_port ();
+        port = g_strdup_printf ("%d", upstream_port);
+
+        {
+                gchar *args[] = { program, "-p", port, "-d", *spool_dir, "-n", "localhost", "-r", "off", "gsd-test", NULL };
+
+                if (!g_spawn_async (NULL, args, NULL, G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                                    NULL, NULL, &pid, &error)) {
+                        g_printerr ("Could not start ippeveprinter: %s\n", error->message);
+                        exit (1);
+                }
+        }
+
+        g_free (port);
+        g_free (program);
+
+        if (!wait_for_port (upstream_host, upstream_port)) {
+                g_printerr ("ippeveprinter did not start\n");
+                kill (pid, SIGTERM);
+                exit (1);
+        }
+
+        return pid;
+}
+
+static ipp_t *
+new_request (const char *printer_uri)
+{
+        ipp_t *request;
+
+        request = ippNewRequest (IPP_GET_PRINTER_ATTRIBUTES);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "printer-uri", NULL, printer_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                      "requested-attributes", NULL, "printer-state");
+
+        return request;
+}
+
+static gboolean
+tick_cb (gpointer user_data)
+{
+        gint64 now = g_get_monotonic_time ();
+
+        max_stall = MAX (max_stall, now - last_tick - TICK_INTERVAL * 1000);
+        last_tick = now;
+
+        return G_SOURCE_CONTINUE;
+}
+
+static void
+reply_cb (GObject      *source_object,
+          GAsyncResult *res,
+          gpointer      user_data)
+{
+        ipp_t *response;
+
+        response = gsd_ipp_client_send_finish (res, NULL);
+        if (response != NULL)
+                ippDelete (response);
+        else
+                n_errors++;
+
+        if (++n_replies == n_requests)
+                g_main_loop_quit (loop);
+}
+
+typedef struct {
+        const char   *printer_uri;
+        const char   *resource;
+        GsdIppClient *client;
+} Run;
+
+static gboolean
+run_blocking (gpointer user_data)
+{
+        Run    *run = user_data;
+        http_t *http;
+        guint   i;
+
+        http = httpConnectEncrypt (cupsServer (), ippPort (), cupsEncryption ());
+        for (i = 0; i < n_requests; i++) {
+                ipp_t *response;
+
+                response = cupsDoRequest (http, new_request (run->printer_uri), run->resource);
+                if (response != NULL)
+                        ippDelete (response);
+                else
+                        n_errors++;
+                n_replies++;
+        }
+        if (http != NULL)
+                httpClose (http);
+
+        g_main_loop_quit (loop);
+
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean
+run_queued (gpointer user_data)
+{
+        Run  *run = user_data;
+        guint i;
+
+        for (i = 0; i < n_requests; i++)
+                gsd_ipp_client_send_async (run->client,
+                                           new_request (run->printer_uri),
+                                           run->resource,
+                                           NULL,
+                                           reply_cb,
+                                           NULL);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+measure (const char  *label,
+         GSourceFunc  func,
+         Run         *run)
+{
+        gint64 start;
+        guint  tick_id;
+
+        n_replies = 0;
+        n_errors = 0;
+        max_stall = 0;
+
+        start = last_tick = g_get_monotonic_time ();
+        tick_id = g_timeout_add (TICK_INTERVAL, tick_cb, NULL);
+        g_idle_add (func, run);
+        g_main_loop_run (loop);
+        g_source_remove (tick_id);
+
+        g_print ("%-9s %u requests in %8.2f ms, main loop blocked for up to %8.2f ms, %u errors\n",
+                 label, n_requests,
+                 (g_get_monotonic_time () - start) / 1000.0,
+                 max_stall / 1000.0,
+                 n_errors);
+}
+
+int
+main (int argc, char **argv)
+{
+        const char *printer_uri;
+        gchar      *default_uri = NULL;
+        gchar      *spool_dir = NULL;
+        gchar      *server;
+        char        scheme[32], userpass[256], host[256], resource[1024];
+        int         port;
+        GPid        pid = 0;
+        Run         run;
+
+        n_requests = argc > 1 ? atoi (argv[1]) : DEFAULT_N_REQUESTS;
+        latency = (argc > 2 ? atoi (argv[2]) : DEFAULT_LATENCY) * 1000;
+
+        printer_uri = g_getenv ("GSD_TEST_IPP_PRINTER");
+        if (printer_uri == NULL) {
+                pid = start_ippeveprinter (&spool_dir);
+                if (pid == 0) {
+                        g_printerr ("ippeveprinter not found and GSD_TEST_IPP_PRINTER not set\n");
+                        return 77;
+                }
+                default_uri = g_strdup_printf ("ipp://localhost:%d/ipp/print", upstream_port);
+                printer_uri = default_uri;
+        }
+
+        if (httpSeparateURI (HTTP_URI_CODING_ALL, printer_uri,
+                             scheme, sizeof (scheme),
+                             userpass, sizeof (userpass),
+                             host, sizeof (host), &port,
+                             resource, sizeof (resource), 0) < HTTP_URI_OK) {
+                g_printerr ("Invalid printer URI %s\n", printer_uri);
+                return 1;
+        }
+
+        if (upstream_host == NULL) {
+                upstream_host = g_strdup (host);
+                upstream_port = port;
+        }
+
+        /* Both the blocking requests and the client go through the proxy */
+        server = g_strdup_printf ("127.0.0.1:%u", start_proxy ());
+        cupsSetServer (server);
+        g_free (server);
+
+        loop = g_main_loop_new (NULL, FALSE);
+
+        run.printer_uri = printer_uri;
+        run.resource = resource;
+        run.client = gsd_ipp_client_new ();
+
+        g_print ("%u ms of latency\n", (guint) (latency / 1000));
+        measure ("blocking:", run_blocking, &run);
+        measure ("queued:", run_queued, &run);
+
+        gsd_ipp_client_free (run.client);
+        g_main_loop_unref (loop);
+
+        if (pid != 0) {
+                kill (pid, SIGTERM);
+                g_spawn_close_pid (pid);
+                g_rmdir (spool_dir);
+        }
+
+        g_free (spool_dir);
+        g_free (default_uri);
+        g_free (upstream_host);
+
+        return 0;
+}
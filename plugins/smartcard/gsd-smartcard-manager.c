@@ -29,6 +29,7 @@
 #include "gsd-smartcard-service.h"
 #include "gsd-smartcard-enum-types.h"
 #include "gsd-smartcard-utils.h"
+#include "gsd-smartcard-watcher.h"
 
 #include <prerror.h>
 #include <prinit.h>
@@ -37,6 +38,10 @@
 #include <secmod.h>
 #include <secerr.h>
 
+#if HAVE_GUDEV
+#include <gudev/gudev.h>
+#endif
+
 #define GSD_SMARTCARD_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_SMARTCARD_MANAGER, GsdSmartcardManagerPrivate))
 
 #define GSD_SESSION_MANAGER_LOGOUT_MODE_FORCE 2
@@ -45,8 +50,13 @@ struct GsdSmartcardManagerPrivate
 {
         guint start_idle_id;
         GsdSmartcardService *service;
-        GList *smartcards_watch_tasks;
+        GsdSmartcardWatcher *watcher;
+        GHashTable *smartcards;
         GCancellable *cancellable;
+#if HAVE_GUDEV
+        GUdevClient *udev_client;
+        gboolean has_readers;
+#endif
 
         GsdSessionManager *session_manager;
         GsdScreenSaver *screen_saver;
@@ -66,7 +76,7 @@ static void     lock_screen                       (GsdSmartcardManager *self);
 static void     log_out                           (GsdSmartcardManager *self);
 G_DEFINE_TYPE (GsdSmartcardManager, gsd_smartcard_manager, G_TYPE_OBJECT)
 G_DEFINE_QUARK (gsd-smartcard-manager-error, gsd_smartcard_manager_error)
-G_LOCK_DEFINE_STATIC (gsd_smartcards_watch_tasks);
+G_LOCK_DEFINE_STATIC (gsd_smartcards);
 
 static gpointer manager_object = NULL;
 
@@ -154,104 +164,61 @@ unload_nss (GsdSmartcardManager *self)
         }
 }
 
-typedef struct
-{
-        SECMODModule *driver;
-        GHashTable *smartcards;
-        int number_of_consecutive_errors;
-} WatchSmartcardsOperation;
-
 static void
-on_watch_cancelled (GCancellable             *cancellable,
-                    WatchSmartcardsOperation *operation)
-{
-        SECMOD_CancelWait (operation->driver);
-}
-
-static gboolean
-watch_one_event_from_driver (GsdSmartcardManager       *self,
-                             WatchSmartcardsOperation  *operation,
-                             GCancellable              *cancellable,
-                             GError                   **error)
+on_token_event (SECMODModule        *driver,
+                PK11SlotInfo        *card,
+                GsdSmartcardManager *self)
 {
         GsdSmartcardManagerPrivate *priv = self->priv;
-        PK11SlotInfo *card, *old_card;
+        GHashTable *smartcards;
+        PK11SlotInfo *old_card;
         CK_SLOT_ID slot_id;
-        gulong handler_id;
         int old_slot_series = -1, slot_series;
+        gboolean is_present;
 
-        handler_id = g_cancellable_connect (cancellable,
-                                            G_CALLBACK (on_watch_cancelled),
-                                            operation,
-                                            NULL);
-
-        card = SECMOD_WaitForAnyTokenEvent (operation->driver, 0, PR_SecondsToInterval (1));
+        slot_id = PK11_GetSlotID (card);
+        slot_series = PK11_GetSlotSeries (card);
 
-        g_cancellable_disconnect (cancellable, handler_id);
+        G_LOCK (gsd_smartcards);
+        smartcards = g_hash_table_lookup (priv->smartcards, driver);
 
-        if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
-                g_warning ("smartcard event function cancelled");
-                return FALSE;
+        old_card = g_hash_table_lookup (smartcards, GINT_TO_POINTER ((int) slot_id));
+        if (old_card != NULL) {
+                old_slot_series = PK11_GetSlotSeries (old_card);
+                PK11_ReferenceSlot (old_card);
+                g_hash_table_remove (smartcards, GINT_TO_POINTER ((int) slot_id));
         }
+        G_UNLOCK (gsd_smartcards);
 
-        if (card == NULL) {
-                int error_code;
-
-                error_code = PORT_GetError ();
-
-                operation->number_of_consecutive_errors++;
-                if (operation->number_of_consecutive_errors > 10) {
-                     g_warning ("Got %d consecutive smartcard errors, so giving up.",
-                                operation->number_of_consecutive_errors);
-
-                     g_set_error (error,
-                                  GSD_SMARTCARD_MANAGER_ERROR,
-                                  GSD_SMARTCARD_MANAGER_ERROR_WITH_NSS,
-                                  "encountered unexpected error while "
-                                  "waiting for smartcard events (error %x)",
-                                  error_code);
-                     return FALSE;
-                }
+        is_present = PK11_IsPresent (card);
 
-                g_warning ("Got potentially spurious smartcard event error: %x.", error_code);
-
-                g_usleep (0.5 * G_USEC_PER_SEC);
-                return TRUE;
+        if (is_present) {
+                G_LOCK (gsd_smartcards);
+                g_hash_table_replace (smartcards,
+                                      GINT_TO_POINTER ((int) slot_id),
+                                      PK11_ReferenceSlot (card));
+                G_UNLOCK (gsd_smartcards);
         }
-        operation->number_of_consecutive_errors = 0;
-
-        slot_id = PK11_GetSlotID (card);
-        slot_series = PK11_GetSlotSeries (card);
-
-        old_card = g_hash_table_lookup (operation->smartcards, GINT_TO_POINTER ((int) slot_id));
 
         /* If there is a different card in the slot now than
          * there was before, then we need to emit a removed signal
          * for the old card
          */
         if (old_card != NULL) {
-                old_slot_series = PK11_GetSlotSeries (old_card);
-
                 if (old_slot_series != slot_series) {
                         /* Card registered with slot previously is
                          * different than this card, so update its
                          * exported state to track the implicit missed
                          * removal
                          */
-                        gsd_smartcard_service_sync_token (priv->service, old_card, cancellable);
+                        gsd_smartcard_service_sync_token (priv->service, old_card, priv->cancellable);
                 }
-
-                g_hash_table_remove (operation->smartcards, GINT_TO_POINTER ((int) slot_id));
         }
 
-        if (PK11_IsPresent (card)) {
+        if (is_present) {
                 g_debug ("Detected smartcard insertion event in slot %d", (int) slot_id);
 
-                g_hash_table_replace (operation->smartcards,
-                                      GINT_TO_POINTER ((int) slot_id),
-                                      PK11_ReferenceSlot (card));
-
-                gsd_smartcard_service_sync_token (priv->service, card, cancellable);
+                gsd_smartcard_service_sync_token (priv->service, card, priv->cancellable);
         } else if (old_card == NULL) {
                 /* If the just removed smartcard is not known to us then
                  * ignore the removal event. NSS sends a synthentic removal
@@ -266,92 +233,98 @@ watch_one_event_from_driver (GsdSmartcardManager       *self,
                  * removal
                  */
                 if (old_slot_series == slot_series)
-                        gsd_smartcard_service_sync_token (priv->service, card, cancellable);
+                        gsd_smartcard_service_sync_token (priv->service, card, priv->cancellable);
         }
 
-        PK11_FreeSlot (card);
-
-        return TRUE;
+        if (old_card != NULL)
+                PK11_FreeSlot (old_card);
 }
 
-static void
-watch_smartcards_from_driver (GTask                    *task,
-                              GsdSmartcardManager      *self,
-                              WatchSmartcardsOperation *operation,
-                              GCancellable             *cancellable)
+#if HAVE_GUDEV
+static gboolean
+device_is_smartcard_reader (GUdevDevice *device)
 {
-        g_debug ("watching for smartcard events");
-        while (!g_cancellable_is_cancelled (cancellable)) {
-                gboolean watch_succeeded;
-                GError *error = NULL;
+        const char *interfaces;
 
-                watch_succeeded = watch_one_event_from_driver (self, operation, cancellable, &error);
+        if (g_strcmp0 (g_udev_device_get_devtype (device), "usb_device") != 0)
+                return FALSE;
 
-                if (g_task_return_error_if_cancelled (task)) {
-                        break;
-                }
+        /* Readers implement the Smart Card (CCID) interface class, 0x0b */
+        interfaces = g_udev_device_get_property (device, "ID_USB_INTERFACES");
 
-                if (!watch_succeeded) {
-                        g_task_return_error (task, error);
-                        break;
-                }
-        }
+        return interfaces != NULL && strstr (interfaces, ":0b") != NULL;
 }
 
-static void
-destroy_watch_smartcards_operation (WatchSmartcardsOperation *operation)
+/* Only CCID readers are recognized, not vendor-specific, non-USB or
+ * virtual ones. So whenever a missed removal would matter, because
+ * there is an action for it or the session was opened with a card,
+ * cards are waited for even though no reader was seen. Drivers
+ * without C_WaitForSlotEvent() then keep being polled every second,
+ * as they were before readers were looked for. */
+static gboolean
+must_always_watch (GsdSmartcardManager *self)
 {
-        SECMOD_DestroyModule (operation->driver);
-        g_hash_table_unref (operation->smartcards);
-        g_free (operation);
+        GsdSmartcardManagerPrivate *priv = self->priv;
+        char *remove_action;
+        gboolean always;
+
+        if (g_getenv ("PKCS11_LOGIN_TOKEN_NAME") != NULL)
+                return TRUE;
+
+        remove_action = g_settings_get_string (priv->settings, KEY_REMOVE_ACTION);
+        always = g_strcmp0 (remove_action, "none") != 0;
+        g_free (remove_action);
+
+        return always;
 }
 
 static void
-on_smartcards_watch_task_destroyed (GsdSmartcardManager *self,
-                                    GTask               *freed_task)
+update_watcher_active (GsdSmartcardManager *self)
 {
         GsdSmartcardManagerPrivate *priv = self->priv;
 
-        G_LOCK (gsd_smartcards_watch_tasks);
-        priv->smartcards_watch_tasks = g_list_remove (priv->smartcards_watch_tasks,
-                                                      freed_task);
-        G_UNLOCK (gsd_smartcards_watch_tasks);
+        /* Without any reader, no card can come and go, so there
+         * is nothing to wait for */
+        gsd_smartcard_watcher_set_active (priv->watcher,
+                                          priv->has_readers || must_always_watch (self));
 }
 
 static void
-watch_smartcards_from_driver_async (GsdSmartcardManager *self,
-                                    SECMODModule        *driver,
-                                    GCancellable        *cancellable,
-                                    GAsyncReadyCallback  callback,
-                                    gpointer             user_data)
+update_smartcard_readers (GsdSmartcardManager *self)
 {
         GsdSmartcardManagerPrivate *priv = self->priv;
-        GTask *task;
-        WatchSmartcardsOperation *operation;
+        gboolean has_readers = FALSE;
+        GList *devices, *l;
 
-        operation = g_new0 (WatchSmartcardsOperation, 1);
-        operation->driver = SECMOD_ReferenceModule (driver);
-        operation->smartcards = g_hash_table_new_full (g_direct_hash,
-                                                       g_direct_equal,
-                                                       NULL,
-                                                       (GDestroyNotify) PK11_FreeSlot);
+        devices = g_udev_client_query_by_subsystem (priv->udev_client, "usb");
+        for (l = devices; l != NULL && !has_readers; l = l->next)
+                has_readers = device_is_smartcard_reader (l->data);
+        g_list_free_full (devices, g_object_unref);
 
-        task = g_task_new (self, cancellable, callback, user_data);
+        g_debug ("Smartcard readers %s", has_readers ? "present" : "absent");
 
-        g_task_set_task_data (task,
-                              operation,
-                              (GDestroyNotify) destroy_watch_smartcards_operation);
+        priv->has_readers = has_readers;
+        update_watcher_active (self);
+}
 
-        G_LOCK (gsd_smartcards_watch_tasks);
-        priv->smartcards_watch_tasks = g_list_prepend (priv->smartcards_watch_tasks,
-                                                       task);
-        g_object_weak_ref (G_OBJECT (task),
-                           (GWeakNotify) on_smartcards_watch_task_destroyed,
-                           self);
-        G_UNLOCK (gsd_smartcards_watch_tasks);
+static void
+on_remove_action_changed (GSettings           *settings,
+                          const char          *key,
+                          GsdSmartcardManager *self)
+{
+        update_watcher_active (self);
+}
 
-        g_task_run_in_thread (task, (GTaskThreadFunc) watch_smartcards_from_driver);
+static void
+on_udev_event (GUdevClient         *client,
+               const char          *action,
+               GUdevDevice         *device,
+               GsdSmartcardManager *self)
+{
+        if (device_is_smartcard_reader (device))
+                update_smartcard_readers (self);
 }
+#endif /* HAVE_GUDEV */
 
 static gboolean
 register_driver_finish (GsdSmartcardManager  *self,
@@ -379,14 +352,6 @@ on_driver_registered (GsdSmartcardManager *self,
         g_object_unref (task);
 }
 
-static void
-on_smartcards_from_driver_watched (GsdSmartcardManager *self,
-                                   GAsyncResult        *result,
-                                   GTask               *task)
-{
-        g_debug ("Done watching smartcards from driver");
-}
-
 typedef struct {
         SECMODModule *driver;
         guint         idle_id;
@@ -466,6 +431,7 @@ activate_driver (GsdSmartcardManager *self,
                  GAsyncReadyCallback  callback,
                  gpointer             user_data)
 {
+        GsdSmartcardManagerPrivate *priv = self->priv;
         GTask *task;
 
         g_debug ("Activating driver '%s'", driver->commonName);
@@ -477,11 +443,17 @@ activate_driver (GsdSmartcardManager *self,
                          cancellable,
                          (GAsyncReadyCallback) on_driver_registered,
                          task);
-        watch_smartcards_from_driver_async (self,
-                                            driver,
-                                            cancellable,
-                                            (GAsyncReadyCallback) on_smartcards_from_driver_watched,
-                                            task);
+
+        G_LOCK (gsd_smartcards);
+        g_hash_table_insert (priv->smartcards,
+                             SECMOD_ReferenceModule (driver),
+                             g_hash_table_new_full (g_direct_hash,
+                                                    g_direct_equal,
+                                                    NULL,
+                                                    (GDestroyNotify) PK11_FreeSlot));
+        G_UNLOCK (gsd_smartcards);
+
+        gsd_smartcard_watcher_add_driver (priv->watcher, driver);
 }
 
 typedef struct
@@ -720,6 +692,28 @@ gsd_smartcard_manager_idle_cb (GsdSmartcardManager *self)
 
         load_nss (self);
 
+        priv->smartcards = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  (GDestroyNotify) SECMOD_DestroyModule,
+                                                  (GDestroyNotify) g_hash_table_unref);
+        priv->watcher = gsd_smartcard_watcher_new ((GsdSmartcardWatcherFunc) on_token_event,
+                                                   self);
+
+#if HAVE_GUDEV
+        {
+                const char * const subsystems[] = { "usb", NULL };
+
+                priv->udev_client = g_udev_client_new (subsystems);
+                g_signal_connect (priv->udev_client, "uevent",
+                                  G_CALLBACK (on_udev_event), self);
+                g_signal_connect (priv->settings, "changed::" KEY_REMOVE_ACTION,
+                                  G_CALLBACK (on_remove_action_changed), self);
+                update_smartcard_readers (self);
+        }
+#else
+        gsd_smartcard_watcher_set_active (priv->watcher, TRUE);
+#endif
+
         gsd_smartcard_service_new_async (self,
                                          priv->cancellable,
                                          (GAsyncReadyCallback) on_service_created,
@@ -754,6 +748,21 @@ gsd_smartcard_manager_stop (GsdSmartcardManager *self)
 
         g_debug ("Stopping smartcard manager");
 
+        if (priv->cancellable != NULL)
+                g_cancellable_cancel (priv->cancellable);
+
+#if HAVE_GUDEV
+        if (priv->udev_client != NULL)
+                g_signal_handlers_disconnect_by_data (priv->udev_client, self);
+        g_clear_object (&priv->udev_client);
+        if (priv->settings != NULL)
+                g_signal_handlers_disconnect_by_data (priv->settings, self);
+#endif
+
+        /* The watching threads are joined before NSS goes away */
+        g_clear_pointer (&priv->watcher, gsd_smartcard_watcher_free);
+        g_clear_pointer (&priv->smartcards, g_hash_table_unref);
+
         unload_nss (self);
 
         g_clear_object (&priv->settings);
@@ -840,13 +849,13 @@ gsd_smartcard_manager_do_remove_action (GsdSmartcardManager *self)
 }
 
 static PK11SlotInfo *
-get_login_token_for_operation (GsdSmartcardManager      *self,
-                               WatchSmartcardsOperation *operation)
+get_login_token_for_driver (GsdSmartcardManager *self,
+                            GHashTable          *smartcards)
 {
         GHashTableIter iter;
         gpointer key, value;
 
-        g_hash_table_iter_init (&iter, operation->smartcards);
+        g_hash_table_iter_init (&iter, smartcards);
         while (g_hash_table_iter_next (&iter, &key, &value)) {
                 PK11SlotInfo *card_slot;
                 const char *token_name;
@@ -866,35 +875,34 @@ gsd_smartcard_manager_get_login_token (GsdSmartcardManager *self)
 {
         GsdSmartcardManagerPrivate *priv = self->priv;
         PK11SlotInfo *card_slot = NULL;
-        GList *node;
+        GHashTableIter iter;
+        gpointer smartcards;
 
-        G_LOCK (gsd_smartcards_watch_tasks);
-        node = priv->smartcards_watch_tasks;
-        while (node != NULL) {
-                GTask *task = node->data;
-                WatchSmartcardsOperation *operation = g_task_get_task_data (task);
+        if (priv->smartcards == NULL)
+                return NULL;
 
-                card_slot = get_login_token_for_operation (self, operation);
+        G_LOCK (gsd_smartcards);
+        g_hash_table_iter_init (&iter, priv->smartcards);
+        while (g_hash_table_iter_next (&iter, NULL, &smartcards)) {
+                card_slot = get_login_token_for_driver (self, smartcards);
 
                 if (card_slot != NULL)
                         break;
-
-                node = node->next;
         }
-        G_UNLOCK (gsd_smartcards_watch_tasks);
+        G_UNLOCK (gsd_smartcards);
 
         return card_slot;
 }
 
 static GList *
-get_inserted_tokens_for_operation (GsdSmartcardManager      *self,
-                                   WatchSmartcardsOperation *operation)
+get_inserted_tokens_for_driver (GsdSmartcardManager *self,
+                                GHashTable          *smartcards)
 {
         GList *inserted_tokens = NULL;
         GHashTableIter iter;
         gpointer key, value;
 
-        g_hash_table_iter_init (&iter, operation->smartcards);
+        g_hash_table_iter_init (&iter, smartcards);
         while (g_hash_table_iter_next (&iter, &key, &value)) {
                 PK11SlotInfo *card_slot;
 
@@ -912,19 +920,22 @@ gsd_smartcard_manager_get_inserted_tokens (GsdSmartcardManager *self,
                                            gsize               *num_tokens)
 {
         GsdSmartcardManagerPrivate *priv = self->priv;
-        GList *inserted_tokens = NULL, *node;
+        GList *inserted_tokens = NULL;
+        GHashTableIter iter;
+        gpointer smartcards;
 
-        G_LOCK (gsd_smartcards_watch_tasks);
-        for (node = priv->smartcards_watch_tasks; node != NULL; node = node->next) {
-                GTask *task = node->data;
-                WatchSmartcardsOperation *operation = g_task_get_task_data (task);
-                GList *operation_inserted_tokens;
+        G_LOCK (gsd_smartcards);
+        if (priv->smartcards != NULL) {
+                g_hash_table_iter_init (&iter, priv->smartcards);
+                while (g_hash_table_iter_next (&iter, NULL, &smartcards)) {
+                        GList *driver_inserted_tokens;
 
-                operation_inserted_tokens = get_inserted_tokens_for_operation (self, operation);
+                        driver_inserted_tokens = get_inserted_tokens_for_driver (self, smartcards);
 
-                inserted_tokens = g_list_concat (inserted_tokens, operation_inserted_tokens);
+                        inserted_tokens = g_list_concat (inserted_tokens, driver_inserted_tokens);
+                }
         }
-        G_UNLOCK (gsd_smartcards_watch_tasks);
+        G_UNLOCK (gsd_smartcards);
 
         if (num_tokens != NULL)
                 *num_tokens = g_list_length (inserted_tokens);
@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include "gsd-smartcard-watcher.h"
+
+#include <secerr.h>
+
+/*
+ * PKCS#11 has no way to wait for the events of several modules at once,
+ * so each driver is waited for by its own thread, which only exists
+ * while the watcher is active. Modules implementing C_WaitForSlotEvent()
+ * block until there is an event, and SECMOD_CancelWait() interrupts
+ * them. NSS simulates the wait for the other modules by polling their
+ * slots, at POLL_INTERVAL.
+ *
+ * When the watcher becomes inactive, a driver which still has a card
+ * inserted keeps being watched until the card is removed, so that
+ * pulling the reader out with the card in it is seen as a removal.
+ * Likewise, a driver added with a card already inserted is watched
+ * until its removal, even while the watcher is inactive.
+ */
+
+#define POLL_INTERVAL           PR_SecondsToInterval (1)
+#define MAX_CONSECUTIVE_ERRORS  10
+#define ERROR_RETRY_INTERVAL    (G_USEC_PER_SEC / 2)
+
+struct _GsdSmartcardWatcher
+{
+        GsdSmartcardWatcherFunc  func;
+        gpointer                 user_data;
+
+        GMutex                   lock;
+        GCond                    cond;
+        GPtrArray               *watches;
+        gboolean                 active;
+};
+
+typedef struct
+{
+        GsdSmartcardWatcher *watcher;
+        SECMODModule        *driver;
+        GThread             *thread;
+
+        /* Protected by the lock of the watcher */
+        gboolean             running;
+        gboolean             stopping;
+        gboolean             cancelled;
+} DriverWatch;
+
+static void
+driver_watch_free (DriverWatch *watch)
+{
+        SECMOD_DestroyModule (watch->driver);
+        g_free (watch);
+}
+
+static gboolean
+driver_has_cards (SECMODModule *driver)
+{
+        SECMODListLock *lock;
+        gboolean has_cards = FALSE;
+        int i;
+
+        lock = SECMOD_GetDefaultModuleListLock ();
+
+        SECMOD_GetReadLock (lock);
+        for (i = 0; i < driver->slotCount && !has_cards; i++) {
+                PK11SlotInfo *slot = driver->slots[i];
+
+                if (PK11_IsRemovable (slot) && PK11_IsPresent (slot))
+                        has_cards = TRUE;
+        }
+        SECMOD_ReleaseReadLock (lock);
+
+        return has_cards;
+}
+
+static gpointer
+watch_driver (DriverWatch *watch)
+{
+        GsdSmartcardWatcher *watcher = watch->watcher;
+        int number_of_consecutive_errors = 0;
+
+        g_debug ("Watching for smartcard events from '%s'", watch->driver->commonName);
+
+        g_mutex_lock (&watcher->lock);
+        while (TRUE) {
+                PK11SlotInfo *card;
+                gint64 end_time;
+
+                g_mutex_unlock (&watcher->lock);
+                card = SECMOD_WaitForAnyTokenEvent (watch->driver, 0, POLL_INTERVAL);
+
+                if (card != NULL) {
+                        gboolean has_cards;
+
+                        number_of_consecutive_errors = 0;
+
+                        watcher->func (watch->driver, card, watcher->user_data);
+                        PK11_FreeSlot (card);
+
+                        has_cards = driver_has_cards (watch->driver);
+
+                        g_mutex_lock (&watcher->lock);
+                        if (watch->stopping && !has_cards)
+                                break;
+                        continue;
+                }
+
+                g_mutex_lock (&watcher->lock);
+
+                if (watch->cancelled) {
+                        watch->cancelled = FALSE;
+                        if (watch->stopping)
+                                break;
+                        continue;
+                }
+
+                number_of_consecutive_errors++;
+                if (number_of_consecutive_errors > MAX_CONSECUTIVE_ERRORS) {
+                        g_warning ("Got %d consecutive smartcard errors from '%s', so giving up.",
+                                   number_of_consecutive_errors, watch->driver->commonName);
+                        break;
+                }
+
+                g_warning ("Got potentially spurious smartcard event error: %x.", PORT_GetError ());
+
+                end_time = g_get_monotonic_time () + ERROR_RETRY_INTERVAL;
+                while (!watch->stopping &&
+                       g_cond_wait_until (&watcher->cond, &watcher->lock, end_time))
+                        ;
+
+                if (watch->stopping)
+                        break;
+        }
+        watch->running = FALSE;
+        g_mutex_unlock (&watcher->lock);
+
+        g_debug ("Done watching smartcards from '%s'", watch->driver->commonName);
+
+        return NULL;
+}
+
+/* Called with the lock held */
+static void
+start_watch (DriverWatch *watch)
+{
+        watch->stopping = FALSE;
+
+        if (watch->running)
+                return;
+
+        /* The previous thread has left its loop, if any */
+        if (watch->thread != NULL)
+                g_thread_join (watch->thread);
+
+        watch->running = TRUE;
+        watch->thread = g_thread_new ("gsd-smartcard-watch",
+                                      (GThreadFunc) watch_driver,
+                                      watch);
+}
+
+/* Called with the lock held */
+static void
+stop_watch (DriverWatch *watch,
+            gboolean     force)
+{
+        if (!watch->running || watch->stopping)
+                return;
+
+        watch->stopping = TRUE;
+
+        if (force || !driver_has_cards (watch->driver)) {
+                watch->cancelled = TRUE;
+                SECMOD_CancelWait (watch->driver);
+        }
+}
+
+GsdSmartcardWatcher *
+gsd_smartcard_watcher_new (GsdSmartcardWatcherFunc func,
+                           gpointer                user_data)
+{
+        GsdSmartcardWatcher *watcher;
+
+        watcher = g_new0 (GsdSmartcardWatcher, 1);
+        watcher->func = func;
+        watcher->user_data = user_data;
+        g_mutex_init (&watcher->lock);
+        g_cond_init (&watcher->cond);
+        watcher->watches = g_ptr_array_new_with_free_func ((GDestroyNotify) driver_watch_free);
+
+        return watcher;
+}
+
+void
+gsd_smartcard_watcher_free (GsdSmartcardWatcher *watcher)
+{
+        guint i;
+
+        g_mutex_lock (&watcher->lock);
+        for (i = 0; i < watcher->watches->len; i++) {
+                DriverWatch *watch = g_ptr_array_index (watcher->watches, i);
+
+                /* Asked to stop by gsd_smartcard_watcher_set_active()
+                 * while a card was still inserted */
+                if (watch->running && !watch->cancelled) {
+                        watch->stopping = FALSE;
+                        stop_watch (watch, TRUE);
+                }
+        }
+        g_cond_broadcast (&watcher->cond);
+        g_mutex_unlock (&watcher->lock);
+
+        for (i = 0; i < watcher->watches->len; i++) {
+                DriverWatch *watch = g_ptr_array_index (watcher->watches, i);
+
+                if (watch->thread != NULL)
+                        g_thread_join (watch->thread);
+        }
+
+        g_ptr_array_free (watcher->watches, TRUE);
+        g_cond_clear (&watcher->cond);
+        g_mutex_clear (&watcher->lock);
+        g_free (watcher);
+}
+
+void
+gsd_smartcard_watcher_add_driver (GsdSmartcardWatcher *watcher,
+                                  SECMODModule        *driver)
+{
+        DriverWatch *watch;
+
+        watch = g_new0 (DriverWatch, 1);
+        watch->watcher = watcher;
+        watch->driver = SECMOD_ReferenceModule (driver);
+
+        g_mutex_lock (&watcher->lock);
+        g_ptr_array_add (watcher->watches, watch);
+        if (watcher->active) {
+                start_watch (watch);
+        } else if (driver_has_cards (driver)) {
+                start_watch (watch);
+                stop_watch (watch, FALSE);
+        }
+        g_mutex_unlock (&watcher->lock);
+}
+
+void
+gsd_smartcard_watcher_set_active (GsdSmartcardWatcher *watcher,
+                                  gboolean             active)
+{
+        guint i;
+
+        g_mutex_lock (&watcher->lock);
+        if (watcher->active == active) {
+                g_mutex_unlock (&watcher->lock);
+                return;
+        }
+
+        g_debug ("%s watching for smartcard events", active ? "Starting" : "Stopping");
+
+        watcher->active = active;
+        for (i = 0; i < watcher->watches->len; i++) {
+                DriverWatch *watch = g_ptr_array_index (watcher->watches, i);
+
+                if (active)
+                        start_watch (watch);
+                else
+                        stop_watch (watch, FALSE);
+        }
+        g_cond_broadcast (&watcher->cond);
+        g_mutex_unlock (&watcher->lock);
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GSD_SMARTCARD_WATCHER_H__
+#define __GSD_SMARTCARD_WATCHER_H__
+
+#include <glib.h>
+
+#include <secmod.h>
+#include <pk11func.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Waits for token events from PKCS#11 drivers and hands them to a
+ * callback, which runs in a thread of the watcher. Apart from the
+ * removal of cards which are already inserted, nothing is waited for
+ * while the watcher is inactive, and it becomes active through
+ * gsd_smartcard_watcher_set_active(), so that a system without any
+ * reader is never woken up for smartcards.
+ */
+typedef struct _GsdSmartcardWatcher GsdSmartcardWatcher;
+
+typedef void (* GsdSmartcardWatcherFunc) (SECMODModule *driver,
+                                          PK11SlotInfo *card,
+                                          gpointer      user_data);
+
+GsdSmartcardWatcher *gsd_smartcard_watcher_new        (GsdSmartcardWatcherFunc  func,
+                                                       gpointer                 user_data);
+void                 gsd_smartcard_watcher_free       (GsdSmartcardWatcher     *watcher);
+
+void                 gsd_smartcard_watcher_add_driver (GsdSmartcardWatcher     *watcher,
+                                                       SECMODModule            *driver);
+void                 gsd_smartcard_watcher_set_active (GsdSmartcardWatcher     *watcher,
+                                                       gboolean                 active);
+
+G_END_DECLS
+
+#endif /* __GSD_SMARTCARD_WATCHER_H__ */
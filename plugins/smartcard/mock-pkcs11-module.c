@@ -0,0 +1,368 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A software PKCS#11 module with a single removable slot, standing in
+ * for a reader in test-smartcard-watcher. The token is inserted and
+ * removed through mock_pkcs11_set_token_present(), and every call
+ * which a watcher makes to find out about events is counted, so that
+ * wakeups can be measured. Everything else is not supported.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gmodule.h>
+
+#include <pkcs11.h>
+
+#define MOCK_SLOT_ID 1
+
+static GMutex   lock;
+static GCond    cond;
+static gboolean initialized;
+static guint    n_finalized;
+static gboolean token_present;
+static gboolean event_pending;
+static guint    insertion;
+static guint    n_calls;
+
+static CK_FUNCTION_LIST function_list;
+
+static void
+copy_padded (CK_UTF8CHAR *dest,
+             const char  *src,
+             gsize        length)
+{
+        memset (dest, ' ', length);
+        memcpy (dest, src, MIN (strlen (src), length));
+}
+
+/* Called with the lock held */
+static gboolean
+session_is_valid (CK_SESSION_HANDLE session)
+{
+        return token_present && session == insertion;
+}
+
+static CK_RV
+mock_not_supported (void)
+{
+        return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV
+mock_initialize (CK_VOID_PTR init_args)
+{
+        g_mutex_lock (&lock);
+        initialized = TRUE;
+        g_mutex_unlock (&lock);
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_finalize (CK_VOID_PTR reserved)
+{
+        g_mutex_lock (&lock);
+        initialized = FALSE;
+        n_finalized++;
+        g_cond_broadcast (&cond);
+        g_mutex_unlock (&lock);
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_info (CK_INFO_PTR info)
+{
+        memset (info, 0, sizeof (CK_INFO));
+        info->cryptokiVersion.major = 2;
+        info->cryptokiVersion.minor = 20;
+        copy_padded (info->manufacturerID, "GNOME", sizeof (info->manufacturerID));
+        copy_padded (info->libraryDescription, "Mock smartcard module", sizeof (info->libraryDescription));
+        info->libraryVersion.major = 1;
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_slot_list (CK_BBOOL       token_present_only,
+                    CK_SLOT_ID_PTR slot_list,
+                    CK_ULONG_PTR   count)
+{
+        CK_ULONG n_slots = 1;
+
+        g_mutex_lock (&lock);
+        if (token_present_only && !token_present)
+                n_slots = 0;
+        g_mutex_unlock (&lock);
+
+        if (slot_list != NULL) {
+                if (*count < n_slots) {
+                        *count = n_slots;
+                        return CKR_BUFFER_TOO_SMALL;
+                }
+                if (n_slots > 0)
+                        slot_list[0] = MOCK_SLOT_ID;
+        }
+        *count = n_slots;
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_slot_info (CK_SLOT_ID      slot,
+                    CK_SLOT_INFO_PTR info)
+{
+        if (slot != MOCK_SLOT_ID)
+                return CKR_SLOT_ID_INVALID;
+
+        memset (info, 0, sizeof (CK_SLOT_INFO));
+        copy_padded (info->slotDescription, "Mock reader", sizeof (info->slotDescription));
+        copy_padded (info->manufacturerID, "GNOME", sizeof (info->manufacturerID));
+        info->flags = CKF_REMOVABLE_DEVICE | CKF_HW_SLOT;
+
+        g_mutex_lock (&lock);
+        n_calls++;
+        if (token_present)
+                info->flags |= CKF_TOKEN_PRESENT;
+        g_mutex_unlock (&lock);
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_token_info (CK_SLOT_ID        slot,
+                     CK_TOKEN_INFO_PTR info)
+{
+        gboolean present;
+
+        if (slot != MOCK_SLOT_ID)
+                return CKR_SLOT_ID_INVALID;
+
+        g_mutex_lock (&lock);
+        present = token_present;
+        g_mutex_unlock (&lock);
+
+        if (!present)
+                return CKR_TOKEN_NOT_PRESENT;
+
+        memset (info, 0, sizeof (CK_TOKEN_INFO));
+        copy_padded (info->label, "Mock token", sizeof (info->label));
+        copy_padded (info->manufacturerID, "GNOME", sizeof (info->manufacturerID));
+        copy_padded (info->model, "Mock", sizeof (info->model));
+        copy_padded (info->serialNumber, "0001", sizeof (info->serialNumber));
+        info->flags = CKF_TOKEN_INITIALIZED | CKF_WRITE_PROTECTED;
+        info->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+        info->ulMaxRwSessionCount = CK_EFFECTIVELY_INFINITE;
+        info->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+        info->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+        info->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+        info->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_mechanism_list (CK_SLOT_ID            slot,
+                         CK_MECHANISM_TYPE_PTR mechanisms,
+                         CK_ULONG_PTR          count)
+{
+        *count = 0;
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_open_session (CK_SLOT_ID            slot,
+                   CK_FLAGS              flags,
+                   CK_VOID_PTR           application,
+                   CK_NOTIFY             notify,
+                   CK_SESSION_HANDLE_PTR session)
+{
+        CK_RV rv = CKR_OK;
+
+        g_mutex_lock (&lock);
+        if (slot != MOCK_SLOT_ID)
+                rv = CKR_SLOT_ID_INVALID;
+        else if (!token_present)
+                rv = CKR_TOKEN_NOT_PRESENT;
+        else
+                *session = insertion;
+        g_mutex_unlock (&lock);
+
+        return rv;
+}
+
+static CK_RV
+mock_close_session (CK_SESSION_HANDLE session)
+{
+        return CKR_OK;
+}
+
+static CK_RV
+mock_close_all_sessions (CK_SLOT_ID slot)
+{
+        return CKR_OK;
+}
+
+static CK_RV
+mock_get_session_info (CK_SESSION_HANDLE   session,
+                       CK_SESSION_INFO_PTR info)
+{
+        CK_RV rv = CKR_OK;
+
+        g_mutex_lock (&lock);
+        if (session_is_valid (session)) {
+                memset (info, 0, sizeof (CK_SESSION_INFO));
+                info->slotID = MOCK_SLOT_ID;
+                info->state = CKS_RO_PUBLIC_SESSION;
+                info->flags = CKF_SERIAL_SESSION;
+        } else {
+                rv = CKR_SESSION_HANDLE_INVALID;
+        }
+        g_mutex_unlock (&lock);
+
+        return rv;
+}
+
+static CK_RV
+mock_find_objects_init (CK_SESSION_HANDLE session,
+                        CK_ATTRIBUTE_PTR  template,
+                        CK_ULONG          count)
+{
+        CK_RV rv;
+
+        g_mutex_lock (&lock);
+        rv = session_is_valid (session) ? CKR_OK : CKR_SESSION_HANDLE_INVALID;
+        g_mutex_unlock (&lock);
+
+        return rv;
+}
+
+static CK_RV
+mock_find_objects (CK_SESSION_HANDLE    session,
+                   CK_OBJECT_HANDLE_PTR objects,
+                   CK_ULONG             max_count,
+                   CK_ULONG_PTR         count)
+{
+        *count = 0;
+
+        return CKR_OK;
+}
+
+static CK_RV
+mock_find_objects_final (CK_SESSION_HANDLE session)
+{
+        return CKR_OK;
+}
+
+static CK_RV
+mock_wait_for_slot_event (CK_FLAGS       flags,
+                          CK_SLOT_ID_PTR slot,
+                          CK_VOID_PTR    reserved)
+{
+        guint finalized;
+        CK_RV rv;
+
+        g_mutex_lock (&lock);
+        n_calls++;
+
+        /* C_Finalize() interrupts the wait, even when the module gets
+         * initialized again before the waiting thread wakes up */
+        finalized = n_finalized;
+        while (!event_pending && initialized && finalized == n_finalized &&
+               !(flags & CKF_DONT_BLOCK))
+                g_cond_wait (&cond, &lock);
+
+        if (!initialized || finalized != n_finalized) {
+                rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+        } else if (event_pending) {
+                event_pending = FALSE;
+                *slot = MOCK_SLOT_ID;
+                rv = CKR_OK;
+        } else {
+                rv = CKR_NO_EVENT;
+        }
+        g_mutex_unlock (&lock);
+
+        return rv;
+}
+
+G_MODULE_EXPORT CK_RV
+C_GetFunctionList (CK_FUNCTION_LIST_PTR_PTR list)
+{
+        static const CK_FUNCTION_LIST unsupported = {
+                { 2, 20 },
+#undef CK_NEED_ARG_LIST
+#undef CK_PKCS11_FUNCTION_INFO
+#define CK_PKCS11_FUNCTION_INFO(name) (__PASTE (CK_, name)) mock_not_supported,
+#define CK_PKCS11_2_0_ONLY 1
+#include <pkcs11f.h>
+#undef CK_PKCS11_2_0_ONLY
+        };
+
+        function_list = unsupported;
+        function_list.C_Initialize = mock_initialize;
+        function_list.C_Finalize = mock_finalize;
+        function_list.C_GetInfo = mock_get_info;
+        function_list.C_GetFunctionList = C_GetFunctionList;
+        function_list.C_GetSlotList = mock_get_slot_list;
+        function_list.C_GetSlotInfo = mock_get_slot_info;
+        function_list.C_GetTokenInfo = mock_get_token_info;
+        function_list.C_GetMechanismList = mock_get_mechanism_list;
+        function_list.C_OpenSession = mock_open_session;
+        function_list.C_CloseSession = mock_close_session;
+        function_list.C_CloseAllSessions = mock_close_all_sessions;
+        function_list.C_GetSessionInfo = mock_get_session_info;
+        function_list.C_FindObjectsInit = mock_find_objects_init;
+        function_list.C_FindObjects = mock_find_objects;
+        function_list.C_FindObjectsFinal = mock_find_objects_final;
+        function_list.C_WaitForSlotEvent = mock_wait_for_slot_event;
+
+        *list = &function_list;
+
+        return CKR_OK;
+}
+
+G_MODULE_EXPORT void
+mock_pkcs11_set_token_present (gboolean present)
+{
+        g_mutex_lock (&lock);
+        if (token_present != present) {
+                token_present = present;
+                if (present)
+                        insertion++;
+                event_pending = TRUE;
+                g_cond_broadcast (&cond);
+        }
+        g_mutex_unlock (&lock);
+}
+
+G_MODULE_EXPORT guint
+mock_pkcs11_get_n_calls (void)
+{
+        guint calls;
+
+        g_mutex_lock (&lock);
+        calls = n_calls;
+        g_mutex_unlock (&lock);
+
+        return calls;
+}
@@ -0,0 +1,152 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for GsdSmartcardWatcher: loads a software PKCS#11 module
+ * with a removable slot into NSS, inserts and removes its token, and
+ * reports how fast the events are seen, and how many times the driver
+ * is called into while nothing happens, with and without a reader.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <glib.h>
+#include <gmodule.h>
+
+#include <nss.h>
+
+#include "gsd-smartcard-watcher.h"
+
+#define IDLE_SECONDS   3
+#define EVENT_TIMEOUT  (5 * G_USEC_PER_SEC)
+
+enum {
+        EVENT_REMOVED = 1,
+        EVENT_INSERTED
+};
+
+static void  (* set_token_present) (gboolean present);
+static guint (* get_n_calls)       (void);
+
+static GAsyncQueue *events;
+
+static void
+on_token_event (SECMODModule *driver,
+                PK11SlotInfo *card,
+                gpointer      user_data)
+{
+        g_async_queue_push (events,
+                            GINT_TO_POINTER (PK11_IsPresent (card) ? EVENT_INSERTED : EVENT_REMOVED));
+}
+
+static gboolean
+change_token (gboolean    present,
+              const char *what)
+{
+        gpointer event;
+        gint64 start;
+
+        start = g_get_monotonic_time ();
+        set_token_present (present);
+
+        while ((event = g_async_queue_timeout_pop (events, EVENT_TIMEOUT)) != NULL) {
+                if (GPOINTER_TO_INT (event) == (present ? EVENT_INSERTED : EVENT_REMOVED)) {
+                        g_print ("%-30s %8.2f ms\n", what, (g_get_monotonic_time () - start) / 1000.0);
+                        return TRUE;
+                }
+        }
+
+        g_printerr ("%-30s not seen\n", what);
+        return FALSE;
+}
+
+static void
+count_idle_calls (const char *what)
+{
+        guint calls;
+
+        calls = get_n_calls ();
+        g_usleep (IDLE_SECONDS * G_USEC_PER_SEC);
+        g_print ("%-30s %8u calls in %d s\n", what, get_n_calls () - calls, IDLE_SECONDS);
+}
+
+int
+main (int argc, char **argv)
+{
+        GsdSmartcardWatcher *watcher;
+        SECMODModule *driver;
+        GModule *module;
+        gboolean ok = TRUE;
+        gint64 start;
+        char *spec;
+
+        if (NSS_NoDB_Init (NULL) != SECSuccess) {
+                g_printerr ("Could not initialize NSS\n");
+                return 77;
+        }
+
+        spec = g_strdup_printf ("library=\"%s\" name=\"Mock smartcard\"", MOCK_PKCS11_MODULE);
+        driver = SECMOD_LoadUserModule (spec, NULL, PR_FALSE);
+        g_free (spec);
+
+        if (driver == NULL || !driver->loaded) {
+                g_printerr ("Could not load %s\n", MOCK_PKCS11_MODULE);
+                return 77;
+        }
+
+        /* The same instance as the one NSS loaded */
+        module = g_module_open (MOCK_PKCS11_MODULE, G_MODULE_BIND_LOCAL);
+        if (module == NULL ||
+            !g_module_symbol (module, "mock_pkcs11_set_token_present", (gpointer *) &set_token_present) ||
+            !g_module_symbol (module, "mock_pkcs11_get_n_calls", (gpointer *) &get_n_calls)) {
+                g_printerr ("Could not open %s: %s\n", MOCK_PKCS11_MODULE, g_module_error ());
+                return 1;
+        }
+
+        events = g_async_queue_new ();
+        watcher = gsd_smartcard_watcher_new (on_token_event, NULL);
+        gsd_smartcard_watcher_add_driver (watcher, driver);
+
+        count_idle_calls ("Without reader, idle:");
+
+        gsd_smartcard_watcher_set_active (watcher, TRUE);
+        count_idle_calls ("With reader, idle:");
+
+        ok &= change_token (TRUE, "Insertion seen after:");
+        ok &= change_token (FALSE, "Removal seen after:");
+
+        /* Unplugging the reader with the card in it */
+        ok &= change_token (TRUE, "Insertion seen after:");
+        gsd_smartcard_watcher_set_active (watcher, FALSE);
+        ok &= change_token (FALSE, "Removal without reader after:");
+        count_idle_calls ("Reader unplugged, idle:");
+
+        gsd_smartcard_watcher_set_active (watcher, TRUE);
+        start = g_get_monotonic_time ();
+        gsd_smartcard_watcher_free (watcher);
+        g_print ("%-30s %8.2f ms\n", "Stopped after:", (g_get_monotonic_time () - start) / 1000.0);
+
+        g_async_queue_unref (events);
+        g_module_close (module);
+
+        SECMOD_UnloadUserModule (driver);
+        SECMOD_DestroyModule (driver);
+        NSS_Shutdown ();
+
+        return ok ? 0 : 1;
+}
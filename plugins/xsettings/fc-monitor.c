@@ -19,38 +19,124 @@
  * Author:  Behdad Esfahbod, Red Hat, Inc.
  */
 
+#include "config.h"
+
 #include "fc-monitor.h"
 
 #include <gio/gio.h>
 #include <fontconfig/fontconfig.h>
 
-#define TIMEOUT_MILLISECONDS 1000
+#if HAVE_INOTIFY
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <glib-unix.h>
+#endif
+
+/* The quiescence period is a multiple of the average gap between
+ * events, so that a single font being dropped in is picked up quickly
+ * while a package installing hundreds of files gets coalesced. An
+ * update is never postponed for longer than MAX_TIMEOUT_MILLISECONDS
+ * after the first event though. */
+#define MIN_TIMEOUT_MILLISECONDS 250
+#define MAX_TIMEOUT_MILLISECONDS 5000
+#define TIMEOUT_GAP_FACTOR       8
+
+typedef struct {
+        /* Full reload because a configuration file changed */
+        gboolean full;
+        /* Font directories to rescan, and on return, the directories
+         * that were rescanned along with all their subdirectories */
+        GPtrArray *dirs;
+        /* How many of those actually had their cache rewritten */
+        guint n_rescanned;
+} UpdateData;
+
+static void
+update_data_free (UpdateData *data)
+{
+        g_ptr_array_unref (data->dirs);
+        g_free (data);
+}
+
+static gboolean
+fontconfig_cache_rescan_dirs (GPtrArray *dirs,
+                              guint *n_rescanned)
+{
+        GPtrArray *seen = g_ptr_array_new ();
+        guint i;
+
+        /* Walk the changed directories, and the ones that appeared
+         * below them, rewriting only their caches */
+        for (i = 0; i < dirs->len; i++) {
+                const char *dir = g_ptr_array_index (dirs, i);
+                FcCache *cache;
+                int j;
+
+                cache = FcDirCacheRescan ((const FcChar8 *) dir, NULL);
+                if (cache == NULL) {
+                        g_debug ("Could not rescan %s, it was probably removed", dir);
+                        continue;
+                }
+
+                g_debug ("Rescanned %s", dir);
+                g_ptr_array_add (seen, g_strdup (dir));
+                (*n_rescanned)++;
+
+                for (j = 0; j < FcCacheNumSubdir (cache); j++) {
+                        const FcChar8 *subdir = FcCacheSubdir (cache, j);
+
+                        if (FcDirCacheValid (subdir))
+                                g_ptr_array_add (seen, g_strdup ((const char *) subdir));
+                        else
+                                g_ptr_array_add (dirs, g_strdup ((const char *) subdir));
+                }
+
+                FcDirCacheUnload (cache);
+        }
+
+        g_ptr_array_set_size (dirs, 0);
+        for (i = 0; i < seen->len; i++)
+                g_ptr_array_add (dirs, g_ptr_array_index (seen, i));
+        g_ptr_array_unref (seen);
+
+        return dirs->len > 0;
+}
 
 static void
 fontconfig_cache_update_thread (GTask *task,
                                 gpointer source_object G_GNUC_UNUSED,
-                                gpointer task_data G_GNUC_UNUSED,
+                                gpointer task_data,
                                 GCancellable *cancellable G_GNUC_UNUSED)
 {
-        if (FcConfigUptoDate (NULL)) {
-                g_task_return_boolean (task, FALSE);
-                return;
-        }
+        UpdateData *data = task_data;
+
+        if (data->full && !FcConfigUptoDate (NULL)) {
+                /* The reload covers the font directories as well */
+                g_ptr_array_set_size (data->dirs, 0);
+
+                if (!FcInitReinitialize ()) {
+                        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "FcInitReinitialize failed");
+                        return;
+                }
 
-        if (!FcInitReinitialize ()) {
-                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                         "FcInitReinitialize failed");
+                g_task_return_boolean (task, TRUE);
                 return;
         }
 
-        g_task_return_boolean (task, TRUE);
+        data->full = FALSE;
+        g_task_return_boolean (task, fontconfig_cache_rescan_dirs (data->dirs, &data->n_rescanned));
 }
 
 static void
-fontconfig_cache_update_async (GAsyncReadyCallback callback,
+fontconfig_cache_update_async (UpdateData *data,
+                               GAsyncReadyCallback callback,
                                gpointer user_data)
 {
         GTask *task = g_task_new (NULL, NULL, callback, user_data);
+        g_task_set_task_data (task, data, (GDestroyNotify) update_data_free);
         g_task_run_in_thread (task, fontconfig_cache_update_thread);
         g_object_unref (task);
 }
@@ -72,11 +158,34 @@ typedef enum {
 struct _FcMonitor {
         GObject parent_instance;
 
-        GPtrArray *monitors;
+        gboolean started;
+
+#if HAVE_INOTIFY
+        /* A single inotify descriptor for everything, and the watched
+         * paths indexed by watch descriptor */
+        int inotify_fd;
+        guint inotify_watch_id;
+        GPtrArray *watches;
+        /* path → GFileMonitor, for paths which do not exist yet */
+        GHashTable *missing;
+#endif
+        /* path → GFileMonitor, when inotify is not available */
+        GHashTable *monitors;
+
+        /* What changed since the last update was started */
+        gboolean config_changed;
+        GHashTable *changed_dirs;
 
         guint timeout;
         UpdateState state;
         gboolean notify;
+
+        gint64 burst_start;
+        gint64 last_event;
+        gint64 average_gap;
+        gint64 update_start;
+
+        FcMonitorStats stats;
 };
 
 enum {
@@ -88,9 +197,10 @@ enum {
 static guint signals[N_SIGNALS] = { 0, };
 
 static void fc_monitor_finalize (GObject *object);
-static void monitor_files (FcMonitor *self, FcStrList *list);
-static void stuff_changed (GFileMonitor *monitor, GFile *file, GFile *other_file,
-                           GFileMonitorEvent event_type, gpointer data);
+static void monitor_files (FcMonitor *self, FcStrList *list, gboolean config);
+static void monitor_file (FcMonitor *self, const char *path, gboolean config);
+static void stop_watching (FcMonitor *self);
+static void stuff_changed (FcMonitor *self, const char *dir, const char *event_name);
 static void start_timeout (FcMonitor *self);
 static gboolean start_update (gpointer data);
 static void update_done (GObject *source_object, GAsyncResult *result, gpointer user_data);
@@ -122,9 +232,14 @@ fc_monitor_new (void)
 }
 
 static void
-fc_monitor_init (FcMonitor *self G_GNUC_UNUSED)
+fc_monitor_init (FcMonitor *self)
 {
         FcInit ();
+
+#if HAVE_INOTIFY
+        self->inotify_fd = -1;
+#endif
+        self->changed_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static void
@@ -136,57 +251,208 @@ fc_monitor_finalize (GObject *object)
                 g_source_remove (self->timeout);
         self->timeout = 0;
 
-        g_clear_pointer (&self->monitors, g_ptr_array_unref);
+        if (self->started)
+                stop_watching (self);
+        g_clear_pointer (&self->changed_dirs, g_hash_table_unref);
 
         G_OBJECT_CLASS (fc_monitor_parent_class)->finalize (object);
 }
 
-void
-fc_monitor_start (FcMonitor *self)
+#if HAVE_INOTIFY
+
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Stands in for the path of configuration file watches, as any
+ * configuration change needs a full reload anyway */
+static char config_watch[] = "";
+
+static const gchar *
+get_event_name (guint32 mask)
 {
-        g_return_if_fail (FC_IS_MONITOR (self));
-        g_return_if_fail (self->monitors == NULL);
+        if (mask & IN_Q_OVERFLOW)
+                return "IN_Q_OVERFLOW";
+        if (mask & IN_ATTRIB)
+                return "IN_ATTRIB";
+        if (mask & IN_CLOSE_WRITE)
+                return "IN_CLOSE_WRITE";
+        if (mask & IN_CREATE)
+                return "IN_CREATE";
+        if (mask & IN_DELETE)
+                return "IN_DELETE";
+        if (mask & IN_DELETE_SELF)
+                return "IN_DELETE_SELF";
+        if (mask & IN_MOVE_SELF)
+                return "IN_MOVE_SELF";
+        if (mask & IN_MOVED_FROM)
+                return "IN_MOVED_FROM";
+        if (mask & IN_MOVED_TO)
+                return "IN_MOVED_TO";
+        return "(unknown)";
+}
 
-        self->monitors = g_ptr_array_new_with_free_func (g_object_unref);
+static void
+free_watch (gpointer path)
+{
+        if (path != config_watch)
+                g_free (path);
+}
 
-        monitor_files (self, FcConfigGetConfigFiles (NULL));
-        monitor_files (self, FcConfigGetFontDirs (NULL));
+static gboolean
+inotify_ready (gint         fd,
+               GIOCondition condition G_GNUC_UNUSED,
+               gpointer     data)
+{
+        FcMonitor *self = FC_MONITOR (data);
+        union {
+                struct inotify_event event;
+                char buf[4096];
+        } u;
+        gssize len;
+
+        while ((len = read (fd, u.buf, sizeof (u.buf))) > 0) {
+                gssize i = 0;
+
+                while (i < len) {
+                        const struct inotify_event *event = (const struct inotify_event *) (u.buf + i);
+                        const char *path = NULL;
+
+                        i += sizeof (struct inotify_event) + event->len;
+
+                        if (event->mask & IN_Q_OVERFLOW) {
+                                /* We lost track, so reload everything */
+                                stuff_changed (self, NULL, get_event_name (event->mask));
+                                continue;
+                        }
+
+                        if (event->wd >= 0 && (guint) event->wd < self->watches->len)
+                                path = g_ptr_array_index (self->watches, event->wd);
+                        if (path == NULL)
+                                continue;
+
+                        if (event->mask & IN_IGNORED) {
+                                free_watch (self->watches->pdata[event->wd]);
+                                self->watches->pdata[event->wd] = NULL;
+                                continue;
+                        }
+
+                        stuff_changed (self, path == config_watch ? NULL : path,
+                                       get_event_name (event->mask));
+                }
+        }
+
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                g_warning ("Failed to read inotify events: %s", g_strerror (errno));
+                self->inotify_watch_id = 0;
+                return G_SOURCE_REMOVE;
+        }
+
+        return G_SOURCE_CONTINUE;
 }
 
-void
-fc_monitor_stop (FcMonitor *self)
+static gboolean
+start_inotify (FcMonitor *self)
 {
-        g_return_if_fail (FC_IS_MONITOR (self));
-        g_clear_pointer (&self->monitors, g_ptr_array_unref);
+        self->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (self->inotify_fd < 0) {
+                g_warning ("Failed to create inotify instance, falling back to file monitors: %s",
+                           g_strerror (errno));
+                return FALSE;
+        }
+
+        self->missing = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+        self->watches = g_ptr_array_new_with_free_func (free_watch);
+        self->inotify_watch_id = g_unix_fd_add (self->inotify_fd, G_IO_IN, inotify_ready, self);
+        g_source_set_name_by_id (self->inotify_watch_id, "[gnome-settings-daemon] inotify_ready");
+
+        return TRUE;
 }
 
 static void
-monitor_files (FcMonitor *self,
-               FcStrList *list)
+stop_inotify (FcMonitor *self)
 {
-        const char *str;
+        if (self->inotify_watch_id != 0) {
+                g_source_remove (self->inotify_watch_id);
+                self->inotify_watch_id = 0;
+        }
+
+        /* Closing the descriptor drops all of its watches */
+        if (self->inotify_fd >= 0) {
+                close (self->inotify_fd);
+                self->inotify_fd = -1;
+        }
 
-        while ((str = (const char *) FcStrListNext (list))) {
-                GFile *file;
-                GFileMonitor *monitor;
+        g_clear_pointer (&self->watches, g_ptr_array_unref);
+        g_clear_pointer (&self->missing, g_hash_table_unref);
+}
 
-                file = g_file_new_for_path (str);
+static void
+missing_file_changed (GFileMonitor *monitor G_GNUC_UNUSED,
+                      GFile *file G_GNUC_UNUSED,
+                      GFile *other_file G_GNUC_UNUSED,
+                      GFileMonitorEvent event_type,
+                      gpointer data)
+{
+        /* Fontconfig only starts using a font directory which did not
+         * exist before on a full reload, which also sets up the
+         * inotify watch for it */
+        if (event_type == G_FILE_MONITOR_EVENT_CREATED)
+                stuff_changed (FC_MONITOR (data), NULL, "G_FILE_MONITOR_EVENT_CREATED");
+}
 
-                monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, NULL);
+/* Font directories such as ~/.local/share/fonts are listed whether
+ * they exist or not. inotify cannot watch for a path to appear, but
+ * GFileMonitor can, by watching its parents. */
+static void
+monitor_missing_file (FcMonitor  *self,
+                      const char *path)
+{
+        GFile *file;
+        GFileMonitor *monitor;
 
-                g_object_unref (file);
+        if (g_hash_table_contains (self->missing, path))
+                return;
 
-                if (!monitor)
-                        continue;
+        file = g_file_new_for_path (path);
+        monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, NULL);
+        g_object_unref (file);
 
-                g_signal_connect (monitor, "changed", G_CALLBACK (stuff_changed), self);
+        if (!monitor)
+                return;
+
+        g_signal_connect (monitor, "changed", G_CALLBACK (missing_file_changed), self);
+        g_hash_table_insert (self->missing, g_strdup (path), monitor);
+}
 
-                g_ptr_array_add (self->monitors, monitor);
+static void
+monitor_file_inotify (FcMonitor  *self,
+                      const char *path,
+                      gboolean    config)
+{
+        int wd;
+
+        wd = inotify_add_watch (self->inotify_fd, path, WATCH_MASK);
+        if (wd < 0) {
+                if (errno == ENOENT)
+                        monitor_missing_file (self, path);
+                else
+                        g_debug ("Failed to watch %s: %s", path, g_strerror (errno));
+                return;
         }
 
-        FcStrListDone (list);
+        g_hash_table_remove (self->missing, path);
+
+        /* Watching the same inode again gives back the same descriptor */
+        if ((guint) wd >= self->watches->len)
+                g_ptr_array_set_size (self->watches, wd + 1);
+        else if (g_ptr_array_index (self->watches, wd) != NULL)
+                return;
+
+        self->watches->pdata[wd] = config ? config_watch : g_strdup (path);
 }
 
+#endif /* HAVE_INOTIFY */
+
 static const gchar *
 get_name (GType enum_type,
           gint enum_value)
@@ -199,14 +465,153 @@ get_name (GType enum_type,
 }
 
 static void
-stuff_changed (GFileMonitor *monitor G_GNUC_UNUSED,
-               GFile *file G_GNUC_UNUSED,
-               GFile *other_file G_GNUC_UNUSED,
-               GFileMonitorEvent event_type,
-               gpointer data)
+file_monitor_changed (GFileMonitor *monitor,
+                      GFile *file G_GNUC_UNUSED,
+                      GFile *other_file G_GNUC_UNUSED,
+                      GFileMonitorEvent event_type,
+                      gpointer data)
 {
-        FcMonitor *self = FC_MONITOR (data);
-        const gchar *event_name = get_name (G_TYPE_FILE_MONITOR_EVENT, event_type);
+        stuff_changed (FC_MONITOR (data),
+                       g_object_get_data (G_OBJECT (monitor), "fc-monitor-dir"),
+                       get_name (G_TYPE_FILE_MONITOR_EVENT, event_type));
+}
+
+static void
+monitor_file_gio (FcMonitor  *self,
+                  const char *path,
+                  gboolean    config)
+{
+        GFile *file;
+        GFileMonitor *monitor;
+
+        if (g_hash_table_contains (self->monitors, path))
+                return;
+
+        file = g_file_new_for_path (path);
+
+        monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, NULL);
+
+        g_object_unref (file);
+
+        if (!monitor)
+                return;
+
+        /* Font directories are rescanned individually, whereas any
+         * configuration change needs a full reload */
+        if (!config)
+                g_object_set_data_full (G_OBJECT (monitor), "fc-monitor-dir",
+                                        g_strdup (path), g_free);
+
+        g_signal_connect (monitor, "changed", G_CALLBACK (file_monitor_changed), self);
+
+        g_hash_table_insert (self->monitors, g_strdup (path), monitor);
+}
+
+static void
+start_watching (FcMonitor *self)
+{
+#if HAVE_INOTIFY
+        if (start_inotify (self))
+                return;
+#endif
+        self->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+}
+
+static void
+stop_watching (FcMonitor *self)
+{
+#if HAVE_INOTIFY
+        stop_inotify (self);
+#endif
+        g_clear_pointer (&self->monitors, g_hash_table_unref);
+}
+
+static void
+monitor_file (FcMonitor  *self,
+              const char *path,
+              gboolean    config)
+{
+#if HAVE_INOTIFY
+        if (self->inotify_fd >= 0) {
+                monitor_file_inotify (self, path, config);
+                return;
+        }
+#endif
+        monitor_file_gio (self, path, config);
+}
+
+void
+fc_monitor_start (FcMonitor *self)
+{
+        g_return_if_fail (FC_IS_MONITOR (self));
+        g_return_if_fail (!self->started);
+
+        self->started = TRUE;
+        start_watching (self);
+
+        monitor_files (self, FcConfigGetConfigFiles (NULL), TRUE);
+        monitor_files (self, FcConfigGetFontDirs (NULL), FALSE);
+}
+
+void
+fc_monitor_stop (FcMonitor *self)
+{
+        g_return_if_fail (FC_IS_MONITOR (self));
+
+        if (!self->started)
+                return;
+
+        stop_watching (self);
+        self->started = FALSE;
+}
+
+void
+fc_monitor_get_stats (FcMonitor      *self,
+                      FcMonitorStats *stats)
+{
+        g_return_if_fail (FC_IS_MONITOR (self));
+
+        *stats = self->stats;
+}
+
+static void
+monitor_files (FcMonitor *self,
+               FcStrList *list,
+               gboolean   config)
+{
+        const char *str;
+
+        while ((str = (const char *) FcStrListNext (list)))
+                monitor_file (self, str, config);
+
+        FcStrListDone (list);
+}
+
+/* @dir is the font directory that changed, or NULL for configuration */
+static void
+stuff_changed (FcMonitor  *self,
+               const char *dir,
+               const char *event_name)
+{
+        gint64 now;
+
+        self->stats.events++;
+
+        if (dir != NULL)
+                g_hash_table_add (self->changed_dirs, g_strdup (dir));
+        else
+                self->config_changed = TRUE;
+
+        now = g_get_monotonic_time ();
+        if (self->state == UPDATE_IDLE) {
+                self->burst_start = now;
+                self->average_gap = 0;
+        } else if (self->average_gap == 0) {
+                self->average_gap = now - self->last_event;
+        } else {
+                self->average_gap = (3 * self->average_gap + (now - self->last_event)) / 4;
+        }
+        self->last_event = now;
 
         switch (self->state) {
         case UPDATE_IDLE:
@@ -215,7 +620,11 @@ stuff_changed (GFileMonitor *monitor G_GNUC_UNUSED,
                 break;
 
         case UPDATE_PENDING:
-                /* wait for quiescence */
+                /* wait for quiescence, unless we already waited too long */
+                if (now - self->burst_start >= MAX_TIMEOUT_MILLISECONDS * G_TIME_SPAN_MILLISECOND) {
+                        g_debug ("Got %-38s: not postponing fontconfig update any further", event_name);
+                        break;
+                }
                 g_debug ("Got %-38s: restarting fontconfig update timeout", event_name);
                 g_source_remove (self->timeout);
                 start_timeout (self);
@@ -235,8 +644,13 @@ stuff_changed (GFileMonitor *monitor G_GNUC_UNUSED,
 static void
 start_timeout (FcMonitor *self)
 {
+        guint timeout;
+
+        timeout = CLAMP (self->average_gap * TIMEOUT_GAP_FACTOR / G_TIME_SPAN_MILLISECOND,
+                         MIN_TIMEOUT_MILLISECONDS, MAX_TIMEOUT_MILLISECONDS);
+
         self->state = UPDATE_PENDING;
-        self->timeout = g_timeout_add (TIMEOUT_MILLISECONDS, start_update, self);
+        self->timeout = g_timeout_add (timeout, start_update, self);
         g_source_set_name_by_id (self->timeout, "[gnome-settings-daemon] update");
 }
 
@@ -244,12 +658,32 @@ static gboolean
 start_update (gpointer data)
 {
         FcMonitor *self = FC_MONITOR (data);
+        UpdateData *update;
+        GHashTableIter iter;
+        gpointer dir;
 
         self->state = UPDATE_RUNNING;
         self->timeout = 0;
+        self->update_start = g_get_monotonic_time ();
 
-        g_debug ("Timeout completed: starting fontconfig update");
-        fontconfig_cache_update_async (update_done, g_object_ref (self));
+        update = g_new0 (UpdateData, 1);
+        update->full = self->config_changed;
+        update->dirs = g_ptr_array_new_with_free_func (g_free);
+
+        g_hash_table_iter_init (&iter, self->changed_dirs);
+        while (g_hash_table_iter_next (&iter, &dir, NULL)) {
+                g_hash_table_iter_steal (&iter);
+                g_ptr_array_add (update->dirs, dir);
+        }
+        self->config_changed = FALSE;
+
+        if (update->full) {
+                g_debug ("Timeout completed: starting fontconfig update");
+        } else {
+                g_debug ("Timeout completed: rescanning %u font directories", update->dirs->len);
+        }
+
+        fontconfig_cache_update_async (update, update_done, g_object_ref (self));
 
         return G_SOURCE_REMOVE;
 }
@@ -260,15 +694,38 @@ update_done (GObject *source_object G_GNUC_UNUSED,
              gpointer data)
 {
         FcMonitor *self = FC_MONITOR (data);
+        UpdateData *update = g_task_get_task_data (G_TASK (result));
         gboolean restart = self->state == UPDATE_RESTART;
         GError *error = NULL;
+        gint64 elapsed;
 
         self->state = UPDATE_IDLE;
 
+        elapsed = g_get_monotonic_time () - self->update_start;
+        self->stats.update_time_usec += elapsed;
+        self->stats.last_update_time_usec = elapsed;
+
         if (fontconfig_cache_update_finish (result, &error)) {
                 g_debug ("Fontconfig update successful");
                 /* Remember we had a successful update even if we have to restart it */
                 self->notify = TRUE;
+
+                if (!update->full) {
+                        guint i;
+
+                        self->stats.rescanned_dirs += update->n_rescanned;
+
+                        /* Pick up new subdirectories without reloading */
+                        for (i = 0; self->started && i < update->dirs->len; i++)
+                                monitor_file (self, g_ptr_array_index (update->dirs, i), FALSE);
+                } else {
+                        self->stats.reloads++;
+
+                        if (self->started) {
+                                fc_monitor_stop (self);
+                                fc_monitor_start (self);
+                        }
+                }
         } else if (error) {
                 g_warning ("Fontconfig update failed: %s", error->message);
                 g_error_free (error);
@@ -281,11 +738,6 @@ update_done (GObject *source_object G_GNUC_UNUSED,
         } else if (self->notify) {
                 self->notify = FALSE;
 
-                if (self->monitors) {
-                        fc_monitor_stop (self);
-                        fc_monitor_start (self);
-                }
-
                 /* we finish modifying self before emitting the signal,
                  * allowing the callback to stop us if it decides to. */
                 g_signal_emit (self, signals[SIGNAL_UPDATED], 0);
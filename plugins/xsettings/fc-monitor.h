@@ -26,10 +26,20 @@ G_BEGIN_DECLS
 #define FC_TYPE_MONITOR (fc_monitor_get_type ())
 G_DECLARE_FINAL_TYPE (FcMonitor, fc_monitor, FC, MONITOR, GObject)
 
+typedef struct {
+        guint64 events;                 /* file monitor events seen */
+        guint64 reloads;                /* full configuration reloads */
+        guint64 rescanned_dirs;         /* font directories rescanned */
+        guint64 update_time_usec;       /* total time spent updating */
+        guint64 last_update_time_usec;
+} FcMonitorStats;
+
 FcMonitor *fc_monitor_new (void);
 
-void fc_monitor_start (FcMonitor *monitor);
-void fc_monitor_stop  (FcMonitor *monitor);
+void fc_monitor_start     (FcMonitor      *monitor);
+void fc_monitor_stop      (FcMonitor      *monitor);
+void fc_monitor_get_stats (FcMonitor      *monitor,
+                           FcMonitorStats *stats);
 
 G_END_DECLS
 
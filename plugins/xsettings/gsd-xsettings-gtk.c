@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "gsd-xsettings-gtk.h"
@@ -38,68 +39,95 @@ enum {
 
 struct GsdXSettingsGtkPrivate {
         char              *modules;
+        /* module name → number of enabled files providing it */
         GHashTable        *dir_modules;
+        /* path → ModuleFile, for every file in the modules directory */
+        GHashTable        *module_files;
 
         GSettings         *settings;
 
-        guint64            dir_mtime;
         GFileMonitor      *monitor;
-        GList             *cond_settings;
 };
 
+typedef struct {
+        GsdXSettingsGtk   *gtk;
+        /* To tell whether the file changed since it was parsed */
+        struct timespec    mtime;
+        goffset            size;
+        char              *module_name; /* NULL if not a GTK module */
+        GSettings         *cond_settings;
+        gboolean           enabled;
+} ModuleFile;
+
 #define GSD_XSETTINGS_GTK_GET_PRIVATE(object) (G_TYPE_INSTANCE_GET_PRIVATE ((object), GSD_TYPE_XSETTINGS_GTK, GsdXSettingsGtkPrivate))
 
 G_DEFINE_TYPE(GsdXSettingsGtk, gsd_xsettings_gtk, G_TYPE_OBJECT)
 
 static void update_gtk_modules (GsdXSettingsGtk *gtk);
 
-static void
-empty_cond_settings_list (GsdXSettingsGtk *gtk)
+/* Returns whether the set of directory modules changed */
+static gboolean
+dir_module_set_enabled (GsdXSettingsGtk *gtk,
+                        const char      *module_name,
+                        gboolean         enabled)
 {
-        if (gtk->priv->cond_settings == NULL)
-                return;
+        guint count;
+
+        count = GPOINTER_TO_UINT (g_hash_table_lookup (gtk->priv->dir_modules, module_name));
+
+        if (enabled) {
+                g_hash_table_insert (gtk->priv->dir_modules, g_strdup (module_name), GUINT_TO_POINTER (count + 1));
+                return count == 0;
+        }
+
+        if (count > 1) {
+                g_hash_table_insert (gtk->priv->dir_modules, g_strdup (module_name), GUINT_TO_POINTER (count - 1));
+                return FALSE;
+        }
 
-        /* Empty the list of settings */
-        g_list_foreach (gtk->priv->cond_settings, (GFunc) g_object_unref, NULL);
-        g_list_free (gtk->priv->cond_settings);
-        gtk->priv->cond_settings = NULL;
+        g_hash_table_remove (gtk->priv->dir_modules, module_name);
+        return TRUE;
 }
 
 static void
 cond_setting_changed (GSettings       *settings,
                       const char      *key,
-                      GsdXSettingsGtk *gtk)
+                      ModuleFile      *file)
 {
         gboolean enabled;
-        const char *module_name;
-
-        module_name = g_object_get_data (G_OBJECT (settings), "module-name");
 
         enabled = g_settings_get_boolean (settings, key);
-        if (enabled != FALSE) {
-                if (gtk->priv->dir_modules == NULL)
-                        gtk->priv->dir_modules = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-                g_hash_table_insert (gtk->priv->dir_modules, g_strdup (module_name), NULL);
-        } else if (gtk->priv->dir_modules != NULL) {
-                g_hash_table_remove (gtk->priv->dir_modules, module_name);
-        }
+        if (enabled == file->enabled)
+                return;
 
-        update_gtk_modules (gtk);
+        file->enabled = enabled;
+        if (dir_module_set_enabled (file->gtk, file->module_name, enabled))
+                update_gtk_modules (file->gtk);
+}
+
+static void
+module_file_free (ModuleFile *file)
+{
+        if (file->cond_settings != NULL) {
+                g_signal_handlers_disconnect_by_data (file->cond_settings, file);
+                g_object_unref (file->cond_settings);
+        }
+        g_free (file->module_name);
+        g_free (file);
 }
 
-static char *
+static ModuleFile *
 process_desktop_file (const char      *path,
+                      const GStatBuf  *buf,
                       GsdXSettingsGtk *gtk)
 {
         GKeyFile *keyfile;
-        char *retval;
-        char *module_name;
-
-        retval = NULL;
+        ModuleFile *file;
 
-        if (g_str_has_suffix (path, ".desktop") == FALSE &&
-            g_str_has_suffix (path, ".gtk-module") == FALSE)
-                return retval;
+        file = g_new0 (ModuleFile, 1);
+        file->gtk = gtk;
+        file->mtime = buf->st_mtim;
+        file->size = buf->st_size;
 
         keyfile = g_key_file_new ();
         if (g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL) == FALSE)
@@ -108,104 +136,103 @@ process_desktop_file (const char      *path,
         if (g_key_file_has_group (keyfile, "GTK Module") == FALSE)
                 goto bail;
 
-        module_name = g_key_file_get_string (keyfile, "GTK Module", "X-GTK-Module-Name", NULL);
-        if (module_name == NULL)
+        file->module_name = g_key_file_get_string (keyfile, "GTK Module", "X-GTK-Module-Name", NULL);
+        if (file->module_name == NULL)
                 goto bail;
 
         if (g_key_file_has_key (keyfile, "GTK Module", "X-GTK-Module-Enabled-Schema", NULL) != FALSE) {
                 char *schema;
                 char *key;
-                gboolean enabled;
-                GSettings *settings;
                 char *signal;
 
                 schema = g_key_file_get_string (keyfile, "GTK Module", "X-GTK-Module-Enabled-Schema", NULL);
                 key = g_key_file_get_string (keyfile, "GTK Module", "X-GTK-Module-Enabled-Key", NULL);
 
-                settings = g_settings_new (schema);
-
-                gtk->priv->cond_settings = g_list_prepend (gtk->priv->cond_settings, settings);
-
-                g_object_set_data_full (G_OBJECT (settings), "module-name", g_strdup (module_name), (GDestroyNotify) g_free);
+                file->cond_settings = g_settings_new (schema);
 
                 signal = g_strdup_printf ("changed::%s", key);
-                g_signal_connect_object (G_OBJECT (settings), signal, G_CALLBACK (cond_setting_changed), gtk, 0);
-                enabled = g_settings_get_boolean (settings, key);
+                g_signal_connect (G_OBJECT (file->cond_settings), signal, G_CALLBACK (cond_setting_changed), file);
+                file->enabled = g_settings_get_boolean (file->cond_settings, key);
                 g_free (signal);
                 g_free (schema);
                 g_free (key);
-
-                if (enabled != FALSE)
-                        retval = g_strdup (module_name);
         } else {
-                retval = g_strdup (module_name);
+                file->enabled = TRUE;
         }
 
-	g_free (module_name);
-
 bail:
         g_key_file_free (keyfile);
-        return retval;
+        return file;
 }
 
-static void
-get_gtk_modules_from_dir (GsdXSettingsGtk *gtk)
+/* A file rewritten within the same second as it was parsed must not
+ * be mistaken for the old one, so nanoseconds and the size count too */
+static gboolean
+module_file_is_current (const ModuleFile *file,
+                        const GStatBuf   *buf)
 {
-        GFile *file;
-        GFileInfo *info;
-        GHashTable *ht;
+        return file->mtime.tv_sec == buf->st_mtim.tv_sec &&
+               file->mtime.tv_nsec == buf->st_mtim.tv_nsec &&
+               file->size == buf->st_size;
+}
 
-        file = g_file_new_for_path (modules_path);
-        info = g_file_query_info (file,
-                                  G_FILE_ATTRIBUTE_TIME_MODIFIED,
-                                  G_FILE_QUERY_INFO_NONE,
-                                  NULL,
-                                  NULL);
-        if (info != NULL) {
-                guint64 dir_mtime;
-
-                dir_mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-                if (gtk->priv->dir_mtime == 0 ||
-                    dir_mtime > gtk->priv->dir_mtime) {
-                        GDir *dir;
-                        const char *name;
-
-                        empty_cond_settings_list (gtk);
-
-                        gtk->priv->dir_mtime = dir_mtime;
-
-                        if (gtk->priv->dir_modules != NULL) {
-                                g_hash_table_destroy (gtk->priv->dir_modules);
-                                gtk->priv->dir_modules = NULL;
-                        }
-
-                        dir = g_dir_open (modules_path, 0, NULL);
-                        if (dir == NULL)
-                                goto bail;
-
-                        ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-                        while ((name = g_dir_read_name (dir)) != NULL) {
-                                char *path;
-                                char *module;
-
-                                path = g_build_filename (modules_path, name, NULL);
-                                module = process_desktop_file (path, gtk);
-                                if (module != NULL)
-                                        g_hash_table_insert (ht, module, NULL);
-                                g_free (path);
-                        }
-                        g_dir_close (dir);
-
-                        gtk->priv->dir_modules = ht;
-                }
-                g_object_unref (info);
+/* Re-parses @path if it is new or was modified since we last looked at
+ * it, and forgets about it if it's gone. Returns whether the set of
+ * directory modules changed. */
+static gboolean
+update_module_file (GsdXSettingsGtk *gtk,
+                    const char      *path)
+{
+        ModuleFile *file, *old_file;
+        GStatBuf buf;
+        gboolean changed = FALSE;
+
+        if (g_str_has_suffix (path, ".desktop") == FALSE &&
+            g_str_has_suffix (path, ".gtk-module") == FALSE)
+                return FALSE;
+
+        old_file = g_hash_table_lookup (gtk->priv->module_files, path);
+
+        if (g_stat (path, &buf) != 0) {
+                file = NULL;
+        } else if (old_file != NULL && module_file_is_current (old_file, &buf)) {
+                return FALSE;
         } else {
-                empty_cond_settings_list (gtk);
+                g_debug ("Parsing GTK module file %s", path);
+                file = process_desktop_file (path, &buf, gtk);
         }
 
-bail:
-        g_object_unref (file);
+        if (old_file != NULL && old_file->enabled)
+                changed |= dir_module_set_enabled (gtk, old_file->module_name, FALSE);
+        if (file != NULL && file->enabled)
+                changed |= dir_module_set_enabled (gtk, file->module_name, TRUE);
+
+        if (file != NULL)
+                g_hash_table_insert (gtk->priv->module_files, g_strdup (path), file);
+        else
+                g_hash_table_remove (gtk->priv->module_files, path);
+
+        return changed;
+}
+
+static void
+get_gtk_modules_from_dir (GsdXSettingsGtk *gtk)
+{
+        GDir *dir;
+        const char *name;
+
+        dir = g_dir_open (modules_path, 0, NULL);
+        if (dir == NULL)
+                return;
+
+        while ((name = g_dir_read_name (dir)) != NULL) {
+                char *path;
+
+                path = g_build_filename (modules_path, name, NULL);
+                update_module_file (gtk, path);
+                g_free (path);
+        }
+        g_dir_close (dir);
 }
 
 static void
@@ -233,13 +260,12 @@ update_gtk_modules (GsdXSettingsGtk *gtk)
         ht = g_hash_table_new (g_str_hash, g_str_equal);
 
         if (gtk->priv->dir_modules != NULL) {
-                GList *list, *l;
+                GHashTableIter iter;
+                gpointer module;
 
-                list = g_hash_table_get_keys (gtk->priv->dir_modules);
-                for (l = list; l != NULL; l = l->next) {
-                        g_hash_table_insert (ht, l->data, NULL);
-                }
-                g_list_free (list);
+                g_hash_table_iter_init (&iter, gtk->priv->dir_modules);
+                while (g_hash_table_iter_next (&iter, &module, NULL))
+                        g_hash_table_insert (ht, module, NULL);
         }
 
         for (i = 0; enabled[i] != NULL; i++)
@@ -275,8 +301,22 @@ gtk_modules_dir_changed_cb (GFileMonitor     *monitor,
                             GFileMonitorEvent event_type,
                             GsdXSettingsGtk  *gtk)
 {
-        get_gtk_modules_from_dir (gtk);
-        update_gtk_modules (gtk);
+        char *path;
+        gboolean changed;
+
+        /* Only look at the file the event is about */
+        path = g_file_get_path (file);
+        changed = update_module_file (gtk, path);
+        g_free (path);
+
+        if (other_file != NULL) {
+                path = g_file_get_path (other_file);
+                changed |= update_module_file (gtk, path);
+                g_free (path);
+        }
+
+        if (changed)
+                update_gtk_modules (gtk);
 }
 
 static void
@@ -290,6 +330,10 @@ gsd_xsettings_gtk_init (GsdXSettingsGtk *gtk)
 
         gtk->priv->settings = g_settings_new (XSETTINGS_PLUGIN_SCHEMA);
 
+        gtk->priv->dir_modules = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        gtk->priv->module_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify) module_file_free);
+
         modules_path = g_getenv ("GSD_gtk_modules_dir");
         if (modules_path == NULL)
                 modules_path = GTK_MODULES_DIRECTORY;
@@ -325,18 +369,14 @@ gsd_xsettings_gtk_finalize (GObject *object)
         g_free (gtk->priv->modules);
         gtk->priv->modules = NULL;
 
-        if (gtk->priv->dir_modules != NULL) {
-                g_hash_table_destroy (gtk->priv->dir_modules);
-                gtk->priv->dir_modules = NULL;
-        }
+        g_clear_pointer (&gtk->priv->module_files, g_hash_table_destroy);
+        g_clear_pointer (&gtk->priv->dir_modules, g_hash_table_destroy);
 
         g_object_unref (gtk->priv->settings);
 
         if (gtk->priv->monitor != NULL)
                 g_object_unref (gtk->priv->monitor);
 
-        empty_cond_settings_list (gtk);
-
         G_OBJECT_CLASS (gsd_xsettings_gtk_parent_class)->finalize (object);
 }
 
@@ -81,6 +81,14 @@ static const gchar introspection_xml[] =
 "    <property name='Modules' type='s' access='read'/>"
 "    <property name='EnableAnimations' type='b' access='read'/>"
 "  </interface>"
+"  <interface name='org.gnome.SettingsDaemon.XSettings'>"
+"    <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+"    <property name='FontconfigEvents' type='t' access='read'/>"
+"    <property name='FontconfigReloads' type='t' access='read'/>"
+"    <property name='FontconfigRescannedDirs' type='t' access='read'/>"
+"    <property name='FontconfigUpdateTime' type='t' access='read'/>"
+"    <property name='FontconfigLastUpdateTime' type='t' access='read'/>"
+"  </interface>"
 "</node>";
 
 /* As we cannot rely on the X server giving us good DPI information, and
@@ -264,11 +272,18 @@ struct _FixedEntry {
         FixedEntryValue val;
 };
 
+typedef enum {
+        GTK_SETTINGS_FONTCONFIG_TIMESTAMP = 1 << 0,
+        GTK_SETTINGS_MODULES              = 1 << 1,
+        GTK_SETTINGS_ENABLE_ANIMATIONS    = 1 << 2
+} GtkSettingsMask;
+
 struct GnomeXSettingsManagerPrivate
 {
         guint              start_idle_id;
         XSettingsManager  *manager;
         GHashTable        *settings;
+        GHashTable        *translations_index;
 
         GSettings         *plugin_settings;
         FcMonitor         *fontconfig_monitor;
@@ -281,15 +296,30 @@ struct GnomeXSettingsManagerPrivate
 
         guint              display_config_watch_id;
         guint              monitors_changed_id;
+        GCancellable      *display_config_cancellable;
+        int                window_scale;
+        /* Nothing is published until the scale is known, or
+         * window_scale_timeout_id gives up on it */
+        gboolean           have_window_scale;
+        guint              window_scale_timeout_id;
 
         guint              shell_name_watch_id;
         gboolean           have_shell;
 
-        guint              notify_idle_id;
+        /* Changes waiting to be sent out by notify_timeout() */
+        guint              notify_id;
+        gboolean           xsettings_changed;
+        GtkSettingsMask    dbus_changes;
 
         GDBusNodeInfo     *introspection_data;
         GDBusConnection   *dbus_connection;
         guint              gtk_settings_name_id;
+
+        /* Parsed RESOURCE_MANAGER, one XResource per line */
+        GPtrArray         *xresources;
+        GHashTable        *xresources_index;
+        gboolean           xresources_stale;
+        guint              xresources_pending_writes;
 };
 
 #define GSD_XSETTINGS_ERROR gsd_xsettings_error_quark ()
@@ -493,33 +523,6 @@ static TranslationEntry translations [] = {
         { "org.gnome.desktop.a11y", "always-show-text-caret",       "Gtk/KeynavUseCaret",         translate_bool_int }
 };
 
-static gboolean
-notify_idle (gpointer data)
-{
-        GnomeXSettingsManager *manager = data;
-
-        xsettings_manager_notify (manager->priv->manager);
-
-        manager->priv->notify_idle_id = 0;
-        return G_SOURCE_REMOVE;
-}
-
-static void
-queue_notify (GnomeXSettingsManager *manager)
-{
-        if (manager->priv->notify_idle_id != 0)
-                return;
-
-        manager->priv->notify_idle_id = g_idle_add (notify_idle, manager);
-        g_source_set_name_by_id (manager->priv->notify_idle_id, "[gnome-settings-daemon] notify_idle");
-}
-
-typedef enum {
-        GTK_SETTINGS_FONTCONFIG_TIMESTAMP = 1 << 0,
-        GTK_SETTINGS_MODULES              = 1 << 1,
-        GTK_SETTINGS_ENABLE_ANIMATIONS    = 1 << 2
-} GtkSettingsMask;
-
 static void
 send_dbus_event (GnomeXSettingsManager *manager,
                  GtkSettingsMask        mask)
@@ -557,6 +560,57 @@ send_dbus_event (GnomeXSettingsManager *manager,
                                        props_changed, NULL);
 }
 
+/* Changes are batched for about a frame, so that a burst of them, say
+ * a font install along with a theme change, only wakes up clients once
+ * for XSETTINGS and once for D-Bus. */
+#define NOTIFY_TIMEOUT_MS 16
+
+static gboolean
+notify_timeout (gpointer data)
+{
+        GnomeXSettingsManager *manager = data;
+        GtkSettingsMask dbus_changes;
+
+        manager->priv->notify_id = 0;
+
+        if (manager->priv->xsettings_changed && manager->priv->have_window_scale) {
+                manager->priv->xsettings_changed = FALSE;
+                xsettings_manager_notify (manager->priv->manager);
+        }
+
+        dbus_changes = manager->priv->dbus_changes;
+        manager->priv->dbus_changes = 0;
+        if (dbus_changes != 0)
+                send_dbus_event (manager, dbus_changes);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_notify (GnomeXSettingsManager *manager)
+{
+        if (manager->priv->notify_id != 0)
+                return;
+
+        manager->priv->notify_id = g_timeout_add (NOTIFY_TIMEOUT_MS, notify_timeout, manager);
+        g_source_set_name_by_id (manager->priv->notify_id, "[gnome-settings-daemon] notify_timeout");
+}
+
+static void
+queue_notify (GnomeXSettingsManager *manager)
+{
+        manager->priv->xsettings_changed = TRUE;
+        schedule_notify (manager);
+}
+
+static void
+queue_dbus_event (GnomeXSettingsManager *manager,
+                  GtkSettingsMask        mask)
+{
+        manager->priv->dbus_changes |= mask;
+        schedule_notify (manager);
+}
+
 static double
 get_dpi_from_gsettings (GnomeXSettingsManager *manager)
 {
@@ -610,45 +664,6 @@ get_legacy_ui_scale (GVariantIter *properties,
 
 #define CURRENT_STATE_FORMAT "(u" MONITORS_FORMAT LOGICAL_MONITORS_FORMAT "a{sv})"
 
-static int
-get_window_scale (GnomeXSettingsManager *manager)
-{
-        g_autoptr(GError) error = NULL;
-        g_autoptr(GVariant) current_state = NULL;
-        g_autoptr(GVariantIter) properties = NULL;
-        int scale = 1;
-
-        current_state =
-                g_dbus_connection_call_sync (manager->priv->dbus_connection,
-                                             "org.gnome.Mutter.DisplayConfig",
-                                             "/org/gnome/Mutter/DisplayConfig",
-                                             "org.gnome.Mutter.DisplayConfig",
-                                             "GetCurrentState",
-                                             NULL,
-                                             NULL,
-                                             G_DBUS_CALL_FLAGS_NO_AUTO_START,
-                                             -1,
-                                             NULL,
-                                             &error);
-        if (!current_state) {
-                g_warning ("Failed to get current display configuration state: %s",
-                           error->message);
-                return 1;
-        }
-
-        g_variant_get (current_state,
-                       CURRENT_STATE_FORMAT,
-                       NULL,
-                       NULL,
-                       NULL,
-                       &properties);
-
-        if (!get_legacy_ui_scale (properties, &scale))
-                g_warning ("Failed to get current UI legacy scaling factor");
-
-        return scale;
-}
-
 typedef struct {
         gboolean    antialias;
         gboolean    hinting;
@@ -682,7 +697,7 @@ xft_settings_get (GnomeXSettingsManager *manager,
 
         settings->antialias = (antialiasing != GSD_FONT_ANTIALIASING_MODE_NONE);
         settings->hinting = (hinting != GSD_FONT_HINTING_NONE);
-        settings->window_scale = get_window_scale (manager);
+        settings->window_scale = manager->priv->window_scale;
         dpi = get_dpi_from_gsettings (manager);
         settings->dpi = dpi * 1024; /* Xft wants 1/1024ths of an inch */
         settings->scaled_dpi = dpi * settings->window_scale * 1024;
@@ -767,76 +782,239 @@ xft_settings_set_xsettings (GnomeXSettingsManager *manager,
         gnome_settings_profile_end (NULL);
 }
 
+typedef struct {
+        char       *line;
+        char       *key;   /* NULL for comments and blank lines */
+        const char *value; /* points into line */
+} XResource;
+
 static void
-update_property (GString *props, const gchar* key, const gchar* value)
-{
-        gchar* needle;
-        size_t needle_len;
-        gchar* found = NULL;
-
-        /* update an existing property */
-        needle = g_strconcat (key, ":", NULL);
-        needle_len = strlen (needle);
-        if (g_str_has_prefix (props->str, needle))
-                found = props->str;
-        else 
-            found = strstr (props->str, needle);
-
-        if (found) {
-                size_t value_index;
-                gchar* end;
-
-                end = strchr (found, '\n');
-                value_index = (found - props->str) + needle_len + 1;
-                g_string_erase (props, value_index, end ? (end - found - needle_len) : -1);
-                g_string_insert (props, value_index, "\n");
-                g_string_insert (props, value_index, value);
-        } else {
-                g_string_append_printf (props, "%s:\t%s\n", key, value);
+xresource_free (XResource *res)
+{
+        g_free (res->line);
+        g_free (res->key);
+        g_free (res);
+}
+
+static XResource *
+xresource_new (const char *line)
+{
+        XResource *res;
+        const char *start, *colon;
+
+        res = g_new0 (XResource, 1);
+        res->line = g_strdup (line);
+
+        start = res->line;
+        while (*start == ' ' || *start == '\t')
+                start++;
+        if (*start == '!' || *start == '#')
+                return res;
+
+        colon = strchr (start, ':');
+        if (colon == NULL)
+                return res;
+
+        res->key = g_strstrip (g_strndup (start, colon - start));
+        res->value = colon + 1;
+        while (*res->value == ' ' || *res->value == '\t')
+                res->value++;
+
+        return res;
+}
+
+/* Re-read RESOURCE_MANAGER through the daemon's own connection;
+ * XResourceManagerString() only has the value from when the display
+ * was opened. */
+static void
+xresources_load (GnomeXSettingsManager *manager)
+{
+        GnomeXSettingsManagerPrivate *p = manager->priv;
+        GdkWindow *root;
+        Atom type;
+        int format;
+        unsigned long n_items, bytes_after;
+        unsigned char *data = NULL;
+        char **lines;
+        guint i;
+
+        root = gdk_get_default_root_window ();
+
+        g_ptr_array_set_size (p->xresources, 0);
+        g_hash_table_remove_all (p->xresources_index);
+        p->xresources_stale = FALSE;
+
+        gdk_x11_display_error_trap_push (gdk_display_get_default ());
+        if (XGetWindowProperty (GDK_WINDOW_XDISPLAY (root), GDK_WINDOW_XID (root),
+                                XA_RESOURCE_MANAGER, 0, G_MAXLONG, False, XA_STRING,
+                                &type, &format, &n_items, &bytes_after, &data) != Success)
+                data = NULL;
+        gdk_x11_display_error_trap_pop_ignored (gdk_display_get_default ());
+
+        if (data == NULL)
+                return;
+
+        g_debug ("xresources_load: orig res '%s'", data);
+
+        lines = g_strsplit ((const char *) data, "\n", -1);
+        for (i = 0; lines[i] != NULL; i++) {
+                XResource *res;
+
+                /* The property ends with a newline */
+                if (lines[i + 1] == NULL && *lines[i] == '\0')
+                        break;
+
+                res = xresource_new (lines[i]);
+                g_ptr_array_add (p->xresources, res);
+
+                /* Later entries take precedence in Xrm */
+                if (res->key != NULL)
+                        g_hash_table_replace (p->xresources_index, res->key, res);
+        }
+        g_strfreev (lines);
+
+        XFree (data);
+}
+
+/* Returns whether the value of @key changed */
+static gboolean
+xresources_set (GnomeXSettingsManager *manager,
+                const char            *key,
+                const char            *value)
+{
+        GnomeXSettingsManagerPrivate *p = manager->priv;
+        XResource *res;
+
+        res = g_hash_table_lookup (p->xresources_index, key);
+        if (res != NULL && g_str_equal (res->value, value))
+                return FALSE;
+
+        if (res == NULL) {
+                res = g_new0 (XResource, 1);
+                res->key = g_strdup (key);
+                g_ptr_array_add (p->xresources, res);
+                g_hash_table_insert (p->xresources_index, res->key, res);
         }
 
-	g_free (needle);
+        g_free (res->line);
+        res->line = g_strdup_printf ("%s:\t%s", key, value);
+        res->value = res->line + strlen (key) + 2;
+
+        return TRUE;
 }
 
 static void
-xft_settings_set_xresources (GnomeXftSettings *settings)
+xresources_write (GnomeXSettingsManager *manager)
+{
+        GnomeXSettingsManagerPrivate *p = manager->priv;
+        GdkWindow *root;
+        GString *str;
+        guint i;
+
+        str = g_string_new (NULL);
+        for (i = 0; i < p->xresources->len; i++) {
+                XResource *res = g_ptr_array_index (p->xresources, i);
+
+                g_string_append (str, res->line);
+                g_string_append_c (str, '\n');
+        }
+
+        g_debug ("xresources_write: new res '%s'", str->str);
+
+        root = gdk_get_default_root_window ();
+        XChangeProperty (GDK_WINDOW_XDISPLAY (root), GDK_WINDOW_XID (root),
+                         XA_RESOURCE_MANAGER, XA_STRING, 8, PropModeReplace,
+                         (const unsigned char *) str->str, str->len);
+        XFlush (GDK_WINDOW_XDISPLAY (root));
+
+        /* Our own change will come back as a PropertyNotify */
+        p->xresources_pending_writes++;
+
+        g_string_free (str, TRUE);
+}
+
+static GdkFilterReturn
+xresources_filter (GdkXEvent *xevent,
+                   GdkEvent  *event,
+                   gpointer   data)
+{
+        GnomeXSettingsManager *manager = data;
+        XEvent *xev = xevent;
+
+        if (xev->type != PropertyNotify ||
+            xev->xproperty.atom != XA_RESOURCE_MANAGER)
+                return GDK_FILTER_CONTINUE;
+
+        /* Anything we did not write ourselves, e.g. from xrdb, means
+         * the cached copy needs reading again before the next update. */
+        if (manager->priv->xresources_pending_writes > 0)
+                manager->priv->xresources_pending_writes--;
+        else
+                manager->priv->xresources_stale = TRUE;
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static void
+start_xresources (GnomeXSettingsManager *manager)
+{
+        GnomeXSettingsManagerPrivate *p = manager->priv;
+        GdkWindow *root;
+
+        p->xresources = g_ptr_array_new_with_free_func ((GDestroyNotify) xresource_free);
+        p->xresources_index = g_hash_table_new (g_str_hash, g_str_equal);
+        p->xresources_stale = TRUE;
+        p->xresources_pending_writes = 0;
+
+        root = gdk_get_default_root_window ();
+        gdk_window_set_events (root, gdk_window_get_events (root) | GDK_PROPERTY_CHANGE_MASK);
+        gdk_window_add_filter (root, xresources_filter, manager);
+}
+
+static void
+stop_xresources (GnomeXSettingsManager *manager)
+{
+        GnomeXSettingsManagerPrivate *p = manager->priv;
+
+        if (p->xresources == NULL)
+                return;
+
+        gdk_window_remove_filter (gdk_get_default_root_window (), xresources_filter, manager);
+
+        g_clear_pointer (&p->xresources_index, g_hash_table_destroy);
+        g_clear_pointer (&p->xresources, g_ptr_array_unref);
+}
+
+static void
+xft_settings_set_xresources (GnomeXSettingsManager *manager,
+                             GnomeXftSettings      *settings)
 {
-        GString    *add_string;
         char        dpibuf[G_ASCII_DTOSTR_BUF_SIZE];
-        Display    *dpy;
+        gboolean    changed = FALSE;
 
         gnome_settings_profile_start (NULL);
 
-        /* get existing properties */
-        dpy = XOpenDisplay (NULL);
-        g_return_if_fail (dpy != NULL);
-        add_string = g_string_new (XResourceManagerString (dpy));
-
-        g_debug("xft_settings_set_xresources: orig res '%s'", add_string->str);
-
-        update_property (add_string, "Xft.dpi",
-                                g_ascii_dtostr (dpibuf, sizeof (dpibuf), (double) settings->scaled_dpi / 1024.0));
-        update_property (add_string, "Xft.antialias",
-                                settings->antialias ? "1" : "0");
-        update_property (add_string, "Xft.hinting",
-                                settings->hinting ? "1" : "0");
-        update_property (add_string, "Xft.hintstyle",
-                                settings->hintstyle);
-        update_property (add_string, "Xft.rgba",
-                                settings->rgba);
-        update_property (add_string, "Xcursor.size",
-                                g_ascii_dtostr (dpibuf, sizeof (dpibuf), (double) settings->cursor_size));
-        update_property (add_string, "Xcursor.theme",
-                                settings->cursor_theme);
-
-        g_debug("xft_settings_set_xresources: new res '%s'", add_string->str);
-
-        /* Set the new X property */
-        XChangeProperty(dpy, RootWindow (dpy, 0),
-                        XA_RESOURCE_MANAGER, XA_STRING, 8, PropModeReplace, (const unsigned char *) add_string->str, add_string->len);
-        XCloseDisplay (dpy);
-
-        g_string_free (add_string, TRUE);
+        if (manager->priv->xresources_stale)
+                xresources_load (manager);
+
+        changed |= xresources_set (manager, "Xft.dpi",
+                                   g_ascii_dtostr (dpibuf, sizeof (dpibuf), (double) settings->scaled_dpi / 1024.0));
+        changed |= xresources_set (manager, "Xft.antialias",
+                                   settings->antialias ? "1" : "0");
+        changed |= xresources_set (manager, "Xft.hinting",
+                                   settings->hinting ? "1" : "0");
+        changed |= xresources_set (manager, "Xft.hintstyle",
+                                   settings->hintstyle);
+        changed |= xresources_set (manager, "Xft.rgba",
+                                   settings->rgba);
+        changed |= xresources_set (manager, "Xcursor.size",
+                                   g_ascii_dtostr (dpibuf, sizeof (dpibuf), (double) settings->cursor_size));
+        changed |= xresources_set (manager, "Xcursor.theme",
+                                   settings->cursor_theme);
+
+        /* Only touch the property when one of our keys differs */
+        if (changed)
+                xresources_write (manager);
 
         gnome_settings_profile_end (NULL);
 }
@@ -849,11 +1027,15 @@ update_xft_settings (GnomeXSettingsManager *manager)
 {
         GnomeXftSettings settings;
 
+        /* Done once the scale is known */
+        if (!manager->priv->have_window_scale)
+                return;
+
         gnome_settings_profile_start (NULL);
 
         xft_settings_get (manager, &settings);
         xft_settings_set_xsettings (manager, &settings);
-        xft_settings_set_xresources (&settings);
+        xft_settings_set_xresources (manager, &settings);
         xft_settings_clear (&settings);
 
         gnome_settings_profile_end (NULL);
@@ -915,7 +1097,7 @@ gtk_modules_callback (GsdXSettingsGtk       *gtk,
         }
 
         queue_notify (manager);
-        send_dbus_event (manager, GTK_SETTINGS_MODULES);
+        queue_dbus_event (manager, GTK_SETTINGS_MODULES);
 }
 
 static void
@@ -932,7 +1114,7 @@ fontconfig_callback (FcMonitor              *monitor,
         manager->priv->fontconfig_timestamp = timestamp;
 
         queue_notify (manager);
-        send_dbus_event (manager, GTK_SETTINGS_FONTCONFIG_TIMESTAMP);
+        queue_dbus_event (manager, GTK_SETTINGS_FONTCONFIG_TIMESTAMP);
         gnome_settings_profile_end (NULL);
 }
 
@@ -958,7 +1140,11 @@ start_fontconfig_monitor (GnomeXSettingsManager  *manager)
         manager->priv->fontconfig_monitor = fc_monitor_new ();
         g_signal_connect (manager->priv->fontconfig_monitor, "updated", G_CALLBACK (fontconfig_callback), manager);
 
-        manager->priv->start_idle_id = g_idle_add ((GSourceFunc) start_fontconfig_monitor_idle_cb, manager);
+        /* Let the rest of the session start up before watching what can
+         * be tens of thousands of font directories */
+        manager->priv->start_idle_id = g_idle_add_full (G_PRIORITY_LOW,
+                                                        (GSourceFunc) start_fontconfig_monitor_idle_cb,
+                                                        manager, NULL);
         g_source_set_name_by_id (manager->priv->start_idle_id, "[gnome-settings-daemon] start_fontconfig_monitor_idle_cb");
 
         gnome_settings_profile_end (NULL);
@@ -972,30 +1158,50 @@ process_value (GnomeXSettingsManager *manager,
         (* trans->translate) (manager, trans, value);
 }
 
-static TranslationEntry *
-find_translation_entry (GSettings *settings, const char *key)
+/* Maps each GSettings instance to a table of its translated keys, so
+ * that change notifications don't need to look up the schema id. */
+static void
+build_translations_index (GnomeXSettingsManager *manager)
 {
+        GHashTableIter iter;
+        const char *schema;
+        GSettings *settings;
         guint i;
-        char *schema;
 
-        g_object_get (settings, "schema-id", &schema, NULL);
+        manager->priv->translations_index = g_hash_table_new_full (NULL, NULL, NULL,
+                                                                   (GDestroyNotify) g_hash_table_destroy);
 
-        if (g_str_equal (schema, CLASSIC_WM_SETTINGS_SCHEMA)) {
-              g_free (schema);
-              schema = g_strdup (WM_SETTINGS_SCHEMA);
-        }
+        g_hash_table_iter_init (&iter, manager->priv->settings);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &schema, (gpointer *) &settings)) {
+                GHashTable *keys;
 
-        for (i = 0; i < G_N_ELEMENTS (translations); i++) {
-                if (g_str_equal (schema, translations[i].gsettings_schema) &&
-                    g_str_equal (key, translations[i].gsettings_key)) {
-                            g_free (schema);
-                        return &translations[i];
+                if (g_str_equal (schema, CLASSIC_WM_SETTINGS_SCHEMA))
+                        schema = WM_SETTINGS_SCHEMA;
+
+                keys = g_hash_table_new (g_str_hash, g_str_equal);
+                for (i = 0; i < G_N_ELEMENTS (translations); i++) {
+                        if (g_str_equal (schema, translations[i].gsettings_schema))
+                                g_hash_table_insert (keys,
+                                                     (gpointer) translations[i].gsettings_key,
+                                                     &translations[i]);
                 }
+
+                g_hash_table_insert (manager->priv->translations_index, settings, keys);
         }
+}
+
+static TranslationEntry *
+find_translation_entry (GnomeXSettingsManager *manager,
+                        GSettings             *settings,
+                        const char            *key)
+{
+        GHashTable *keys;
 
-        g_free (schema);
+        keys = g_hash_table_lookup (manager->priv->translations_index, settings);
+        if (keys == NULL)
+                return NULL;
 
-        return NULL;
+        return g_hash_table_lookup (keys, key);
 }
 
 static void
@@ -1013,7 +1219,7 @@ xsettings_callback (GSettings             *settings,
         	return;
 	}
 
-        trans = find_translation_entry (settings, key);
+        trans = find_translation_entry (manager, settings, key);
         if (trans == NULL) {
                 return;
         }
@@ -1092,7 +1298,7 @@ force_disable_animation_changed (GObject    *gobject,
         xsettings_manager_set_int (manager->priv->manager, "Gtk/EnableAnimations", value);
 
         queue_notify (manager);
-        send_dbus_event (manager, GTK_SETTINGS_ENABLE_ANIMATIONS);
+        queue_dbus_event (manager, GTK_SETTINGS_ENABLE_ANIMATIONS);
 }
 
 static void
@@ -1103,13 +1309,121 @@ enable_animations_changed_cb (GSettings             *settings,
         force_disable_animation_changed (G_OBJECT (manager->priv->remote_display), NULL, manager);
 }
 
+/* How long to hold back XSETTINGS at startup, waiting for the scale */
+#define WINDOW_SCALE_TIMEOUT_MS 1000
+
+/* Returns whether the scale was still being waited for */
+static gboolean
+end_window_scale_wait (GnomeXSettingsManager *manager)
+{
+        if (manager->priv->have_window_scale)
+                return FALSE;
+
+        manager->priv->have_window_scale = TRUE;
+        if (manager->priv->window_scale_timeout_id != 0) {
+                g_source_remove (manager->priv->window_scale_timeout_id);
+                manager->priv->window_scale_timeout_id = 0;
+        }
+
+        return TRUE;
+}
+
+/* Publishes what was held back with the scale we have, when there is
+ * no better one coming */
 static void
-monitors_changed (GnomeXSettingsManager *manager)
+window_scale_unavailable (GnomeXSettingsManager *manager)
+{
+        if (!end_window_scale_wait (manager))
+                return;
+
+        g_debug ("Could not get the window scale, using %d", manager->priv->window_scale);
+
+        update_xft_settings (manager);
+        queue_notify (manager);
+}
+
+static gboolean
+window_scale_timeout (gpointer data)
+{
+        GnomeXSettingsManager *manager = data;
+
+        manager->priv->window_scale_timeout_id = 0;
+        window_scale_unavailable (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+get_current_state_cb (GObject      *source,
+                      GAsyncResult *res,
+                      gpointer      data)
 {
+        GnomeXSettingsManager *manager;
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GVariant) current_state = NULL;
+        g_autoptr(GVariantIter) properties = NULL;
+        gboolean first;
+        int scale;
+
+        current_state = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &error);
+        if (!current_state) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_warning ("Failed to get current display configuration state: %s",
+                                   error->message);
+                        window_scale_unavailable (data);
+                }
+                return;
+        }
+
+        manager = data;
+
+        g_variant_get (current_state,
+                       CURRENT_STATE_FORMAT,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &properties);
+
+        if (!get_legacy_ui_scale (properties, &scale))
+                g_warning ("Failed to get current UI legacy scaling factor");
+
+        first = end_window_scale_wait (manager);
+        if (scale == manager->priv->window_scale && !first)
+                return;
+
+        if (first)
+                g_debug ("Window scale is %d", scale);
+        else
+                g_debug ("Window scale changed from %d to %d", manager->priv->window_scale, scale);
+        manager->priv->window_scale = scale;
+
         update_xft_settings (manager);
         queue_notify (manager);
 }
 
+/* The scale is cached, so that settings changes don't need a round trip
+ * to the compositor; only a change of monitor configuration refreshes it. */
+static void
+monitors_changed (GnomeXSettingsManager *manager)
+{
+        g_cancellable_cancel (manager->priv->display_config_cancellable);
+        g_clear_object (&manager->priv->display_config_cancellable);
+        manager->priv->display_config_cancellable = g_cancellable_new ();
+
+        g_dbus_connection_call (manager->priv->dbus_connection,
+                                "org.gnome.Mutter.DisplayConfig",
+                                "/org/gnome/Mutter/DisplayConfig",
+                                "org.gnome.Mutter.DisplayConfig",
+                                "GetCurrentState",
+                                NULL,
+                                G_VARIANT_TYPE (CURRENT_STATE_FORMAT),
+                                G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                -1,
+                                manager->priv->display_config_cancellable,
+                                get_current_state_cb,
+                                manager);
+}
+
 static void
 on_monitors_changed (GDBusConnection *connection,
                      const gchar     *sender_name,
@@ -1133,6 +1447,17 @@ on_display_config_name_appeared_handler (GDBusConnection *connection,
         monitors_changed (manager);
 }
 
+/* No compositor to ask, so there is no point in holding back until
+ * the timeout */
+static void
+on_display_config_name_vanished_handler (GDBusConnection *connection,
+                                         const gchar     *name,
+                                         gpointer         data)
+{
+        GnomeXSettingsManager *manager = data;
+        window_scale_unavailable (manager);
+}
+
 gboolean
 gnome_xsettings_manager_start (GnomeXSettingsManager *manager,
                                GError               **error)
@@ -1152,10 +1477,18 @@ gnome_xsettings_manager_start (GnomeXSettingsManager *manager,
                 return FALSE;
         }
 
+        start_xresources (manager);
+
         manager->priv->remote_display = gsd_remote_display_manager_new ();
         g_signal_connect (G_OBJECT (manager->priv->remote_display), "notify::force-disable-animations",
                           G_CALLBACK (force_disable_animation_changed), manager);
 
+        /* Publishing with a wrong scale first would make every client
+         * relayout, so wait a bit for the compositor to tell us */
+        manager->priv->have_window_scale = FALSE;
+        manager->priv->window_scale_timeout_id = g_timeout_add (WINDOW_SCALE_TIMEOUT_MS, window_scale_timeout, manager);
+        g_source_set_name_by_id (manager->priv->window_scale_timeout_id, "[gnome-settings-daemon] window_scale_timeout");
+
         manager->priv->monitors_changed_id =
                 g_dbus_connection_signal_subscribe (manager->priv->dbus_connection,
                                                     "org.gnome.Mutter.DisplayConfig",
@@ -1172,7 +1505,7 @@ gnome_xsettings_manager_start (GnomeXSettingsManager *manager,
                                                 "org.gnome.Mutter.DisplayConfig",
                                                 G_BUS_NAME_WATCHER_FLAGS_NONE,
                                                 on_display_config_name_appeared_handler,
-                                                NULL,
+                                                on_display_config_name_vanished_handler,
                                                 manager,
                                                 NULL);
 
@@ -1208,6 +1541,8 @@ gnome_xsettings_manager_start (GnomeXSettingsManager *manager,
                 }
         }
 
+        build_translations_index (manager);
+
         g_signal_connect (G_OBJECT (g_hash_table_lookup (manager->priv->settings, INTERFACE_SETTINGS_SCHEMA)), "changed::enable-animations",
                           G_CALLBACK (enable_animations_changed_cb), manager);
 
@@ -1278,6 +1613,11 @@ gnome_xsettings_manager_stop (GnomeXSettingsManager *manager)
 
         g_clear_object (&manager->priv->remote_display);
 
+        if (p->display_config_cancellable != NULL) {
+                g_cancellable_cancel (p->display_config_cancellable);
+                g_clear_object (&p->display_config_cancellable);
+        }
+
         if (p->monitors_changed_id) {
                 g_dbus_connection_signal_unsubscribe (p->dbus_connection,
                                                       p->monitors_changed_id);
@@ -1289,11 +1629,23 @@ gnome_xsettings_manager_stop (GnomeXSettingsManager *manager)
                 p->display_config_watch_id = 0;
         }
 
+        if (p->window_scale_timeout_id != 0) {
+                g_source_remove (p->window_scale_timeout_id);
+                p->window_scale_timeout_id = 0;
+        }
+
         if (p->shell_name_watch_id > 0) {
                 g_bus_unwatch_name (p->shell_name_watch_id);
                 p->shell_name_watch_id = 0;
         }
 
+        if (p->notify_id != 0) {
+                g_source_remove (p->notify_id);
+                p->notify_id = 0;
+        }
+        p->xsettings_changed = FALSE;
+        p->dbus_changes = 0;
+
         if (p->manager != NULL) {
                 xsettings_manager_destroy (p->manager);
                 p->manager = NULL;
@@ -1317,6 +1669,8 @@ gnome_xsettings_manager_stop (GnomeXSettingsManager *manager)
                 p->fontconfig_monitor = NULL;
         }
 
+        g_clear_pointer (&p->translations_index, g_hash_table_destroy);
+
         if (p->settings != NULL) {
                 g_hash_table_destroy (p->settings);
                 p->settings = NULL;
@@ -1326,6 +1680,8 @@ gnome_xsettings_manager_stop (GnomeXSettingsManager *manager)
                 g_object_unref (p->gtk);
                 p->gtk = NULL;
         }
+
+        stop_xresources (manager);
 }
 
 static void
@@ -1344,6 +1700,7 @@ gnome_xsettings_manager_init (GnomeXSettingsManager *manager)
         GError *error = NULL;
 
         manager->priv = GNOME_XSETTINGS_MANAGER_GET_PRIVATE (manager);
+        manager->priv->window_scale = 1;
 
         manager->priv->dbus_connection = g_bus_get_sync (G_BUS_TYPE_SESSION,
                                                          NULL, &error);
@@ -1405,6 +1762,46 @@ static const GDBusInterfaceVTable interface_vtable =
         NULL
 };
 
+/* Fontconfig monitor counters, times are in microseconds */
+static GVariant *
+handle_get_stats_property (GDBusConnection *connection,
+                           const gchar *sender,
+                           const gchar *object_path,
+                           const gchar *interface_name,
+                           const gchar *property_name,
+                           GError **error,
+                           gpointer user_data)
+{
+        GnomeXSettingsManager *manager = user_data;
+        FcMonitorStats stats = { 0, };
+
+        if (manager->priv->fontconfig_monitor != NULL)
+                fc_monitor_get_stats (manager->priv->fontconfig_monitor, &stats);
+
+        if (g_strcmp0 (property_name, "FontconfigEvents") == 0) {
+                return g_variant_new_uint64 (stats.events);
+        } else if (g_strcmp0 (property_name, "FontconfigReloads") == 0) {
+                return g_variant_new_uint64 (stats.reloads);
+        } else if (g_strcmp0 (property_name, "FontconfigRescannedDirs") == 0) {
+                return g_variant_new_uint64 (stats.rescanned_dirs);
+        } else if (g_strcmp0 (property_name, "FontconfigUpdateTime") == 0) {
+                return g_variant_new_uint64 (stats.update_time_usec);
+        } else if (g_strcmp0 (property_name, "FontconfigLastUpdateTime") == 0) {
+                return g_variant_new_uint64 (stats.last_update_time_usec);
+        } else {
+                g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                             "No such property: %s", property_name);
+                return NULL;
+        }
+}
+
+static const GDBusInterfaceVTable stats_interface_vtable =
+{
+        NULL,
+        handle_get_stats_property,
+        NULL
+};
+
 static void
 register_manager_dbus (GnomeXSettingsManager *manager)
 {
@@ -1420,6 +1817,13 @@ register_manager_dbus (GnomeXSettingsManager *manager)
                                            manager,
                                            NULL,
                                            NULL);
+        g_dbus_connection_register_object (manager->priv->dbus_connection,
+                                           GTK_SETTINGS_DBUS_PATH,
+                                           manager->priv->introspection_data->interfaces[1],
+                                           &stats_interface_vtable,
+                                           manager,
+                                           NULL,
+                                           NULL);
 
         manager->priv->gtk_settings_name_id = g_bus_own_name_on_connection (manager->priv->dbus_connection,
                                                                             GTK_SETTINGS_DBUS_NAME,
@@ -0,0 +1,161 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark for fc_monitor_start(): builds a synthetic font tree with
+ * many directories, points fontconfig at it, and reports how long it
+ * takes to start watching it and how much the resident memory grows.
+ * Kernel memory used by inotify watches is not included.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fontconfig/fontconfig.h>
+
+#include "fc-monitor.h"
+
+#define DEFAULT_N_DIRS  10000
+#define DIRS_PER_LEVEL  100
+
+static gsize
+get_rss (void)
+{
+        char *contents = NULL;
+        gsize rss = 0;
+
+        if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL)) {
+                char **fields = g_strsplit (contents, " ", 3);
+
+                if (fields[0] != NULL && fields[1] != NULL)
+                        rss = g_ascii_strtoull (fields[1], NULL, 10) * sysconf (_SC_PAGESIZE);
+                g_strfreev (fields);
+        }
+        g_free (contents);
+
+        return rss;
+}
+
+static void
+remove_tree (const char *path)
+{
+        GDir *dir;
+        const char *name;
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir != NULL) {
+                while ((name = g_dir_read_name (dir)) != NULL) {
+                        char *child = g_build_filename (path, name, NULL);
+                        remove_tree (child);
+                        g_free (child);
+                }
+                g_dir_close (dir);
+        }
+
+        g_remove (path);
+}
+
+static char *
+make_font_tree (guint n_dirs)
+{
+        GError *error = NULL;
+        char *root, *fonts, *conf, *contents;
+        guint i;
+
+        root = g_dir_make_tmp ("fc-monitor-XXXXXX", &error);
+        if (root == NULL) {
+                g_printerr ("Could not create temporary directory: %s\n", error->message);
+                exit (1);
+        }
+
+        /* Two levels, like the TeX Live and Noto trees */
+        fonts = g_build_filename (root, "fonts", NULL);
+        for (i = 0; i < n_dirs; i++) {
+                char *dir;
+
+                dir = g_strdup_printf ("%s/%03u/%03u", fonts, i / DIRS_PER_LEVEL, i % DIRS_PER_LEVEL);
+                g_mkdir_with_parents (dir, 0755);
+                g_free (dir);
+        }
+
+        conf = g_build_filename (root, "fonts.conf", NULL);
+        contents = g_strdup_printf ("<?xml version=\"1.0\"?>\n"
+                                    "<fontconfig>\n"
+                                    "  <dir>%s</dir>\n"
+                                    "  <cachedir>%s/cache</cachedir>\n"
+                                    "</fontconfig>\n",
+                                    fonts, root);
+        if (!g_file_set_contents (conf, contents, -1, &error)) {
+                g_printerr ("Could not write %s: %s\n", conf, error->message);
+                exit (1);
+        }
+        g_setenv ("FONTCONFIG_FILE", conf, TRUE);
+
+        g_free (contents);
+        g_free (conf);
+        g_free (fonts);
+
+        return root;
+}
+
+int
+main (int argc, char **argv)
+{
+        FcMonitor *monitor;
+        FcStrList *list;
+        guint n_dirs, n_watched = 0;
+        gsize rss;
+        gint64 start;
+        char *root;
+
+        n_dirs = argc > 1 ? atoi (argv[1]) : DEFAULT_N_DIRS;
+        root = make_font_tree (n_dirs);
+
+        /* Scanning the tree and writing the caches is not what we
+         * are measuring, so get it out of the way first */
+        start = g_get_monotonic_time ();
+        FcInit ();
+        g_print ("FcInit:           %8.2f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+
+        list = FcConfigGetFontDirs (NULL);
+        while (FcStrListNext (list) != NULL)
+                n_watched++;
+        FcStrListDone (list);
+
+        monitor = fc_monitor_new ();
+
+        rss = get_rss ();
+        start = g_get_monotonic_time ();
+        fc_monitor_start (monitor);
+        g_print ("fc_monitor_start: %8.2f ms for %u directories\n",
+                 (g_get_monotonic_time () - start) / 1000.0, n_watched);
+        g_print ("Resident memory:  %8.2f KiB more\n", ((double) get_rss () - rss) / 1024.0);
+
+        start = g_get_monotonic_time ();
+        fc_monitor_stop (monitor);
+        g_print ("fc_monitor_stop:  %8.2f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+
+        g_object_unref (monitor);
+
+        remove_tree (root);
+        g_free (root);
+
+        return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Benchmark for xsettings_manager_notify(): measures the time taken to
+ * publish the _XSETTINGS_SETTINGS property, and the size of the
+ * property, when 1, 10 and 100 settings out of 200 change between two
+ * notifications. Needs an X server, for example Xvfb.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include "xsettings-manager.h"
+
+#define N_SETTINGS 200
+#define N_ITERATIONS 1000
+
+static void
+terminate_cb (void *data)
+{
+  g_printerr ("Could not acquire the XSETTINGS selection, is another manager running?\n");
+  exit (1);
+}
+
+static gulong
+get_property_size (Display *display)
+{
+  Atom selection_atom, xsettings_atom, type;
+  Window owner;
+  int format;
+  unsigned long n_items, bytes_after;
+  unsigned char *data = NULL;
+
+  selection_atom = XInternAtom (display, "_XSETTINGS_S0", False);
+  xsettings_atom = XInternAtom (display, "_XSETTINGS_SETTINGS", False);
+  owner = XGetSelectionOwner (display, selection_atom);
+
+  if (XGetWindowProperty (display, owner, xsettings_atom, 0, G_MAXLONG, False,
+                          xsettings_atom, &type, &format, &n_items,
+                          &bytes_after, &data) != Success)
+    return 0;
+
+  XFree (data);
+
+  return n_items;
+}
+
+static void
+set_setting (XSettingsManager *manager,
+             guint             i,
+             guint             generation)
+{
+  char name[32];
+
+  g_snprintf (name, sizeof (name), "Bench/Setting%u", i);
+
+  if (i % 2 == 0)
+    {
+      char *value;
+
+      value = g_strdup_printf ("string value %u for generation %u", i, generation);
+      xsettings_manager_set_string (manager, name, value);
+      g_free (value);
+    }
+  else
+    {
+      xsettings_manager_set_int (manager, name, i + generation);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  static const guint n_changed[] = { 1, 10, 100 };
+  XSettingsManager *manager;
+  Display *display;
+  guint generation = 0;
+  guint i, j, k;
+
+  display = XOpenDisplay (NULL);
+  if (display == NULL)
+    {
+      g_printerr ("Could not open display\n");
+      return 77;
+    }
+
+  if (xsettings_manager_check_running (display, 0))
+    {
+      g_printerr ("An XSETTINGS manager is already running\n");
+      return 77;
+    }
+
+  manager = xsettings_manager_new (display, 0, terminate_cb, NULL);
+
+  for (i = 0; i < N_SETTINGS; i++)
+    set_setting (manager, i, generation);
+  xsettings_manager_notify (manager);
+  XSync (display, False);
+
+  for (k = 0; k < G_N_ELEMENTS (n_changed); k++)
+    {
+      gint64 elapsed = 0;
+
+      for (j = 0; j < N_ITERATIONS; j++)
+        {
+          gint64 start;
+
+          generation++;
+          for (i = 0; i < n_changed[k]; i++)
+            set_setting (manager, (i * 7 + j) % N_SETTINGS, generation);
+
+          start = g_get_monotonic_time ();
+          xsettings_manager_notify (manager);
+          XSync (display, False);
+          elapsed += g_get_monotonic_time () - start;
+        }
+
+      g_print ("%3u changed settings: %7.2f µs per notify, %lu bytes per notify\n",
+               n_changed[k], (double) elapsed / N_ITERATIONS,
+               get_property_size (display));
+    }
+
+  xsettings_manager_destroy (manager);
+  XCloseDisplay (display);
+
+  return 0;
+}
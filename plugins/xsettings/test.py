@@ -208,6 +208,22 @@ class XsettingsPluginTest(gsdtestcase.GSDTestCase):
         self.assertEqual(self.obj_xsettings_props.Get('org.gtk.Settings', 'EnableAnimations'),
                 dbus.Boolean(True, variant_level=1))
 
+    def get_fontconfig_counter(self, name):
+        return self.obj_xsettings_props.Get('org.gnome.SettingsDaemon.XSettings', name)
+
+    def wait_fontconfig_settled(self, timeout=10):
+        '''Wait until the fontconfig monitor counters stop changing'''
+
+        names = ['FontconfigEvents', 'FontconfigReloads', 'FontconfigRescannedDirs']
+        last = None
+        for i in range(timeout * 2):
+            current = [self.get_fontconfig_counter(n) for n in names]
+            if current == last:
+                return
+            last = current
+            time.sleep(0.5)
+        self.fail('fontconfig monitor did not settle within %i seconds' % timeout)
+
     def test_fontconfig_timestamp(self):
         # gdbus_log_write = open(os.path.join(self.workdir, 'gdbus.log'), 'wb')
         # process = subprocess.Popen(['gdbus', 'introspect', '--session', '--dest', 'org.gtk.Settings', '--object-path', '/org/gtk/Settings'],
@@ -217,6 +233,10 @@ class XsettingsPluginTest(gsdtestcase.GSDTestCase):
         before = self.obj_xsettings_props.Get('org.gtk.Settings', 'FontconfigTimestamp')
         self.assertEqual(before, 0)
 
+        self.wait_fontconfig_settled()
+        reloads_before = self.get_fontconfig_counter('FontconfigReloads')
+        rescanned_before = self.get_fontconfig_counter('FontconfigRescannedDirs')
+
         # Copy the fonts.conf again
         shutil.copy(os.path.join(os.path.dirname(__file__), 'fontconfig-test/fonts.conf'),
                 os.path.join(self.fc_dir, 'fonts.conf'))
@@ -230,5 +250,16 @@ class XsettingsPluginTest(gsdtestcase.GSDTestCase):
         after = self.obj_xsettings_props.Get('org.gtk.Settings', 'FontconfigTimestamp')
         self.assertTrue(after > before)
 
+        # A configuration change means a full reload, rather than
+        # rescanning font directories. The copy can be seen as more
+        # than one change, hence more than one reload.
+        self.wait_fontconfig_settled()
+        events = self.get_fontconfig_counter('FontconfigEvents')
+        self.assertTrue(events > 0)
+        reloads = self.get_fontconfig_counter('FontconfigReloads')
+        self.assertGreaterEqual(reloads - reloads_before, 1)
+        rescanned = self.get_fontconfig_counter('FontconfigRescannedDirs')
+        self.assertEqual(rescanned, rescanned_before)
+
 # avoid writing to stderr
 unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
@@ -84,7 +84,10 @@ xsettings_setting_set (XSettingsSetting *setting,
   setting->value[tier] = value ? g_variant_ref_sink (value) : NULL;
 
   if (!xsettings_variant_equal0 (old_value, xsettings_setting_get (setting)))
-    setting->last_change_serial = serial;
+    {
+      setting->last_change_serial = serial;
+      g_clear_pointer (&setting->encoded, g_bytes_unref);
+    }
 
   if (old_value)
     g_variant_unref (old_value);
@@ -100,6 +103,7 @@ xsettings_setting_free (XSettingsSetting *setting)
       g_variant_unref (setting->value[i]);
 
   g_free (setting->name);
+  g_clear_pointer (&setting->encoded, g_bytes_unref);
 
   g_slice_free (XSettingsSetting, setting);
 }
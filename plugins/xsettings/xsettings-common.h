@@ -50,6 +50,9 @@ struct _XSettingsSetting
   char *name;
   GVariant *value[XSETTINGS_N_TIERS];
   unsigned long last_change_serial;
+
+  /* Wire encoding of the setting, dropped when it changes */
+  GBytes *encoded;
 };
 
 XSettingsSetting *xsettings_setting_new   (const gchar      *name);
@@ -47,6 +47,9 @@ struct _XSettingsManager
   GHashTable *settings;
   unsigned long serial;
 
+  /* Reused for every _XSETTINGS_SETTINGS update */
+  GByteArray *buffer;
+
   GVariant *overrides;
 };
 
@@ -147,6 +150,7 @@ xsettings_manager_new (Display                *display,
   manager->settings = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) xsettings_setting_free);
   manager->serial = 0;
   manager->overrides = NULL;
+  manager->buffer = g_byte_array_new ();
 
   manager->window = XCreateSimpleWindow (display,
 					 RootWindow (display, screen),
@@ -194,6 +198,7 @@ xsettings_manager_destroy (XSettingsManager *manager)
   XDestroyWindow (manager->display, manager->window);
 
   g_hash_table_unref (manager->settings);
+  g_byte_array_unref (manager->buffer);
 
   g_slice_free (XSettingsManager, manager);
 }
@@ -276,11 +281,13 @@ static void
 align_string (GString *string,
               gint     alignment)
 {
+  static const gchar zeros[8] = { 0, };
+
   /* Adds nul-bytes to the string until its length is an even multiple
    * of the specified alignment requirement.
    */
-  while ((string->len % alignment) != 0)
-    g_string_append_c (string, '\0');
+  if ((string->len % alignment) != 0)
+    g_string_append_len (string, zeros, alignment - (string->len % alignment));
 }
 
 static void
@@ -322,34 +329,61 @@ setting_store (XSettingsSetting *setting,
     g_string_append_len (buffer, g_variant_get_data (value), g_variant_get_size (value));
 }
 
+static GBytes *
+setting_encode (XSettingsSetting *setting)
+{
+  /* The encoding only depends on the value and its serial, so it is
+   * kept until the setting changes, and unchanged settings are only
+   * copied into the property on notify.
+   */
+  if (setting->encoded == NULL)
+    {
+      GString *buffer;
+
+      buffer = g_string_new (NULL);
+      setting_store (setting, buffer);
+      setting->encoded = g_string_free_to_bytes (buffer);
+    }
+
+  return setting->encoded;
+}
+
 void
 xsettings_manager_notify (XSettingsManager *manager)
 {
-  GString *buffer;
+  GByteArray *buffer = manager->buffer;
   GHashTableIter iter;
-  int n_settings;
+  guint32 n_settings;
+  guint32 serial;
   gpointer value;
+  guint8 header[4] = { 0, };
 
   n_settings = g_hash_table_size (manager->settings);
+  serial = manager->serial;
 
-  buffer = g_string_new (NULL);
-  g_string_append_c (buffer, xsettings_byte_order ());
-  g_string_append_c (buffer, '\0');
-  g_string_append_c (buffer, '\0');
-  g_string_append_c (buffer, '\0');
+  g_byte_array_set_size (buffer, 0);
 
-  g_string_append_len (buffer, (gchar *) &manager->serial, 4);
-  g_string_append_len (buffer, (gchar *) &n_settings, 4);
+  header[0] = xsettings_byte_order ();
+  g_byte_array_append (buffer, header, 4);
+  g_byte_array_append (buffer, (guint8 *) &serial, 4);
+  g_byte_array_append (buffer, (guint8 *) &n_settings, 4);
 
   g_hash_table_iter_init (&iter, manager->settings);
   while (g_hash_table_iter_next (&iter, NULL, &value))
-    setting_store (value, buffer);
+    {
+      GBytes *encoded;
+      gsize size;
+      gconstpointer data;
+
+      encoded = setting_encode (value);
+      data = g_bytes_get_data (encoded, &size);
+      g_byte_array_append (buffer, data, size);
+    }
 
   XChangeProperty (manager->display, manager->window,
                    manager->xsettings_atom, manager->xsettings_atom,
-                   8, PropModeReplace, (guchar *) buffer->str, buffer->len);
+                   8, PropModeReplace, buffer->data, buffer->len);
 
-  g_string_free (buffer, TRUE);
   manager->serial++;
 }
 